@@ -0,0 +1,112 @@
+#include "aov.h"
+#include "exr.h"
+#include "kernels.h"
+
+#include <cstring>
+
+AovBuffers::AovBuffers(size_t width, size_t height, unsigned flags)
+	: width(width), height(height), flags(flags), shapeIds()
+{
+	// The variance is resolved against the mean without the emission
+	if (flags & kAovVariance)
+		this->flags |= kAovEmission;
+
+	size_t count = width * height;
+	if (flags & kAovAlbedo)
+	{
+		planes[kAovAlbedoR].resize(count);
+		planes[kAovAlbedoG].resize(count);
+		planes[kAovAlbedoB].resize(count);
+	}
+	if (flags & kAovNormal)
+	{
+		planes[kAovNormalX].resize(count);
+		planes[kAovNormalY].resize(count);
+		planes[kAovNormalZ].resize(count);
+	}
+	if (flags & kAovDepth)
+		planes[kAovDepthPlane].resize(count);
+	if (flags & kAovVariance)
+		planes[kAovVariancePlane].resize(count);
+	if (this->flags & kAovEmission)
+	{
+		planes[kAovEmissionR].resize(count);
+		planes[kAovEmissionG].resize(count);
+		planes[kAovEmissionB].resize(count);
+	}
+	if (flags & kAovShapeId)
+		shapeIds.resize(count);
+}
+
+void AovBuffers::clear()
+{
+	for (int p = 0; p < kAovFloatPlaneCount; p++)
+		std::fill(planes[p].begin(), planes[p].end(), 0.0f);
+	std::fill(shapeIds.begin(), shapeIds.end(), 0u);
+}
+
+void AovBuffers::scale(float factor, AovBuffers& outBuffers) const
+{
+	for (int p = 0; p < kAovFloatPlaneCount; p++)
+	{
+		if (!planes[p].empty())
+			kernels().scaleFloats(&planes[p][0], factor, planes[p].size(), &outBuffers.planes[p][0]);
+	}
+	outBuffers.shapeIds = shapeIds;
+}
+
+bool AovBuffers::saveToFile(const char* filename, const Image& beauty) const
+{
+	const float* pBeauty = &beauty.getPixels()->r;
+	std::vector<ExrChannel> channels;
+	channels.push_back(ExrChannel("R", kExrFloat, pBeauty, sizeof(Color)));
+	channels.push_back(ExrChannel("G", kExrFloat, pBeauty + 1, sizeof(Color)));
+	channels.push_back(ExrChannel("B", kExrFloat, pBeauty + 2, sizeof(Color)));
+
+	static const char* const planeNames[kAovFloatPlaneCount] =
+	{
+		"albedo.R", "albedo.G", "albedo.B", "N.X", "N.Y", "N.Z", "Z", "variance",
+		"emission.R", "emission.G", "emission.B"
+	};
+	for (int p = 0; p < kAovFloatPlaneCount; p++)
+	{
+		if (!planes[p].empty())
+			channels.push_back(ExrChannel(planeNames[p], kExrFloat, &planes[p][0], sizeof(float)));
+	}
+	if (!shapeIds.empty())
+		channels.push_back(ExrChannel("id", kExrUint, &shapeIds[0], sizeof(uint32_t)));
+
+	return saveExr(filename, width, height, channels);
+}
+
+bool AovBuffers::parseFlags(const char* text, unsigned& outFlags)
+{
+	outFlags = 0;
+	while (*text != '\0')
+	{
+		const char* end = strchr(text, ',');
+		size_t length = end != NULL ? (size_t)(end - text) : strlen(text);
+
+		if (length == 3 && !strncmp(text, "all", 3))
+			outFlags |= kAovAll;
+		else if (length == 6 && !strncmp(text, "albedo", 6))
+			outFlags |= kAovAlbedo;
+		else if (length == 6 && !strncmp(text, "normal", 6))
+			outFlags |= kAovNormal;
+		else if (length == 5 && !strncmp(text, "depth", 5))
+			outFlags |= kAovDepth;
+		else if (length == 2 && !strncmp(text, "id", 2))
+			outFlags |= kAovShapeId;
+		else if (length == 8 && !strncmp(text, "variance", 8))
+			outFlags |= kAovVariance;
+		else if (length == 8 && !strncmp(text, "emission", 8))
+			outFlags |= kAovEmission;
+		else
+			return false;
+
+		text += length;
+		if (*text == ',')
+			text++;
+	}
+	return outFlags != 0;
+}
@@ -0,0 +1,135 @@
+#ifndef __AOV_H__
+#define __AOV_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "hugepages.h"
+#include "image.h"
+
+// Arbitrary output variables: data about the first hit of each camera path
+// written next to the beauty image for compositing and denoising
+enum AovFlags
+{
+	kAovAlbedo = 1 << 0,
+	kAovNormal = 1 << 1,
+	kAovDepth = 1 << 2,
+	kAovShapeId = 1 << 3,
+	// Variance of the beauty luminance without the emission, of the pixel
+	// mean once resolved. Implies kAovEmission.
+	kAovVariance = 1 << 4,
+	// Emitters and environment seen directly by the camera
+	kAovEmission = 1 << 5,
+	kAovAll = kAovAlbedo | kAovNormal | kAovDepth | kAovShapeId | kAovVariance | kAovEmission
+};
+
+enum AovPlane
+{
+	kAovAlbedoR,
+	kAovAlbedoG,
+	kAovAlbedoB,
+	kAovNormalX,
+	kAovNormalY,
+	kAovNormalZ,
+	kAovDepthPlane,
+	kAovVariancePlane,
+	kAovEmissionR,
+	kAovEmissionG,
+	kAovEmissionB,
+	kAovFloatPlaneCount
+};
+
+// What the renderer records about one primary hit. Misses leave everything
+// zero, shape ids start at 1.
+struct PrimaryHit
+{
+	Color albedo;
+	Vector normal;
+	float depth;
+	uint32_t shapeId;
+	Color emission;
+
+	PrimaryHit() : albedo(), normal(0.0f, 0.0f, 0.0f), depth(0.0f), shapeId(0), emission() { }
+};
+
+// One float plane per component plus a uint plane of shape ids, planes of
+// disabled AOVs stay empty. The renderer sums albedo, normal and depth over
+// all passes and keeps the shape id of the first. The variance plane holds
+// the sum of squared sample luminances until Renderer::resolveAovs().
+class AovBuffers
+{
+public:
+	AovBuffers(size_t width, size_t height, unsigned flags);
+
+	virtual ~AovBuffers() { }
+
+	unsigned getFlags() const { return flags; }
+	size_t getWidth() const { return width; }
+	size_t getHeight() const { return height; }
+
+	float* getPlane(AovPlane plane) { return planes[plane].empty() ? NULL : &planes[plane][0]; }
+	const float* getPlane(AovPlane plane) const { return planes[plane].empty() ? NULL : &planes[plane][0]; }
+	uint32_t* getShapeIds() { return shapeIds.empty() ? NULL : &shapeIds[0]; }
+	const uint32_t* getShapeIds() const { return shapeIds.empty() ? NULL : &shapeIds[0]; }
+
+	void clear();
+
+	// Adds one sample of pixel index, firstSample also sets the shape id
+	inline void add(size_t index, const PrimaryHit& hit, bool firstSample);
+
+	// Adds the squared luminance of one beauty sample less its emission for
+	// the variance
+	inline void addSample(size_t index, const Color& sample, const PrimaryHit& hit);
+
+	// outBuffers = this * scale, shape ids are copied. Sizes and flags must match.
+	void scale(float factor, AovBuffers& outBuffers) const;
+
+	// Writes beauty and every enabled AOV to one multi-layer .exr file:
+	// R G B, albedo.R/G/B, N.X/Y/Z, Z, variance, emission.R/G/B and id
+	bool saveToFile(const char* filename, const Image& beauty) const;
+
+	// Parses a comma separated list of albedo, normal, depth, id, variance
+	// and emission, or "all"
+	static bool parseFlags(const char* text, unsigned& outFlags);
+
+protected:
+	size_t width, height;
+	unsigned flags;
+	LargeVector<float> planes[kAovFloatPlaneCount];
+	LargeVector<uint32_t> shapeIds;
+};
+
+inline void AovBuffers::add(size_t index, const PrimaryHit& hit, bool firstSample)
+{
+	if (flags & kAovAlbedo)
+	{
+		planes[kAovAlbedoR][index] += hit.albedo.r;
+		planes[kAovAlbedoG][index] += hit.albedo.g;
+		planes[kAovAlbedoB][index] += hit.albedo.b;
+	}
+	if (flags & kAovNormal)
+	{
+		planes[kAovNormalX][index] += hit.normal.x;
+		planes[kAovNormalY][index] += hit.normal.y;
+		planes[kAovNormalZ][index] += hit.normal.z;
+	}
+	if (flags & kAovDepth)
+		planes[kAovDepthPlane][index] += hit.depth;
+	if (flags & kAovEmission)
+	{
+		planes[kAovEmissionR][index] += hit.emission.r;
+		planes[kAovEmissionG][index] += hit.emission.g;
+		planes[kAovEmissionB][index] += hit.emission.b;
+	}
+	if ((flags & kAovShapeId) && firstSample)
+		shapeIds[index] = hit.shapeId;
+}
+
+inline void AovBuffers::addSample(size_t index, const Color& sample, const PrimaryHit& hit)
+{
+	if (flags & kAovVariance)
+		planes[kAovVariancePlane][index] += squared((sample - hit.emission).luminance());
+}
+
+#endif
@@ -0,0 +1,1769 @@
+#include "benchmark.h"
+#include "denoiser.h"
+#include "fastmath.h"
+#include "hugepages.h"
+#include "kernels.h"
+#include "material.h"
+#include "numa.h"
+#include "pagedmesh.h"
+#include "parallel.h"
+#include "preview.h"
+#include "random.h"
+#include "renderer.h"
+#include "sampling.h"
+#include "sceneloader.h"
+#include "scenes.h"
+#include "spectrum.h"
+#include "splat.h"
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#ifdef _WIN32
+#include <windows.h>
+#include <psapi.h>
+#pragma comment(lib, "psapi.lib")
+#else
+#include <sys/resource.h>
+#endif
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+struct BenchmarkOptions
+{
+	const char* sceneName;
+	const char* sceneFile;
+	size_t count;
+	RenderSettings settings;
+	unsigned samplesPerPixel;
+	const char* referenceFile;
+	bool makeReference;
+	bool checkMath;
+	bool checkPathControl;
+	bool checkBrdf;
+	bool checkSpectrum;
+	bool checkBvh;
+	bool checkEdits;
+	bool checkHugePages;
+	bool checkPaging;
+	bool checkSplats;
+	bool preview;
+	bool denoise;
+	NumaMode numaMode;
+	unsigned numaNodes;
+	bool numaScaling;
+	bool compareRayOrders;
+	HugePageMode hugePages;
+	const char* geometryFile;
+	size_t geometryMegabytes;
+	// Opened from geometryFile by runBenchmark()
+	GeometryCache* pGeometryCache;
+	float targetRmse;
+	const char* outputFile;
+
+	BenchmarkOptions()
+		: sceneName("cornell"),
+		sceneFile(NULL),
+		count(0),
+		settings(),
+		samplesPerPixel(16),
+		referenceFile(NULL),
+		makeReference(false),
+		checkMath(false),
+		checkPathControl(false),
+		checkBrdf(false),
+		checkSpectrum(false),
+		checkBvh(false),
+		checkEdits(false),
+		checkHugePages(false),
+		checkPaging(false),
+		checkSplats(false),
+		preview(false),
+		denoise(false),
+		numaMode(NUMA_OFF),
+		numaNodes(1),
+		numaScaling(false),
+		compareRayOrders(false),
+		hugePages(getHugePageMode()),
+		geometryFile(NULL),
+		geometryMegabytes(64),
+		pGeometryCache(NULL),
+		targetRmse(0.05f),
+		outputFile(NULL)
+	{
+		settings.width = 256;
+		settings.height = 256;
+	}
+};
+
+static void printUsage()
+{
+	printf("usage: RayTracer bench [options]\n"
+		"  --scene cornell|spheres|motion|manylights|terrain\n"
+		"  --scene-file FILE   load a scene file instead, reports load throughput\n"
+		"  --count N           spheres, lights or triangles in the generated scene\n"
+		"  --width W --height H\n"
+		"  --spp N             samples per pixel\n"
+		"  --depth N           maximum path depth\n"
+		"  --min-depth N       depth where Russian roulette starts\n"
+		"  --split F           splitting factor, 1 = roulette only\n"
+		"  --threads N         0 = all hardware threads\n"
+		"  --spectral          trace four wavelengths per path instead of RGB\n"
+		"  --numa MODE         off, pin (threads and image tiles per NUMA node) or replicate (also\n"
+		"                      a copy of the scene per node)\n"
+		"  --numa-nodes N      split every node in N, to try --numa on a single node machine\n"
+		"  --numa-scaling      time every --numa mode from 1 thread up to --threads, check the\n"
+		"                      images match and exit\n"
+		"  --huge-pages MODE   off, transparent (default) or explicit pages for BVHs, meshes and\n"
+		"                      images, reports dTLB misses where perf events are readable\n"
+		"  --page-geometry FILE  keep mesh triangles in clusters in FILE, read back on demand\n"
+		"  --geometry-memory M   MiB of clusters kept in memory with --page-geometry (default 64)\n"
+		"  --ray-order ORDER   path (default), wavefront (a tile's paths a bounce at a time) or\n"
+		"                      sorted (also sort every bounce's rays by direction and origin)\n"
+		"  --tile-size N       tile edge in pixels, the batch size of the wavefront orders\n"
+		"  --compare-ray-orders  render with every --ray-order, report secondary ray throughput\n"
+		"                      and cache misses, check the images match and exit\n"
+		"  --isa LEVEL         generic, avx2 or avx512 kernels (default: best supported)\n"
+		"  --reference FILE    .pfm reference to measure time-to-RMSE against\n"
+		"  --make-reference    render --spp samples and write --reference instead\n"
+		"  --rmse X            RMSE target for time-to-RMSE\n"
+		"  --output FILE       save the final image (.bmp or .pfm)\n"
+		"  --denoise           also time the denoiser and report the RMSE after it\n"
+		"  --preview           orbit the camera --count times under the interactive preview, refining\n"
+		"                      to --spp, and report the latency of each change\n"
+		"  --check-math        measure fastmath.h errors against libm and exit\n"
+		"  --check-path-control  check that roulette and splitting are unbiased and exit\n"
+		"  --check-brdf        chi-square test the BRDF sampling, compare glossy sample weight\n"
+		"                      variance with full NDF sampling and exit\n"
+		"  --check-spectrum    check 4-lane colors against scalar math and the RGB to spectrum round\n"
+		"                      trip, then exit\n"
+		"  --check-bvh         time single and multithreaded BVH builds over --count boxes, check\n"
+		"                      they match and exit\n"
+		"  --check-huge-pages  chase pointers through a --count MiB array on small and on huge\n"
+		"                      pages, report the time and dTLB misses per load and exit\n"
+		"  --check-paging      trace a terrain of --count triangles paged under --geometry-memory, one\n"
+		"                      ray at a time and in batches, check the hits match memory and exit\n"
+		"  --check-splats      splat --count filter footprints from every thread into each kind of\n"
+		"                      splat buffer, check the sums against a serial one and exit\n"
+		"  --check-edits       edit a prepared sphere field of --count spheres, check it traces like\n"
+		"                      one prepared after the same edits and exit\n");
+}
+
+static bool parseOptions(int argc, char* argv[], BenchmarkOptions& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		const char* arg = argv[i];
+		const char* value = (i + 1 < argc) ? argv[i + 1] : NULL;
+
+		if (!strcmp(arg, "--make-reference"))
+		{
+			options.makeReference = true;
+			continue;
+		}
+		if (!strcmp(arg, "--check-math"))
+		{
+			options.checkMath = true;
+			continue;
+		}
+		if (!strcmp(arg, "--check-path-control"))
+		{
+			options.checkPathControl = true;
+			continue;
+		}
+		if (!strcmp(arg, "--check-brdf"))
+		{
+			options.checkBrdf = true;
+			continue;
+		}
+		if (!strcmp(arg, "--check-spectrum"))
+		{
+			options.checkSpectrum = true;
+			continue;
+		}
+		if (!strcmp(arg, "--spectral"))
+		{
+			options.settings.spectral = true;
+			continue;
+		}
+		if (!strcmp(arg, "--check-bvh"))
+		{
+			options.checkBvh = true;
+			continue;
+		}
+		if (!strcmp(arg, "--check-edits"))
+		{
+			options.checkEdits = true;
+			continue;
+		}
+		if (!strcmp(arg, "--check-huge-pages"))
+		{
+			options.checkHugePages = true;
+			continue;
+		}
+		if (!strcmp(arg, "--check-paging"))
+		{
+			options.checkPaging = true;
+			continue;
+		}
+		if (!strcmp(arg, "--check-splats"))
+		{
+			options.checkSplats = true;
+			continue;
+		}
+		if (!strcmp(arg, "--preview"))
+		{
+			options.preview = true;
+			continue;
+		}
+		if (!strcmp(arg, "--denoise"))
+		{
+			options.denoise = true;
+			continue;
+		}
+		if (!strcmp(arg, "--numa-scaling"))
+		{
+			options.numaScaling = true;
+			continue;
+		}
+		if (!strcmp(arg, "--compare-ray-orders"))
+		{
+			options.compareRayOrders = true;
+			continue;
+		}
+
+		if (value == NULL)
+			return false;
+		i++;
+
+		if (!strcmp(arg, "--scene"))
+			options.sceneName = value;
+		else if (!strcmp(arg, "--scene-file"))
+			options.sceneFile = value;
+		else if (!strcmp(arg, "--count"))
+			options.count = strtoul(value, NULL, 10);
+		else if (!strcmp(arg, "--width"))
+			options.settings.width = strtoul(value, NULL, 10);
+		else if (!strcmp(arg, "--height"))
+			options.settings.height = strtoul(value, NULL, 10);
+		else if (!strcmp(arg, "--spp"))
+			options.samplesPerPixel = (unsigned)strtoul(value, NULL, 10);
+		else if (!strcmp(arg, "--depth"))
+			options.settings.maxDepth = (unsigned)strtoul(value, NULL, 10);
+		else if (!strcmp(arg, "--min-depth"))
+			options.settings.minDepth = (unsigned)strtoul(value, NULL, 10);
+		else if (!strcmp(arg, "--split"))
+			options.settings.splitFactor = (float)atof(value);
+		else if (!strcmp(arg, "--threads"))
+			options.settings.threadCount = (unsigned)strtoul(value, NULL, 10);
+		else if (!strcmp(arg, "--numa"))
+		{
+			if (!parseNumaMode(value, options.numaMode))
+				return false;
+		}
+		else if (!strcmp(arg, "--numa-nodes"))
+			options.numaNodes = (unsigned)strtoul(value, NULL, 10);
+		else if (!strcmp(arg, "--huge-pages"))
+		{
+			if (!parseHugePageMode(value, options.hugePages))
+				return false;
+		}
+		else if (!strcmp(arg, "--page-geometry"))
+			options.geometryFile = value;
+		else if (!strcmp(arg, "--geometry-memory"))
+			options.geometryMegabytes = strtoul(value, NULL, 10);
+		else if (!strcmp(arg, "--ray-order"))
+		{
+			if (!parseRayOrder(value, options.settings.rayOrder))
+				return false;
+		}
+		else if (!strcmp(arg, "--tile-size"))
+			options.settings.tileSize = strtoul(value, NULL, 10);
+		else if (!strcmp(arg, "--isa"))
+		{
+			IsaLevel level;
+			if (!parseIsaLevel(value, level) || !selectKernels(level))
+			{
+				fprintf(stderr, "ISA level '%s' is not available on this machine\n", value);
+				return false;
+			}
+		}
+		else if (!strcmp(arg, "--reference"))
+			options.referenceFile = value;
+		else if (!strcmp(arg, "--rmse"))
+			options.targetRmse = (float)atof(value);
+		else if (!strcmp(arg, "--output"))
+			options.outputFile = value;
+		else
+			return false;
+	}
+
+	return options.settings.width > 0 && options.settings.height > 0 && options.samplesPerPixel > 0 &&
+		options.settings.tileSize > 0 &&
+		(!options.makeReference || options.referenceFile != NULL);
+}
+
+enum CounterEvent
+{
+	COUNTER_DTLB_LOAD_MISSES,
+	COUNTER_L1D_LOAD_MISSES,
+	// Last level cache misses
+	COUNTER_CACHE_MISSES
+};
+
+// Hardware events in user code of this process, from Linux perf events.
+// Threads started after open() count once they have exited.
+class EventCounter
+{
+public:
+	EventCounter() : fd(-1) { }
+
+	virtual ~EventCounter() { close(); }
+
+	// False where the kernel, the CPU or a VM doesn't offer the event
+	bool open(CounterEvent event)
+	{
+		close();
+#ifdef __linux__
+		perf_event_attr attr;
+		memset(&attr, 0, sizeof(attr));
+		attr.type = PERF_TYPE_HW_CACHE;
+		attr.size = sizeof(attr);
+		if (event == COUNTER_CACHE_MISSES)
+		{
+			attr.type = PERF_TYPE_HARDWARE;
+			attr.config = PERF_COUNT_HW_CACHE_MISSES;
+		}
+		else
+		{
+			attr.config = (event == COUNTER_DTLB_LOAD_MISSES ? PERF_COUNT_HW_CACHE_DTLB : PERF_COUNT_HW_CACHE_L1D) |
+				(PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+		}
+		attr.inherit = 1;
+		attr.exclude_kernel = 1;
+		attr.exclude_hv = 1;
+		fd = (int)syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0);
+#else
+		(void)event;
+#endif
+		return fd >= 0;
+	}
+
+	void close()
+	{
+#ifdef __linux__
+		if (fd >= 0)
+			::close(fd);
+#endif
+		fd = -1;
+	}
+
+	bool read(unsigned long long& outCount) const
+	{
+#ifdef __linux__
+		uint64_t count;
+		if (fd >= 0 && ::read(fd, &count, sizeof(count)) == (ssize_t)sizeof(count))
+		{
+			outCount = count;
+			return true;
+		}
+#endif
+		return false;
+	}
+
+protected:
+	EventCounter(const EventCounter&);
+	EventCounter& operator =(const EventCounter&);
+
+	int fd;
+};
+
+// FNV-1a over the bytes of the RGB channels, equal hashes mean bit
+// identical images
+static unsigned long long imageHash(const Image& image)
+{
+	const Color* pPixels = image.getPixels();
+	unsigned long long hash = 14695981039346656037ull;
+	for (size_t i = 0; i < image.getWidth() * image.getHeight(); i++)
+	{
+		const unsigned char* p = (const unsigned char*)&pPixels[i].r;
+		for (size_t j = 0; j < 3 * sizeof(float); j++)
+			hash = (hash ^ p[j]) * 1099511628211ull;
+	}
+	return hash;
+}
+
+static double peakResidentMegabytes()
+{
+#ifdef _WIN32
+	PROCESS_MEMORY_COUNTERS counters;
+	if (GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+		return counters.PeakWorkingSetSize / (1024.0 * 1024.0);
+	return 0.0;
+#else
+	struct rusage usage;
+	if (getrusage(RUSAGE_SELF, &usage) == 0)
+		return usage.ru_maxrss / 1024.0; // Reported in KiB on Linux
+	return 0.0;
+#endif
+}
+
+// Error in units in the last place of the correctly rounded result
+static double ulpError(float value, double reference)
+{
+	int exponent;
+	std::frexp((double)(float)reference, &exponent);
+	double ulp = std::ldexp(1.0, std::max(exponent - 24, -149));
+	return std::fabs(value - reference) / ulp;
+}
+
+struct MathCheck
+{
+	const char* name;
+	double maxScalar;
+	double maxKernel;
+	double bound;
+};
+
+static bool reportMathCheck(const MathCheck& check)
+{
+	bool pass = check.maxScalar <= check.bound && check.maxKernel <= check.bound;
+	printf("%-6s scalar %.2f ulp, %s %.2f ulp, bound %.0f ulp: %s\n", check.name, check.maxScalar,
+		isaLevelName(kernels().isa), check.maxKernel, check.bound, pass ? "ok" : "FAILED");
+	return pass;
+}
+
+// Sweeps the fastmath.h functions over the ranges the renderer uses and
+// compares the scalar forms and the selected array kernels with double
+// precision libm. Fails if any error exceeds the bound quoted in fastmath.h.
+static bool checkFastMath()
+{
+	const size_t kCount = 1 << 20;
+	std::vector<float> in(kCount);
+	std::vector<float> in2(kCount);
+	std::vector<float> out(kCount);
+	std::vector<float> out2(kCount);
+	bool pass = true;
+
+	// exp2 over the whole normal output range
+	MathCheck exp2Check = { "exp2", 0.0, 0.0, 2.0 };
+	for (size_t i = 0; i < kCount; i++)
+		in[i] = -126.0f + 253.0f * (i + 0.5f) / kCount;
+	kernels().exp2Floats(&in[0], kCount, &out[0]);
+	for (size_t i = 0; i < kCount; i++)
+	{
+		double reference = std::exp2((double)in[i]);
+		exp2Check.maxScalar = std::max(exp2Check.maxScalar, ulpError(fastExp2(in[i]), reference));
+		exp2Check.maxKernel = std::max(exp2Check.maxKernel, ulpError(out[i], reference));
+	}
+	pass &= reportMathCheck(exp2Check);
+
+	// log2 over every binade of positive normal floats
+	MathCheck log2Check = { "log2", 0.0, 0.0, 2.0 };
+	for (size_t i = 0; i < kCount; i++)
+	{
+		unsigned bits = 0x00800000u + (unsigned)((0x7f000000ull * i) / kCount);
+		memcpy(&in[i], &bits, sizeof(float));
+	}
+	kernels().log2Floats(&in[0], kCount, &out[0]);
+	for (size_t i = 0; i < kCount; i++)
+	{
+		double reference = std::log2((double)in[i]);
+		log2Check.maxScalar = std::max(log2Check.maxScalar, ulpError(fastLog2(in[i]), reference));
+		log2Check.maxKernel = std::max(log2Check.maxKernel, ulpError(out[i], reference));
+	}
+	pass &= reportMathCheck(log2Check);
+
+	// sin and cos over two turns either side of zero
+	MathCheck sinCheck = { "sin", 0.0, 0.0, 2.0 };
+	MathCheck cosCheck = { "cos", 0.0, 0.0, 2.0 };
+	for (size_t i = 0; i < kCount; i++)
+		in[i] = (float)(4.0 * M_PI * ((i + 0.5) / kCount - 0.5));
+	kernels().sinCosFloats(&in[0], kCount, &out[0], &out2[0]);
+	for (size_t i = 0; i < kCount; i++)
+	{
+		float sinValue, cosValue;
+		fastSinCos(in[i], sinValue, cosValue);
+		double sinReference = std::sin((double)in[i]);
+		double cosReference = std::cos((double)in[i]);
+		sinCheck.maxScalar = std::max(sinCheck.maxScalar, ulpError(sinValue, sinReference));
+		sinCheck.maxKernel = std::max(sinCheck.maxKernel, ulpError(out[i], sinReference));
+		cosCheck.maxScalar = std::max(cosCheck.maxScalar, ulpError(cosValue, cosReference));
+		cosCheck.maxKernel = std::max(cosCheck.maxKernel, ulpError(out2[i], cosReference));
+	}
+	pass &= reportMathCheck(sinCheck);
+	pass &= reportMathCheck(cosCheck);
+
+	// pow with bases in (0, 1] and exponents from 1/16 to 1024, which covers
+	// glossy lobes and their inverses. Errors are divided by the documented
+	// max(1, |y log2(x)|) growth.
+	MathCheck powCheck = { "pow", 0.0, 0.0, 3.0 };
+	for (size_t i = 0; i < kCount; i++)
+	{
+		double u = (i + 0.5) / kCount;
+		in[i] = (float)u;
+		in2[i] = (float)std::exp2(14.0 * (u * 1021.0 - std::floor(u * 1021.0)) - 4.0);
+	}
+	kernels().powFloats(&in[0], &in2[0], kCount, &out[0]);
+	for (size_t i = 0; i < kCount; i++)
+	{
+		double reference = std::pow((double)in[i], (double)in2[i]);
+		if (reference < 1.17549435e-38)
+			continue;
+		double scale = std::max(1.0, std::fabs(in2[i] * std::log2((double)in[i])));
+		powCheck.maxScalar = std::max(powCheck.maxScalar, ulpError(fastPow(in[i], in2[i]), reference) / scale);
+		powCheck.maxKernel = std::max(powCheck.maxKernel, ulpError(out[i], reference) / scale);
+	}
+	pass &= reportMathCheck(powCheck);
+
+	return pass;
+}
+
+// PathControl is unbiased if every surface below the maximum depth gets
+// continuations * weight = 1 on average over u. Averages over stratified u
+// for a sweep of throughputs, depths, split factors and stack limits, and
+// checks the continuation count never exceeds the limit. Survival chances
+// stay above 1%, rarer ones would need more strata to resolve.
+static bool checkPathControl()
+{
+	const unsigned kStrata = 1 << 18;
+	const float splitFactors[] = { 1.0f, 2.0f, 4.0f, 7.5f };
+	const unsigned maxCounts[] = { 1, 3, 32 };
+	double maxError = 0.0;
+	bool countsInRange = true;
+	bool rouletteOnly = true;
+
+	for (size_t s = 0; s < sizeof(splitFactors) / sizeof(splitFactors[0]); s++)
+	{
+		PathControl control(3, 8, splitFactors[s]);
+		for (size_t m = 0; m < sizeof(maxCounts) / sizeof(maxCounts[0]); m++)
+		{
+			for (unsigned depth = 0; depth + 1 < control.getMaxDepth(); depth++)
+			{
+				for (int e = -6; e <= 6; e++)
+				{
+					float value = std::ldexp(1.0f, e) * 1.3f;
+					Color throughput(value, 0.5f * value, 0.25f * value);
+					double sum = 0.0;
+					for (unsigned i = 0; i < kStrata; i++)
+					{
+						float weight;
+						unsigned count = control.continuations(throughput, depth, maxCounts[m],
+							(i + 0.5f) / kStrata, weight);
+						countsInRange &= count <= maxCounts[m];
+						rouletteOnly &= splitFactors[s] > 1.0f || count <= 1;
+						sum += count * (double)weight;
+					}
+					maxError = std::max(maxError, std::fabs(sum / kStrata - 1.0));
+				}
+			}
+		}
+	}
+
+	// Nothing continues from the last depth
+	PathControl control(3, 8, 4.0f);
+	float weight;
+	bool stopsAtMaxDepth = control.continuations(Color(1.0f), 7, 32, 0.5f, weight) == 0;
+
+	bool pass = maxError < 1.0e-3 && countsInRange && rouletteOnly && stopsAtMaxDepth;
+	printf("path control: max |E[count * weight] - 1| %.2e, counts within limits: %s, no splits at factor 1: %s, "
+		"stops at max depth: %s: %s\n", maxError, countsInRange ? "yes" : "no", rouletteOnly ? "yes" : "no",
+		stopsAtMaxDepth ? "yes" : "no", pass ? "ok" : "FAILED");
+	return pass;
+}
+
+// Compares the Color operators lane by lane with scalar arithmetic, which
+// must match exactly, and turns colors into spectra and back over a sweep of
+// hero wavelengths, which must average to the color again
+static bool checkSpectrum()
+{
+	RandomStream random(0, 0, 8642);
+	unsigned laneMismatches = 0;
+	for (unsigned i = 0; i < 100000; i++)
+	{
+		float x[4], y[4], f = random.next() * 4.0f - 2.0f;
+		for (unsigned lane = 0; lane < 4; lane++)
+		{
+			x[lane] = random.next() * 4.0f - 2.0f;
+			y[lane] = random.next() * 4.0f + 0.5f;
+		}
+		Color cx(x[0], x[1], x[2], x[3]), cy(y[0], y[1], y[2], y[3]);
+		Color results[] = { cx + cy, cx - cy, cx * cy, cx / cy, cx * f, f * cx, cx / f };
+		for (unsigned lane = 0; lane < 4; lane++)
+		{
+			float expected[] = { x[lane] + y[lane], x[lane] - y[lane], x[lane] * y[lane], x[lane] / y[lane],
+				x[lane] * f, x[lane] * f, x[lane] / f };
+			for (unsigned op = 0; op < sizeof(expected) / sizeof(expected[0]); op++)
+			{
+				const float* pResult = &results[op].r;
+				if (pResult[lane] != expected[op])
+					laneMismatches++;
+			}
+		}
+	}
+
+	const Color colors[] = { Color(1.0f), Color(1.0f, 0.0f, 0.0f), Color(0.0f, 1.0f, 0.0f), Color(0.0f, 0.0f, 1.0f),
+		Color(0.2f, 0.5f, 0.9f), Color(0.73f, 0.73f, 0.73f) };
+	const unsigned strata = 4096;
+	float maxError = 0.0f;
+	for (size_t c = 0; c < sizeof(colors) / sizeof(colors[0]); c++)
+	{
+		Color sum;
+		for (unsigned s = 0; s < strata; s++)
+		{
+			Wavelengths wavelengths;
+			wavelengths.sample((s + 0.5f) / strata);
+			sum += wavelengths.toRgb(wavelengths.fromRgb(colors[c]));
+		}
+		Color error = sum / (float)strata - colors[c];
+		maxError = std::max(maxError, std::max(std::fabs(error.r), std::max(std::fabs(error.g), std::fabs(error.b))));
+	}
+
+	bool pass = laneMismatches == 0 && maxError < 2.0e-3f;
+	printf("color lanes: %u mismatches, rgb -> spectrum -> rgb max error %.2e: %s\n", laneMismatches, maxError,
+		pass ? "ok" : "FAILED");
+	return pass;
+}
+
+// Upper tail of the chi-square distribution, Wilson-Hilferty approximation
+static double chiSquareTail(double statistic, unsigned degrees)
+{
+	double k = degrees;
+	double z = (std::pow(statistic / k, 1.0 / 3.0) - (1.0 - 2.0 / (9.0 * k))) / std::sqrt(2.0 / (9.0 * k));
+	return 0.5 * std::erfc(z / std::sqrt(2.0));
+}
+
+// Histograms sampleSA() over (cos theta, phi) cells around the normal and
+// returns the chi-square p-value against pdfSA() integrated over each cell.
+// Samples that fail or leave the hemisphere get a cell of their own, cells
+// expecting fewer than 5 samples are pooled. outMismatches counts samples
+// whose value or pdf disagrees with evaluateSA().
+static double chiSquareBrdf(const Brdf& brdf, const Vector& outgoing, const Vector& normal, unsigned sampleCount,
+	uint32_t seed, unsigned& outMismatches)
+{
+	const unsigned cosCells = 16, phiCells = 32, subdivisions = 16;
+	Vector x, y, z;
+	makeCoordinateSpace(dot(outgoing, normal) < 0.0f ? -normal : normal, x, y, z);
+
+	std::vector<double> observed(cosCells * phiCells + 1, 0.0), expected(cosCells * phiCells + 1, 0.0);
+	RandomStream random(0, 0, seed);
+	outMismatches = 0;
+	for (unsigned i = 0; i < sampleCount; i++)
+	{
+		Vector incoming;
+		float pdf = 0.0f;
+		float value = brdf.sampleSA(incoming, outgoing, normal, random.next(), random.next(), pdf);
+		Vector local = transformToLocalSpace(-incoming, x, y, z);
+		if (!(pdf > 0.0f) || local.z <= 0.0f)
+		{
+			observed[cosCells * phiCells]++;
+			continue;
+		}
+
+		float evaluatedPdf = 0.0f;
+		float evaluated = brdf.evaluateSA(incoming, outgoing, normal, evaluatedPdf);
+		if (std::fabs(evaluated - value) > 1.0e-3f * value || std::fabs(evaluatedPdf - pdf) > 1.0e-3f * pdf)
+			outMismatches++;
+
+		float phi = std::atan2(local.y, local.x) + (float)M_PI;
+		unsigned cosCell = std::min((unsigned)(local.z * cosCells), cosCells - 1);
+		unsigned phiCell = std::min((unsigned)(phi / (2.0f * M_PI) * phiCells), phiCells - 1);
+		observed[cosCell * phiCells + phiCell]++;
+	}
+
+	// Midpoint rule over each cell, the solid angle element is dcos dphi
+	double covered = 0.0;
+	double area = (1.0 / (cosCells * subdivisions)) * (2.0 * M_PI / (phiCells * subdivisions));
+	for (unsigned cell = 0; cell < cosCells * phiCells; cell++)
+	{
+		double sum = 0.0;
+		for (unsigned s = 0; s < subdivisions * subdivisions; s++)
+		{
+			float cosTheta = ((cell / phiCells) * subdivisions + s / subdivisions + 0.5f) / (cosCells * subdivisions);
+			float phi = ((cell % phiCells) * subdivisions + s % subdivisions + 0.5f) / (phiCells * subdivisions) *
+				2.0f * (float)M_PI - (float)M_PI;
+			float sinTheta = std::sqrt(std::max(1.0f - squared(cosTheta), 0.0f));
+			Vector direction = transformFromLocalSpace(Vector(sinTheta * std::cos(phi), sinTheta * std::sin(phi),
+				cosTheta), x, y, z);
+			sum += brdf.pdfSA(-direction, outgoing, normal);
+		}
+		expected[cell] = sum * area * sampleCount;
+		covered += sum * area;
+	}
+	expected[cosCells * phiCells] = std::max(1.0 - covered, 0.0) * sampleCount;
+
+	double statistic = 0.0, pooledObserved = 0.0, pooledExpected = 0.0;
+	unsigned degrees = 0;
+	for (size_t cell = 0; cell < observed.size(); cell++)
+	{
+		if (expected[cell] < 5.0)
+		{
+			pooledObserved += observed[cell];
+			pooledExpected += expected[cell];
+			continue;
+		}
+		statistic += squared(observed[cell] - expected[cell]) / expected[cell];
+		degrees++;
+	}
+	if (pooledExpected > 0.0)
+	{
+		statistic += squared(pooledObserved - pooledExpected) / pooledExpected;
+		degrees++;
+	}
+	else if (pooledObserved > 0.0)
+		return 0.0;
+	return degrees > 1 ? chiSquareTail(statistic, degrees - 1) : 1.0;
+}
+
+// Mean and variance of the weight f cos / pdf of glossy samples, drawn from
+// the visible normals as Glossy does or from the whole NDF, D cos(h)
+static void glossyWeightMoments(const Glossy& glossy, const Vector& outgoing, bool visibleNormals,
+	unsigned sampleCount, double& outMean, double& outVariance)
+{
+	Vector normal(0.0f, 0.0f, 1.0f);
+	float alpha2 = squared(glossy.getRoughness());
+	RandomStream random(0, 0, 97531);
+	double sum = 0.0, sumSquares = 0.0;
+	for (unsigned i = 0; i < sampleCount; i++)
+	{
+		float u1 = random.next(), u2 = random.next();
+		Vector incoming;
+		float pdf = 0.0f, value = 0.0f;
+		if (visibleNormals)
+			value = glossy.sampleSA(incoming, outgoing, normal, u1, u2, pdf);
+		else
+		{
+			float cos2Half = (1.0f - u1) / (1.0f + (alpha2 - 1.0f) * u1);
+			float sinHalf = std::sqrt(std::max(1.0f - cos2Half, 0.0f));
+			float phi = 2.0f * (float)M_PI * u2;
+			Vector half(sinHalf * std::cos(phi), sinHalf * std::sin(phi), std::sqrt(cos2Half));
+			float outgoingDotHalf = dot(outgoing, half);
+			incoming = outgoing - half * (2.0f * outgoingDotHalf);
+			float d = alpha2 / ((float)M_PI * squared(cos2Half * (alpha2 - 1.0f) + 1.0f));
+			float unused;
+			value = glossy.evaluateSA(incoming, outgoing, normal, unused);
+			pdf = outgoingDotHalf > 0.0f ? d * half.z / (4.0f * outgoingDotHalf) : 0.0f;
+		}
+		double weight = pdf > 0.0f ? value * std::fabs(incoming.z) / pdf : 0.0;
+		sum += weight;
+		sumSquares += weight * weight;
+	}
+	outMean = sum / sampleCount;
+	outVariance = std::max(sumSquares / sampleCount - outMean * outMean, 0.0);
+}
+
+// Largest difference between two arrays, relative to values above 1
+static float maxRelativeError(const float* pValues, const float* pExpected, size_t count)
+{
+	float worst = 0.0f;
+	for (size_t i = 0; i < count; i++)
+		worst = std::max(worst, std::fabs(pValues[i] - pExpected[i]) / std::max(std::fabs(pExpected[i]), 1.0f));
+	return worst;
+}
+
+// Runs evaluateSABatch() for Lambert and two GGX lobes, and the cosine
+// hemisphere warp kernel, over random directions on both sides of random
+// normals. They must agree with the scalar functions up to rounding.
+static bool checkBrdfKernels()
+{
+	const size_t count = 1 << 16;
+	RandomStream random(0, 0, 8642);
+	std::vector<float> planes[9];
+	for (int p = 0; p < 9; p++)
+		planes[p].resize(count);
+	std::vector<float> u1(count), u2(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		// Incoming, outgoing and normal
+		for (int v = 0; v < 3; v++)
+		{
+			Vector direction = uniformToSphere(random.next(), random.next());
+			planes[v * 3][i] = direction.x;
+			planes[v * 3 + 1][i] = direction.y;
+			planes[v * 3 + 2][i] = direction.z;
+		}
+		u1[i] = random.next();
+		u2[i] = random.next();
+	}
+	const float* const incoming[3] = { &planes[0][0], &planes[1][0], &planes[2][0] };
+	const float* const outgoing[3] = { &planes[3][0], &planes[4][0], &planes[5][0] };
+	const float* const normal[3] = { &planes[6][0], &planes[7][0], &planes[8][0] };
+
+	Lambert lambert;
+	Glossy coat(0.15f, 0.04f), metal(0.6f);
+	const Brdf* brdfs[] = { &lambert, &coat, &metal };
+	const char* names[] = { "lambert", "ggx 0.15 coat", "ggx 0.60 metal" };
+	std::vector<float> reflectance(count), pdf(count), expectedReflectance(count), expectedPdf(count);
+	bool pass = true;
+	for (size_t b = 0; b < sizeof(brdfs) / sizeof(brdfs[0]); b++)
+	{
+		// The scalar loop of the base class against the kernel, each timed
+		// on its second run
+		brdfs[b]->evaluateSABatch(incoming, outgoing, normal, count, &reflectance[0], &pdf[0]);
+		brdfs[b]->Brdf::evaluateSABatch(incoming, outgoing, normal, count, &expectedReflectance[0], &expectedPdf[0]);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		brdfs[b]->Brdf::evaluateSABatch(incoming, outgoing, normal, count, &expectedReflectance[0], &expectedPdf[0]);
+		std::chrono::steady_clock::time_point middle = std::chrono::steady_clock::now();
+		brdfs[b]->evaluateSABatch(incoming, outgoing, normal, count, &reflectance[0], &pdf[0]);
+		std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+		float error = std::max(maxRelativeError(&reflectance[0], &expectedReflectance[0], count),
+			maxRelativeError(&pdf[0], &expectedPdf[0], count));
+		pass &= error < 1.0e-4f;
+		printf("%s kernel: %.1f ns per evaluation, %.1f ns scalar, max relative error %.2e\n", names[b],
+			std::chrono::duration<double>(end - middle).count() * 1.0e9 / count,
+			std::chrono::duration<double>(middle - start).count() * 1.0e9 / count, error);
+	}
+
+	std::vector<float> directions[3];
+	for (int c = 0; c < 3; c++)
+		directions[c].resize(count);
+	float* const outDirection[3] = { &directions[0][0], &directions[1][0], &directions[2][0] };
+	kernels().cosineHemisphereFloats(&u1[0], &u2[0], count, outDirection);
+	float warpError = 0.0f;
+	for (size_t i = 0; i < count; i++)
+	{
+		Vector expected = uniformToCosineHemisphere(u1[i], u2[i]);
+		warpError = std::max(warpError, std::max(std::fabs(directions[0][i] - expected.x),
+			std::max(std::fabs(directions[1][i] - expected.y), std::fabs(directions[2][i] - expected.z))));
+	}
+	// z loses precision near the rim, where it is a square root of a small
+	// difference
+	pass &= warpError < 1.0e-3f;
+	printf("cosine hemisphere kernel: max error %.2e\n", warpError);
+	return pass;
+}
+
+// Chi-square tests Lambert and Glossy sampling over a range of roughnesses
+// and outgoing angles around a tilted normal, and shows the variance the
+// visible normal sampling saves over sampling the whole NDF
+static bool checkBrdf()
+{
+	const unsigned sampleCount = 1000000;
+	const float roughnesses[] = { 0.15f, 0.4f, 0.8f };
+	const float angles[] = { 0.0f, 45.0f, 80.0f };
+	const unsigned testCount = 1 + 2 * sizeof(roughnesses) / sizeof(roughnesses[0]) * sizeof(angles) / sizeof(angles[0]);
+	// Sidak correction keeps the chance of any false failure at 1%
+	double threshold = 1.0 - std::pow(0.99, 1.0 / testCount);
+
+	Vector normal = Vector(0.3f, 0.8f, -0.5f).normalized();
+	Vector x, y, z;
+	makeCoordinateSpace(normal, x, y, z);
+	bool pass = true;
+	uint32_t seed = 1;
+
+	Lambert lambert;
+	unsigned mismatches = 0;
+	double p = chiSquareBrdf(lambert, transformFromLocalSpace(Vector(0.5f, 0.0f, 0.866f), x, y, z), normal,
+		sampleCount, seed++, mismatches);
+	pass &= p > threshold && mismatches == 0;
+	printf("lambert: chi-square p %.3f, %u mismatches\n", p, mismatches);
+
+	for (size_t r = 0; r < sizeof(roughnesses) / sizeof(roughnesses[0]); r++)
+	{
+		for (size_t a = 0; a < sizeof(angles) / sizeof(angles[0]); a++)
+		{
+			float theta = angles[a] * (float)M_PI / 180.0f;
+			Vector localOutgoing(std::sin(theta), 0.0f, std::cos(theta));
+			Vector outgoing = transformFromLocalSpace(localOutgoing, x, y, z);
+
+			// A coat with Fresnel and a full metal reflector
+			Glossy coat(roughnesses[r], 0.04f), metal(roughnesses[r]);
+			unsigned coatMismatches = 0, metalMismatches = 0;
+			double coatP = chiSquareBrdf(coat, outgoing, normal, sampleCount, seed++, coatMismatches);
+			double metalP = chiSquareBrdf(metal, outgoing, normal, sampleCount, seed++, metalMismatches);
+			pass &= coatP > threshold && metalP > threshold && coatMismatches + metalMismatches == 0;
+
+			double visibleMean, visibleVariance, fullMean, fullVariance;
+			glossyWeightMoments(metal, localOutgoing, true, sampleCount, visibleMean, visibleVariance);
+			glossyWeightMoments(metal, localOutgoing, false, sampleCount, fullMean, fullVariance);
+			// Both estimate the directional albedo, as does the table
+			double tolerance = 5.0 * std::sqrt((visibleVariance + fullVariance) / sampleCount) + 1.0e-4;
+			bool albedoMatches = std::fabs(visibleMean - fullMean) < tolerance &&
+				std::fabs(metal.directionalAlbedo(localOutgoing.z) - visibleMean) < 0.01;
+			pass &= albedoMatches;
+
+			printf("glossy %.2f at %2.0f deg: chi-square p %.3f coat, %.3f metal, %u mismatches, albedo %.4f (table %.4f)%s, "
+				"weight variance %.5f visible normals, %.5f full NDF\n",
+				roughnesses[r], angles[a], coatP, metalP, coatMismatches + metalMismatches, visibleMean, metal.directionalAlbedo(localOutgoing.z),
+				albedoMatches ? "" : " (DIFFERS)", visibleVariance, fullVariance);
+		}
+	}
+
+	pass &= checkBrdfKernels();
+	printf("brdf sampling (p > %.4f): %s\n", threshold, pass ? "ok" : "FAILED");
+	return pass;
+}
+
+// Builds a BVH over clustered random boxes with one thread and with several,
+// which must give the same primitive order, node count and SAH cost. On a
+// machine with fewer cores the threads take turns, which still checks the
+// result but not the speedup.
+static bool checkBvh(size_t boxCount, unsigned threadCount)
+{
+	if (threadCount <= 1)
+		threadCount = std::max(defaultThreadCount(), 8u);
+
+	RandomStream random(0, 0, 2468);
+	std::vector<BoundingBox> boxes(boxCount);
+	Point clusterCenter;
+	for (size_t i = 0; i < boxCount; i++)
+	{
+		if (i % 1000 == 0)
+			clusterCenter = Point(random.next(), random.next(), random.next()) * 1000.0f;
+		Point min = clusterCenter + Point(random.next(), random.next(), random.next()) * 20.0f;
+		boxes[i] = BoundingBox(min, min + Point(random.next(), random.next(), random.next()));
+	}
+
+	Bvh single, multi;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	single.build(boxes, 4, 1);
+	std::chrono::steady_clock::time_point middle = std::chrono::steady_clock::now();
+	multi.build(boxes, 4, threadCount);
+	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+	bool identical = single.getPrimitiveOrder() == multi.getPrimitiveOrder() &&
+		single.getNodeCount() == multi.getNodeCount() && single.getSahCost() == multi.getSahCost();
+	printf("bvh: %llu boxes, %llu nodes, SAH cost %.2f, 1 thread %.3f s, %u threads %.3f s, identical: %s\n",
+		(unsigned long long)boxCount, (unsigned long long)single.getNodeCount(), single.getSahCost(),
+		std::chrono::duration<double>(middle - start).count(), threadCount,
+		std::chrono::duration<double>(end - middle).count(), identical ? "ok" : "FAILED");
+	return identical;
+}
+
+// Dependent loads at random across the array, like a BVH traversal of a
+// scene far bigger than the caches, once per page mode
+static bool checkHugePages(size_t megabytes)
+{
+	const size_t count = megabytes * 1024 * 1024 / sizeof(uint32_t);
+	const unsigned loads = 1 << 24;
+	const HugePageMode modes[] = { HUGE_PAGES_OFF, HUGE_PAGES_TRANSPARENT, HUGE_PAGES_EXPLICIT };
+	HugePageMode previousMode = getHugePageMode();
+	unsigned long long checksum = 0;
+	for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+	{
+		setHugePageMode(modes[m]);
+		HugePageStats before = getHugePageStats();
+		uint32_t* pNext = static_cast<uint32_t*>(allocateLarge(count * sizeof(uint32_t)));
+		HugePageStats allocated = getHugePageStats();
+
+		// One cycle through every element in random order, so no load can
+		// start before the previous one finished
+		RandomStream random(0, 0, 1357);
+		for (size_t i = 0; i < count; i++)
+			pNext[i] = (uint32_t)i;
+		for (size_t i = count - 1; i > 0; i--)
+			std::swap(pNext[i], pNext[std::min((size_t)(random.next() * i), i - 1)]);
+		HugePageStats touched = getHugePageStats();
+
+		EventCounter tlbMisses;
+		bool counting = tlbMisses.open(COUNTER_DTLB_LOAD_MISSES);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		uint32_t index = 0;
+		for (unsigned i = 0; i < loads; i++)
+			index = pNext[index];
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		checksum += index;
+		unsigned long long misses;
+		counting = counting && tlbMisses.read(misses);
+		freeLarge(pNext, count * sizeof(uint32_t));
+
+		const char* pPages = allocated.explicitBytes > before.explicitBytes ? "hugetlb" :
+			allocated.transparentBytes > before.transparentBytes ? "transparent" : "small";
+		printf("%-11s %u MiB on %s pages, %.0f MiB resident on huge pages: %.1f ns per load", hugePageModeName(modes[m]),
+			(unsigned)megabytes, pPages, (touched.residentHugeBytes - before.residentHugeBytes) / (1024.0 * 1024.0),
+			elapsed.count() * 1.0e9 / loads);
+		if (counting)
+			printf(", %.3f dTLB misses per load\n", (double)misses / loads);
+		else
+			printf(", dTLB misses not available\n");
+	}
+	setHugePageMode(previousMode);
+	// Keeps the chase from being optimized out
+	return checksum != ~0ull;
+}
+
+// Traces the same random rays at a terrain kept in memory and at one paged
+// into a cache of megabytes, first one ray at a time faulting clusters in
+// as they are reached and then in batches that queue rays per cluster. Hit
+// distances and shadow tests must match the mesh in memory exactly. Reports
+// the clusters each way reads. The file is usually still in the OS page
+// cache, so this times the cache's own work rather than a disk.
+static bool checkPaging(size_t triangleCount, size_t megabytes, const char* pCacheFile, unsigned threadCount)
+{
+	GeometryCache cache;
+	if (!cache.open(pCacheFile, megabytes * 1024 * 1024))
+		return false;
+
+	Scene inMemory, paged;
+	buildTerrain(inMemory, triangleCount);
+	buildTerrain(paged, triangleCount, &cache);
+	inMemory.prepare(threadCount);
+	std::chrono::steady_clock::time_point prepareStart = std::chrono::steady_clock::now();
+	paged.prepare(threadCount);
+	std::chrono::duration<double> prepareTime = std::chrono::steady_clock::now() - prepareStart;
+
+	// The terrain is the first shape of both
+	std::vector<Shape*> memoryShapes, pagedShapes;
+	inMemory.findShapes(memoryShapes);
+	paged.findShapes(pagedShapes);
+	TriangleMesh* pMesh = static_cast<TriangleMesh*>(memoryShapes[0]);
+	PagedMesh* pPaged = static_cast<PagedMesh*>(pagedShapes[0]);
+	if (!pPaged->isPaged())
+		return false;
+	printf("paging: %llu triangles in %llu clusters, %.1f MiB file, prepared in %.3f s\n",
+		(unsigned long long)pPaged->getPagedTriangleCount(), (unsigned long long)pPaged->getClusterCount(),
+		cache.getFileBytes() / (1024.0 * 1024.0), prepareTime.count());
+
+	// Incoherent rays from above the hills in every direction, with shadow
+	// rays of random length
+	const size_t rayCount = 1 << 18;
+	const size_t batchSize = 1 << 14;
+	RandomStream random(0, 0, 4321);
+	auto uniform = [&](float low, float high) { return low + (high - low) * random.next(); };
+	std::vector<Ray> rays(rayCount);
+	for (size_t i = 0; i < rayCount; i++)
+	{
+		Point origin(uniform(-50.0f, 50.0f), uniform(6.0f, 20.0f), uniform(-50.0f, 50.0f));
+		Vector direction(uniform(-1.0f, 1.0f), uniform(-1.0f, 0.2f), uniform(-1.0f, 1.0f));
+		rays[i] = Ray(origin, direction.normalized(), uniform(1.0f, 60.0f));
+	}
+
+	std::vector<Hit> expected(rayCount);
+	std::vector<char> expectedOccluded(rayCount);
+	parallelFor(rayCount, threadCount, [&](size_t i, unsigned)
+	{
+		pMesh->intersect(rays[i], expected[i]);
+		expectedOccluded[i] = pMesh->doesIntersect(rays[i]) ? 1 : 0;
+	});
+
+	std::vector<Hit> hits(rayCount);
+	std::vector<char> occluded(rayCount);
+	bool pass = true;
+	for (int batched = 0; batched < 2; batched++)
+	{
+		std::fill(hits.begin(), hits.end(), Hit());
+		cache.resetStats();
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		if (batched)
+		{
+			parallelFor(rayCount / batchSize, threadCount, [&](size_t batch, unsigned)
+			{
+				pPaged->intersectBatch(&rays[batch * batchSize], batchSize, &hits[batch * batchSize]);
+			});
+		}
+		else
+		{
+			parallelFor(rayCount, threadCount, [&](size_t i, unsigned)
+			{
+				pPaged->intersect(rays[i], hits[i]);
+				occluded[i] = pPaged->doesIntersect(rays[i]) ? 1 : 0;
+			});
+		}
+		std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+		GeometryCacheStats stats = cache.getStats();
+
+		size_t mismatches = 0;
+		for (size_t i = 0; i < rayCount; i++)
+		{
+			if (hits[i].dist != expected[i].dist || (!batched && occluded[i] != expectedOccluded[i]))
+				mismatches++;
+		}
+		pass = pass && mismatches == 0;
+		printf("%-8s %llu rays in %.3f s: %llu acquires, %.1f%% resident, %llu loads (%.1f MiB), "
+			"%llu evictions, %llu waits, %llu mismatches: %s\n", batched ? "batched" : "faulting",
+			(unsigned long long)rayCount, elapsed.count(), stats.acquires,
+			stats.acquires > 0 ? 100.0 * stats.hits / stats.acquires : 0.0, stats.loads, stats.bytesRead / (1024.0 * 1024.0),
+			stats.evictions, stats.waits, (unsigned long long)mismatches, mismatches == 0 ? "ok" : "FAILED");
+	}
+	printf("cache: %llu slots, %.1f MiB resident of %u MiB\n", (unsigned long long)cache.getSlotCount(),
+		cache.getResidentBytes() / (1024.0 * 1024.0), (unsigned)megabytes);
+	return pass;
+}
+
+// Applies the same random moves, removals, additions and material changes
+// to two sphere fields, one already prepared and one prepared afterwards,
+// then checks random rays find the same hits in both. Times the edits
+// against the full prepare.
+static bool checkEdits(size_t sphereCount, unsigned threadCount)
+{
+	Scene edited, rebuilt;
+	buildSphereField(edited, sphereCount);
+	buildSphereField(rebuilt, sphereCount);
+	edited.prepare(threadCount);
+
+	// Same construction, so shapes match by position
+	std::vector<Shape*> editedShapes, rebuiltShapes;
+	edited.findShapes(editedShapes);
+	rebuilt.findShapes(rebuiltShapes);
+	Material* pEditedMaterial = edited.addMaterial(new DiffuseMaterial(Color(0.2f, 0.7f, 0.3f)));
+	Material* pRebuiltMaterial = rebuilt.addMaterial(new DiffuseMaterial(Color(0.2f, 0.7f, 0.3f)));
+
+	const unsigned editCount = 2000;
+	float fieldSize = std::sqrt((float)sphereCount);
+	RandomStream random(0, 0, 1357);
+	bool applied = true;
+	std::chrono::steady_clock::duration editTime(0);
+	for (unsigned e = 0; e < editCount && applied; e++)
+	{
+		// Index 0 is the ground plane
+		size_t target = 1 + std::min((size_t)(random.next() * (editedShapes.size() - 1)), editedShapes.size() - 2);
+		unsigned kind = e % 10;
+		Vector offset((random.next() - 0.5f) * 4.0f, 0.0f, (random.next() - 0.5f) * 4.0f);
+		Point center((random.next() - 0.5f) * fieldSize, 0.3f, (random.next() - 0.5f) * fieldSize);
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		if (kind < 7)
+			applied = edited.moveShape(editedShapes[target], offset);
+		else if (kind == 7)
+			applied = edited.removeShape(editedShapes[target]);
+		else if (kind == 8)
+			edited.addShape(new Sphere(center, 0.3f, pEditedMaterial));
+		else
+			applied = edited.setShapeMaterial(editedShapes[target], pEditedMaterial);
+		editTime += std::chrono::steady_clock::now() - start;
+
+		if (kind < 7)
+			applied &= rebuilt.moveShape(rebuiltShapes[target], offset);
+		else if (kind == 7)
+			applied &= rebuilt.removeShape(rebuiltShapes[target]);
+		else if (kind == 8)
+			rebuilt.addShape(new Sphere(center, 0.3f, pRebuiltMaterial));
+		else
+			applied &= rebuilt.setShapeMaterial(rebuiltShapes[target], pRebuiltMaterial);
+
+		if (kind == 7)
+		{
+			editedShapes.erase(editedShapes.begin() + target);
+			rebuiltShapes.erase(rebuiltShapes.begin() + target);
+		}
+	}
+
+	BvhStats refitStats = edited.getBvhStats();
+	std::chrono::steady_clock::time_point prepareStart = std::chrono::steady_clock::now();
+	rebuilt.prepare(threadCount);
+	std::chrono::duration<double> prepareTime = std::chrono::steady_clock::now() - prepareStart;
+	BvhStats rebuiltStats = rebuilt.getBvhStats();
+
+	// Compare by position among all shapes, which also tells the materials apart
+	std::vector<Shape*> allEdited, allRebuilt;
+	edited.findShapes(allEdited);
+	rebuilt.findShapes(allRebuilt);
+	std::unordered_map<const Shape*, size_t> editedIndex, rebuiltIndex;
+	for (size_t i = 0; i < allEdited.size(); i++)
+		editedIndex[allEdited[i]] = i;
+	for (size_t i = 0; i < allRebuilt.size(); i++)
+		rebuiltIndex[allRebuilt[i]] = i;
+
+	const unsigned rayCount = 200000;
+	unsigned mismatches = 0;
+	for (unsigned r = 0; r < rayCount; r++)
+	{
+		Point origin((random.next() - 0.5f) * fieldSize, random.next() * 2.0f, (random.next() - 0.5f) * fieldSize);
+		Vector direction(random.next() - 0.5f, random.next() - 0.75f, random.next() - 0.5f);
+		Ray ray(origin, direction);
+		Intersection a(ray), b(ray);
+		bool hitA = edited.getShapes().intersectSurface(a);
+		bool hitB = rebuilt.getShapes().intersectSurface(b);
+		// Spheres added since the last rebuild are intersected one by one
+		// rather than by the packed kernels, which round the distance
+		// differently, by a few ulps of the squared terms on grazing rays
+		bool sameDist = std::fabs(a.dist - b.dist) <= 1.0e-4f * std::max(a.dist, b.dist);
+		if (hitA != hitB || (hitA && (!sameDist || editedIndex[a.pShape] != rebuiltIndex[b.pShape] ||
+			(a.pMaterial == pEditedMaterial) != (b.pMaterial == pRebuiltMaterial))))
+			mismatches++;
+	}
+
+	double editMicroseconds = std::chrono::duration<double>(editTime).count() * 1.0e6 / editCount;
+	bool pass = applied && mismatches == 0;
+	printf("edits: %u on %llu spheres, %.1f us each, %u rebuilds, SAH cost %.2f refitted, %.2f rebuilt\n",
+		editCount, (unsigned long long)sphereCount, editMicroseconds, edited.getShapes().getRebuildCount(),
+		refitStats.sahCost, rebuiltStats.sahCost);
+	printf("full prepare: %.1f us, %u rays, %u mismatches: %s\n", prepareTime.count() * 1.0e6, rayCount, mismatches,
+		pass ? "ok" : "FAILED");
+	return pass;
+}
+
+// Rotates a perspective camera about its focus point
+static PerspectiveCamera* orbitCamera(const PerspectiveCamera& camera, float angle)
+{
+	Point target = camera.getTarget();
+	Vector axis = camera.getUp();
+	Vector offset = camera.getOrigin() - target;
+	Vector along = axis * dot(axis, offset);
+	Vector across = offset - along;
+	Vector rotated = along + across * std::cos(angle) + cross(axis, across) * std::sin(angle);
+	return new PerspectiveCamera(camera.getFieldOfView(), target + rotated, target, axis,
+		camera.getFocalDistance(), camera.getLensRadius());
+}
+
+// Moves the camera every 100 ms, often enough to cut into the full
+// resolution refinement, and reports how soon each move shows up
+static bool runPreview(Scene& scene, const BenchmarkOptions& options)
+{
+	if (dynamic_cast<PerspectiveCamera*>(scene.getCamera()) == NULL)
+	{
+		fprintf(stderr, "--preview needs a perspective camera\n");
+		return false;
+	}
+
+	unsigned levelFrames[kPreviewLevels] = { 0 };
+	PreviewRenderer preview(scene, options.settings, options.samplesPerPixel,
+		[&](const Image&, unsigned level, unsigned)
+	{
+		levelFrames[level]++;
+	});
+
+	// The scene's camera belongs to the preview thread once it starts
+	PerspectiveCamera* pStart = orbitCamera(*static_cast<PerspectiveCamera*>(scene.getCamera()), 0.0f);
+	unsigned moveCount = options.count > 0 ? (unsigned)options.count : 20;
+	preview.start();
+	for (unsigned move = 1; move <= moveCount; move++)
+	{
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+		preview.setCamera(orbitCamera(*pStart, 0.02f * move));
+	}
+	while (!preview.isIdle())
+		std::this_thread::sleep_for(std::chrono::milliseconds(10));
+	preview.stop();
+	delete pStart;
+
+	PreviewStats stats = preview.getStats();
+	printf("preview: %ux%u, %u moves, refined to %u spp\n", (unsigned)options.settings.width,
+		(unsigned)options.settings.height, moveCount, options.samplesPerPixel);
+	printf("frames: %u at 1/16, %u at 1/4, %u at full resolution, %llu passes cancelled\n",
+		levelFrames[0], levelFrames[1], levelFrames[2], stats.cancelledPasses);
+	printf("cancel: %.1f ms mean, %.1f ms max over %llu applied changes\n",
+		stats.appliedChanges > 0 ? stats.cancelSeconds * 1000.0 / stats.appliedChanges : 0.0,
+		stats.maxCancelSeconds * 1000.0, stats.appliedChanges);
+	printf("latency to first frame: %.1f ms mean, %.1f ms max over %llu changes shown\n",
+		stats.shownChanges > 0 ? stats.latencySeconds * 1000.0 / stats.shownChanges : 0.0,
+		stats.maxLatencySeconds * 1000.0, stats.shownChanges);
+	return true;
+}
+
+// Builds the --scene or --scene-file scene without preparing it
+static bool buildScene(const BenchmarkOptions& options, Scene& outScene, unsigned threadCount)
+{
+	if (options.sceneFile != NULL)
+	{
+		if (!loadScene(options.sceneFile, outScene, threadCount, options.pGeometryCache) || outScene.getCamera() == NULL)
+		{
+			fprintf(stderr, "Could not load '%s'\n", options.sceneFile);
+			return false;
+		}
+		return true;
+	}
+	if (!buildBenchmarkScene(options.sceneName, outScene, options.count, options.pGeometryCache))
+	{
+		fprintf(stderr, "Unknown scene '%s'\n", options.sceneName);
+		return false;
+	}
+	return true;
+}
+
+// The scene and its replicas for numaMode under the current placement
+static bool prepareNumaScene(const BenchmarkOptions& options, NumaMode numaMode, Scene& outScene,
+	SceneReplicas& outReplicas)
+{
+	if (numaMode == NUMA_REPLICATE)
+	{
+		return outReplicas.build(outScene, options.settings.threadCount, [&](Scene& nodeScene, unsigned threadCount)
+		{
+			if (!buildScene(options, nodeScene, threadCount))
+				return false;
+			nodeScene.prepare(threadCount);
+			return true;
+		});
+	}
+	if (!buildScene(options, outScene, options.settings.threadCount))
+		return false;
+	outScene.prepare(options.settings.threadCount);
+	return true;
+}
+
+// Renders with 1, 2, 4, ... threads up to --threads under each NUMA mode.
+// Renders are bit identical whatever the placement, so every hash must match.
+static bool runNumaScaling(const BenchmarkOptions& options)
+{
+	NumaTopology topology = detectNumaTopology().split(options.numaNodes);
+	unsigned maxThreads = options.settings.threadCount > 0 ? options.settings.threadCount : defaultThreadCount();
+	std::vector<unsigned> threadCounts;
+	for (unsigned threads = 1; threads < maxThreads; threads *= 2)
+		threadCounts.push_back(threads);
+	threadCounts.push_back(maxThreads);
+
+	printf("scene: %s\n", options.sceneFile != NULL ? options.sceneFile : options.sceneName);
+	printf("numa: %u nodes, %u cpus\n", topology.getNodeCount(), (unsigned)topology.getCpuCount());
+
+	const NumaMode modes[] = { NUMA_OFF, NUMA_PIN, NUMA_REPLICATE };
+	double baseline[64] = { 0.0 };
+	unsigned long long firstHash = 0;
+	bool allMatch = true;
+	for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+	{
+		setNumaPlacement(modes[m] != NUMA_OFF ? &topology : NULL);
+		Scene scene;
+		SceneReplicas replicas;
+		if (!prepareNumaScene(options, modes[m], scene, replicas))
+		{
+			setNumaPlacement(NULL);
+			return false;
+		}
+
+		for (size_t t = 0; t < threadCounts.size() && t < 64; t++)
+		{
+			RenderSettings settings = options.settings;
+			settings.threadCount = threadCounts[t];
+			Renderer renderer(scene, settings);
+			renderer.setReplicas(replicas.getScenes());
+			renderer.render(options.samplesPerPixel);
+			Image image(settings.width, settings.height);
+			renderer.resolve(image);
+
+			const RenderStats& stats = renderer.getStats();
+			double mraysPerSecond = stats.renderSeconds > 0.0 ? stats.totalRays() / stats.renderSeconds * 1.0e-6 : 0.0;
+			if (modes[m] == NUMA_OFF)
+				baseline[t] = mraysPerSecond;
+			unsigned long long hash = imageHash(image);
+			if (m == 0 && t == 0)
+				firstHash = hash;
+			allMatch = allMatch && hash == firstHash;
+			printf("%-9s %3u threads: %8.3f Mrays/s, %.2fx off, hash %016llx\n", numaModeName(modes[m]),
+				threadCounts[t], mraysPerSecond, baseline[t] > 0.0 ? mraysPerSecond / baseline[t] : 0.0, hash);
+		}
+	}
+	setNumaPlacement(NULL);
+
+	printf("images: %s\n", allMatch ? "identical" : "DIFFERENT");
+	return allMatch;
+}
+
+// Calls splat(x, y, color) for a tent filter of radius 2 pixels around a
+// random point, which follows from sampleIndex alone. Spread points reach
+// past the edges, crowded ones stay in a 16 pixel square at the center like
+// a caustic a light tracer keeps hitting.
+template <class SplatFn>
+static void splatFootprint(size_t sampleIndex, bool crowded, size_t width, size_t height, SplatFn splat)
+{
+	const float radius = 2.0f;
+	RandomStream random((uint32_t)sampleIndex, 0, 2468);
+	float centerX, centerY;
+	if (crowded)
+	{
+		centerX = width * 0.5f + (random.next() - 0.5f) * 16.0f;
+		centerY = height * 0.5f + (random.next() - 0.5f) * 16.0f;
+	}
+	else
+	{
+		centerX = -radius + random.next() * (width + 2.0f * radius);
+		centerY = -radius + random.next() * (height + 2.0f * radius);
+	}
+	Color value(random.next(), random.next(), random.next());
+
+	ptrdiff_t x0 = (ptrdiff_t)std::floor(centerX - radius), x1 = (ptrdiff_t)std::floor(centerX + radius);
+	ptrdiff_t y0 = (ptrdiff_t)std::floor(centerY - radius), y1 = (ptrdiff_t)std::floor(centerY + radius);
+	for (ptrdiff_t y = y0; y <= y1; y++)
+	{
+		float weightY = 1.0f - std::fabs(y + 0.5f - centerY) / radius;
+		for (ptrdiff_t x = x0; x <= x1; x++)
+		{
+			float weight = weightY * (1.0f - std::fabs(x + 0.5f - centerX) / radius);
+			if (weightY > 0.0f && weight > 0.0f)
+				splat(x, y, value * weight);
+		}
+	}
+}
+
+// Splats sampleCount footprints from every thread into each kind of
+// SplatBuffer, spread over the image and then crowded together. The sums
+// must match a serial one in doubles up to float rounding, and so must the
+// splats dropped off the edges.
+static bool checkSplats(size_t sampleCount, unsigned threadCount, size_t width, size_t height)
+{
+	if (threadCount == 0)
+		threadCount = defaultThreadCount();
+	const size_t chunkSize = 4096;
+	const size_t chunkCount = (sampleCount + chunkSize - 1) / chunkSize;
+	const SplatMode modes[] = { SPLAT_PER_THREAD, SPLAT_ATOMIC };
+	bool allMatch = true;
+	for (int crowded = 0; crowded < 2; crowded++)
+	{
+		std::vector<double> reference(width * height * 3, 0.0);
+		unsigned long long splatCount = 0, droppedCount = 0;
+		for (size_t i = 0; i < sampleCount; i++)
+		{
+			splatFootprint(i, crowded != 0, width, height, [&](ptrdiff_t x, ptrdiff_t y, const Color& value)
+			{
+				splatCount++;
+				if (x < 0 || y < 0 || x >= (ptrdiff_t)width || y >= (ptrdiff_t)height)
+				{
+					droppedCount++;
+					return;
+				}
+				double* pPixel = &reference[((size_t)y * width + x) * 3];
+				pPixel[0] += value.r;
+				pPixel[1] += value.g;
+				pPixel[2] += value.b;
+			});
+		}
+
+		for (size_t m = 0; m < sizeof(modes) / sizeof(modes[0]); m++)
+		{
+			SplatBuffer buffer(width, height, modes[m], threadCount);
+			std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+			parallelFor(chunkCount, threadCount, [&](size_t chunk, unsigned threadIndex)
+			{
+				size_t end = std::min((chunk + 1) * chunkSize, sampleCount);
+				for (size_t i = chunk * chunkSize; i < end; i++)
+				{
+					splatFootprint(i, crowded != 0, width, height, [&](ptrdiff_t x, ptrdiff_t y, const Color& value)
+					{
+						buffer.splat(x, y, value, threadIndex);
+					});
+				}
+			});
+			std::chrono::steady_clock::time_point middle = std::chrono::steady_clock::now();
+			Image image(width, height);
+			buffer.resolve(image, 1.0f, threadCount);
+			std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+
+			bool match = buffer.getDroppedCount() == droppedCount;
+			const Color* pPixels = image.getPixels();
+			for (size_t i = 0; i < width * height && match; i++)
+			{
+				const float channels[3] = { pPixels[i].r, pPixels[i].g, pPixels[i].b };
+				for (int c = 0; c < 3; c++)
+				{
+					double expected = reference[i * 3 + c];
+					if (std::fabs(channels[c] - expected) > 1.0e-3 * std::max(expected, 1.0))
+						match = false;
+				}
+			}
+			allMatch = allMatch && match;
+
+			double splatSeconds = std::chrono::duration<double>(middle - start).count();
+			printf("%-7s %-10s %u threads: %8.2f M pixel splats/s, resolve %.2f ms, %.1f MiB, %llu dropped: %s\n",
+				crowded ? "crowded" : "spread", splatModeName(modes[m]), threadCount,
+				splatSeconds > 0.0 ? splatCount / splatSeconds * 1.0e-6 : 0.0,
+				std::chrono::duration<double>(end - middle).count() * 1.0e3,
+				buffer.getAllocatedBytes() / (1024.0 * 1024.0), buffer.getDroppedCount(), match ? "ok" : "FAILED");
+		}
+	}
+	return allMatch;
+}
+
+// Renders the scene once per ray order. The orders trace the same paths,
+// so the images must be bit identical; what changes is how coherent the
+// batches of secondary rays are when they reach the BVH.
+static bool compareRayOrders(const BenchmarkOptions& options)
+{
+	Scene scene;
+	if (!buildScene(options, scene, options.settings.threadCount))
+		return false;
+	scene.prepare(options.settings.threadCount);
+
+	printf("scene: %s, tiles of %u pixels\n", options.sceneFile != NULL ? options.sceneFile : options.sceneName,
+		(unsigned)(options.settings.tileSize * options.settings.tileSize));
+	const RayOrder orders[] = { RAY_ORDER_PATH, RAY_ORDER_WAVEFRONT, RAY_ORDER_SORTED };
+	unsigned long long firstHash = 0;
+	bool allMatch = true;
+	for (size_t o = 0; o < sizeof(orders) / sizeof(orders[0]); o++)
+	{
+		RenderSettings settings = options.settings;
+		settings.rayOrder = orders[o];
+		Renderer renderer(scene, settings);
+
+		EventCounter l1Misses, cacheMisses;
+		bool countingL1 = l1Misses.open(COUNTER_L1D_LOAD_MISSES);
+		bool countingCache = cacheMisses.open(COUNTER_CACHE_MISSES);
+		renderer.render(options.samplesPerPixel);
+		unsigned long long l1Count = 0, cacheCount = 0;
+		countingL1 = countingL1 && l1Misses.read(l1Count);
+		countingCache = countingCache && cacheMisses.read(cacheCount);
+
+		Image image(settings.width, settings.height);
+		renderer.resolve(image);
+		unsigned long long hash = imageHash(image);
+		if (o == 0)
+			firstHash = hash;
+		allMatch = allMatch && hash == firstHash;
+
+		const RenderStats& stats = renderer.getStats();
+		double rays = (double)std::max(stats.totalRays(), 1ull);
+		printf("%-9s %8.3f Mrays/s", rayOrderName(orders[o]),
+			stats.renderSeconds > 0.0 ? stats.totalRays() / stats.renderSeconds * 1.0e-6 : 0.0);
+		if (stats.secondarySeconds > 0.0)
+			printf(", secondary %8.3f Mrays/s per thread", stats.secondaryRays / stats.secondarySeconds * 1.0e-6);
+		else
+			printf(", secondary not batched           ");
+		if (countingL1 && countingCache)
+			printf(", %.1f L1D and %.2f LLC misses per ray", l1Count / rays, cacheCount / rays);
+		else
+			printf(", cache misses not available");
+		printf(", hash %016llx\n", hash);
+	}
+
+	printf("images: %s\n", allMatch ? "identical" : "DIFFERENT");
+	return allMatch;
+}
+
+static float computeRmse(const Image& image, const Image& reference)
+{
+	size_t count = image.getWidth() * image.getHeight();
+	const Color* pImage = image.getPixels();
+	const Color* pReference = reference.getPixels();
+
+	double sum = 0.0;
+	for (size_t i = 0; i < count; i++)
+	{
+		Color diff = pImage[i] - pReference[i];
+		sum += squared(diff.r) + squared(diff.g) + squared(diff.b);
+	}
+
+	return (float)std::sqrt(sum / (3.0 * count));
+}
+
+int runBenchmark(int argc, char* argv[])
+{
+	BenchmarkOptions options;
+	if (!parseOptions(argc, argv, options))
+	{
+		printUsage();
+		return 1;
+	}
+
+	if (options.checkMath)
+		return checkFastMath() ? 0 : 1;
+	if (options.checkPathControl)
+		return checkPathControl() ? 0 : 1;
+	if (options.checkBrdf)
+		return checkBrdf() ? 0 : 1;
+	if (options.checkSpectrum)
+		return checkSpectrum() ? 0 : 1;
+	if (options.checkBvh)
+		return checkBvh(options.count > 0 ? options.count : 2000000, options.settings.threadCount) ? 0 : 1;
+	if (options.checkHugePages)
+		return checkHugePages(options.count > 0 ? options.count : 512) ? 0 : 1;
+	if (options.checkPaging)
+	{
+		return checkPaging(options.count > 0 ? options.count : 2000000, options.geometryMegabytes,
+			options.geometryFile != NULL ? options.geometryFile : "geometry.cache", options.settings.threadCount) ? 0 : 1;
+	}
+	if (options.checkSplats)
+	{
+		return checkSplats(options.count > 0 ? options.count : 1000000, options.settings.threadCount,
+			options.settings.width, options.settings.height) ? 0 : 1;
+	}
+	if (options.checkEdits)
+		return checkEdits(options.count > 0 ? options.count : 100000, options.settings.threadCount) ? 0 : 1;
+
+	if (options.numaScaling)
+		return runNumaScaling(options) ? 0 : 1;
+	if (options.compareRayOrders)
+		return compareRayOrders(options) ? 0 : 1;
+
+	NumaTopology numaTopology = detectNumaTopology().split(options.numaNodes);
+	if (options.numaMode != NUMA_OFF)
+		setNumaPlacement(&numaTopology);
+	setHugePageMode(options.hugePages);
+
+	GeometryCache geometryCache;
+	if (options.geometryFile != NULL)
+	{
+		if (!geometryCache.open(options.geometryFile, options.geometryMegabytes * 1024 * 1024))
+			return 1;
+		options.pGeometryCache = &geometryCache;
+	}
+
+	std::chrono::steady_clock::time_point wallStart = std::chrono::steady_clock::now();
+
+	Scene scene;
+	SceneReplicas replicas;
+	double loadSeconds = 0.0;
+	std::chrono::duration<double> prepareTime(0.0);
+	if (options.numaMode == NUMA_REPLICATE)
+	{
+		// Each node loads and prepares its own copy, timed together
+		if (!prepareNumaScene(options, options.numaMode, scene, replicas))
+			return 1;
+		prepareTime = std::chrono::steady_clock::now() - wallStart;
+	}
+	else
+	{
+		if (!buildScene(options, scene, options.settings.threadCount))
+			return 1;
+		std::chrono::duration<double> loadTime = std::chrono::steady_clock::now() - wallStart;
+		loadSeconds = loadTime.count();
+
+		std::chrono::steady_clock::time_point prepareStart = std::chrono::steady_clock::now();
+		scene.prepare(options.settings.threadCount);
+		prepareTime = std::chrono::steady_clock::now() - prepareStart;
+	}
+	if (options.sceneFile != NULL)
+		options.sceneName = options.sceneFile;
+
+	if (options.preview)
+		return runPreview(scene, options) ? 0 : 1;
+
+	Image reference(options.settings.width, options.settings.height);
+	bool haveReference = false;
+	if (options.referenceFile != NULL && !options.makeReference)
+	{
+		if (!reference.loadFromFile(options.referenceFile) ||
+			reference.getWidth() != options.settings.width ||
+			reference.getHeight() != options.settings.height)
+		{
+			fprintf(stderr, "Reference '%s' is missing or does not match the render size\n", options.referenceFile);
+			return 1;
+		}
+		haveReference = true;
+	}
+
+	if (options.denoise)
+		options.settings.aovFlags |= kAovAlbedo | kAovNormal | kAovDepth | kAovVariance;
+
+	Renderer renderer(scene, options.settings);
+	renderer.setReplicas(replicas.getScenes());
+	Image image(options.settings.width, options.settings.height);
+
+	// Time-to-RMSE only counts rendering, not the error measurement itself
+	double timeToRmse = -1.0;
+	unsigned passesToRmse = 0;
+	float rmse = 0.0f;
+
+	EventCounter tlbMisses, l1Misses;
+	bool countingTlbMisses = tlbMisses.open(COUNTER_DTLB_LOAD_MISSES);
+	bool countingL1Misses = l1Misses.open(COUNTER_L1D_LOAD_MISSES);
+
+	for (unsigned pass = 0; pass < options.samplesPerPixel; pass++)
+	{
+		renderer.renderPass();
+
+		if (haveReference)
+		{
+			renderer.resolve(image);
+			rmse = computeRmse(image, reference);
+			if (timeToRmse < 0.0 && rmse <= options.targetRmse)
+			{
+				timeToRmse = renderer.getStats().renderSeconds;
+				passesToRmse = renderer.getPassCount();
+			}
+		}
+	}
+
+	renderer.resolve(image);
+	std::chrono::duration<double> wallTime = std::chrono::steady_clock::now() - wallStart;
+
+	const RenderStats& stats = renderer.getStats();
+	printf("scene: %s\n", options.sceneName);
+	printf("resolution: %ux%u\n", (unsigned)options.settings.width, (unsigned)options.settings.height);
+	printf("spp: %u\n", renderer.getPassCount());
+	printf("kernels: %s\n", isaLevelName(kernels().isa));
+	printf("color: %s\n", options.settings.spectral ? "spectral, 4 wavelengths" : "rgb");
+	printf("ray order: %s, tiles of %u pixels\n", rayOrderName(options.settings.rayOrder),
+		(unsigned)(options.settings.tileSize * options.settings.tileSize));
+	printf("numa: %s over %u nodes\n", numaModeName(options.numaMode), numaTopology.getNodeCount());
+	if (options.sceneFile != NULL)
+	{
+		FILE* pFile = fopen(options.sceneFile, "rb");
+		double megabytes = 0.0;
+		if (pFile != NULL)
+		{
+			fseek(pFile, 0, SEEK_END);
+			megabytes = ftell(pFile) / (1024.0 * 1024.0);
+			fclose(pFile);
+		}
+		printf("load time: %.3f s (%.1f MiB/s)\n", loadSeconds, loadSeconds > 0.0 ? megabytes / loadSeconds : 0.0);
+	}
+	BvhStats bvhStats = scene.getBvhStats();
+	printf("prepare time: %.3f s\n", prepareTime.count());
+	printf("bvh: %u trees, %llu nodes, SAH cost %.2f\n", bvhStats.treeCount,
+		(unsigned long long)bvhStats.nodeCount, bvhStats.sahCost);
+	printf("render time: %.3f s\n", stats.renderSeconds);
+	printf("wall time: %.3f s\n", wallTime.count());
+	printf("rays: %llu camera, %llu bounce, %llu shadow\n", stats.cameraRays, stats.bounceRays, stats.shadowRays);
+	printf("Mrays/s: %.3f\n", stats.renderSeconds > 0.0 ? stats.totalRays() / stats.renderSeconds * 1.0e-6 : 0.0);
+	if (stats.secondarySeconds > 0.0)
+	{
+		printf("secondary rays: %llu batched, %.3f Mrays/s per thread sorting and tracing them\n", stats.secondaryRays,
+			stats.secondaryRays / stats.secondarySeconds * 1.0e-6);
+	}
+	printf("peak RSS: %.1f MiB\n", peakResidentMegabytes());
+	HugePageStats hugePageStats = getHugePageStats();
+	const double mebibyte = 1024.0 * 1024.0;
+	printf("huge pages: %s, large arrays %.1f MiB explicit, %.1f MiB transparent, %.1f MiB small pages, "
+		"%.1f MiB resident on huge pages\n", hugePageModeName(options.hugePages),
+		hugePageStats.explicitBytes / mebibyte, hugePageStats.transparentBytes / mebibyte,
+		hugePageStats.smallPageBytes / mebibyte, hugePageStats.residentHugeBytes / mebibyte);
+	unsigned long long misses;
+	if (countingTlbMisses && tlbMisses.read(misses))
+	{
+		printf("dTLB load misses: %llu, %.2f per ray\n", misses,
+			stats.totalRays() > 0 ? (double)misses / stats.totalRays() : 0.0);
+	}
+	else
+		printf("dTLB load misses: not available\n");
+	if (countingL1Misses && l1Misses.read(misses))
+	{
+		printf("L1D load misses: %llu, %.2f per ray\n", misses,
+			stats.totalRays() > 0 ? (double)misses / stats.totalRays() : 0.0);
+	}
+	else
+		printf("L1D load misses: not available\n");
+	if (geometryCache.isOpen())
+	{
+		GeometryCacheStats geometryStats = geometryCache.getStats();
+		printf("geometry cache: %llu clusters, %.1f MiB file, %llu slots, %.1f%% resident, %llu loads (%.1f MiB), "
+			"%llu evictions\n", (unsigned long long)geometryCache.getClusterCount(), geometryCache.getFileBytes() / mebibyte,
+			(unsigned long long)geometryCache.getSlotCount(),
+			geometryStats.acquires > 0 ? 100.0 * geometryStats.hits / geometryStats.acquires : 0.0, geometryStats.loads,
+			geometryStats.bytesRead / mebibyte, geometryStats.evictions);
+	}
+	printf("image hash: %016llx\n", imageHash(image));
+
+	if (haveReference)
+	{
+		printf("rmse: %.5f\n", rmse);
+		if (timeToRmse >= 0.0)
+			printf("time to rmse %.5f: %.3f s (%u spp)\n", options.targetRmse, timeToRmse, passesToRmse);
+		else
+			printf("time to rmse %.5f: not reached\n", options.targetRmse);
+	}
+
+	if (options.makeReference)
+		image.saveToFile(options.referenceFile);
+
+	// Timed with the buffers allocated, as a progressive renderer would reuse them
+	if (options.denoise)
+	{
+		AovBuffers aovs(options.settings.width, options.settings.height, options.settings.aovFlags);
+		renderer.resolveAovs(aovs);
+		Denoiser denoiser(options.settings.width, options.settings.height);
+		DenoiseSettings denoiseSettings;
+		denoiseSettings.threadCount = options.settings.threadCount;
+
+		std::chrono::steady_clock::time_point denoiseStart = std::chrono::steady_clock::now();
+		denoiser.denoise(image, aovs, denoiseSettings, image);
+		std::chrono::duration<double> denoiseTime = std::chrono::steady_clock::now() - denoiseStart;
+
+		double megapixels = options.settings.width * options.settings.height * 1.0e-6;
+		printf("denoise time: %.3f s (%.1f Mpixels/s)\n", denoiseTime.count(), megapixels / denoiseTime.count());
+		if (haveReference)
+			printf("denoised rmse: %.5f\n", computeRmse(image, reference));
+	}
+
+	if (options.outputFile != NULL)
+		image.saveToFile(options.outputFile);
+
+	return 0;
+}
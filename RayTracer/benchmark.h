@@ -0,0 +1,9 @@
+#ifndef __BENCHMARK_H__
+#define __BENCHMARK_H__
+
+// End-to-end render benchmark over the procedural reference scenes.
+// Reports wall time, Mrays/s and peak RSS, and when given a reference image
+// the time taken to converge below an RMSE target.
+int runBenchmark(int argc, char* argv[]);
+
+#endif
@@ -0,0 +1,606 @@
+#include "bvh.h"
+#include "parallel.h"
+
+#include <algorithm>
+
+namespace
+{
+	const unsigned kBinCount = 16;
+
+	// Relative cost of one node traversal against one primitive test
+	const float kTraversalCost = 1.0f;
+	const float kIntersectionCost = 1.0f;
+
+	// Nodes near the root are measured, binned and partitioned by every thread
+	// in chunks of this many primitives
+	const unsigned kChunkSize = 16384;
+
+	// Below the top levels whole subtrees of at least this many primitives are
+	// built one per thread
+	const unsigned kMinTaskSize = 4096;
+
+	struct Bin
+	{
+		BoundingBox bounds;
+		unsigned count;
+
+		Bin() : bounds(), count(0) { }
+	};
+
+	bool sameBounds(const BoundingBox& a, const BoundingBox& b)
+	{
+		return a.min.x == b.min.x && a.min.y == b.min.y && a.min.z == b.min.z &&
+			a.max.x == b.max.x && a.max.y == b.max.y && a.max.z == b.max.z;
+	}
+
+	int binIndex(float center, float binMin, float binScale)
+	{
+		int bin = (int)((center - binMin) * binScale);
+		return std::min(std::max(bin, 0), (int)kBinCount - 1);
+	}
+
+	// Primitives in bins below bin go left, bin = 0 makes a leaf and axis < 0
+	// splits at the middle of the range as all centers coincide
+	struct Split
+	{
+		int axis;
+		float binMin, binScale;
+		unsigned bin;
+	};
+
+	// Subtree left to one thread, built into its own nodes and spliced in
+	// place of the placeholder node afterwards
+	struct BuildTask
+	{
+		unsigned node;
+		unsigned first, count, depth;
+		LargeVector<BvhNode> nodes;
+	};
+
+	// Builds the same tree whether or not the top levels are parallel: bounds
+	// and bins are exact unions in any order and partitioning is stable
+	class BvhBuilder
+	{
+	public:
+		BvhBuilder(const std::vector<BoundingBox>& primitiveBounds,
+			const std::vector<Point>& centers,
+			std::vector<unsigned>& primitiveOrder,
+			unsigned maxLeafSize,
+			unsigned maxDepth,
+			unsigned threadCount)
+			: primitiveBounds(primitiveBounds),
+			centers(centers),
+			order(primitiveOrder),
+			scratch(primitiveOrder.size()),
+			maxLeafSize(maxLeafSize),
+			maxDepth(maxDepth),
+			threadCount(threadCount) { }
+
+		// With pOutTasks every thread works on each node and ranges of at
+		// most taskSize primitives become placeholder nodes with a task each.
+		// Returns the index of the range's node.
+		unsigned build(LargeVector<BvhNode>& outNodes,
+			std::vector<BuildTask>* pOutTasks,
+			unsigned first,
+			unsigned count,
+			unsigned depth,
+			unsigned taskSize);
+
+	protected:
+		BvhBuilder(const BvhBuilder&);
+		BvhBuilder& operator =(const BvhBuilder&);
+
+		void measure(unsigned first, unsigned count, bool parallel,
+			BoundingBox& outBounds, BoundingBox& outCenterBounds);
+		void chooseSplit(const BoundingBox& bounds, const BoundingBox& centerBounds,
+			unsigned first, unsigned count, unsigned depth, bool parallel, Split& outSplit);
+		void binRange(unsigned first, unsigned count, const Split& split, Bin* outBins) const;
+		unsigned partition(unsigned first, unsigned count, const Split& split, bool parallel);
+
+		bool goesLeft(unsigned primitive, const Split& split) const
+		{
+			return (unsigned)binIndex(axisValue(centers[primitive], split.axis), split.binMin, split.binScale) < split.bin;
+		}
+
+		unsigned chunkCount(unsigned count) const { return (count + kChunkSize - 1) / kChunkSize; }
+
+		const std::vector<BoundingBox>& primitiveBounds;
+		const std::vector<Point>& centers;
+		std::vector<unsigned>& order;
+		// Partition buffer, tasks own disjoint ranges of it
+		std::vector<unsigned> scratch;
+		unsigned maxLeafSize;
+		unsigned maxDepth;
+		unsigned threadCount;
+	};
+
+	unsigned BvhBuilder::build(LargeVector<BvhNode>& outNodes,
+		std::vector<BuildTask>* pOutTasks,
+		unsigned first,
+		unsigned count,
+		unsigned depth,
+		unsigned taskSize)
+	{
+		unsigned nodeIndex = (unsigned)outNodes.size();
+		outNodes.push_back(BvhNode());
+
+		bool parallel = pOutTasks != NULL;
+		if (parallel && count <= taskSize)
+		{
+			BuildTask task;
+			task.node = nodeIndex;
+			task.first = first;
+			task.count = count;
+			task.depth = depth;
+			pOutTasks->push_back(task);
+			return nodeIndex;
+		}
+
+		BoundingBox bounds, centerBounds;
+		measure(first, count, parallel, bounds, centerBounds);
+		outNodes[nodeIndex].bounds = bounds;
+		outNodes[nodeIndex].offset = first;
+		outNodes[nodeIndex].count = count;
+
+		Split split;
+		chooseSplit(bounds, centerBounds, first, count, depth, parallel, split);
+		if (split.bin == 0)
+			return nodeIndex;
+
+		unsigned middle = partition(first, count, split, parallel);
+		build(outNodes, pOutTasks, first, middle - first, depth + 1, taskSize);
+		unsigned second = build(outNodes, pOutTasks, middle, first + count - middle, depth + 1, taskSize);
+
+		outNodes[nodeIndex].offset = second;
+		outNodes[nodeIndex].count = 0;
+		return nodeIndex;
+	}
+
+	void BvhBuilder::measure(unsigned first, unsigned count, bool parallel,
+		BoundingBox& outBounds, BoundingBox& outCenterBounds)
+	{
+		if (!parallel)
+		{
+			for (unsigned i = first; i < first + count; i++)
+			{
+				outBounds.grow(primitiveBounds[order[i]]);
+				outCenterBounds.grow(centers[order[i]]);
+			}
+			return;
+		}
+
+		unsigned chunks = chunkCount(count);
+		std::vector<BoundingBox> chunkBounds(chunks), chunkCenterBounds(chunks);
+		parallelFor(chunks, threadCount, [&](size_t chunk, unsigned)
+		{
+			unsigned begin = first + (unsigned)chunk * kChunkSize;
+			unsigned end = std::min(begin + kChunkSize, first + count);
+			for (unsigned i = begin; i < end; i++)
+			{
+				chunkBounds[chunk].grow(primitiveBounds[order[i]]);
+				chunkCenterBounds[chunk].grow(centers[order[i]]);
+			}
+		});
+
+		for (unsigned chunk = 0; chunk < chunks; chunk++)
+		{
+			outBounds.grow(chunkBounds[chunk]);
+			outCenterBounds.grow(chunkCenterBounds[chunk]);
+		}
+	}
+
+	void BvhBuilder::chooseSplit(const BoundingBox& bounds, const BoundingBox& centerBounds,
+		unsigned first, unsigned count, unsigned depth, bool parallel, Split& outSplit)
+	{
+		outSplit.axis = centerBounds.longestAxis();
+		outSplit.binMin = axisValue(centerBounds.min, outSplit.axis);
+		outSplit.binScale = 0.0f;
+		outSplit.bin = 0;
+		if (count <= maxLeafSize || depth + 2 >= maxDepth)
+			return;
+
+		float binExtent = axisValue(centerBounds.max, outSplit.axis) - outSplit.binMin;
+		if (!(binExtent > 0.0f))
+		{
+			// All centers coincide, any split is as good as the next
+			outSplit.axis = -1;
+			outSplit.bin = 1;
+			return;
+		}
+
+		// Binned SAH over the centers along the longest axis
+		outSplit.binScale = kBinCount / binExtent * 0.99999f;
+		Bin bins[kBinCount];
+		if (!parallel)
+		{
+			binRange(first, count, outSplit, bins);
+		}
+		else
+		{
+			unsigned chunks = chunkCount(count);
+			std::vector<Bin> chunkBins(chunks * kBinCount);
+			parallelFor(chunks, threadCount, [&](size_t chunk, unsigned)
+			{
+				unsigned begin = first + (unsigned)chunk * kChunkSize;
+				unsigned end = std::min(begin + kChunkSize, first + count);
+				binRange(begin, end - begin, outSplit, &chunkBins[chunk * kBinCount]);
+			});
+
+			for (unsigned chunk = 0; chunk < chunks; chunk++)
+			{
+				for (unsigned b = 0; b < kBinCount; b++)
+				{
+					bins[b].bounds.grow(chunkBins[chunk * kBinCount + b].bounds);
+					bins[b].count += chunkBins[chunk * kBinCount + b].count;
+				}
+			}
+		}
+
+		float rightArea[kBinCount];
+		unsigned rightCount[kBinCount];
+		BoundingBox rightBounds;
+		unsigned rightTotal = 0;
+		for (unsigned b = kBinCount - 1; b > 0; b--)
+		{
+			rightBounds.grow(bins[b].bounds);
+			rightTotal += bins[b].count;
+			rightArea[b] = rightBounds.surfaceArea();
+			rightCount[b] = rightTotal;
+		}
+
+		// Big leaves are split even when SAH disagrees to bound the leaf cost
+		float bestCost = (count > 8 * maxLeafSize) ? 1.0e30f : kIntersectionCost * count;
+		BoundingBox leftBounds;
+		unsigned leftTotal = 0;
+		float invArea = 1.0f / std::max(bounds.surfaceArea(), 1.0e-20f);
+		for (unsigned b = 1; b < kBinCount; b++)
+		{
+			leftBounds.grow(bins[b - 1].bounds);
+			leftTotal += bins[b - 1].count;
+			if (leftTotal == 0 || rightCount[b] == 0)
+				continue;
+
+			float cost = kTraversalCost + kIntersectionCost * invArea *
+				(leftBounds.surfaceArea() * leftTotal + rightArea[b] * rightCount[b]);
+			if (cost < bestCost)
+			{
+				bestCost = cost;
+				outSplit.bin = b;
+			}
+		}
+	}
+
+	void BvhBuilder::binRange(unsigned first, unsigned count, const Split& split, Bin* outBins) const
+	{
+		for (unsigned i = first; i < first + count; i++)
+		{
+			unsigned primitive = order[i];
+			Bin& bin = outBins[binIndex(axisValue(centers[primitive], split.axis), split.binMin, split.binScale)];
+			bin.bounds.grow(primitiveBounds[primitive]);
+			bin.count++;
+		}
+	}
+
+	// Stable, so the order within each side doesn't depend on the chunking.
+	// Returns the first primitive on the right.
+	unsigned BvhBuilder::partition(unsigned first, unsigned count, const Split& split, bool parallel)
+	{
+		if (split.axis < 0)
+			return first + count / 2;
+
+		if (!parallel)
+		{
+			unsigned left = first;
+			unsigned right = first;
+			for (unsigned i = first; i < first + count; i++)
+			{
+				if (goesLeft(order[i], split))
+					order[left++] = order[i];
+				else
+					scratch[right++] = order[i];
+			}
+			std::copy(&scratch[0] + first, &scratch[0] + right, &order[0] + left);
+			return left;
+		}
+
+		// Count each chunk's left side, then scatter both sides through the
+		// scratch buffer at the offsets the counts give
+		unsigned chunks = chunkCount(count);
+		std::vector<unsigned> chunkLeft(chunks + 1, 0);
+		parallelFor(chunks, threadCount, [&](size_t chunk, unsigned)
+		{
+			unsigned begin = first + (unsigned)chunk * kChunkSize;
+			unsigned end = std::min(begin + kChunkSize, first + count);
+			unsigned left = 0;
+			for (unsigned i = begin; i < end; i++)
+				left += goesLeft(order[i], split) ? 1 : 0;
+			chunkLeft[chunk + 1] = left;
+		});
+
+		for (unsigned chunk = 0; chunk < chunks; chunk++)
+			chunkLeft[chunk + 1] += chunkLeft[chunk];
+		unsigned leftTotal = chunkLeft[chunks];
+
+		parallelFor(chunks, threadCount, [&](size_t chunk, unsigned)
+		{
+			unsigned begin = first + (unsigned)chunk * kChunkSize;
+			unsigned end = std::min(begin + kChunkSize, first + count);
+			unsigned left = first + chunkLeft[chunk];
+			unsigned right = first + leftTotal + ((begin - first) - chunkLeft[chunk]);
+			for (unsigned i = begin; i < end; i++)
+			{
+				if (goesLeft(order[i], split))
+					scratch[left++] = order[i];
+				else
+					scratch[right++] = order[i];
+			}
+		});
+
+		parallelFor(chunks, threadCount, [&](size_t chunk, unsigned)
+		{
+			unsigned begin = first + (unsigned)chunk * kChunkSize;
+			unsigned end = std::min(begin + kChunkSize, first + count);
+			std::copy(&scratch[0] + begin, &scratch[0] + end, &order[0] + begin);
+		});
+
+		return first + leftTotal;
+	}
+
+	// Copies the top level node and its subtree depth first, replacing
+	// placeholders with their task's nodes
+	void spliceNode(const LargeVector<BvhNode>& topNodes,
+		const std::vector<BuildTask>& tasks,
+		const std::vector<int>& taskOfNode,
+		unsigned topIndex,
+		LargeVector<BvhNode>& outNodes)
+	{
+		if (taskOfNode[topIndex] >= 0)
+		{
+			const LargeVector<BvhNode>& taskNodes = tasks[taskOfNode[topIndex]].nodes;
+			unsigned base = (unsigned)outNodes.size();
+			for (size_t i = 0; i < taskNodes.size(); i++)
+			{
+				outNodes.push_back(taskNodes[i]);
+				if (!taskNodes[i].isLeaf())
+					outNodes.back().offset += base;
+			}
+			return;
+		}
+
+		unsigned index = (unsigned)outNodes.size();
+		outNodes.push_back(topNodes[topIndex]);
+		if (topNodes[topIndex].isLeaf())
+			return;
+
+		spliceNode(topNodes, tasks, taskOfNode, topIndex + 1, outNodes);
+		outNodes[index].offset = (unsigned)outNodes.size();
+		spliceNode(topNodes, tasks, taskOfNode, topNodes[topIndex].offset, outNodes);
+	}
+}
+
+void Bvh::build(const std::vector<BoundingBox>& primitiveBounds, unsigned maxLeafSize, unsigned threadCount)
+{
+	clear();
+	if (primitiveBounds.empty())
+		return;
+
+	if (threadCount == 0)
+		threadCount = defaultThreadCount();
+	maxLeafSize = std::max(maxLeafSize, 1u);
+
+	unsigned count = (unsigned)primitiveBounds.size();
+	primitiveOrder.resize(count);
+	std::vector<Point> centers(count);
+	parallelFor((count + kChunkSize - 1) / kChunkSize, threadCount, [&](size_t chunk, unsigned)
+	{
+		unsigned end = std::min((unsigned)chunk * kChunkSize + kChunkSize, count);
+		for (unsigned i = (unsigned)chunk * kChunkSize; i < end; i++)
+		{
+			primitiveOrder[i] = i;
+			centers[i] = primitiveBounds[i].center();
+		}
+	});
+
+	BvhBuilder builder(primitiveBounds, centers, primitiveOrder, maxLeafSize, kMaxDepth, threadCount);
+	nodes.reserve(2 * count / maxLeafSize + 1);
+
+	// Enough tasks per thread to even out their uneven sizes
+	unsigned taskSize = std::max(count / (16 * threadCount), kMinTaskSize);
+	if (threadCount <= 1 || count <= taskSize)
+	{
+		builder.build(nodes, NULL, 0, count, 0, 0);
+		computeSahCost();
+		return;
+	}
+
+	LargeVector<BvhNode> topNodes;
+	std::vector<BuildTask> tasks;
+	builder.build(topNodes, &tasks, 0, count, 0, taskSize);
+
+	// Biggest subtrees first so no thread is left with one at the end
+	std::vector<unsigned> taskOrder(tasks.size());
+	for (size_t i = 0; i < tasks.size(); i++)
+		taskOrder[i] = (unsigned)i;
+	std::sort(taskOrder.begin(), taskOrder.end(),
+		[&](unsigned a, unsigned b) { return tasks[a].count > tasks[b].count; });
+
+	parallelFor(tasks.size(), threadCount, [&](size_t i, unsigned)
+	{
+		BuildTask& task = tasks[taskOrder[i]];
+		task.nodes.reserve(2 * task.count / maxLeafSize + 1);
+		builder.build(task.nodes, NULL, task.first, task.count, task.depth, 0);
+	});
+
+	std::vector<int> taskOfNode(topNodes.size(), -1);
+	for (size_t i = 0; i < tasks.size(); i++)
+		taskOfNode[tasks[i].node] = (int)i;
+	spliceNode(topNodes, tasks, taskOfNode, 0, nodes);
+	computeSahCost();
+}
+
+void Bvh::buildMotion(const std::vector<BoundingBox>& primitiveKeyframeBounds,
+	unsigned keyframes,
+	unsigned maxLeafSize,
+	unsigned threadCount)
+{
+	if (keyframes <= 1)
+	{
+		build(primitiveKeyframeBounds, maxLeafSize, threadCount);
+		return;
+	}
+
+	// Split on the bounds over the whole interval
+	size_t primitiveCount = primitiveKeyframeBounds.size() / keyframes;
+	std::vector<BoundingBox> primitiveBounds(primitiveCount);
+	for (size_t i = 0; i < primitiveCount; i++)
+	{
+		for (unsigned k = 0; k < keyframes; k++)
+			primitiveBounds[i].grow(primitiveKeyframeBounds[i * keyframes + k]);
+	}
+
+	build(primitiveBounds, maxLeafSize, threadCount);
+	if (nodes.empty())
+		return;
+
+	// Children always follow their parent, so going backwards sees them first
+	keyframeCount = keyframes;
+	keyframeBounds.assign(nodes.size() * keyframes, BoundingBox());
+	for (size_t n = nodes.size(); n-- > 0;)
+	{
+		const BvhNode& node = nodes[n];
+		BoundingBox* pBounds = &keyframeBounds[n * keyframes];
+		for (unsigned k = 0; k < keyframes; k++)
+		{
+			if (node.isLeaf())
+			{
+				for (unsigned i = node.offset; i < node.offset + node.count; i++)
+					pBounds[k].grow(primitiveKeyframeBounds[primitiveOrder[i] * keyframes + k]);
+			}
+			else
+			{
+				pBounds[k].grow(keyframeBounds[(n + 1) * keyframes + k]);
+				pBounds[k].grow(keyframeBounds[node.offset * keyframes + k]);
+			}
+		}
+	}
+}
+
+void Bvh::clear()
+{
+	nodes.clear();
+	primitiveOrder.clear();
+	keyframeCount = 1;
+	keyframeBounds.clear();
+	parents.clear();
+	positionLeaves.clear();
+	areaCost = 0.0;
+	builtSahCost = 0.0f;
+}
+
+void Bvh::setNodes(const BvhNode* pNodes, size_t count)
+{
+	clear();
+	nodes.assign(pNodes, pNodes + count);
+	computeSahCost();
+}
+
+void Bvh::refit(const std::vector<unsigned>& positions, const std::function<BoundingBox(unsigned)>& boundsOf)
+{
+	if (nodes.empty() || keyframeCount > 1 || positions.empty())
+		return;
+
+	if (parents.empty())
+	{
+		parents.resize(nodes.size());
+		positionLeaves.resize(primitiveOrder.size());
+		parents[0] = 0;
+		for (unsigned n = 0; n < (unsigned)nodes.size(); n++)
+		{
+			const BvhNode& node = nodes[n];
+			if (node.isLeaf())
+			{
+				for (unsigned i = node.offset; i < node.offset + node.count; i++)
+					positionLeaves[i] = n;
+			}
+			else
+			{
+				parents[n + 1] = n;
+				parents[node.offset] = n;
+			}
+		}
+	}
+
+	// Children always come after their parent, so taking the highest dirty
+	// node first refits every node after its children and only once
+	std::vector<unsigned> dirty;
+	dirty.reserve(2 * positions.size());
+	for (size_t i = 0; i < positions.size(); i++)
+		dirty.push_back(positionLeaves[positions[i]]);
+	std::make_heap(dirty.begin(), dirty.end());
+
+	while (!dirty.empty())
+	{
+		unsigned n = dirty.front();
+		while (!dirty.empty() && dirty.front() == n)
+		{
+			std::pop_heap(dirty.begin(), dirty.end());
+			dirty.pop_back();
+		}
+
+		BvhNode& node = nodes[n];
+		BoundingBox bounds;
+		if (node.isLeaf())
+		{
+			for (unsigned i = node.offset; i < node.offset + node.count; i++)
+				bounds.grow(boundsOf(i));
+			if (bounds.isEmpty())
+				bounds = BoundingBox(node.bounds.center(), node.bounds.center());
+		}
+		else
+		{
+			bounds = nodes[n + 1].bounds;
+			bounds.grow(nodes[node.offset].bounds);
+		}
+
+		if (sameBounds(bounds, node.bounds))
+			continue;
+
+		areaCost -= nodeAreaCost(node);
+		node.bounds = bounds;
+		areaCost += nodeAreaCost(node);
+		if (n > 0)
+		{
+			dirty.push_back(parents[n]);
+			std::push_heap(dirty.begin(), dirty.end());
+		}
+	}
+}
+
+void Bvh::translate(const Vector& offset)
+{
+	for (size_t i = 0; i < nodes.size(); i++)
+		nodes[i].bounds = BoundingBox(nodes[i].bounds.min + offset, nodes[i].bounds.max + offset);
+	for (size_t i = 0; i < keyframeBounds.size(); i++)
+		keyframeBounds[i] = BoundingBox(keyframeBounds[i].min + offset, keyframeBounds[i].max + offset);
+}
+
+double Bvh::nodeAreaCost(const BvhNode& node)
+{
+	double area = node.bounds.surfaceArea();
+	return node.isLeaf() ? area * kIntersectionCost * node.count : area * kTraversalCost;
+}
+
+void Bvh::computeSahCost()
+{
+	areaCost = 0.0;
+	for (size_t i = 0; i < nodes.size(); i++)
+		areaCost += nodeAreaCost(nodes[i]);
+	builtSahCost = getSahCost();
+}
+
+float Bvh::getSahCost() const
+{
+	if (nodes.empty())
+		return 0.0f;
+	return (float)(areaCost / std::max(nodes[0].bounds.surfaceArea(), 1.0e-20f));
+}
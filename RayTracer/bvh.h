@@ -0,0 +1,265 @@
+#ifndef __BVH_H__
+#define __BVH_H__
+
+#include <functional>
+#include <vector>
+
+#include "hugepages.h"
+#include "maths.h"
+#include "ray.h"
+
+struct BvhNode
+{
+	BoundingBox bounds;
+
+	// Leaves have count > 0 and offset is the first primitive, inner nodes
+	// have count == 0, the first child follows directly and offset is the second
+	unsigned offset;
+	unsigned count;
+
+	bool isLeaf() const { return count > 0; }
+};
+
+// Bounding volume hierarchy over anything with a bounding box. After build()
+// the primitives must be used in getPrimitiveOrder() so that every leaf covers
+// a contiguous range, the owner reorders its own arrays to match.
+//
+// A motion BVH also keeps node bounds at evenly spaced keyframes over time
+// [0, 1] and interpolates them with the ray time, node.bounds then covers the
+// whole interval.
+class Bvh
+{
+public:
+	Bvh() : nodes(), primitiveOrder(), keyframeCount(1), keyframeBounds(), parents(), positionLeaves(),
+		areaCost(0.0), builtSahCost(0.0f) { }
+
+	// Binned SAH. With several threads the nodes near the root are binned and
+	// partitioned by all of them and the subtrees below are built one per
+	// thread, giving the same tree as a single thread. threadCount = 0 uses
+	// the default.
+	void build(const std::vector<BoundingBox>& primitiveBounds, unsigned maxLeafSize = 4, unsigned threadCount = 1);
+
+	// Bounds are given per primitive per keyframe, primitive major. Each
+	// primitive must stay within the linear interpolation of its bounds.
+	void buildMotion(const std::vector<BoundingBox>& primitiveKeyframeBounds,
+		unsigned keyframes,
+		unsigned maxLeafSize = 4,
+		unsigned threadCount = 1);
+
+	void clear();
+
+	// Recomputes the bounds of the leaves holding the given positions of
+	// getPrimitiveOrder() and of their ancestors, bottom up, with
+	// boundsOf(position) giving a primitive's current bounds. Each node is
+	// visited once, about positions * depth in all. An empty leaf shrinks to
+	// a point. Motion BVHs are not refitted, rebuild them instead.
+	void refit(const std::vector<unsigned>& positions, const std::function<BoundingBox(unsigned)>& boundsOf);
+
+	// For primitives that all moved by offset
+	void translate(const Vector& offset);
+
+	bool isEmpty() const { return nodes.empty(); }
+	BoundingBox getBounds() const { return isEmpty() ? BoundingBox() : nodes[0].bounds; }
+	const std::vector<unsigned>& getPrimitiveOrder() const { return primitiveOrder; }
+	size_t getNodeCount() const { return nodes.size(); }
+
+	// The nodes of a built tree, for owners that store it away with their
+	// primitives already in getPrimitiveOrder(). setNodes() takes them back
+	// without a primitive order, motion bounds or refit data.
+	const BvhNode* getNodes() const { return nodes.empty() ? NULL : &nodes[0]; }
+	void setNodes(const BvhNode* pNodes, size_t count);
+
+	// Expected cost of a ray through the root with the builder's traversal
+	// and intersection costs, summed over nodes weighted by surface area.
+	// Kept up to date by refit(), which usually makes it worse than
+	// getBuiltSahCost().
+	float getSahCost() const;
+	float getBuiltSahCost() const { return builtSahCost; }
+
+	unsigned getKeyframeCount() const { return keyframeCount; }
+	BoundingBox getKeyframeBounds(unsigned keyframe) const
+	{
+		if (isEmpty())
+			return BoundingBox();
+		return keyframeCount > 1 ? keyframeBounds[keyframe] : nodes[0].bounds;
+	}
+
+	// Calls hitLeaf(first, count) front to back for every leaf the ray reaches
+	// before currentDist, which the callback shrinks as it finds hits
+	template <class LeafFn>
+	bool intersect(const Ray& ray, const float& currentDist, LeafFn hitLeaf) const
+	{
+		if (nodes.empty())
+			return false;
+
+		RayBoxTest test(ray);
+		unsigned stack[kMaxDepth];
+		unsigned stackSize = 0;
+		unsigned nodeIndex = 0;
+		bool hit = false;
+
+		float entry;
+		if (!test.intersect(nodeBounds(0, ray.time), currentDist, entry))
+			return false;
+
+		for (;;)
+		{
+			const BvhNode& node = nodes[nodeIndex];
+			if (node.isLeaf())
+			{
+				if (hitLeaf(node.offset, node.count))
+					hit = true;
+			}
+			else
+			{
+				unsigned first = nodeIndex + 1;
+				unsigned second = node.offset;
+				float firstEntry, secondEntry;
+				bool hitFirst = test.intersect(nodeBounds(first, ray.time), currentDist, firstEntry);
+				bool hitSecond = test.intersect(nodeBounds(second, ray.time), currentDist, secondEntry);
+
+				if (hitFirst && hitSecond)
+				{
+					if (secondEntry < firstEntry)
+						std::swap(first, second);
+					stack[stackSize++] = second;
+					nodeIndex = first;
+					continue;
+				}
+				if (hitFirst || hitSecond)
+				{
+					nodeIndex = hitFirst ? first : second;
+					continue;
+				}
+			}
+
+			if (stackSize == 0)
+				break;
+			nodeIndex = stack[--stackSize];
+		}
+
+		return hit;
+	}
+
+	// Stops at the first leaf for which isOccluded(first, count) is true
+	template <class LeafFn>
+	bool occluded(const Ray& ray, LeafFn isOccluded) const
+	{
+		if (nodes.empty())
+			return false;
+
+		RayBoxTest test(ray);
+		unsigned stack[kMaxDepth];
+		unsigned stackSize = 0;
+		stack[stackSize++] = 0;
+
+		while (stackSize > 0)
+		{
+			unsigned nodeIndex = stack[--stackSize];
+			const BvhNode& node = nodes[nodeIndex];
+			float entry;
+			if (!test.intersect(nodeBounds(nodeIndex, ray.time), ray.maxDist, entry))
+				continue;
+
+			if (node.isLeaf())
+			{
+				if (isOccluded(node.offset, node.count))
+					return true;
+			}
+			else
+			{
+				stack[stackSize++] = node.offset;
+				stack[stackSize++] = nodeIndex + 1;
+			}
+		}
+
+		return false;
+	}
+
+	// Slab test of a ray against boxes, also for callers that visit leaves
+	// in an order of their own
+	struct RayBoxTest
+	{
+		Point origin;
+		Vector invDirection;
+
+		RayBoxTest(const Ray& ray)
+			: origin(ray.origin),
+			invDirection(1.0f / ray.direction.x, 1.0f / ray.direction.y, 1.0f / ray.direction.z) { }
+
+		// Slab test, outEntry is the distance where the ray enters the box
+		inline bool intersect(const BoundingBox& box, float maxDist, float& outEntry) const
+		{
+			float tx1 = (box.min.x - origin.x) * invDirection.x;
+			float tx2 = (box.max.x - origin.x) * invDirection.x;
+			float ty1 = (box.min.y - origin.y) * invDirection.y;
+			float ty2 = (box.max.y - origin.y) * invDirection.y;
+			float tz1 = (box.min.z - origin.z) * invDirection.z;
+			float tz2 = (box.max.z - origin.z) * invDirection.z;
+
+			float tNear = std::max(std::max(std::min(tx1, tx2), std::min(ty1, ty2)), std::max(std::min(tz1, tz2), 0.0f));
+			float tFar = std::min(std::min(std::max(tx1, tx2), std::max(ty1, ty2)), std::min(std::max(tz1, tz2), maxDist));
+
+			outEntry = tNear;
+			return tNear <= tFar;
+		}
+	};
+
+protected:
+	// The builder stops splitting before this, so the stacks never overflow
+	static const unsigned kMaxDepth = 64;
+
+	inline BoundingBox nodeBounds(unsigned nodeIndex, float time) const
+	{
+		if (keyframeCount == 1)
+			return nodes[nodeIndex].bounds;
+
+		float segment = std::min(std::max(time, 0.0f), 1.0f) * (keyframeCount - 1);
+		unsigned keyframe = std::min((unsigned)segment, keyframeCount - 2);
+		float t = segment - keyframe;
+		const BoundingBox& b0 = keyframeBounds[nodeIndex * keyframeCount + keyframe];
+		const BoundingBox& b1 = keyframeBounds[nodeIndex * keyframeCount + keyframe + 1];
+		return BoundingBox(b0.min + (b1.min - b0.min) * t, b0.max + (b1.max - b0.max) * t);
+	}
+
+	LargeVector<BvhNode> nodes;
+	std::vector<unsigned> primitiveOrder;
+
+	// Node major, only used when keyframeCount > 1
+	unsigned keyframeCount;
+	LargeVector<BoundingBox> keyframeBounds;
+
+	// Made by the first refit()
+	std::vector<unsigned> parents;
+	std::vector<unsigned> positionLeaves;
+
+	// Surface area weighted cost summed over the nodes, not yet divided by
+	// the root's area
+	double areaCost;
+	float builtSahCost;
+
+	void computeSahCost();
+	static double nodeAreaCost(const BvhNode& node);
+};
+
+// Totals over the trees of a scene, see Scene::getBvhStats()
+struct BvhStats
+{
+	unsigned treeCount;
+	size_t nodeCount;
+	// Sum of the trees' SAH costs
+	double sahCost;
+
+	BvhStats() : treeCount(0), nodeCount(0), sahCost(0.0) { }
+
+	void add(const Bvh& bvh)
+	{
+		if (bvh.isEmpty())
+			return;
+		treeCount++;
+		nodeCount += bvh.getNodeCount();
+		sahCost += bvh.getSahCost();
+	}
+};
+
+#endif
@@ -1,6 +1,41 @@
 #include "camera.h"
 #include "sampling.h"
 
+void Camera::generateRays(const SampleBlock& samples, RaySoA& outRays) const
+{
+	outRays.resize(samples.size());
+	for (size_t i = 0; i < samples.size(); i++)
+	{
+		outRays.setRay(i, makeRay(samples.xScreen[i], samples.yScreen[i],
+			samples.lensU[i], samples.lensV[i], samples.timeU[i]));
+	}
+}
+
+void Camera::fillParams(const Point& origin,
+	const Vector& forward,
+	const Vector& right,
+	const Vector& up,
+	CameraRayParams& outParams) const
+{
+	outParams.origin[0] = origin.x;
+	outParams.origin[1] = origin.y;
+	outParams.origin[2] = origin.z;
+	outParams.forward[0] = forward.x;
+	outParams.forward[1] = forward.y;
+	outParams.forward[2] = forward.z;
+	outParams.right[0] = right.x;
+	outParams.right[1] = right.y;
+	outParams.right[2] = right.z;
+	outParams.up[0] = up.x;
+	outParams.up[1] = up.y;
+	outParams.up[2] = up.z;
+	outParams.tanFov = 0.0f;
+	outParams.focalDistance = 0.0f;
+	outParams.lensRadius = 0.0f;
+	outParams.shutterOpen = shutterOpen;
+	outParams.shutterClose = shutterClose;
+}
+
 PerspectiveCamera::PerspectiveCamera(float fieldOfViewInDegrees,
 	const Point& origin,
 	const Vector& target,
@@ -17,36 +52,135 @@ PerspectiveCamera::PerspectiveCamera(float fieldOfViewInDegrees,
 	up = cross(right, forward);
 }
 
-Ray PerspectiveCamera::makeRay(float xScreen, float yScreen, float lensU, float lensV) const
+float PerspectiveCamera::getFieldOfView() const
+{
+	return std::atan(tanFov) * 180.0f / (float)M_PI;
+}
+
+Ray PerspectiveCamera::makeRay(float xScreen, float yScreen, float lensU, float lensV, float timeU) const
 {
 	Ray ray;
+	ray.time = sampleTime(timeU);
 	ray.origin = origin;
 	ray.direction = forward + right * ((xScreen - 0.5f) * tanFov) + up * ((yScreen - 0.5f) * tanFov);
-	ray.direction.normalize();
 
 	if (lensRadius > 0.0f)
 	{
-		// Modify for DOF
+		// Modify for DOF, the unnormalized direction reaches the focal plane
+		// after focalDistance because forward has unit length
 		float horizontalShift = 0.0f, verticalShift = 0.0f;
-		float nearDistance = 0.0f;
-
 		uniformToUniformDisc(lensU, lensV, horizontalShift, verticalShift);
-		horizontalShift *= lensRadius;
-		verticalShift *= lensRadius;
 
-		Vector localRayDirection((xScreen - 0.5f) * tanFov,
-			(yScreen - 0.5f) * tanFov,
-			1.0f);
-		localRayDirection.normalize();
+		Vector lensOffset = right * (horizontalShift * lensRadius) + up * (verticalShift * lensRadius);
+		ray.origin += lensOffset;
+		ray.direction = ray.direction * focalDistance - lensOffset;
+	}
+
+	ray.direction.normalize();
+	return ray;
+}
+
+void PerspectiveCamera::generateRays(const SampleBlock& samples, RaySoA& outRays) const
+{
+	outRays.resize(samples.size());
+	if (samples.size() == 0)
+		return;
+
+	CameraRayParams params;
+	fillParams(origin, forward, right, up, params);
+	params.tanFov = tanFov;
+	params.focalDistance = focalDistance;
+	params.lensRadius = lensRadius;
 
-		float focusT = (focalDistance - nearDistance) / localRayDirection.z;
-		Point focusPoint = origin + ray.direction * focusT;
+	float* const outOrigin[3] = { &outRays.originX[0], &outRays.originY[0], &outRays.originZ[0] };
+	float* const outDirection[3] = { &outRays.directionX[0], &outRays.directionY[0], &outRays.directionZ[0] };
+	kernels().generatePerspectiveRays(params, &samples.xScreen[0], &samples.yScreen[0],
+		&samples.lensU[0], &samples.lensV[0], &samples.timeU[0], samples.size(),
+		outOrigin, outDirection, &outRays.time[0]);
+}
+
+OrthographicCamera::OrthographicCamera(const Point& origin,
+	const Point& target,
+	const Vector& targetUpDirection,
+	float viewWidth)
+	: origin(origin),
+	forward((target - origin).normalized()),
+	viewWidth(viewWidth)
+{
+	right = cross(forward, targetUpDirection).normalized();
+	up = cross(right, forward);
+}
 
-		ray.origin += right * horizontalShift + up * verticalShift;
+Ray OrthographicCamera::makeRay(float xScreen, float yScreen, float lensU, float lensV, float timeU) const
+{
+	Ray ray;
+	ray.time = sampleTime(timeU);
+	ray.origin = origin + right * ((xScreen - 0.5f) * viewWidth) + up * ((yScreen - 0.5f) * viewWidth);
+	ray.direction = forward;
+	return ray;
+}
 
-		ray.direction = focusPoint - ray.origin;
-		ray.direction.normalize();
+void OrthographicCamera::generateRays(const SampleBlock& samples, RaySoA& outRays) const
+{
+	// Only multiply-adds, the compiler vectorizes this without a kernel
+	size_t count = samples.size();
+	outRays.resize(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		float a = (samples.xScreen[i] - 0.5f) * viewWidth;
+		float b = (samples.yScreen[i] - 0.5f) * viewWidth;
+		outRays.originX[i] = origin.x + right.x * a + up.x * b;
+		outRays.originY[i] = origin.y + right.y * a + up.y * b;
+		outRays.originZ[i] = origin.z + right.z * a + up.z * b;
+		outRays.directionX[i] = forward.x;
+		outRays.directionY[i] = forward.y;
+		outRays.directionZ[i] = forward.z;
+		outRays.time[i] = sampleTime(samples.timeU[i]);
 	}
+}
+
+EnvironmentCamera::EnvironmentCamera(const Point& origin,
+	const Point& target,
+	const Vector& targetUpDirection)
+	: origin(origin),
+	forward((target - origin).normalized())
+{
+	right = cross(forward, targetUpDirection).normalized();
+	up = cross(right, forward);
+}
+
+Ray EnvironmentCamera::makeRay(float xScreen, float yScreen, float lensU, float lensV, float timeU) const
+{
+	float longitude = 2.0f * (float)M_PI * (xScreen - 0.5f);
+	float latitude = 2.0f * (float)M_PI * (yScreen - 0.5f);
 
+	Ray ray;
+	ray.time = sampleTime(timeU);
+	ray.origin = origin;
+	ray.direction = forward * (std::cos(latitude) * std::cos(longitude)) +
+		right * (std::cos(latitude) * std::sin(longitude)) +
+		up * std::sin(latitude);
 	return ray;
-}
\ No newline at end of file
+}
+
+void EnvironmentCamera::generateRays(const SampleBlock& samples, RaySoA& outRays) const
+{
+	size_t count = samples.size();
+	outRays.resize(count);
+	if (count == 0)
+		return;
+
+	CameraRayParams params;
+	fillParams(origin, forward, right, up, params);
+
+	for (size_t i = 0; i < count; i++)
+	{
+		outRays.originX[i] = origin.x;
+		outRays.originY[i] = origin.y;
+		outRays.originZ[i] = origin.z;
+	}
+
+	float* const outDirection[3] = { &outRays.directionX[0], &outRays.directionY[0], &outRays.directionZ[0] };
+	kernels().generateEnvironmentRays(params, &samples.xScreen[0], &samples.yScreen[0], &samples.timeU[0],
+		count, outDirection, &outRays.time[0]);
+}
@@ -1,16 +1,64 @@
 #ifndef __CAMERA_H__
 #define __CAMERA_H__
 
+#include <vector>
+
+#include "kernels.h"
 #include "ray.h"
 
+// Inputs for a batch of primary rays. Screen positions are as for makeRay(),
+// the lens and time samples are in [0, 1).
+struct SampleBlock
+{
+	std::vector<float> xScreen, yScreen;
+	std::vector<float> lensU, lensV;
+	std::vector<float> timeU;
+
+	size_t size() const { return xScreen.size(); }
+
+	void resize(size_t count)
+	{
+		xScreen.resize(count);
+		yScreen.resize(count);
+		lensU.resize(count);
+		lensV.resize(count);
+		timeU.resize(count);
+	}
+};
+
 class Camera
 {
 public:
-	Camera() { }
+	Camera() : shutterOpen(0.0f), shutterClose(0.0f) { }
 
 	virtual ~Camera() { }
 
-	virtual Ray makeRay(float xScreen, float yScreen, float lensU, float lensV) const = 0;
+	// timeU in [0, 1) picks the ray time within the shutter interval
+	virtual Ray makeRay(float xScreen, float yScreen, float lensU, float lensV, float timeU) const = 0;
+
+	// A whole block of primary rays at once, outRays is resized to match.
+	// Cameras override this with a batched kernel, the default calls makeRay().
+	virtual void generateRays(const SampleBlock& samples, RaySoA& outRays) const;
+
+	// Times are in keyframe units, [0, 1] spans all motion keyframes.
+	// Open and close equal (the default) gives no motion blur.
+	void setShutter(float open, float close) { shutterOpen = open; shutterClose = close; }
+	float getShutterOpen() const { return shutterOpen; }
+	float getShutterClose() const { return shutterClose; }
+
+protected:
+	float sampleTime(float timeU) const { return shutterOpen + (shutterClose - shutterOpen) * timeU; }
+
+	// Kernel parameters for the given frame and this shutter, the
+	// perspective fields are left zero
+	void fillParams(const Point& origin,
+		const Vector& forward,
+		const Vector& right,
+		const Vector& up,
+		CameraRayParams& outParams) const;
+
+	float shutterOpen;
+	float shutterClose;
 };
 
 class PerspectiveCamera : public Camera
@@ -26,7 +74,16 @@ public:
 
 	virtual ~PerspectiveCamera() { }
 
-	virtual Ray makeRay(float xScreen, float yScreen, float lensU, float lensV) const;
+	virtual Ray makeRay(float xScreen, float yScreen, float lensU, float lensV, float timeU) const;
+	virtual void generateRays(const SampleBlock& samples, RaySoA& outRays) const;
+
+	// The constructor's parameters back, target becomes the point in focus
+	float getFieldOfView() const;
+	const Point& getOrigin() const { return origin; }
+	Point getTarget() const { return origin + forward * focalDistance; }
+	const Vector& getUp() const { return up; }
+	float getFocalDistance() const { return focalDistance; }
+	float getLensRadius() const { return lensRadius; }
 
 protected:
 	Point origin;
@@ -38,4 +95,47 @@ protected:
 	float lensRadius;
 };
 
-#endif
\ No newline at end of file
+// Parallel rays from a viewWidth wide window centred on origin
+class OrthographicCamera : public Camera
+{
+public:
+	OrthographicCamera(const Point& origin,
+		const Point& target,
+		const Vector& targetUpDirection,
+		float viewWidth);
+
+	virtual ~OrthographicCamera() { }
+
+	virtual Ray makeRay(float xScreen, float yScreen, float lensU, float lensV, float timeU) const;
+	virtual void generateRays(const SampleBlock& samples, RaySoA& outRays) const;
+
+protected:
+	Point origin;
+	Vector forward;
+	Vector up;
+	Vector right;
+	float viewWidth;
+};
+
+// Latitude-longitude panorama of everything around origin, the image should
+// be twice as wide as it is high. The centre of the image looks at target.
+class EnvironmentCamera : public Camera
+{
+public:
+	EnvironmentCamera(const Point& origin,
+		const Point& target,
+		const Vector& targetUpDirection);
+
+	virtual ~EnvironmentCamera() { }
+
+	virtual Ray makeRay(float xScreen, float yScreen, float lensU, float lensV, float timeU) const;
+	virtual void generateRays(const SampleBlock& samples, RaySoA& outRays) const;
+
+protected:
+	Point origin;
+	Vector forward;
+	Vector up;
+	Vector right;
+};
+
+#endif
@@ -0,0 +1,104 @@
+#include "cpu.h"
+
+#include <cstring>
+
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+#include <intrin.h>
+#define CPU_X86 1
+
+static void cpuid(int leaf, int subleaf, unsigned regs[4])
+{
+	int r[4];
+	__cpuidex(r, leaf, subleaf);
+	for (int i = 0; i < 4; i++)
+		regs[i] = (unsigned)r[i];
+}
+
+static unsigned long long xgetbv0()
+{
+	return _xgetbv(0);
+}
+
+#elif defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#define CPU_X86 1
+
+static void cpuid(int leaf, int subleaf, unsigned regs[4])
+{
+	__cpuid_count(leaf, subleaf, regs[0], regs[1], regs[2], regs[3]);
+}
+
+static unsigned long long xgetbv0()
+{
+	unsigned eax, edx;
+	__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+	return ((unsigned long long)edx << 32) | eax;
+}
+
+#endif
+
+IsaLevel detectIsaLevel()
+{
+#ifdef CPU_X86
+	unsigned regs[4];
+	cpuid(0, 0, regs);
+	unsigned maxLeaf = regs[0];
+	if (maxLeaf < 7)
+		return ISA_GENERIC;
+
+	cpuid(1, 0, regs);
+	bool osxsave = (regs[2] & (1u << 27)) != 0;
+	bool avx = (regs[2] & (1u << 28)) != 0;
+	bool fma = (regs[2] & (1u << 12)) != 0;
+	if (!osxsave || !avx || !fma)
+		return ISA_GENERIC;
+
+	// The OS has to save YMM (and for AVX-512 the opmask and ZMM) state
+	unsigned long long xcr0 = xgetbv0();
+	bool ymmState = (xcr0 & 0x6) == 0x6;
+	bool zmmState = (xcr0 & 0xE6) == 0xE6;
+
+	cpuid(7, 0, regs);
+	bool avx2 = (regs[1] & (1u << 5)) != 0;
+	bool avx512f = (regs[1] & (1u << 16)) != 0;
+	bool avx512dq = (regs[1] & (1u << 17)) != 0;
+	bool avx512bw = (regs[1] & (1u << 30)) != 0;
+	bool avx512vl = (regs[1] & (1u << 31)) != 0;
+
+	if (!ymmState || !avx2)
+		return ISA_GENERIC;
+	if (zmmState && avx512f && avx512dq && avx512bw && avx512vl)
+		return ISA_AVX512;
+	return ISA_AVX2;
+#else
+	return ISA_GENERIC;
+#endif
+}
+
+const char* isaLevelName(IsaLevel level)
+{
+	switch (level)
+	{
+	case ISA_AVX512:
+		return "avx512";
+	case ISA_AVX2:
+		return "avx2";
+	default:
+	case ISA_GENERIC:
+		return "generic";
+	}
+}
+
+bool parseIsaLevel(const char* name, IsaLevel& outLevel)
+{
+	if (!strcmp(name, "generic"))
+		outLevel = ISA_GENERIC;
+	else if (!strcmp(name, "avx2"))
+		outLevel = ISA_AVX2;
+	else if (!strcmp(name, "avx512"))
+		outLevel = ISA_AVX512;
+	else
+		return false;
+
+	return true;
+}
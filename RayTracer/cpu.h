@@ -0,0 +1,20 @@
+#ifndef __CPU_H__
+#define __CPU_H__
+
+// Instruction set levels that kernels are compiled for, in increasing order
+enum IsaLevel
+{
+	ISA_GENERIC = 0,
+	ISA_AVX2 = 1,
+	ISA_AVX512 = 2
+};
+
+// Highest level supported by both the CPU and the OS (register state saving)
+IsaLevel detectIsaLevel();
+
+const char* isaLevelName(IsaLevel level);
+
+// Parses "generic", "avx2" or "avx512", returns false for anything else
+bool parseIsaLevel(const char* name, IsaLevel& outLevel);
+
+#endif
@@ -0,0 +1,136 @@
+#include "denoiser.h"
+#include "kernels.h"
+#include "parallel.h"
+
+// Tiles keep the five tap rows of every plane in cache while a thread
+// works through them
+static const size_t kTileWidth = 256;
+static const size_t kTileHeight = 8;
+
+// Albedo channels below this are not divided out, misses and black surfaces
+// would only amplify noise
+static const float kMinAlbedo = 0.01f;
+
+static inline Color demodulationFactor(const float* const albedo[3], size_t index)
+{
+	if (albedo[0] == NULL)
+		return Color(1.0f);
+	Color factor(albedo[0][index], albedo[1][index], albedo[2][index]);
+	factor.r = factor.r > kMinAlbedo ? factor.r : 1.0f;
+	factor.g = factor.g > kMinAlbedo ? factor.g : 1.0f;
+	factor.b = factor.b > kMinAlbedo ? factor.b : 1.0f;
+	return factor;
+}
+
+Denoiser::Denoiser(size_t width, size_t height)
+	: width(width), height(height)
+{
+	size_t count = width * height;
+	for (int i = 0; i < 2; i++)
+	{
+		for (int c = 0; c < 3; c++)
+			color[i][c].resize(count);
+		variance[i].resize(count);
+	}
+	depthGradient.resize(count);
+}
+
+bool Denoiser::denoise(const Image& image, const AovBuffers& features, const DenoiseSettings& settings,
+	Image& outImage)
+{
+	if (image.getWidth() != width || image.getHeight() != height ||
+		outImage.getWidth() != width || outImage.getHeight() != height ||
+		features.getWidth() != width || features.getHeight() != height ||
+		features.getPlane(kAovVariancePlane) == NULL)
+		return false;
+
+	const float* const albedo[3] = { features.getPlane(kAovAlbedoR), features.getPlane(kAovAlbedoG),
+		features.getPlane(kAovAlbedoB) };
+	const float* const emission[3] = { features.getPlane(kAovEmissionR), features.getPlane(kAovEmissionG),
+		features.getPlane(kAovEmissionB) };
+	const float* const pVariance = features.getPlane(kAovVariancePlane);
+	const float* const pDepth = features.getPlane(kAovDepthPlane);
+	const Color* pPixels = image.getPixels();
+
+	// Lighting only, without albedo and the emitters seen directly, which
+	// are exact and would bleed into their surroundings. The variance plane
+	// already leaves out the emission. The depth gradient takes the smaller
+	// one-sided difference so silhouettes don't widen it.
+	parallelFor(height, settings.threadCount, [&](size_t y, unsigned)
+	{
+		for (size_t x = 0; x < width; x++)
+		{
+			size_t i = y * width + x;
+			Color factor = demodulationFactor(albedo, i);
+			Color lighting = (pPixels[i] - Color(emission[0][i], emission[1][i], emission[2][i])) / factor;
+			color[0][0][i] = lighting.r;
+			color[0][1][i] = lighting.g;
+			color[0][2][i] = lighting.b;
+			variance[0][i] = pVariance[i] / squared(factor.luminance());
+
+			if (pDepth == NULL)
+				continue;
+			float left = x > 0 ? std::fabs(pDepth[i] - pDepth[i - 1]) : 1.0e30f;
+			float right = x + 1 < width ? std::fabs(pDepth[i + 1] - pDepth[i]) : 1.0e30f;
+			float up = y > 0 ? std::fabs(pDepth[i] - pDepth[i - width]) : 1.0e30f;
+			float down = y + 1 < height ? std::fabs(pDepth[i + width] - pDepth[i]) : 1.0e30f;
+			float gradientX = std::min(left, right);
+			float gradientY = std::min(up, down);
+			gradientX = gradientX < 1.0e30f ? gradientX : 0.0f;
+			gradientY = gradientY < 1.0e30f ? gradientY : 0.0f;
+			depthGradient[i] = std::max(gradientX, gradientY);
+		}
+	});
+
+	DenoiseParams params;
+	params.width = width;
+	params.height = height;
+	params.depth = pDepth;
+	params.depthGradient = &depthGradient[0];
+	params.colorSigma = settings.colorSigma;
+	params.depthSigma = settings.depthSigma;
+	params.albedoSigma = settings.albedoSigma;
+	for (int c = 0; c < 3; c++)
+	{
+		params.albedo[c] = albedo[c];
+		params.normal[c] = features.getPlane((AovPlane)(kAovNormalX + c));
+	}
+
+	size_t tilesX = (width + kTileWidth - 1) / kTileWidth;
+	size_t tilesY = (height + kTileHeight - 1) / kTileHeight;
+	int current = 0;
+	for (unsigned iteration = 0; iteration < settings.iterations; iteration++, current ^= 1)
+	{
+		params.step = (size_t)1 << iteration;
+		for (int c = 0; c < 3; c++)
+		{
+			params.color[c] = &color[current][c][0];
+			params.outColor[c] = &color[current ^ 1][c][0];
+		}
+		params.variance = &variance[current][0];
+		params.outVariance = &variance[current ^ 1][0];
+
+		parallelFor(tilesX * tilesY, settings.threadCount, [&](size_t tileIndex, unsigned)
+		{
+			size_t x0 = (tileIndex % tilesX) * kTileWidth;
+			size_t y0 = (tileIndex / tilesX) * kTileHeight;
+			size_t x1 = std::min(x0 + kTileWidth, width);
+			size_t y1 = std::min(y0 + kTileHeight, height);
+			for (size_t y = y0; y < y1; y++)
+				kernels().denoiseRow(params, y, x0, x1);
+		});
+	}
+
+	Color* pOutPixels = outImage.getPixels();
+	parallelFor(height, settings.threadCount, [&](size_t y, unsigned)
+	{
+		for (size_t i = y * width; i < (y + 1) * width; i++)
+		{
+			Color lighting(color[current][0][i], color[current][1][i], color[current][2][i]);
+			Color emitted(emission[0][i], emission[1][i], emission[2][i]);
+			pOutPixels[i] = lighting * demodulationFactor(albedo, i) + emitted;
+		}
+	});
+
+	return true;
+}
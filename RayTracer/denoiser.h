@@ -0,0 +1,55 @@
+#ifndef __DENOISER_H__
+#define __DENOISER_H__
+
+#include <vector>
+
+#include "aov.h"
+#include "image.h"
+
+struct DenoiseSettings
+{
+	// Each iteration doubles the tap spacing, 5 reach 62 pixels out
+	unsigned iterations;
+	// Luminance tolerance in standard deviations of the pixel estimate
+	float colorSigma;
+	// Depth tolerance in multiples of the local depth gradient
+	float depthSigma;
+	float albedoSigma;
+	// 0 = use every hardware thread
+	unsigned threadCount;
+
+	DenoiseSettings()
+		: iterations(5), colorSigma(2.0f), depthSigma(1.0f), albedoSigma(0.1f), threadCount(0) { }
+};
+
+// Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010, with the
+// variance guidance of SVGF) for the resolved beauty image. Directly seen
+// emission is set aside and albedo divided out before filtering so lights
+// and textures stay sharp, and normal, depth and albedo differences stop
+// the filter at edges. Each iteration is a 5x5
+// sparse kernel run over small tiles by the denoiseRow kernel.
+class Denoiser
+{
+public:
+	Denoiser(size_t width, size_t height);
+
+	virtual ~Denoiser() { }
+
+	// Filters image into outImage, which may be the same image. features
+	// must match the size and hold the variance AOV (which brings the
+	// emission), albedo, normal and depth are used when present.
+	bool denoise(const Image& image, const AovBuffers& features, const DenoiseSettings& settings,
+		Image& outImage);
+
+protected:
+	Denoiser(const Denoiser&);
+	Denoiser& operator =(const Denoiser&);
+
+	size_t width, height;
+	// Ping-pong buffers for the demodulated color and its variance
+	std::vector<float> color[2][3];
+	std::vector<float> variance[2];
+	std::vector<float> depthGradient;
+};
+
+#endif
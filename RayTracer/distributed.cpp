@@ -0,0 +1,727 @@
+#include "distributed.h"
+#include "kernels.h"
+#include "network.h"
+#include "parallel.h"
+#include "sceneloader.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef _WIN32
+#include <signal.h>
+#include <spawn.h>
+#include <sys/wait.h>
+#include <unistd.h>
+extern char** environ;
+#endif
+
+// Every message is a little endian (type, payload size) header and payload:
+//
+//   job     coordinator -> worker  width height depth minDepth split tileSize passes, scene path
+//   ready   worker -> coordinator  threads, once the scene is loaded
+//   lease   coordinator -> worker  tile firstPass passCount
+//   result  worker -> coordinator  tile firstPass passCount, camera/bounce/shadow
+//                                  ray counts, float count, compressed sums
+//   done    coordinator -> worker  no payload, the worker exits
+enum MessageType
+{
+	kMessageJob = 1,
+	kMessageReady,
+	kMessageLease,
+	kMessageResult,
+	kMessageDone
+};
+
+static const size_t kMessageHeaderSize = 8;
+static const uint32_t kMaxMessageSize = 64 << 20;
+
+class MessageWriter
+{
+public:
+	MessageWriter(uint32_t type) : data(kMessageHeaderSize, 0)
+	{
+		setU32(0, type);
+	}
+
+	void putU32(uint32_t value)
+	{
+		for (int i = 0; i < 4; i++)
+			data.push_back((unsigned char)(value >> (8 * i)));
+	}
+
+	void putU64(unsigned long long value)
+	{
+		putU32((uint32_t)value);
+		putU32((uint32_t)(value >> 32));
+	}
+
+	void putFloat(float value)
+	{
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		putU32(bits);
+	}
+
+	void putBytes(const void* pBytes, size_t size)
+	{
+		data.insert(data.end(), (const unsigned char*)pBytes, (const unsigned char*)pBytes + size);
+	}
+
+	bool send(Socket& socket)
+	{
+		setU32(4, (uint32_t)(data.size() - kMessageHeaderSize));
+		return socket.sendAll(&data[0], data.size());
+	}
+
+protected:
+	void setU32(size_t offset, uint32_t value)
+	{
+		for (int i = 0; i < 4; i++)
+			data[offset + i] = (unsigned char)(value >> (8 * i));
+	}
+
+	std::vector<unsigned char> data;
+};
+
+class MessageReader
+{
+public:
+	MessageReader(const unsigned char* pBegin, size_t size) : p(pBegin), end(pBegin + size) { }
+
+	bool getU32(uint32_t& outValue)
+	{
+		if (end - p < 4)
+			return false;
+		outValue = (uint32_t)p[0] | ((uint32_t)p[1] << 8) | ((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+		p += 4;
+		return true;
+	}
+
+	bool getU64(unsigned long long& outValue)
+	{
+		uint32_t low, high;
+		if (!getU32(low) || !getU32(high))
+			return false;
+		outValue = low | ((unsigned long long)high << 32);
+		return true;
+	}
+
+	bool getFloat(float& outValue)
+	{
+		uint32_t bits;
+		if (!getU32(bits))
+			return false;
+		memcpy(&outValue, &bits, sizeof(outValue));
+		return true;
+	}
+
+	const unsigned char* getRest(size_t& outSize) const
+	{
+		outSize = end - p;
+		return p;
+	}
+
+protected:
+	const unsigned char* p;
+	const unsigned char* end;
+};
+
+static bool parseHeader(const unsigned char* pHeader, uint32_t& outType, uint32_t& outSize)
+{
+	MessageReader reader(pHeader, kMessageHeaderSize);
+	return reader.getU32(outType) && reader.getU32(outSize) && outSize <= kMaxMessageSize;
+}
+
+static bool receiveMessage(Socket& socket, uint32_t& outType, std::vector<unsigned char>& outPayload)
+{
+	unsigned char header[kMessageHeaderSize];
+	uint32_t size;
+	if (!socket.receiveAll(header, sizeof(header)) || !parseHeader(header, outType, size))
+		return false;
+
+	outPayload.resize(size);
+	return size == 0 || socket.receiveAll(&outPayload[0], size);
+}
+
+// Neighbouring pixels share most of their sign, exponent and top mantissa
+// bits, so each float is XORed with the previous one of the same channel and
+// the result split into byte planes, most significant first. The mostly zero
+// high planes then shrink well under PackBits style run length coding: a
+// control byte c < 128 is followed by c + 1 literal bytes, otherwise the
+// next byte repeats c - 125 times.
+static void compressFloats(const float* values, size_t count, std::vector<unsigned char>& outData)
+{
+	std::vector<unsigned char> planes(4 * count);
+	uint32_t previous[3] = { 0, 0, 0 };
+	for (size_t i = 0; i < count; i++)
+	{
+		uint32_t bits;
+		memcpy(&bits, &values[i], 4);
+		uint32_t delta = bits ^ previous[i % 3];
+		previous[i % 3] = bits;
+		for (size_t b = 0; b < 4; b++)
+			planes[b * count + i] = (unsigned char)(delta >> (24 - 8 * b));
+	}
+
+	outData.clear();
+	size_t size = planes.size();
+	size_t i = 0;
+	while (i < size)
+	{
+		size_t run = 1;
+		while (i + run < size && run < 130 && planes[i + run] == planes[i])
+			run++;
+
+		if (run >= 3)
+		{
+			outData.push_back((unsigned char)(run + 125));
+			outData.push_back(planes[i]);
+			i += run;
+			continue;
+		}
+
+		// Literals up to the next run of three or the 128 byte limit
+		size_t literalEnd = i;
+		while (literalEnd < size && literalEnd - i < 128 &&
+			!(literalEnd + 2 < size && planes[literalEnd] == planes[literalEnd + 1] && planes[literalEnd] == planes[literalEnd + 2]))
+		{
+			literalEnd++;
+		}
+		outData.push_back((unsigned char)(literalEnd - i - 1));
+		outData.insert(outData.end(), planes.begin() + i, planes.begin() + literalEnd);
+		i = literalEnd;
+	}
+}
+
+static bool decompressFloats(const unsigned char* pData, size_t size, size_t count, float* outValues)
+{
+	std::vector<unsigned char> planes(4 * count);
+	size_t out = 0;
+	const unsigned char* end = pData + size;
+	while (pData < end)
+	{
+		unsigned control = *pData++;
+		if (control < 128)
+		{
+			size_t literals = control + 1;
+			if ((size_t)(end - pData) < literals || planes.size() - out < literals)
+				return false;
+			memcpy(&planes[out], pData, literals);
+			pData += literals;
+			out += literals;
+		}
+		else
+		{
+			size_t run = control - 125;
+			if (pData == end || planes.size() - out < run)
+				return false;
+			memset(&planes[out], *pData++, run);
+			out += run;
+		}
+	}
+	if (out != planes.size())
+		return false;
+
+	uint32_t previous[3] = { 0, 0, 0 };
+	for (size_t i = 0; i < count; i++)
+	{
+		uint32_t delta = 0;
+		for (size_t b = 0; b < 4; b++)
+			delta |= (uint32_t)planes[b * count + i] << (24 - 8 * b);
+		uint32_t bits = delta ^ previous[i % 3];
+		previous[i % 3] = bits;
+		memcpy(&outValues[i], &bits, 4);
+	}
+	return true;
+}
+
+struct WorkItem
+{
+	uint32_t tileIndex;
+	uint32_t firstPass;
+	uint32_t passCount;
+
+	WorkItem() : tileIndex(0), firstPass(0), passCount(0) { }
+	WorkItem(uint32_t tileIndex, uint32_t firstPass, uint32_t passCount)
+		: tileIndex(tileIndex), firstPass(firstPass), passCount(passCount) { }
+};
+
+struct WorkerConnection
+{
+	Socket socket;
+	unsigned id;
+	unsigned threadCount;
+	bool ready;
+	// Bytes received but not yet parsed into whole messages
+	std::vector<unsigned char> inbox;
+	std::vector<WorkItem> leases;
+	std::chrono::steady_clock::time_point lastProgress;
+
+	WorkerConnection(unsigned id) : socket(), id(id), threadCount(0), ready(false), inbox(), leases(), lastProgress() { }
+};
+
+static bool spawnWorkers(const char* programPath, const char* address, unsigned count,
+	unsigned threadCount, std::vector<long long>& outProcesses)
+{
+#ifdef _WIN32
+	fprintf(stderr, "starting local workers is not supported on this platform, start them by hand\n");
+	return false;
+#else
+	char threads[16];
+	snprintf(threads, sizeof(threads), "%u", threadCount);
+	for (unsigned i = 0; i < count; i++)
+	{
+		char* argv[] = { (char*)programPath, (char*)"worker", (char*)address,
+			(char*)"--threads", threads, NULL };
+		pid_t pid;
+		if (posix_spawnp(&pid, programPath, NULL, NULL, argv, environ) != 0)
+		{
+			fprintf(stderr, "%s: could not start worker\n", programPath);
+			return false;
+		}
+		outProcesses.push_back(pid);
+	}
+	return true;
+#endif
+}
+
+static void waitForWorkers(std::vector<long long>& processes, bool kill)
+{
+#ifndef _WIN32
+	for (size_t i = 0; i < processes.size(); i++)
+	{
+		if (kill)
+			::kill((pid_t)processes[i], SIGTERM);
+		waitpid((pid_t)processes[i], NULL, 0);
+	}
+#endif
+	processes.clear();
+}
+
+
+// Everything the coordinator loop shares between its helpers
+struct CoordinatorState
+{
+	const RenderSettings& settings;
+	Image& image;
+	std::deque<WorkItem> pending;
+	size_t remaining;
+	std::vector<WorkerConnection*> workers;
+	RenderStats stats;
+	unsigned long long payloadBytes;
+	unsigned long long rawBytes;
+
+	CoordinatorState(const RenderSettings& settings, Image& image)
+		: settings(settings), image(image), pending(), remaining(0), workers(), stats(),
+		payloadBytes(0), rawBytes(0) { }
+};
+
+// Closes the connection and puts whatever it still held back at the front of
+// the queue, late results from it can no longer arrive
+static void dropWorker(CoordinatorState& state, size_t workerIndex, const char* reason)
+{
+	WorkerConnection* pWorker = state.workers[workerIndex];
+	fprintf(stderr, "worker %u %s, leasing its %u tiles again\n",
+		pWorker->id, reason, (unsigned)pWorker->leases.size());
+
+	for (size_t i = pWorker->leases.size(); i > 0; i--)
+		state.pending.push_front(pWorker->leases[i - 1]);
+
+	delete pWorker;
+	state.workers.erase(state.workers.begin() + workerIndex);
+}
+
+static bool handleResult(CoordinatorState& state, WorkerConnection& worker, MessageReader& reader)
+{
+	WorkItem item;
+	RenderStats resultStats;
+	uint32_t floatCount;
+	if (!reader.getU32(item.tileIndex) || !reader.getU32(item.firstPass) || !reader.getU32(item.passCount) ||
+		!reader.getU64(resultStats.cameraRays) || !reader.getU64(resultStats.bounceRays) ||
+		!reader.getU64(resultStats.shadowRays) || !reader.getU32(floatCount))
+	{
+		return false;
+	}
+
+	size_t leaseIndex = 0;
+	while (leaseIndex < worker.leases.size() &&
+		(worker.leases[leaseIndex].tileIndex != item.tileIndex || worker.leases[leaseIndex].firstPass != item.firstPass))
+	{
+		leaseIndex++;
+	}
+	if (leaseIndex == worker.leases.size())
+		return false;
+
+	size_t x0, y0, x1, y1;
+	state.settings.getTileBounds(item.tileIndex, x0, y0, x1, y1);
+	size_t tileWidth = x1 - x0;
+	if (floatCount != 3 * tileWidth * (y1 - y0))
+		return false;
+
+	size_t payloadSize;
+	const unsigned char* pPayload = reader.getRest(payloadSize);
+	std::vector<float> sums(floatCount);
+	if (!decompressFloats(pPayload, payloadSize, floatCount, &sums[0]))
+		return false;
+
+	Color* pPixels = state.image.getPixels();
+	for (size_t y = y0; y < y1; y++)
+	{
+		for (size_t x = x0; x < x1; x++)
+		{
+			const float* pSum = &sums[3 * ((y - y0) * tileWidth + (x - x0))];
+			pPixels[y * state.settings.width + x] += Color(pSum[0], pSum[1], pSum[2]);
+		}
+	}
+
+	state.stats += resultStats;
+	state.payloadBytes += payloadSize;
+	state.rawBytes += floatCount * sizeof(float);
+	state.remaining--;
+	worker.leases.erase(worker.leases.begin() + leaseIndex);
+	worker.lastProgress = std::chrono::steady_clock::now();
+	return true;
+}
+
+// Parses every whole message in the inbox, false on a protocol error
+static bool processInbox(CoordinatorState& state, WorkerConnection& worker)
+{
+	size_t offset = 0;
+	uint32_t type, size;
+	while (worker.inbox.size() - offset >= kMessageHeaderSize)
+	{
+		if (!parseHeader(&worker.inbox[offset], type, size))
+			return false;
+		if (worker.inbox.size() - offset - kMessageHeaderSize < size)
+			break;
+
+		MessageReader reader(&worker.inbox[offset + kMessageHeaderSize], size);
+		offset += kMessageHeaderSize + size;
+		if (type == kMessageReady && !worker.ready)
+		{
+			if (!reader.getU32(worker.threadCount))
+				return false;
+			worker.ready = true;
+			worker.lastProgress = std::chrono::steady_clock::now();
+		}
+		else if (type != kMessageResult || !worker.ready || !handleResult(state, worker, reader))
+		{
+			return false;
+		}
+	}
+
+	worker.inbox.erase(worker.inbox.begin(), worker.inbox.begin() + offset);
+	return true;
+}
+
+bool runCoordinator(const char* programPath,
+	const char* sceneFile,
+	const RenderSettings& settings,
+	unsigned samplesPerPixel,
+	const DistributedSettings& distributed,
+	Image& outImage)
+{
+	Socket listener;
+	if (!listener.listen(distributed.address))
+		return false;
+
+	CoordinatorState state(settings, outImage);
+	outImage.clear();
+
+	// Every tile's first pass range before any tile's second, so an early
+	// stop would still leave an evenly sampled image
+	unsigned passesPerLease = distributed.passesPerLease > 0 ? distributed.passesPerLease : samplesPerPixel;
+	for (unsigned firstPass = 0; firstPass < samplesPerPixel; firstPass += passesPerLease)
+	{
+		unsigned passCount = std::min(passesPerLease, samplesPerPixel - firstPass);
+		for (size_t tile = 0; tile < settings.getTileCount(); tile++)
+			state.pending.push_back(WorkItem((uint32_t)tile, firstPass, passCount));
+	}
+	state.remaining = state.pending.size();
+
+	std::vector<long long> processes;
+	if (distributed.spawnCount > 0)
+	{
+		// Share this machine's threads between the local workers
+		unsigned threadCount = settings.threadCount;
+		if (threadCount == 0)
+			threadCount = std::max(defaultThreadCount() / distributed.spawnCount, 1u);
+		if (!spawnWorkers(programPath, distributed.address, distributed.spawnCount, threadCount, processes))
+		{
+			waitForWorkers(processes, true);
+			return false;
+		}
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point lastWorkerSeen = start;
+	unsigned nextWorkerId = 0;
+	unsigned workersSeen = 0;
+	std::vector<unsigned char> buffer(64 * 1024);
+	bool success = true;
+
+	while (state.remaining > 0)
+	{
+		std::vector<Socket*> sockets(1, &listener);
+		for (size_t i = 0; i < state.workers.size(); i++)
+			sockets.push_back(&state.workers[i]->socket);
+
+		std::vector<bool> readable;
+		if (!Socket::waitReadable(sockets, 100, readable))
+		{
+			success = false;
+			break;
+		}
+
+		std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+		for (size_t i = state.workers.size(); i > 0; i--)
+		{
+			WorkerConnection* pWorker = state.workers[i - 1];
+			if (readable[i])
+			{
+				long long received = pWorker->socket.receiveSome(&buffer[0], buffer.size());
+				if (received <= 0)
+				{
+					dropWorker(state, i - 1, "disconnected");
+					continue;
+				}
+
+				pWorker->inbox.insert(pWorker->inbox.end(), buffer.begin(), buffer.begin() + (size_t)received);
+				if (!processInbox(state, *pWorker))
+				{
+					dropWorker(state, i - 1, "sent an invalid message");
+					continue;
+				}
+			}
+
+			std::chrono::duration<double> idle = now - pWorker->lastProgress;
+			if (!pWorker->leases.empty() && idle.count() > distributed.leaseTimeout)
+				dropWorker(state, i - 1, "timed out");
+		}
+
+		if (readable[0])
+		{
+			WorkerConnection* pWorker = new WorkerConnection(nextWorkerId++);
+			MessageWriter job(kMessageJob);
+			job.putU32((uint32_t)settings.width);
+			job.putU32((uint32_t)settings.height);
+			job.putU32(settings.maxDepth);
+			job.putU32(settings.minDepth);
+			job.putFloat(settings.splitFactor);
+			job.putU32((uint32_t)settings.tileSize);
+			job.putU32(samplesPerPixel);
+			job.putBytes(sceneFile, strlen(sceneFile));
+			if (listener.accept(pWorker->socket) && job.send(pWorker->socket))
+			{
+				state.workers.push_back(pWorker);
+				workersSeen++;
+			}
+			else
+			{
+				delete pWorker;
+			}
+		}
+
+		// Two leases per thread keep a worker busy while results travel back
+		for (size_t i = state.workers.size(); i > 0; i--)
+		{
+			WorkerConnection* pWorker = state.workers[i - 1];
+			bool sent = true;
+			while (sent && pWorker->ready && !state.pending.empty() &&
+				pWorker->leases.size() < 2 * (size_t)std::max(pWorker->threadCount, 1u))
+			{
+				WorkItem item = state.pending.front();
+				MessageWriter lease(kMessageLease);
+				lease.putU32(item.tileIndex);
+				lease.putU32(item.firstPass);
+				lease.putU32(item.passCount);
+				sent = lease.send(pWorker->socket);
+				if (sent)
+				{
+					state.pending.pop_front();
+					if (pWorker->leases.empty())
+						pWorker->lastProgress = now;
+					pWorker->leases.push_back(item);
+				}
+			}
+			if (!sent)
+				dropWorker(state, i - 1, "could not be reached");
+		}
+
+		if (!state.workers.empty())
+			lastWorkerSeen = now;
+		std::chrono::duration<double> alone = now - lastWorkerSeen;
+		if (alone.count() > distributed.leaseTimeout)
+		{
+			fprintf(stderr, "no workers for %.0f s, giving up\n", alone.count());
+			success = false;
+			break;
+		}
+	}
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	for (size_t i = 0; i < state.workers.size(); i++)
+	{
+		MessageWriter done(kMessageDone);
+		done.send(state.workers[i]->socket);
+		delete state.workers[i];
+	}
+	state.workers.clear();
+	listener.close();
+	waitForWorkers(processes, !success);
+
+	if (!success)
+		return false;
+
+	float scale = samplesPerPixel > 0 ? 1.0f / samplesPerPixel : 0.0f;
+	kernels().scaleFloats(&outImage.getPixels()->r, scale, 4 * settings.width * settings.height, &outImage.getPixels()->r);
+
+	state.stats.renderSeconds = elapsed.count();
+	printf("rendered %u spp on %u workers in %.3f s, %.1f Mrays/s, tile payloads %.2fx smaller\n",
+		samplesPerPixel, workersSeen, elapsed.count(),
+		state.stats.totalRays() / elapsed.count() * 1e-6,
+		state.payloadBytes > 0 ? (double)state.rawBytes / state.payloadBytes : 0.0);
+	return true;
+}
+
+bool runWorker(const char* address, unsigned threadCount)
+{
+	// The coordinator may still be starting up
+	Socket socket;
+	for (int attempt = 0; !socket.connect(address); attempt++)
+	{
+		if (attempt == 50)
+		{
+			fprintf(stderr, "%s: could not connect\n", address);
+			return false;
+		}
+		std::this_thread::sleep_for(std::chrono::milliseconds(100));
+	}
+
+	uint32_t type;
+	std::vector<unsigned char> payload;
+	RenderSettings settings;
+	uint32_t width, height, maxDepth, minDepth, tileSize, samplesPerPixel;
+	float splitFactor;
+	if (!receiveMessage(socket, type, payload) || type != kMessageJob)
+	{
+		fprintf(stderr, "%s: expected a job\n", address);
+		return false;
+	}
+
+	MessageReader reader(payload.empty() ? NULL : &payload[0], payload.size());
+	if (!reader.getU32(width) || !reader.getU32(height) || !reader.getU32(maxDepth) ||
+		!reader.getU32(minDepth) || !reader.getFloat(splitFactor) || !reader.getU32(tileSize) || !reader.getU32(samplesPerPixel) || tileSize == 0)
+	{
+		fprintf(stderr, "%s: invalid job\n", address);
+		return false;
+	}
+	size_t pathLength;
+	const unsigned char* pPath = reader.getRest(pathLength);
+	std::string sceneFile((const char*)pPath, pathLength);
+
+	settings.width = width;
+	settings.height = height;
+	settings.maxDepth = maxDepth;
+	settings.minDepth = minDepth;
+	settings.splitFactor = splitFactor;
+	settings.tileSize = tileSize;
+	settings.threadCount = threadCount > 0 ? threadCount : defaultThreadCount();
+
+	Scene scene;
+	if (!loadScene(sceneFile.c_str(), scene, settings.threadCount))
+		return false;
+	if (scene.getCamera() == NULL)
+	{
+		fprintf(stderr, "%s: no camera\n", sceneFile.c_str());
+		return false;
+	}
+	scene.prepare(settings.threadCount);
+	Renderer renderer(scene, settings);
+
+	MessageWriter ready(kMessageReady);
+	ready.putU32(settings.threadCount);
+	if (!ready.send(socket))
+		return false;
+
+	std::vector<Socket*> sockets(1, &socket);
+	std::vector<bool> readable;
+	std::vector<WorkItem> batch;
+	bool done = false;
+	while (!done)
+	{
+		// Block for one lease, then take whatever else has already arrived
+		batch.clear();
+		bool more = true;
+		while (!done && more)
+		{
+			if (!receiveMessage(socket, type, payload))
+				return false;
+
+			MessageReader leaseReader(payload.empty() ? NULL : &payload[0], payload.size());
+			WorkItem item;
+			if (type == kMessageDone)
+				done = true;
+			else if (type == kMessageLease && leaseReader.getU32(item.tileIndex) &&
+				leaseReader.getU32(item.firstPass) && leaseReader.getU32(item.passCount) &&
+				item.tileIndex < settings.getTileCount())
+			{
+				batch.push_back(item);
+			}
+			else
+				return false;
+
+			if (!Socket::waitReadable(sockets, 0, readable))
+				return false;
+			more = readable[0];
+		}
+
+		std::vector<std::vector<unsigned char> > results(batch.size());
+		std::vector<RenderStats> itemStats(batch.size());
+		parallelFor(batch.size(), settings.threadCount,
+			[&](size_t index, unsigned threadIndex)
+		{
+			size_t x0, y0, x1, y1;
+			settings.getTileBounds(batch[index].tileIndex, x0, y0, x1, y1);
+			Image tile(x1 - x0, y1 - y0);
+			renderer.renderTileSamples(batch[index].tileIndex, batch[index].firstPass, batch[index].passCount,
+				tile.getPixels(), itemStats[index]);
+			// Tiles travel as RGB without the padding lane
+			size_t pixelCount = (x1 - x0) * (y1 - y0);
+			std::vector<float> rgb(3 * pixelCount);
+			for (size_t i = 0; i < pixelCount; i++)
+			{
+				const Color& sum = tile.getPixels()[i];
+				rgb[3 * i + 0] = sum.r;
+				rgb[3 * i + 1] = sum.g;
+				rgb[3 * i + 2] = sum.b;
+			}
+			compressFloats(&rgb[0], rgb.size(), results[index]);
+		});
+
+		for (size_t i = 0; i < batch.size(); i++)
+		{
+			size_t x0, y0, x1, y1;
+			settings.getTileBounds(batch[i].tileIndex, x0, y0, x1, y1);
+			MessageWriter result(kMessageResult);
+			result.putU32(batch[i].tileIndex);
+			result.putU32(batch[i].firstPass);
+			result.putU32(batch[i].passCount);
+			result.putU64(itemStats[i].cameraRays);
+			result.putU64(itemStats[i].bounceRays);
+			result.putU64(itemStats[i].shadowRays);
+			result.putU32((uint32_t)(3 * (x1 - x0) * (y1 - y0)));
+			result.putBytes(results[i].empty() ? NULL : &results[i][0], results[i].size());
+			if (!result.send(socket))
+				return false;
+		}
+	}
+
+	return true;
+}
@@ -0,0 +1,40 @@
+#ifndef __DISTRIBUTED_H__
+#define __DISTRIBUTED_H__
+
+#include "renderer.h"
+
+struct DistributedSettings
+{
+	// See Socket for the address format
+	const char* address;
+	// Worker processes the coordinator starts itself on this machine
+	unsigned spawnCount;
+	// Passes of one tile handed out per lease, 0 = all of them
+	unsigned passesPerLease;
+	// A worker holding leases without returning any result for this long is
+	// dropped and its tiles leased again
+	double leaseTimeout;
+
+	DistributedSettings()
+		: address(NULL), spawnCount(0), passesPerLease(0), leaseTimeout(60.0) { }
+};
+
+// Leases (tile, pass range) work items to worker processes and merges their
+// results into outImage, which must match the render size. Tiles held by a
+// worker that disconnects or times out go back to the queue. With whole
+// tiles per lease the image is bit identical to a local render.
+//
+// Workers load sceneFile themselves, so the path must be valid for them.
+// programPath is used to start spawnCount local workers.
+bool runCoordinator(const char* programPath,
+	const char* sceneFile,
+	const RenderSettings& settings,
+	unsigned samplesPerPixel,
+	const DistributedSettings& distributed,
+	Image& outImage);
+
+// Connects to a coordinator and renders leases until told to stop,
+// threadCount = 0 uses every hardware thread
+bool runWorker(const char* address, unsigned threadCount);
+
+#endif
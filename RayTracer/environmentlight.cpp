@@ -0,0 +1,240 @@
+#include "environmentlight.h"
+
+#include <cmath>
+
+#include "fastmath.h"
+
+// Far enough to clear any sensible scene, small enough that squaring the
+// distance while normalizing the shadow ray direction stays finite
+static const float kEnvironmentDistance = 1.0e8f;
+
+// Largest float below one, keeps remapped uniforms inside [0, 1)
+static const float kOneMinusEpsilon = 0.99999994f;
+
+EnvironmentLight::EnvironmentLight(float power, float rotationInDegrees)
+	: Light(Color(1.0f), power), image(0, 0),
+	rotation(rotationInDegrees * (float)(M_PI / 180.0)),
+	rowTable(), columnTables(), pixelPdf()
+{
+}
+
+bool EnvironmentLight::loadFromFile(const char* filename)
+{
+	return image.loadFromFile(filename);
+}
+
+void EnvironmentLight::prepare(unsigned threadCount)
+{
+	size_t width = image.getWidth();
+	size_t height = image.getHeight();
+	rowTable.clear();
+	columnTables.clear();
+	pixelPdf.clear();
+	if (width == 0 || height == 0)
+		return;
+
+	// Weight each pixel by the solid angle its row covers so the poles, which
+	// are stretched across the whole width, aren't oversampled
+	const Color* pixels = image.getPixels();
+	pixelPdf.resize(width * height);
+	std::vector<float> rowWeights(height);
+	double total = 0.0;
+	for (size_t y = 0; y < height; y++)
+	{
+		float sinTheta = std::sin((float)M_PI * (y + 0.5f) / height);
+		double rowSum = 0.0;
+		for (size_t x = 0; x < width; x++)
+		{
+			const Color& c = pixels[y * width + x];
+			float luminance = 0.2126f * c.r + 0.7152f * c.g + 0.0722f * c.b;
+			float weight = luminance > 0.0f && std::isfinite(luminance) ? luminance * sinTheta : 0.0f;
+			pixelPdf[y * width + x] = weight;
+			rowSum += weight;
+		}
+		rowWeights[y] = (float)rowSum;
+		total += rowSum;
+	}
+
+	// A black map still gets valid tables, they just sample by solid angle
+	if (total <= 0.0)
+	{
+		for (size_t y = 0; y < height; y++)
+		{
+			float sinTheta = std::sin((float)M_PI * (y + 0.5f) / height);
+			for (size_t x = 0; x < width; x++)
+				pixelPdf[y * width + x] = sinTheta;
+			rowWeights[y] = sinTheta * width;
+			total += rowWeights[y];
+		}
+	}
+
+	rowTable.resize(height);
+	columnTables.resize(width * height);
+	buildAliasTable(&rowWeights[0], height, &rowTable[0]);
+	std::vector<float> uniformRow(width, 1.0f);
+	for (size_t y = 0; y < height; y++)
+	{
+		// Rows that are never picked still need a valid table
+		const float* rowPixels = rowWeights[y] > 0.0f ? &pixelPdf[y * width] : &uniformRow[0];
+		buildAliasTable(rowPixels, width, &columnTables[y * width]);
+	}
+
+	// Probability of each pixel turned into a density over the unit square
+	float scale = (float)(width * height / total);
+	for (size_t i = 0; i < width * height; i++)
+		pixelPdf[i] *= scale;
+}
+
+void EnvironmentLight::buildAliasTable(const float* weights, size_t count, AliasEntry* outTable)
+{
+	double sum = 0.0;
+	for (size_t i = 0; i < count; i++)
+		sum += weights[i];
+
+	std::vector<float> scaled(count);
+	std::vector<unsigned> small, large;
+	small.reserve(count);
+	large.reserve(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		scaled[i] = (float)(weights[i] * count / sum);
+		if (scaled[i] < 1.0f)
+			small.push_back((unsigned)i);
+		else
+			large.push_back((unsigned)i);
+	}
+
+	while (!small.empty() && !large.empty())
+	{
+		unsigned less = small.back();
+		unsigned more = large.back();
+		small.pop_back();
+		large.pop_back();
+
+		outTable[less].probability = scaled[less];
+		outTable[less].alias = more;
+
+		scaled[more] = (scaled[more] + scaled[less]) - 1.0f;
+		if (scaled[more] < 1.0f)
+			small.push_back(more);
+		else
+			large.push_back(more);
+	}
+
+	// Whatever is left is within rounding of one
+	for (size_t i = 0; i < large.size(); i++)
+	{
+		outTable[large[i]].probability = 1.0f;
+		outTable[large[i]].alias = large[i];
+	}
+	for (size_t i = 0; i < small.size(); i++)
+	{
+		outTable[small[i]].probability = 1.0f;
+		outTable[small[i]].alias = small[i];
+	}
+}
+
+size_t EnvironmentLight::sampleAliasTable(const AliasEntry* table, size_t count, float u, float& outRemapped)
+{
+	float scaled = u * count;
+	size_t index = std::min((size_t)scaled, count - 1);
+	float fraction = std::min(scaled - index, kOneMinusEpsilon);
+
+	const AliasEntry& entry = table[index];
+	if (fraction < entry.probability)
+	{
+		outRemapped = std::min(fraction / entry.probability, kOneMinusEpsilon);
+		return index;
+	}
+
+	outRemapped = std::min((fraction - entry.probability) / (1.0f - entry.probability), kOneMinusEpsilon);
+	return entry.alias;
+}
+
+void EnvironmentLight::directionToMap(const Vector& direction, float& outU, float& outV) const
+{
+	float cosTheta = std::max(-1.0f, std::min(direction.y, 1.0f));
+	outV = std::acos(cosTheta) * (float)(1.0 / M_PI);
+
+	float u = (std::atan2(direction.z, direction.x) - rotation) * (float)(0.5 / M_PI);
+	outU = u - std::floor(u);
+}
+
+Vector EnvironmentLight::mapToDirection(float u, float v, float& outSinTheta) const
+{
+	float sinTheta, cosTheta, sinPhi, cosPhi;
+	fastSinCos((float)M_PI * v, sinTheta, cosTheta);
+	fastSinCos((float)(M_PI * 2.0) * u + rotation, sinPhi, cosPhi);
+
+	outSinTheta = sinTheta;
+	return Vector(sinTheta * cosPhi, cosTheta, sinTheta * sinPhi);
+}
+
+size_t EnvironmentLight::pixelIndex(float u, float v) const
+{
+	size_t width = image.getWidth();
+	size_t height = image.getHeight();
+	size_t x = std::min((size_t)(u * width), width - 1);
+	size_t y = std::min((size_t)(v * height), height - 1);
+	return y * width + x;
+}
+
+bool EnvironmentLight::sampleSurface(const Point& surfPosition,
+	const Vector& surfNormal,
+	float u1, float u2, float u3,
+	Point& outPosition,
+	Vector& outNormal,
+	float& outPdf)
+{
+	outPdf = 0.0f;
+	if (pixelPdf.empty())
+		return false;
+
+	// The leftover of each pick places the direction inside its pixel
+	size_t width = image.getWidth();
+	size_t height = image.getHeight();
+	float rowOffset, columnOffset;
+	size_t y = sampleAliasTable(&rowTable[0], height, u1, rowOffset);
+	size_t x = sampleAliasTable(&columnTables[y * width], width, u2, columnOffset);
+
+	float sinTheta;
+	Vector direction = mapToDirection((x + columnOffset) / width, (y + rowOffset) / height, sinTheta);
+	if (sinTheta <= 0.0f)
+		return false;
+
+	outPosition = surfPosition + direction * kEnvironmentDistance;
+	outNormal = -direction;
+	outPdf = pixelPdf[y * width + x] / ((float)(2.0 * M_PI * M_PI) * sinTheta);
+	return outPdf > 0.0f;
+}
+
+float EnvironmentLight::directionPdf(const Vector& toLight) const
+{
+	if (pixelPdf.empty())
+		return 0.0f;
+
+	float sinTheta = std::sqrt(std::max(0.0f, 1.0f - squared(toLight.y)));
+	if (sinTheta <= 0.0f)
+		return 0.0f;
+
+	float u, v;
+	directionToMap(toLight, u, v);
+	return pixelPdf[pixelIndex(u, v)] / ((float)(2.0 * M_PI * M_PI) * sinTheta);
+}
+
+float EnvironmentLight::intersectPdf(const Intersection& isect)
+{
+	if (isect.pShape == this)
+		return directionPdf(isect.ray.direction);
+	return 0.0f;
+}
+
+Color EnvironmentLight::radiance(const Vector& toLight) const
+{
+	if (pixelPdf.empty())
+		return Color();
+
+	float u, v;
+	directionToMap(toLight, u, v);
+	return image.getPixels()[pixelIndex(u, v)] * power;
+}
@@ -0,0 +1,77 @@
+#ifndef __ENVIRONMENTLIGHT_H__
+#define __ENVIRONMENTLIGHT_H__
+
+#include <vector>
+
+#include "image.h"
+#include "light.h"
+
+// Infinitely distant light from a latitude-longitude radiance map. The top
+// row is straight up (+y), u runs once around the horizon starting at +x
+// towards +z and rotation turns the map about +y in degrees.
+//
+// Directions are importance sampled from a piecewise constant distribution
+// over the pixels proportional to luminance * sin(theta), drawn in O(1) from
+// a marginal alias table over rows and one conditional alias table per row.
+// The environment is never part of the shape set, the scene hands it to the
+// renderer as a light and for rays that escape.
+class EnvironmentLight : public Light
+{
+public:
+	EnvironmentLight(float power, float rotationInDegrees = 0.0f);
+
+	virtual ~EnvironmentLight() { }
+
+	// Only supports .pfm, see Image::loadFromFile()
+	bool loadFromFile(const char* filename);
+
+	virtual bool intersect(const Ray& ray, Hit& inOutHit) { return false; }
+	virtual bool doesIntersect(const Ray& ray) { return false; }
+	virtual void completeIntersection(const Hit& hit, Intersection& intersection) { }
+
+	// Builds the sampling tables from the current image
+	virtual void prepare(unsigned threadCount = 1);
+
+	virtual bool sampleSurface(const Point& surfPosition,
+		const Vector& surfNormal,
+		float u1, float u2, float u3,
+		Point& outPosition,
+		Vector& outNormal,
+		float& outPdf);
+
+	virtual float intersectPdf(const Intersection& isect);
+
+	virtual Color radiance(const Vector& toLight) const;
+
+	// Solid angle pdf of sampleSurface() picking toLight
+	float directionPdf(const Vector& toLight) const;
+
+protected:
+	struct AliasEntry
+	{
+		float probability;
+		unsigned alias;
+	};
+
+	// Vose's method, weights need not be normalised but must not all be zero
+	static void buildAliasTable(const float* weights, size_t count, AliasEntry* outTable);
+
+	// Picks an entry and rescales the unused part of u to a fresh uniform
+	static size_t sampleAliasTable(const AliasEntry* table, size_t count, float u, float& outRemapped);
+
+	// Map coordinates in [0, 1) of a direction and back
+	void directionToMap(const Vector& direction, float& outU, float& outV) const;
+	Vector mapToDirection(float u, float v, float& outSinTheta) const;
+
+	size_t pixelIndex(float u, float v) const;
+
+	Image image;
+	float rotation;
+
+	// Set by prepare()
+	std::vector<AliasEntry> rowTable;
+	std::vector<AliasEntry> columnTables;
+	std::vector<float> pixelPdf;
+};
+
+#endif
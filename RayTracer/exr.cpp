@@ -0,0 +1,120 @@
+#include "exr.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+// Little endian helpers for the header, which is a list of
+// (name, type, size, value) attributes ended by an empty name
+static void putInt(std::string& out, int value)
+{
+	for (int i = 0; i < 4; i++)
+		out.push_back((char)((unsigned)value >> (8 * i)));
+}
+
+static void putFloat(std::string& out, float value)
+{
+	int bits;
+	memcpy(&bits, &value, 4);
+	putInt(out, bits);
+}
+
+static void putAttribute(std::string& out, const char* name, const char* type, const std::string& value)
+{
+	out.append(name).push_back('\0');
+	out.append(type).push_back('\0');
+	putInt(out, (int)value.size());
+	out.append(value);
+}
+
+static bool channelNameLess(const ExrChannel& a, const ExrChannel& b)
+{
+	return strcmp(a.name, b.name) < 0;
+}
+
+bool saveExr(const char* filename, size_t width, size_t height, const std::vector<ExrChannel>& channels)
+{
+	if (width == 0 || height == 0 || channels.empty())
+		return false;
+
+	// Readers expect the channel list and the data in each line sorted by name
+	std::vector<ExrChannel> sorted(channels);
+	std::stable_sort(sorted.begin(), sorted.end(), channelNameLess);
+
+	std::string header;
+	putInt(header, 20000630);
+	putInt(header, 2);
+
+	std::string value;
+	for (size_t c = 0; c < sorted.size(); c++)
+	{
+		value.append(sorted[c].name).push_back('\0');
+		putInt(value, sorted[c].type);
+		putInt(value, 0);
+		putInt(value, 1);
+		putInt(value, 1);
+	}
+	value.push_back('\0');
+	putAttribute(header, "channels", "chlist", value);
+
+	putAttribute(header, "compression", "compression", std::string(1, '\0'));
+
+	value.clear();
+	putInt(value, 0);
+	putInt(value, 0);
+	putInt(value, (int)width - 1);
+	putInt(value, (int)height - 1);
+	putAttribute(header, "dataWindow", "box2i", value);
+	putAttribute(header, "displayWindow", "box2i", value);
+
+	putAttribute(header, "lineOrder", "lineOrder", std::string(1, '\0'));
+
+	value.clear();
+	putFloat(value, 1.0f);
+	putAttribute(header, "pixelAspectRatio", "float", value);
+
+	value.clear();
+	putFloat(value, 0.0f);
+	putFloat(value, 0.0f);
+	putAttribute(header, "screenWindowCenter", "v2f", value);
+
+	value.clear();
+	putFloat(value, 1.0f);
+	putAttribute(header, "screenWindowWidth", "float", value);
+	header.push_back('\0');
+
+	// Offset table, one uncompressed line per block
+	size_t lineBytes = 4 * width * sorted.size();
+	size_t blockBytes = 8 + lineBytes;
+	unsigned long long offset = header.size() + 8 * height;
+	for (size_t y = 0; y < height; y++, offset += blockBytes)
+	{
+		for (int i = 0; i < 8; i++)
+			header.push_back((char)(offset >> (8 * i)));
+	}
+
+	FILE* pFile = fopen(filename, "wb");
+	if (pFile == NULL)
+		return false;
+	bool success = fwrite(header.data(), 1, header.size(), pFile) == header.size();
+
+	std::string block;
+	block.reserve(blockBytes);
+	for (size_t y = 0; y < height && success; y++)
+	{
+		block.clear();
+		putInt(block, (int)y);
+		putInt(block, (int)lineBytes);
+		// Values are copied as they are, EXR is little endian like the hosts we build for
+		for (size_t c = 0; c < sorted.size(); c++)
+		{
+			const char* pLine = (const char*)sorted[c].pData + y * width * sorted[c].stride;
+			for (size_t x = 0; x < width; x++)
+				block.append(pLine + x * sorted[c].stride, 4);
+		}
+		success = fwrite(block.data(), 1, block.size(), pFile) == block.size();
+	}
+
+	return fclose(pFile) == 0 && success;
+}
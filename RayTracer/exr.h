@@ -0,0 +1,31 @@
+#ifndef __EXR_H__
+#define __EXR_H__
+
+#include <cstddef>
+#include <vector>
+
+enum ExrPixelType
+{
+	kExrUint = 0,
+	kExrFloat = 2
+};
+
+// One channel of an image in memory, pixel (x, y) is the 32-bit value at
+// pData + (y * width + x) * stride bytes
+struct ExrChannel
+{
+	const char* name;
+	ExrPixelType type;
+	const void* pData;
+	size_t stride;
+
+	ExrChannel(const char* name, ExrPixelType type, const void* pData, size_t stride)
+		: name(name), type(type), pData(pData), stride(stride) { }
+};
+
+// Writes an uncompressed single part scanline OpenEXR file with any number
+// of 32-bit channels. Layer channels are named "layer.channel", e.g.
+// "albedo.R", and readers group them by the prefix.
+bool saveExr(const char* filename, size_t width, size_t height, const std::vector<ExrChannel>& channels);
+
+#endif
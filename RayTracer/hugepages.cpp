@@ -0,0 +1,144 @@
+#include "hugepages.h"
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+
+#ifdef __linux__
+#include <sys/mman.h>
+#endif
+
+static std::atomic<int> mode(HUGE_PAGES_TRANSPARENT);
+// Large allocations so far, by the pages asked for
+static std::atomic<size_t> explicitBytes(0), transparentBytes(0), smallPageBytes(0);
+
+#ifdef __linux__
+// Mappings are whole huge pages, so hugetlb ones can be unmapped
+static size_t mappedSize(size_t bytes)
+{
+	return (bytes + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+}
+#endif
+
+void setHugePageMode(HugePageMode newMode)
+{
+	mode = newMode;
+}
+
+HugePageMode getHugePageMode()
+{
+	return (HugePageMode)mode.load();
+}
+
+bool parseHugePageMode(const char* name, HugePageMode& outMode)
+{
+	if (!strcmp(name, "off"))
+		outMode = HUGE_PAGES_OFF;
+	else if (!strcmp(name, "transparent"))
+		outMode = HUGE_PAGES_TRANSPARENT;
+	else if (!strcmp(name, "explicit"))
+		outMode = HUGE_PAGES_EXPLICIT;
+	else
+		return false;
+
+	return true;
+}
+
+const char* hugePageModeName(HugePageMode hugePageMode)
+{
+	switch (hugePageMode)
+	{
+	case HUGE_PAGES_OFF:
+		return "off";
+	case HUGE_PAGES_EXPLICIT:
+		return "explicit";
+	default:
+	case HUGE_PAGES_TRANSPARENT:
+		return "transparent";
+	}
+}
+
+void* allocateLarge(size_t bytes)
+{
+	if (bytes < kMinHugePageAllocation)
+		return ::operator new(bytes);
+
+#ifdef __linux__
+	HugePageMode currentMode = getHugePageMode();
+	size_t size = mappedSize(bytes);
+	if (currentMode == HUGE_PAGES_EXPLICIT)
+	{
+		void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (p != MAP_FAILED)
+		{
+			explicitBytes += size;
+			return p;
+		}
+		// Nothing reserved, or not enough left
+	}
+
+	// Room to move the start up to a huge page boundary, the rest is
+	// unmapped again
+	void* p = mmap(NULL, size + kHugePageSize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		throw std::bad_alloc();
+	uintptr_t start = reinterpret_cast<uintptr_t>(p);
+	uintptr_t data = (start + kHugePageSize - 1) / kHugePageSize * kHugePageSize;
+	if (data > start)
+		munmap(p, data - start);
+	if (start + kHugePageSize > data)
+		munmap(reinterpret_cast<void*>(data + size), start + kHugePageSize - data);
+
+	bool huge = currentMode != HUGE_PAGES_OFF;
+	madvise(reinterpret_cast<void*>(data), size, huge ? MADV_HUGEPAGE : MADV_NOHUGEPAGE);
+	(huge ? transparentBytes : smallPageBytes) += size;
+	return reinterpret_cast<void*>(data);
+#else
+	smallPageBytes += bytes;
+	return ::operator new(bytes);
+#endif
+}
+
+void freeLarge(void* p, size_t bytes)
+{
+	if (p == NULL)
+		return;
+	if (bytes < kMinHugePageAllocation)
+	{
+		::operator delete(p);
+		return;
+	}
+
+#ifdef __linux__
+	munmap(p, mappedSize(bytes));
+#else
+	::operator delete(p);
+#endif
+}
+
+HugePageStats getHugePageStats()
+{
+	HugePageStats stats;
+	stats.explicitBytes = explicitBytes;
+	stats.transparentBytes = transparentBytes;
+	stats.smallPageBytes = smallPageBytes;
+
+#ifdef __linux__
+	FILE* pFile = fopen("/proc/self/smaps_rollup", "r");
+	if (pFile != NULL)
+	{
+		char line[256];
+		unsigned long long kilobytes;
+		while (fgets(line, sizeof(line), pFile) != NULL)
+		{
+			if (sscanf(line, "AnonHugePages: %llu kB", &kilobytes) == 1 ||
+				sscanf(line, "Private_Hugetlb: %llu kB", &kilobytes) == 1 ||
+				sscanf(line, "Shared_Hugetlb: %llu kB", &kilobytes) == 1)
+				stats.residentHugeBytes += (size_t)kilobytes * 1024;
+		}
+		fclose(pFile);
+	}
+#endif
+	return stats;
+}
@@ -0,0 +1,97 @@
+#ifndef __HUGEPAGES_H__
+#define __HUGEPAGES_H__
+
+#include <cstddef>
+#include <new>
+#include <vector>
+
+enum HugePageMode
+{
+	// Small pages only, even where the OS would use huge ones by itself
+	HUGE_PAGES_OFF = 0,
+	// Asks for transparent huge pages, which the kernel assembles when it can
+	HUGE_PAGES_TRANSPARENT = 1,
+	// Takes pages reserved in the hugetlb pool first, transparent ones when
+	// the pool is empty
+	HUGE_PAGES_EXPLICIT = 2
+};
+
+static const size_t kHugePageSize = 2 * 1024 * 1024;
+// Smaller allocations come from operator new in every mode
+static const size_t kMinHugePageAllocation = kHugePageSize / 2;
+
+// Process wide, applies to allocations made after it. The default is
+// HUGE_PAGES_TRANSPARENT.
+void setHugePageMode(HugePageMode mode);
+HugePageMode getHugePageMode();
+
+// Parses "off", "transparent" or "explicit"
+bool parseHugePageMode(const char* name, HugePageMode& outMode);
+const char* hugePageModeName(HugePageMode mode);
+
+// For big arrays read at random, BVH nodes, mesh buffers and images, where
+// 4 KiB pages make nearly every access a TLB miss. Large allocations are
+// mapped on huge page boundaries, freeLarge() needs the size they were made
+// with. Only Linux gets huge pages, elsewhere this is operator new. Throws
+// std::bad_alloc like it.
+void* allocateLarge(size_t bytes);
+void freeLarge(void* p, size_t bytes);
+
+struct HugePageStats
+{
+	// Large allocations made so far by the pages they asked for
+	size_t explicitBytes;
+	size_t transparentBytes;
+	size_t smallPageBytes;
+	// Anonymous memory the kernel actually backs with huge pages, explicit
+	// ones included, or 0 where that can't be read
+	size_t residentHugeBytes;
+
+	HugePageStats() : explicitBytes(0), transparentBytes(0), smallPageBytes(0), residentHugeBytes(0) { }
+};
+
+HugePageStats getHugePageStats();
+
+// Allocates count default constructed Ts with allocateLarge()
+template <class T>
+T* newLargeArray(size_t count)
+{
+	T* p = static_cast<T*>(allocateLarge(count * sizeof(T)));
+	for (size_t i = 0; i < count; i++)
+		new (&p[i]) T();
+	return p;
+}
+
+template <class T>
+void deleteLargeArray(T* p, size_t count)
+{
+	if (p == NULL)
+		return;
+	for (size_t i = 0; i < count; i++)
+		p[i].~T();
+	freeLarge(p, count * sizeof(T));
+}
+
+// Standard allocator over allocateLarge()
+template <class T>
+struct LargePageAllocator
+{
+	typedef T value_type;
+
+	LargePageAllocator() { }
+	template <class U>
+	LargePageAllocator(const LargePageAllocator<U>&) { }
+
+	T* allocate(size_t count) { return static_cast<T*>(allocateLarge(count * sizeof(T))); }
+	void deallocate(T* p, size_t count) { freeLarge(p, count * sizeof(T)); }
+};
+
+template <class T, class U>
+bool operator ==(const LargePageAllocator<T>&, const LargePageAllocator<U>&) { return true; }
+template <class T, class U>
+bool operator !=(const LargePageAllocator<T>&, const LargePageAllocator<U>&) { return false; }
+
+template <class T>
+using LargeVector = std::vector<T, LargePageAllocator<T> >;
+
+#endif
@@ -1,6 +1,12 @@
 #include "image.h"
+#include "exr.h"
+#include "kernels.h"
+
+#include <cstdio>
+#include <cstring>
 #include <fstream>
 #include <iostream>
+#include <vector>
 
 size_t Image::getWidth() const
 {
@@ -12,50 +18,44 @@ size_t Image::getHeight() const
 	return height;
 }
 
-Color& Image::pixelXY(size_t x, size_t y, char wrapType)
+void Image::clear()
 {
-	if (x < 0 || x >= width)
+	for (size_t i = 0; i < width * height; i++)
+		pixels[i] = Color();
+}
+
+// Wraps a coordinate into [0, size), false for WRAP_BLACK outside it
+static bool wrapCoordinate(ptrdiff_t& inOutCoordinate, size_t size, char wrapType)
+{
+	ptrdiff_t limit = (ptrdiff_t)size;
+	if (inOutCoordinate >= 0 && inOutCoordinate < limit)
+		return true;
+
+	switch (wrapType)
 	{
-		switch (wrapType)
-		{
-		case WRAP_CLAMP:
-			if (x < 0)
-				x = 0;
-			else if (x >= width)
-				x = width - 1;
-			break;
-
-		case WRAP_REPEAT:
-			x = x % width;
-			break;
-
-		default:
-		case WRAP_BLACK:
-			pixels[width * height] = Color(0.0f);
-			return pixels[width * height];
-		}
+	case WRAP_CLAMP:
+		inOutCoordinate = inOutCoordinate < 0 ? 0 : limit - 1;
+		return true;
+
+	case WRAP_REPEAT:
+		inOutCoordinate %= limit;
+		if (inOutCoordinate < 0)
+			inOutCoordinate += limit;
+		return true;
+
+	default:
+	case WRAP_BLACK:
+		return false;
 	}
+}
 
-	if (y < 0 || y >= width)
+Color& Image::pixelXY(ptrdiff_t x, ptrdiff_t y, char wrapType)
+{
+	if (!wrapCoordinate(x, width, wrapType) || !wrapCoordinate(y, height, wrapType))
 	{
-		switch (wrapType)
-		{
-		case WRAP_CLAMP:
-			if (y < 0)
-				y = 0;
-			else if (y >= height)
-				y = height - 1;
-			break;
-
-		case WRAP_REPEAT:
-			y = y % height;
-			break;
-
-		default:
-		case WRAP_BLACK:
-			pixels[width * height] = Color(0.0f);
-			return pixels[width * height];
-		}
+		static thread_local Color black;
+		black = Color(0.0f);
+		return black;
 	}
 
 	return pixels[y * width + x];
@@ -63,8 +63,8 @@ Color& Image::pixelXY(size_t x, size_t y, char wrapType)
 
 Color& Image::pixelUV(float u, float v, char wrapType)
 {
-	size_t x = (size_t)std::floor(u * (width - 1));
-	size_t y = (size_t)std::floor(v * (height - 1));
+	ptrdiff_t x = (ptrdiff_t)std::floor(u * (width - 1));
+	ptrdiff_t y = (ptrdiff_t)std::floor(v * (height - 1));
 	return pixelXY(x, y, wrapType);
 }
 
@@ -114,12 +114,14 @@ struct BitmapHeader
 
 void Image::saveToFile(const char* filename) const
 {
-	const char* extension = strchr(filename, '.');
-	
+	const char* extension = strrchr(filename, '.');
+	if (extension == NULL)
+		return;
+
 	if (!strcmp(extension, ".bmp"))
 	{
-		int padSize = 4 - ((3 * width) % 4);
-		char pad[3];
+		int padSize = (4 - ((3 * width) % 4)) % 4;
+		char pad[3] = { 0, 0, 0 };
 
 		// Write BMP
 		BitmapHeader head;
@@ -133,22 +135,86 @@ void Image::saveToFile(const char* filename) const
 		head.write(outputFile);
 
 		// Create pixel data
-		char curVals[3];
-		for (int y = height - 1; y >= 0; y--)
+		std::vector<unsigned char> row(3 * width);
+		for (int y = (int)height - 1; y >= 0; y--)
+		{
+			kernels().colorsToBgr8(&pixels[y * width].r, width, &row[0]);
+			outputFile.write((const char*)&row[0], row.size());
+			outputFile.write(pad, padSize);
+		}
+
+		outputFile.flush();
+		outputFile.close();
+	}
+	else if (!strcmp(extension, ".exr"))
+	{
+		const float* pRgb = &pixels->r;
+		std::vector<ExrChannel> channels;
+		channels.push_back(ExrChannel("R", kExrFloat, pRgb, sizeof(Color)));
+		channels.push_back(ExrChannel("G", kExrFloat, pRgb + 1, sizeof(Color)));
+		channels.push_back(ExrChannel("B", kExrFloat, pRgb + 2, sizeof(Color)));
+		saveExr(filename, width, height, channels);
+	}
+	else if (!strcmp(extension, ".pfm"))
+	{
+		// Little endian, rows stored bottom to top
+		std::ofstream outputFile(filename, std::ios::out | std::ios::binary);
+		outputFile << "PF\n" << width << " " << height << "\n-1.0\n";
+
+		for (int y = (int)height - 1; y >= 0; y--)
 		{
-			for (int x = 0; x < width; x++)
+			for (size_t x = 0; x < width; x++)
 			{
-				Color curCol = pixels[y * width + x];
-				curCol.clamp();
-				curVals[0] = static_cast<unsigned char>(curCol.b * 255.0f);
-				curVals[1] = static_cast<unsigned char>(curCol.g * 255.0f);
-				curVals[2] = static_cast<unsigned char>(curCol.r * 255.0f);
-				outputFile.write(curVals, 3);
+				const Color& curCol = pixels[y * width + x];
+				outputFile.write((const char*)&curCol.r, 4);
+				outputFile.write((const char*)&curCol.g, 4);
+				outputFile.write((const char*)&curCol.b, 4);
 			}
-			outputFile.write(pad, padSize);
 		}
 
 		outputFile.flush();
 		outputFile.close();
 	}
-}
\ No newline at end of file
+}
+
+bool Image::loadFromFile(const char* filename)
+{
+	FILE* pFile = fopen(filename, "rb");
+	if (pFile == NULL)
+		return false;
+
+	char id[3] = { 0, 0, 0 };
+	int fileWidth = 0, fileHeight = 0;
+	float scale = 0.0f;
+	if (fscanf(pFile, "%2s %d %d %f", id, &fileWidth, &fileHeight, &scale) != 4 ||
+		strcmp(id, "PF") || fileWidth <= 0 || fileHeight <= 0 || scale >= 0.0f)
+	{
+		fclose(pFile);
+		return false;
+	}
+	// Exactly one whitespace character separates the header from the data
+	fgetc(pFile);
+
+	deleteLargeArray(pixels, width * height);
+	width = fileWidth;
+	height = fileHeight;
+	pixels = newLargeArray<Color>(width * height);
+
+	bool success = true;
+	float rgb[3];
+	for (int y = (int)height - 1; y >= 0 && success; y--)
+	{
+		for (size_t x = 0; x < width; x++)
+		{
+			if (fread(rgb, sizeof(float), 3, pFile) != 3)
+			{
+				success = false;
+				break;
+			}
+			pixels[y * width + x] = Color(rgb[0], rgb[1], rgb[2]);
+		}
+	}
+
+	fclose(pFile);
+	return success;
+}
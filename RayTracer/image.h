@@ -5,6 +5,7 @@
 #define WRAP_CLAMP 1
 #define WRAP_REPEAT 2
 
+#include "hugepages.h"
 #include "maths.h"
 
 class Image
@@ -12,19 +13,34 @@ class Image
 public:
 	Image(size_t width, size_t height)
 		: width(width), height(height),
-		pixels(new Color[width * height + 1]) { }
+		pixels(newLargeArray<Color>(width * height)) { }
 
-	virtual ~Image() { delete[] pixels; }
+	virtual ~Image() { deleteLargeArray(pixels, width * height); }
 
 	size_t getWidth() const;
 	size_t getHeight() const;
 
-	Color& pixelXY(size_t x, size_t y, char wrapType = WRAP_BLACK);
+	Color* getPixels() { return pixels; }
+	const Color* getPixels() const { return pixels; }
+
+	void clear();
+
+	// Outside the image, WRAP_BLACK returns a black pixel of the calling
+	// thread's own, so writes to it are dropped and threads don't share it.
+	// For concurrent writes to pixels in the image see SplatBuffer.
+	Color& pixelXY(ptrdiff_t x, ptrdiff_t y, char wrapType = WRAP_BLACK);
 	Color& pixelUV(float u, float v, char wrapType = WRAP_BLACK);
 
+	// .bmp, .pfm or .exr by extension
 	void saveToFile(const char* filename) const;
 
+	// Only supports .pfm, resizes the image to match the file
+	bool loadFromFile(const char* filename);
+
 protected:
+	Image(const Image&);
+	Image& operator =(const Image&);
+
 	size_t width, height;
 	Color *pixels;
 };
@@ -0,0 +1,154 @@
+#include "instance.h"
+
+Instance::Instance(Shape* pPrototype, const Transform& transform)
+	: pPrototype(pPrototype),
+	nestedOwners(pPrototype->setsHitOwner()),
+	objectToWorld(1, transform),
+	worldToObject(transform.inverse())
+{
+}
+
+Instance::Instance(Shape* pPrototype, const std::vector<Transform>& objectToWorldKeyframes)
+	: pPrototype(pPrototype),
+	nestedOwners(pPrototype->setsHitOwner()),
+	objectToWorld(objectToWorldKeyframes),
+	worldToObject()
+{
+	if (objectToWorld.empty())
+		objectToWorld.push_back(Transform());
+	worldToObject = objectToWorld[0].inverse();
+}
+
+Transform Instance::worldToObjectAt(float time) const
+{
+	if (!isMoving())
+		return worldToObject;
+
+	float segment = std::min(std::max(time, 0.0f), 1.0f) * (objectToWorld.size() - 1);
+	size_t keyframe = std::min((size_t)segment, objectToWorld.size() - 2);
+	float t = segment - keyframe;
+
+	const Transform& t0 = objectToWorld[keyframe];
+	const Transform& t1 = objectToWorld[keyframe + 1];
+	Transform blended;
+	for (int row = 0; row < 3; row++)
+	{
+		for (int col = 0; col < 4; col++)
+			blended.m[row][col] = t0.m[row][col] + (t1.m[row][col] - t0.m[row][col]) * t;
+	}
+
+	return blended.inverse();
+}
+
+Ray Instance::toObjectSpace(const Ray& ray, const Transform& toObject, float& outScale) const
+{
+	Ray objectRay(ray);
+	objectRay.origin = toObject.transformPoint(ray.origin);
+	objectRay.direction = toObject.transformVector(ray.direction);
+	outScale = objectRay.direction.normalize();
+	objectRay.maxDist = ray.maxDist * outScale;
+	return objectRay;
+}
+
+bool Instance::intersect(const Ray& ray, Hit& inOutHit)
+{
+	float scale;
+	Ray objectRay = toObjectSpace(ray, worldToObjectAt(ray.time), scale);
+	Hit objectHit(inOutHit.dist * scale);
+
+	if (!pPrototype->intersect(objectRay, objectHit))
+		return false;
+
+	inOutHit = objectHit;
+	inOutHit.dist = objectHit.dist / scale;
+	inOutHit.pOwner = this;
+	return true;
+}
+
+void Instance::completeIntersection(const Hit& hit, Intersection& intersection)
+{
+	Transform toObject = worldToObjectAt(intersection.ray.time);
+	float scale;
+	Ray objectRay = toObjectSpace(intersection.ray, toObject, scale);
+	Intersection objectIsect(objectRay);
+	objectIsect.dist = intersection.dist * scale;
+
+	// Hits only keep the outermost owner. Tracing the prototype again finds
+	// the hit with the owner inside it, such as a nested instance, which then
+	// completes it with its own transform.
+	Hit objectHit;
+	if (!nestedOwners || !pPrototype->intersect(objectRay, objectHit))
+	{
+		// The owner is this instance
+		objectHit = hit;
+		objectHit.pOwner = NULL;
+	}
+	Shape* pCompleting = objectHit.pOwner != NULL ? objectHit.pOwner : objectHit.pShape;
+	pCompleting->completeIntersection(objectHit, objectIsect);
+
+	intersection.normal = toObject.transformNormalByInverse(objectIsect.normal).normalized();
+	intersection.pShape = objectIsect.pShape;
+	intersection.pMaterial = objectIsect.pMaterial;
+}
+
+bool Instance::translate(const Vector& offset)
+{
+	for (size_t i = 0; i < objectToWorld.size(); i++)
+	{
+		objectToWorld[i].m[0][3] += offset.x;
+		objectToWorld[i].m[1][3] += offset.y;
+		objectToWorld[i].m[2][3] += offset.z;
+	}
+	worldToObject = objectToWorld[0].inverse();
+	return true;
+}
+
+bool Instance::doesIntersect(const Ray& ray)
+{
+	float scale;
+	return pPrototype->doesIntersect(toObjectSpace(ray, worldToObjectAt(ray.time), scale));
+}
+
+bool Instance::getBounds(BoundingBox& outBounds) const
+{
+	BoundingBox objectBounds;
+	if (!pPrototype->getBounds(objectBounds))
+		return false;
+
+	// Interpolated transforms keep every corner between its keyframe positions
+	outBounds = BoundingBox();
+	for (size_t k = 0; k < objectToWorld.size(); k++)
+		outBounds.grow(objectToWorld[k].transformBox(objectBounds));
+	return true;
+}
+
+unsigned Instance::getKeyframeCount() const
+{
+	unsigned prototypeKeyframes = pPrototype->getKeyframeCount();
+
+	// Both moving is not linear between keyframes, only the overall bounds hold
+	if (isMoving() && prototypeKeyframes > 1)
+		return 1;
+
+	return isMoving() ? (unsigned)objectToWorld.size() : prototypeKeyframes;
+}
+
+bool Instance::getKeyframeBounds(unsigned keyframe, BoundingBox& outBounds) const
+{
+	if (getKeyframeCount() == 1)
+		return getBounds(outBounds);
+
+	BoundingBox objectBounds;
+	if (isMoving())
+	{
+		if (!pPrototype->getBounds(objectBounds))
+			return false;
+		outBounds = objectToWorld[keyframe].transformBox(objectBounds);
+		return true;
+	}
+
+	if (!pPrototype->getKeyframeBounds(keyframe, objectBounds))
+		return false;
+	outBounds = objectToWorld[0].transformBox(objectBounds);
+	return true;
+}
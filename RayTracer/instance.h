@@ -0,0 +1,61 @@
+#ifndef __INSTANCE_H__
+#define __INSTANCE_H__
+
+#include <vector>
+
+#include "shape.h"
+#include "transform.h"
+
+// A transformed reference to shared geometry. The prototype is not owned and
+// must already be prepared, so any number of instances share its BVH and only
+// pay for the transform. Lights inside prototypes are not sampled.
+class Instance : public Shape
+{
+public:
+	Instance(Shape* pPrototype, const Transform& objectToWorld);
+
+	// Keyframes are evenly spaced over ray time [0, 1], the transform is
+	// interpolated linearly between them
+	Instance(Shape* pPrototype, const std::vector<Transform>& objectToWorldKeyframes);
+
+	virtual ~Instance() { }
+
+	virtual bool intersect(const Ray& ray, Hit& inOutHit);
+	virtual bool doesIntersect(const Ray& ray);
+
+	// Completes the prototype's hit in object space and transforms the normal
+	virtual void completeIntersection(const Hit& hit, Intersection& intersection);
+
+	virtual bool setsHitOwner() const { return true; }
+
+	virtual bool getBounds(BoundingBox& outBounds) const;
+	virtual unsigned getKeyframeCount() const;
+	virtual bool getKeyframeBounds(unsigned keyframe, BoundingBox& outBounds) const;
+
+	// Moves every keyframe, the prototype stays as it is
+	virtual bool translate(const Vector& offset);
+
+	Shape* getPrototype() const { return pPrototype; }
+	const Transform& getTransform() const { return objectToWorld[0]; }
+
+protected:
+	bool isMoving() const { return objectToWorld.size() > 1; }
+
+	// For a moving instance this interpolates and inverts
+	Transform worldToObjectAt(float time) const;
+
+	// The object space ray has a unit direction, outScale converts world
+	// distances to object distances
+	Ray toObjectSpace(const Ray& ray, const Transform& toObject, float& outScale) const;
+
+	Shape* pPrototype;
+	// The prototype holds instances or lights, whose owner intersect()
+	// replaces with this one
+	bool nestedOwners;
+	std::vector<Transform> objectToWorld;
+
+	// Only kept for static instances
+	Transform worldToObject;
+};
+
+#endif
@@ -0,0 +1,86 @@
+#include "kernels.h"
+
+#include <atomic>
+#include <cstdlib>
+
+const KernelTable& getGenericKernels();
+#ifdef RAYTRACER_AVX2_KERNELS
+const KernelTable& getAvx2Kernels();
+#endif
+#ifdef RAYTRACER_AVX512_KERNELS
+const KernelTable& getAvx512Kernels();
+#endif
+
+static const KernelTable* kernelsForLevel(IsaLevel level)
+{
+	switch (level)
+	{
+#ifdef RAYTRACER_AVX512_KERNELS
+	case ISA_AVX512:
+		return &getAvx512Kernels();
+#endif
+#ifdef RAYTRACER_AVX2_KERNELS
+	case ISA_AVX2:
+		return &getAvx2Kernels();
+#endif
+	case ISA_GENERIC:
+		return &getGenericKernels();
+	default:
+		return NULL;
+	}
+}
+
+IsaLevel compiledIsaLevel()
+{
+#if defined(RAYTRACER_AVX512_KERNELS)
+	return ISA_AVX512;
+#elif defined(RAYTRACER_AVX2_KERNELS)
+	return ISA_AVX2;
+#else
+	return ISA_GENERIC;
+#endif
+}
+
+static std::atomic<const KernelTable*> pSelectedKernels(NULL);
+
+static const KernelTable* selectDefaultKernels()
+{
+	IsaLevel level = detectIsaLevel();
+	if (level > compiledIsaLevel())
+		level = compiledIsaLevel();
+
+	IsaLevel requested;
+	const char* override = getenv("RAYTRACER_ISA");
+	if (override != NULL && parseIsaLevel(override, requested) && requested < level)
+		level = requested;
+
+	// Not every level between generic and the best has to be compiled in
+	while (kernelsForLevel(level) == NULL)
+		level = (IsaLevel)(level - 1);
+	return kernelsForLevel(level);
+}
+
+const KernelTable& kernels()
+{
+	const KernelTable* pKernels = pSelectedKernels.load(std::memory_order_acquire);
+	if (pKernels == NULL)
+	{
+		// Every thread racing here picks the same table
+		pKernels = selectDefaultKernels();
+		pSelectedKernels.store(pKernels, std::memory_order_release);
+	}
+	return *pKernels;
+}
+
+bool selectKernels(IsaLevel level)
+{
+	if (level > detectIsaLevel())
+		return false;
+
+	const KernelTable* pKernels = kernelsForLevel(level);
+	if (pKernels == NULL)
+		return false;
+
+	pSelectedKernels.store(pKernels, std::memory_order_release);
+	return true;
+}
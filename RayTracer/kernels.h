@@ -0,0 +1,170 @@
+#ifndef __KERNELS_H__
+#define __KERNELS_H__
+
+#include <cstddef>
+#include <cstdint>
+
+#include "cpu.h"
+
+// Camera description for the batched primary ray kernels
+struct CameraRayParams
+{
+	float origin[3];
+	float forward[3];
+	float right[3];
+	float up[3];
+
+	// Perspective only, a lens radius of 0 is a pinhole
+	float tanFov;
+	float focalDistance;
+	float lensRadius;
+
+	float shutterOpen;
+	float shutterClose;
+};
+
+// Planes of one a-trous iteration of the denoiser (denoiser.h), all width *
+// height floats. Feature planes may be NULL to leave that feature out.
+struct DenoiseParams
+{
+	size_t width, height;
+	// Distance in pixels between the 5x5 filter taps
+	size_t step;
+
+	const float* color[3];
+	// Variance of the color's luminance
+	const float* variance;
+	const float* albedo[3];
+	const float* normal[3];
+	const float* depth;
+	// Screen space depth change per pixel
+	const float* depthGradient;
+
+	float colorSigma;
+	float depthSigma;
+	float albedoSigma;
+
+	float* outColor[3];
+	float* outVariance;
+};
+
+// Constants of a GGX lobe, see Glossy in material.h
+struct GgxParams
+{
+	float alpha2;
+	// alpha^2 / pi and alpha^2 - 1, the constant parts of D
+	float distributionScale;
+	float alpha2Minus1;
+	// Schlick's F0
+	float normalReflectance;
+};
+
+// Hot inner loops compiled once per instruction set level (kernels_*.cpp)
+// and picked at runtime. Kernels only see plain float arrays so that nothing
+// compiled with wider instructions leaks into shared inline code.
+struct KernelTable
+{
+	IsaLevel isa;
+
+	// Closest hit of one ray against count spheres in structure of arrays
+	// form. Hits must lie in (minDist, inOutDist), inOutDist is updated and
+	// the index of the sphere hit is returned, or -1 for no hit.
+	int (*intersectSpheres)(const float* centerX,
+		const float* centerY,
+		const float* centerZ,
+		const float* radius2,
+		size_t count,
+		const float origin[3],
+		const float direction[3],
+		float minDist,
+		float& inOutDist);
+
+	// True if any sphere is hit in (minDist, maxDist)
+	bool (*occludedBySpheres)(const float* centerX,
+		const float* centerY,
+		const float* centerZ,
+		const float* radius2,
+		size_t count,
+		const float origin[3],
+		const float direction[3],
+		float minDist,
+		float maxDist);
+
+	// out[i] = in[i] * scale over count floats
+	void (*scaleFloats)(const float* in, float scale, size_t count, float* out);
+
+	// Colors, four floats per pixel with the last one ignored, to 8-bit BGR
+	// clamped to [0, 1]
+	void (*colorsToBgr8)(const float* colors, size_t pixelCount, unsigned char* outBgr);
+
+	// Primary rays for count samples, screen positions as in Camera::makeRay()
+	// and the rest in [0, 1). Outputs are structure of arrays (x, y, z).
+	void (*generatePerspectiveRays)(const CameraRayParams& camera,
+		const float* xScreen,
+		const float* yScreen,
+		const float* lensU,
+		const float* lensV,
+		const float* timeU,
+		size_t count,
+		float* const outOrigin[3],
+		float* const outDirection[3],
+		float* outTime);
+
+	// Latitude-longitude rays covering the full sphere over a 2:1 image
+	void (*generateEnvironmentRays)(const CameraRayParams& camera,
+		const float* xScreen,
+		const float* yScreen,
+		const float* timeU,
+		size_t count,
+		float* const outDirection[3],
+		float* outTime);
+
+	// Array forms of fastmath.h, same results as the scalar functions
+	void (*exp2Floats)(const float* in, size_t count, float* out);
+	void (*log2Floats)(const float* in, size_t count, float* out);
+	void (*powFloats)(const float* base, const float* exponent, size_t count, float* out);
+	void (*sinCosFloats)(const float* in, size_t count, float* outSin, float* outCos);
+
+	// One uniform in [0, 1) from each of count random.h streams, the draw
+	// RandomJump(multiplier, increment) ahead of each state
+	void (*randomFloats)(const uint64_t* streamStates,
+		size_t count,
+		uint64_t multiplier,
+		uint64_t increment,
+		float* out);
+
+	// Cosine weighted directions around +z from the concentric disc, as
+	// uniformToCosineHemisphere() in sampling.h
+	void (*cosineHemisphereFloats)(const float* u1, const float* u2, size_t count, float* const outDirection[3]);
+
+	// Lambert::evaluateSA() and Glossy::evaluateSA() over count sets of
+	// directions in structure of arrays form
+	void (*evaluateLambert)(const float* const incoming[3],
+		const float* const outgoing[3],
+		const float* const normal[3],
+		size_t count,
+		float* outReflectance,
+		float* outPdf);
+	void (*evaluateGgx)(const GgxParams& params,
+		const float* const incoming[3],
+		const float* const outgoing[3],
+		const float* const normal[3],
+		size_t count,
+		float* outReflectance,
+		float* outPdf);
+
+	// One edge-avoiding a-trous iteration for pixels [x0, x1) of row y
+	void (*denoiseRow)(const DenoiseParams& params, size_t y, size_t x0, size_t x1);
+};
+
+// The kernels for the selected level, by default the best the CPU supports.
+// The RAYTRACER_ISA environment variable can lower it for comparisons.
+const KernelTable& kernels();
+
+// Switch to a specific level, fails if the CPU or the build lacks it
+bool selectKernels(IsaLevel level);
+
+// Highest level compiled into this binary
+IsaLevel compiledIsaLevel();
+
+#endif
@@ -0,0 +1,8 @@
+#define KERNEL_NAMESPACE kernelsAvx2
+#define KERNEL_ISA ISA_AVX2
+#include "kernels_impl.h"
+
+const KernelTable& getAvx2Kernels()
+{
+	return kernelsAvx2::table;
+}
@@ -0,0 +1,8 @@
+#define KERNEL_NAMESPACE kernelsAvx512
+#define KERNEL_ISA ISA_AVX512
+#include "kernels_impl.h"
+
+const KernelTable& getAvx512Kernels()
+{
+	return kernelsAvx512::table;
+}
@@ -0,0 +1,8 @@
+#define KERNEL_NAMESPACE kernelsGeneric
+#define KERNEL_ISA ISA_GENERIC
+#include "kernels_impl.h"
+
+const KernelTable& getGenericKernels()
+{
+	return kernelsGeneric::table;
+}
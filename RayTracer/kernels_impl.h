@@ -0,0 +1,614 @@
+// Included once per instruction set by kernels_*.cpp with KERNEL_NAMESPACE
+// and KERNEL_ISA defined. Everything here must stay inside the namespace and
+// avoid inline functions from shared headers, otherwise the linker may pick a
+// copy built for a wider instruction set than the CPU supports.
+
+#include <math.h>
+#include <stddef.h>
+#include <string.h>
+
+#include "fastmath.h"
+#include "kernels.h"
+#include "random.h"
+
+#ifndef KERNEL_NAMESPACE
+#error KERNEL_NAMESPACE must be defined before including kernels_impl.h
+#endif
+
+namespace KERNEL_NAMESPACE
+{
+	// Spheres are processed in blocks so the distance loop vectorizes and the
+	// closest hit search runs over a small buffer that stays in L1
+	const size_t kBlockSize = 64;
+	const float kNoHit = 3.0e38f;
+
+	static inline void sphereDistances(const float* centerX,
+		const float* centerY,
+		const float* centerZ,
+		const float* radius2,
+		size_t count,
+		const float origin[3],
+		const float direction[3],
+		float minDist,
+		float maxDist,
+		float* outDist)
+	{
+		const float ox = origin[0], oy = origin[1], oz = origin[2];
+		const float dx = direction[0], dy = direction[1], dz = direction[2];
+
+		for (size_t i = 0; i < count; i++)
+		{
+			float px = ox - centerX[i];
+			float py = oy - centerY[i];
+			float pz = oz - centerZ[i];
+
+			// Direction is normalized so a = 1 and b is halved
+			float b = px * dx + py * dy + pz * dz;
+			float c = px * px + py * py + pz * pz - radius2[i];
+			float discriminant = b * b - c;
+			float root = sqrtf(discriminant > 0.0f ? discriminant : 0.0f);
+
+			float t1 = -b - root;
+			float t2 = -b + root;
+			// Selects rather than branches so the loop stays vectorizable
+			float t = t1 > minDist ? t1 : t2;
+			t = discriminant >= 0.0f ? t : kNoHit;
+			t = t > minDist ? t : kNoHit;
+			outDist[i] = t < maxDist ? t : kNoHit;
+		}
+	}
+
+	static int intersectSpheres(const float* centerX,
+		const float* centerY,
+		const float* centerZ,
+		const float* radius2,
+		size_t count,
+		const float origin[3],
+		const float direction[3],
+		float minDist,
+		float& inOutDist)
+	{
+		float dist[kBlockSize];
+		int closest = -1;
+
+		for (size_t start = 0; start < count; start += kBlockSize)
+		{
+			size_t blockCount = count - start < kBlockSize ? count - start : kBlockSize;
+			sphereDistances(centerX + start, centerY + start, centerZ + start, radius2 + start,
+				blockCount, origin, direction, minDist, inOutDist, dist);
+
+			for (size_t i = 0; i < blockCount; i++)
+			{
+				if (dist[i] < inOutDist)
+				{
+					inOutDist = dist[i];
+					closest = (int)(start + i);
+				}
+			}
+		}
+
+		return closest;
+	}
+
+	static bool occludedBySpheres(const float* centerX,
+		const float* centerY,
+		const float* centerZ,
+		const float* radius2,
+		size_t count,
+		const float origin[3],
+		const float direction[3],
+		float minDist,
+		float maxDist)
+	{
+		float dist[kBlockSize];
+
+		for (size_t start = 0; start < count; start += kBlockSize)
+		{
+			size_t blockCount = count - start < kBlockSize ? count - start : kBlockSize;
+			sphereDistances(centerX + start, centerY + start, centerZ + start, radius2 + start,
+				blockCount, origin, direction, minDist, maxDist, dist);
+
+			float closest = kNoHit;
+			for (size_t i = 0; i < blockCount; i++)
+				closest = dist[i] < closest ? dist[i] : closest;
+			if (closest < kNoHit)
+				return true;
+		}
+
+		return false;
+	}
+
+	static void scaleFloats(const float* in, float scale, size_t count, float* out)
+	{
+		for (size_t i = 0; i < count; i++)
+			out[i] = in[i] * scale;
+	}
+
+	static void colorsToBgr8(const float* colors, size_t pixelCount, unsigned char* outBgr)
+	{
+		for (size_t i = 0; i < pixelCount; i++)
+		{
+			float r = colors[4 * i + 0];
+			float g = colors[4 * i + 1];
+			float b = colors[4 * i + 2];
+			r = r < 0.0f ? 0.0f : (r > 1.0f ? 1.0f : r);
+			g = g < 0.0f ? 0.0f : (g > 1.0f ? 1.0f : g);
+			b = b < 0.0f ? 0.0f : (b > 1.0f ? 1.0f : b);
+			outBgr[3 * i + 0] = (unsigned char)(b * 255.0f);
+			outBgr[3 * i + 1] = (unsigned char)(g * 255.0f);
+			outBgr[3 * i + 2] = (unsigned char)(r * 255.0f);
+		}
+	}
+
+	static void generatePerspectiveRays(const CameraRayParams& camera,
+		const float* xScreen,
+		const float* yScreen,
+		const float* lensU,
+		const float* lensV,
+		const float* timeU,
+		size_t count,
+		float* const outOrigin[3],
+		float* const outDirection[3],
+		float* outTime)
+	{
+		const float fx = camera.forward[0], fy = camera.forward[1], fz = camera.forward[2];
+		const float rx = camera.right[0], ry = camera.right[1], rz = camera.right[2];
+		const float ux = camera.up[0], uy = camera.up[1], uz = camera.up[2];
+		const float tanFov = camera.tanFov;
+		const float lensRadius = camera.lensRadius;
+
+		// With a pinhole any positive focal distance gives the same direction
+		const float focalDistance = lensRadius > 0.0f ? camera.focalDistance : 1.0f;
+		const float originX = camera.origin[0], originY = camera.origin[1], originZ = camera.origin[2];
+		const float shutterOpen = camera.shutterOpen;
+		const float shutterLength = camera.shutterClose - camera.shutterOpen;
+
+		// Rays are built into local blocks and copied out, otherwise the
+		// seven output streams need more runtime alias checks than the
+		// vectorizer is willing to emit
+		float block[7][kBlockSize];
+
+		for (size_t start = 0; start < count; start += kBlockSize)
+		{
+			size_t blockCount = count - start < kBlockSize ? count - start : kBlockSize;
+
+			for (size_t j = 0; j < blockCount; j++)
+			{
+				size_t i = start + j;
+				float a = (xScreen[i] - 0.5f) * tanFov;
+				float b = (yScreen[i] - 0.5f) * tanFov;
+
+				// Point in focus, relative to the camera origin
+				float px = (fx + rx * a + ux * b) * focalDistance;
+				float py = (fy + ry * a + uy * b) * focalDistance;
+				float pz = (fz + rz * a + uz * b) * focalDistance;
+
+				// Uniform point on the lens
+				float sinTheta, cosTheta;
+				fastSinCos(6.28318531f * lensV[i], sinTheta, cosTheta);
+				float radius = sqrtf(lensU[i]) * lensRadius;
+				float lx = radius * cosTheta;
+				float ly = radius * sinTheta;
+				float ox = rx * lx + ux * ly;
+				float oy = ry * lx + uy * ly;
+				float oz = rz * lx + uz * ly;
+
+				float dx = px - ox;
+				float dy = py - oy;
+				float dz = pz - oz;
+				float invLength = 1.0f / sqrtf(dx * dx + dy * dy + dz * dz);
+
+				block[0][j] = originX + ox;
+				block[1][j] = originY + oy;
+				block[2][j] = originZ + oz;
+				block[3][j] = dx * invLength;
+				block[4][j] = dy * invLength;
+				block[5][j] = dz * invLength;
+				block[6][j] = shutterOpen + shutterLength * timeU[i];
+			}
+
+			size_t bytes = blockCount * sizeof(float);
+			memcpy(outOrigin[0] + start, block[0], bytes);
+			memcpy(outOrigin[1] + start, block[1], bytes);
+			memcpy(outOrigin[2] + start, block[2], bytes);
+			memcpy(outDirection[0] + start, block[3], bytes);
+			memcpy(outDirection[1] + start, block[4], bytes);
+			memcpy(outDirection[2] + start, block[5], bytes);
+			memcpy(outTime + start, block[6], bytes);
+		}
+	}
+
+	static void generateEnvironmentRays(const CameraRayParams& camera,
+		const float* xScreen,
+		const float* yScreen,
+		const float* timeU,
+		size_t count,
+		float* const outDirection[3],
+		float* outTime)
+	{
+		const float fx = camera.forward[0], fy = camera.forward[1], fz = camera.forward[2];
+		const float rx = camera.right[0], ry = camera.right[1], rz = camera.right[2];
+		const float ux = camera.up[0], uy = camera.up[1], uz = camera.up[2];
+		const float shutterOpen = camera.shutterOpen;
+		const float shutterLength = camera.shutterClose - camera.shutterOpen;
+		float block[4][kBlockSize];
+
+		for (size_t start = 0; start < count; start += kBlockSize)
+		{
+			size_t blockCount = count - start < kBlockSize ? count - start : kBlockSize;
+
+			for (size_t j = 0; j < blockCount; j++)
+			{
+				size_t i = start + j;
+
+				// y spans [0.25, 0.75] on a 2:1 image, so both map through 2 pi
+				float sinLongitude, cosLongitude, sinLatitude, cosLatitude;
+				fastSinCos(6.28318531f * (xScreen[i] - 0.5f), sinLongitude, cosLongitude);
+				fastSinCos(6.28318531f * (yScreen[i] - 0.5f), sinLatitude, cosLatitude);
+
+				float f = cosLatitude * cosLongitude;
+				float r = cosLatitude * sinLongitude;
+				block[0][j] = fx * f + rx * r + ux * sinLatitude;
+				block[1][j] = fy * f + ry * r + uy * sinLatitude;
+				block[2][j] = fz * f + rz * r + uz * sinLatitude;
+				block[3][j] = shutterOpen + shutterLength * timeU[i];
+			}
+
+			size_t bytes = blockCount * sizeof(float);
+			memcpy(outDirection[0] + start, block[0], bytes);
+			memcpy(outDirection[1] + start, block[1], bytes);
+			memcpy(outDirection[2] + start, block[2], bytes);
+			memcpy(outTime + start, block[3], bytes);
+		}
+	}
+
+	static void exp2Floats(const float* in, size_t count, float* out)
+	{
+		for (size_t i = 0; i < count; i++)
+			out[i] = fastExp2(in[i]);
+	}
+
+	static void log2Floats(const float* in, size_t count, float* out)
+	{
+		for (size_t i = 0; i < count; i++)
+			out[i] = fastLog2(in[i]);
+	}
+
+	static void powFloats(const float* base, const float* exponent, size_t count, float* out)
+	{
+		for (size_t i = 0; i < count; i++)
+			out[i] = fastPow(base[i], exponent[i]);
+	}
+
+	static void sinCosFloats(const float* in, size_t count, float* outSin, float* outCos)
+	{
+		for (size_t i = 0; i < count; i++)
+			fastSinCos(in[i], outSin[i], outCos[i]);
+	}
+
+	static void randomFloats(const uint64_t* streamStates,
+		size_t count,
+		uint64_t multiplier,
+		uint64_t increment,
+		float* out)
+	{
+		for (size_t i = 0; i < count; i++)
+			out[i] = randomToFloat(randomOutput(streamStates[i] * multiplier + increment));
+	}
+
+	// Shirley and Chiu's mapping folded into two cases, r changes sign
+	// instead of theta adding multiples of pi/2 for the other quadrants
+	static void cosineHemisphereFloats(const float* u1, const float* u2, size_t count, float* const outDirection[3])
+	{
+		const float kQuarterPi = 0.785398163f;
+		for (size_t i = 0; i < count; i++)
+		{
+			float sx = 2.0f * u1[i] - 1.0f;
+			float sy = 2.0f * u2[i] - 1.0f;
+			bool useX = fabsf(sx) > fabsf(sy);
+			float r = useX ? sx : sy;
+			// The origin lands here with sy = 0
+			float ratio = useX ? sy / sx : sx / (sy != 0.0f ? sy : 1.0f);
+			float theta = useX ? kQuarterPi * ratio : 2.0f * kQuarterPi - kQuarterPi * ratio;
+
+			float sinTheta, cosTheta;
+			fastSinCos(theta, sinTheta, cosTheta);
+			float dx = r * cosTheta;
+			float dy = r * sinTheta;
+			float z2 = 1.0f - dx * dx - dy * dy;
+			outDirection[0][i] = dx;
+			outDirection[1][i] = dy;
+			outDirection[2][i] = sqrtf(z2 > 0.0f ? z2 : 0.0f);
+		}
+	}
+
+	static void evaluateLambert(const float* const incoming[3],
+		const float* const outgoing[3],
+		const float* const normal[3],
+		size_t count,
+		float* outReflectance,
+		float* outPdf)
+	{
+		const float kInvPi = 0.318309886f;
+		for (size_t i = 0; i < count; i++)
+		{
+			float nDotI = normal[0][i] * incoming[0][i] + normal[1][i] * incoming[1][i] + normal[2][i] * incoming[2][i];
+			float nDotO = normal[0][i] * outgoing[0][i] + normal[1][i] * outgoing[1][i] + normal[2][i] * outgoing[2][i];
+			// Incoming points at the surface, so it must be on the other side
+			bool sameSide = (nDotI > 0.0f && nDotO > 0.0f) || (nDotI < 0.0f && nDotO < 0.0f);
+			outReflectance[i] = sameSide ? 0.0f : kInvPi;
+			outPdf[i] = sameSide ? 0.0f : fabsf(nDotI) * kInvPi;
+		}
+	}
+
+	static inline float ggxLambda(float alpha2, float cosTheta)
+	{
+		float cos2 = cosTheta * cosTheta;
+		float sin2 = 1.0f - cos2 > 0.0f ? 1.0f - cos2 : 0.0f;
+		return 0.5f * (sqrtf(1.0f + alpha2 * sin2 / cos2) - 1.0f);
+	}
+
+	// Computes every lane and zeroes those below either horizon at the end,
+	// their infinities and NaNs never reach the outputs
+	static void evaluateGgx(const GgxParams& params,
+		const float* const incoming[3],
+		const float* const outgoing[3],
+		const float* const normal[3],
+		size_t count,
+		float* outReflectance,
+		float* outPdf)
+	{
+		for (size_t i = 0; i < count; i++)
+		{
+			float ox = outgoing[0][i], oy = outgoing[1][i], oz = outgoing[2][i];
+			// The direction light leaves towards
+			float rx = -incoming[0][i], ry = -incoming[1][i], rz = -incoming[2][i];
+			float nx = normal[0][i], ny = normal[1][i], nz = normal[2][i];
+
+			float nDotO = nx * ox + ny * oy + nz * oz;
+			float facing = nDotO < 0.0f ? -1.0f : 1.0f;
+			float cosOutgoing = facing * nDotO;
+			float cosReflected = facing * (nx * rx + ny * ry + nz * rz);
+
+			float hx = ox + rx, hy = oy + ry, hz = oz + rz;
+			float length2 = hx * hx + hy * hy + hz * hz;
+			float invLength = 1.0f / sqrtf(length2 > 0.0f ? length2 : 1.0f);
+			float cosHalf = facing * (nx * hx + ny * hy + nz * hz) * invLength;
+			float outgoingDotHalf = (ox * hx + oy * hy + oz * hz) * invLength;
+
+			float denominator = cosHalf * cosHalf * params.alpha2Minus1 + 1.0f;
+			float d = params.distributionScale / (denominator * denominator);
+			float lambdaOutgoing = ggxLambda(params.alpha2, cosOutgoing);
+			float shadowing = 1.0f / (1.0f + lambdaOutgoing + ggxLambda(params.alpha2, cosReflected));
+			float x = 1.0f - outgoingDotHalf > 0.0f ? 1.0f - outgoingDotHalf : 0.0f;
+			float x2 = x * x;
+			float fresnel = params.normalReflectance + (1.0f - params.normalReflectance) * x2 * x2 * x;
+
+			bool valid = cosOutgoing > 0.0f && cosReflected > 0.0f;
+			float pdf = d / ((1.0f + lambdaOutgoing) * 4.0f * cosOutgoing);
+			float reflectance = fresnel * d * shadowing / (4.0f * cosOutgoing * cosReflected);
+			outPdf[i] = valid ? pdf : 0.0f;
+			outReflectance[i] = valid ? reflectance : 0.0f;
+		}
+	}
+
+	// Denoiser taps, the B3 spline [1/16, 1/4, 3/8, 1/4, 1/16] by distance
+	const float kAtrousKernel[3] = { 0.375f, 0.25f, 0.0625f };
+	const float kLog2e = 1.44269504f;
+
+	// Block positions [outBegin, outEnd) whose pixel start + i + offset lies
+	// in [0, width), so every tap loop runs without bounds checks
+	static inline void tapRange(size_t start, size_t count, ptrdiff_t offset, size_t width,
+		size_t& outBegin, size_t& outEnd)
+	{
+		ptrdiff_t first = -((ptrdiff_t)start + offset);
+		ptrdiff_t last = (ptrdiff_t)width - ((ptrdiff_t)start + offset);
+		outEnd = last < (ptrdiff_t)count ? (last > 0 ? (size_t)last : 0) : count;
+		outBegin = first > 0 ? (size_t)first : 0;
+		outBegin = outBegin < outEnd ? outBegin : outEnd;
+	}
+
+	static void denoiseBlock(const DenoiseParams& params, size_t y, size_t start, size_t count)
+	{
+		const size_t width = params.width;
+		const ptrdiff_t height = (ptrdiff_t)params.height;
+		const size_t center = y * width + start;
+		const float* const r = params.color[0];
+		const float* const g = params.color[1];
+		const float* const b = params.color[2];
+		const float* const variance = params.variance;
+
+		float lum[kBlockSize];
+		float lumScale[kBlockSize];
+		float depthScale[kBlockSize];
+		float exponent[kBlockSize];
+		float weight[kBlockSize];
+		float sumR[kBlockSize], sumG[kBlockSize], sumB[kBlockSize];
+		float sumWeight[kBlockSize], sumVariance[kBlockSize];
+
+		// Luminance differences are measured in standard deviations, taken
+		// from a 3x3 blur of the variance as single pixel estimates are noisy.
+		// A pixel's own variance wins when it is lower, so the noise of
+		// emitter edges doesn't spread to the quiet gradients next to them.
+		for (size_t i = 0; i < count; i++)
+		{
+			sumVariance[i] = 0.0f;
+			sumWeight[i] = 0.0f;
+		}
+		for (ptrdiff_t dy = -1; dy <= 1; dy++)
+		{
+			ptrdiff_t qy = (ptrdiff_t)y + dy;
+			if (qy < 0 || qy >= height)
+				continue;
+			for (ptrdiff_t dx = -1; dx <= 1; dx++)
+			{
+				float h = (dx == 0 ? 0.5f : 0.25f) * (dy == 0 ? 0.5f : 0.25f);
+				size_t begin, end;
+				tapRange(start, count, dx, width, begin, end);
+				size_t base = qy * width + start + dx;
+				for (size_t i = begin; i < end; i++)
+				{
+					sumVariance[i] += h * variance[base + i];
+					sumWeight[i] += h;
+				}
+			}
+		}
+
+		const float depthSigma = params.depthSigma;
+		const float colorSigma = params.colorSigma;
+		for (size_t i = 0; i < count; i++)
+		{
+			size_t p = center + i;
+			lum[i] = 0.2126f * r[p] + 0.7152f * g[p] + 0.0722f * b[p];
+			float pixelVariance = variance[p];
+			float blurredVariance = sumVariance[i] / sumWeight[i];
+			float sigma = sqrtf(pixelVariance < blurredVariance ? pixelVariance : blurredVariance);
+			lumScale[i] = kLog2e / (colorSigma * sigma + 1.0e-4f);
+		}
+		if (params.depth != NULL)
+		{
+			for (size_t i = 0; i < count; i++)
+				depthScale[i] = kLog2e / (depthSigma * params.depthGradient[center + i] + 1.0e-6f);
+		}
+
+		// The centre tap always has full weight
+		const float centerWeight = kAtrousKernel[0] * kAtrousKernel[0];
+		for (size_t i = 0; i < count; i++)
+		{
+			size_t p = center + i;
+			sumR[i] = centerWeight * r[p];
+			sumG[i] = centerWeight * g[p];
+			sumB[i] = centerWeight * b[p];
+			sumWeight[i] = centerWeight;
+			sumVariance[i] = centerWeight * centerWeight * variance[p];
+		}
+
+		const float albedoScale = kLog2e / (params.albedoSigma * params.albedoSigma);
+		for (ptrdiff_t dy = -2; dy <= 2; dy++)
+		{
+			ptrdiff_t qy = (ptrdiff_t)y + dy * (ptrdiff_t)params.step;
+			if (qy < 0 || qy >= height)
+				continue;
+			for (ptrdiff_t dx = -2; dx <= 2; dx++)
+			{
+				if (dx == 0 && dy == 0)
+					continue;
+
+				ptrdiff_t offset = dx * (ptrdiff_t)params.step;
+				size_t begin, end;
+				tapRange(start, count, offset, width, begin, end);
+				if (begin == end)
+					continue;
+
+				// Wraps for negative offsets, base + i is in range for every i used
+				size_t base = qy * width + start + offset;
+				float h = kAtrousKernel[dx < 0 ? -dx : dx] * kAtrousKernel[dy < 0 ? -dy : dy];
+
+				for (size_t i = begin; i < end; i++)
+				{
+					size_t q = base + i;
+					float qLum = 0.2126f * r[q] + 0.7152f * g[q] + 0.0722f * b[q];
+					exponent[i] = fabsf(lum[i] - qLum) * lumScale[i];
+				}
+
+				// Depth may change by the local gradient times the tap distance
+				if (params.depth != NULL)
+				{
+					const float* const depth = params.depth;
+					float invDistance = 1.0f / (params.step * sqrtf((float)(dx * dx + dy * dy)));
+					for (size_t i = begin; i < end; i++)
+						exponent[i] += fabsf(depth[center + i] - depth[base + i]) * depthScale[i] * invDistance;
+				}
+
+				if (params.albedo[0] != NULL)
+				{
+					const float* const ar = params.albedo[0];
+					const float* const ag = params.albedo[1];
+					const float* const ab = params.albedo[2];
+					for (size_t i = begin; i < end; i++)
+					{
+						size_t p = center + i;
+						size_t q = base + i;
+						float distance2 = (ar[p] - ar[q]) * (ar[p] - ar[q]) +
+							(ag[p] - ag[q]) * (ag[p] - ag[q]) + (ab[p] - ab[q]) * (ab[p] - ab[q]);
+						exponent[i] += distance2 * albedoScale;
+					}
+				}
+
+				for (size_t i = begin; i < end; i++)
+					weight[i] = h * fastExp2(-exponent[i]);
+
+				// max(0, n.n')^128 by repeated squaring
+				if (params.normal[0] != NULL)
+				{
+					const float* const nx = params.normal[0];
+					const float* const ny = params.normal[1];
+					const float* const nz = params.normal[2];
+					for (size_t i = begin; i < end; i++)
+					{
+						size_t p = center + i;
+						size_t q = base + i;
+						float d = nx[p] * nx[q] + ny[p] * ny[q] + nz[p] * nz[q];
+						d = d > 0.0f ? d : 0.0f;
+						d *= d;
+						d *= d;
+						d *= d;
+						d *= d;
+						d *= d;
+						d *= d;
+						d *= d;
+						weight[i] *= d;
+					}
+				}
+
+				for (size_t i = begin; i < end; i++)
+				{
+					size_t q = base + i;
+					float w = weight[i];
+					sumR[i] += w * r[q];
+					sumG[i] += w * g[q];
+					sumB[i] += w * b[q];
+					sumWeight[i] += w;
+					sumVariance[i] += w * w * variance[q];
+				}
+			}
+		}
+
+		// Variance of a weighted mean of independent pixels
+		for (size_t i = 0; i < count; i++)
+		{
+			size_t p = center + i;
+			float invWeight = 1.0f / sumWeight[i];
+			params.outColor[0][p] = sumR[i] * invWeight;
+			params.outColor[1][p] = sumG[i] * invWeight;
+			params.outColor[2][p] = sumB[i] * invWeight;
+			params.outVariance[p] = sumVariance[i] * invWeight * invWeight;
+		}
+	}
+
+	static void denoiseRow(const DenoiseParams& params, size_t y, size_t x0, size_t x1)
+	{
+		for (size_t start = x0; start < x1; start += kBlockSize)
+			denoiseBlock(params, y, start, x1 - start < kBlockSize ? x1 - start : kBlockSize);
+	}
+
+	static const KernelTable table =
+	{
+		KERNEL_ISA,
+		intersectSpheres,
+		occludedBySpheres,
+		scaleFloats,
+		colorsToBgr8,
+		generatePerspectiveRays,
+		generateEnvironmentRays,
+		exp2Floats,
+		log2Floats,
+		powFloats,
+		sinCosFloats,
+		randomFloats,
+		cosineHemisphereFloats,
+		evaluateLambert,
+		evaluateGgx,
+		denoiseRow
+	};
+}
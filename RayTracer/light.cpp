@@ -15,71 +15,68 @@ Color Light::emitted() const
 	return color * power;
 }
 
-bool RectangleLight::intersect(Intersection& intersection)
+void RectangleLight::prepare(unsigned threadCount)
 {
-	Vector normal = cross(side1, side2).normalized();
-	float nDotD = dot(normal, intersection.ray.direction);
-	if (nDotD == 0.0f)
-		return false;
+	normal = cross(side1, side2);
+	float area = normal.normalize();
+	invArea = area > 0.0f ? 1.0f / area : 0.0f;
+
+	side1Dir = side1;
+	side2Dir = side2;
+	side1Length = side1Dir.normalize();
+	side2Length = side2Dir.normalize();
+}
 
-	float t = dot(origin - intersection.ray.origin, normal) / nDotD;
+float RectangleLight::hitDistance(const Ray& ray, float maxDist, bool& outHit) const
+{
+	// Plane distance, then a slab test in the rectangle's own coordinates.
+	// A parallel ray gives inf or NaN which fails every comparison.
+	Vector toOrigin = ray.origin - origin;
+	float t = -dot(toOrigin, normal) / dot(ray.direction, normal);
+	float u = dot(toOrigin, side1Dir) + t * dot(ray.direction, side1Dir);
+	float v = dot(toOrigin, side2Dir) + t * dot(ray.direction, side2Dir);
+
+	outHit = (t < maxDist) & (t >= kRayMinDist) &
+		(u >= 0.0f) & (u <= side1Length) &
+		(v >= 0.0f) & (v <= side2Length);
+	return t;
+}
 
-	if (t >= intersection.dist || t < kRayMinDist)
+bool RectangleLight::intersect(const Ray& ray, Hit& inOutHit)
+{
+	bool hit;
+	float t = hitDistance(ray, inOutHit.dist, hit);
+	if (!hit)
 		return false;
 
-	Vector side1Norm = side1;
-	Vector side2Norm = side2;
-	float side1Length = side1Norm.normalize();
-	float side2Length = side2Norm.normalize();
-
-	Point worldPoint = intersection.ray.calc(t);
-	Point relativePoint = worldPoint - origin;
-	Point localPoint = Point(dot(relativePoint, side1Norm),
-		dot(relativePoint, side2Norm),
-		0.0f);
+	inOutHit.dist = t;
+	inOutHit.pShape = this;
+	inOutHit.pOwner = NULL;
 
-	if (localPoint.x < 0.0f || localPoint.x > side1Length ||
-		localPoint.y < 0.0f || localPoint.y > side2Length)
-		return false;
+	return true;
+}
 
-	intersection.dist = t;
+void RectangleLight::completeIntersection(const Hit& hit, Intersection& intersection)
+{
 	intersection.pShape = this;
 	intersection.pMaterial = &material;
-	intersection.normal = normal;
-
-	if (dot(intersection.normal, intersection.ray.direction) > 0.0f)
-		intersection.normal *= -1.0f;
-
-	return true;
+	intersection.normal = dot(normal, intersection.ray.direction) > 0.0f ? -normal : normal;
 }
 
 bool RectangleLight::doesIntersect(const Ray& ray)
 {
-	Vector normal = cross(side1, side2).normalized();
-	float nDotD = dot(normal, ray.direction);
-	if (nDotD == 0.0f)
-		return false;
-
-	float t = dot(origin - ray.origin, normal) / nDotD;
-
-	if (t >= ray.maxDist || t < kRayMinDist)
-		return false;
-
-	Vector side1Norm = side1;
-	Vector side2Norm = side2;
-	float side1Length = side1Norm.normalize();
-	float side2Length = side2Norm.normalize();
-
-	Point worldPoint = ray.calc(t);
-	Point relativePoint = worldPoint - origin;
-	Point localPoint = Point(dot(relativePoint, side1Norm),
-		dot(relativePoint, side2Norm),
-		0.0f);
-
-	if (localPoint.x < 0.0f || localPoint.x > side1Length ||
-		localPoint.y < 0.0f || localPoint.y > side2Length)
-		return false;
+	bool hit;
+	hitDistance(ray, ray.maxDist, hit);
+	return hit;
+}
 
+bool RectangleLight::getBounds(BoundingBox& outBounds) const
+{
+	outBounds = BoundingBox();
+	outBounds.grow(origin);
+	outBounds.grow(origin + side1);
+	outBounds.grow(origin + side2);
+	outBounds.grow(origin + side1 + side2);
 	return true;
 }
 
@@ -93,12 +90,9 @@ bool RectangleLight::sampleSurface(const Point& surfPosition,
 	outPosition = origin + side1 * u1 + side2 * u2;
 	Vector outgoing = surfPosition - outPosition;
 	float dist = outgoing.normalize();
-	outNormal = cross(side1, side2);
-	float area = outNormal.normalize();
-
-	if (dot(outNormal, outgoing) < 0.0f)
-		outNormal *= -1.0f;
-	outPdf = squared(dist) / (area * std::fabs(dot(outNormal, outgoing)));
+	float cosine = dot(normal, outgoing);
+	outNormal = cosine < 0.0f ? -normal : normal;
+	outPdf = squared(dist) * invArea / std::fabs(cosine);
 
 	// Really big PDFs will cause issues later, remove them now
 	if (outPdf > 1.0e10f)
@@ -114,7 +108,7 @@ float RectangleLight::intersectPdf(const Intersection& isect)
 {
 	if (isect.pShape == this)
 	{
-		float pdf = squared(isect.dist) / (std::fabs(dot(isect.normal, -isect.ray.direction)) * cross(side1, side2).length());
+		float pdf = squared(isect.dist) * invArea / std::fabs(dot(isect.normal, isect.ray.direction));
 
 		// Really big PDFs will cause issues later, remove them now
 		if (pdf > 1.0e10f)
@@ -125,18 +119,24 @@ float RectangleLight::intersectPdf(const Intersection& isect)
 	return 0.0f;
 }
 
-bool ShapeLight::intersect(Intersection& intersection)
+bool ShapeLight::intersect(const Ray& ray, Hit& inOutHit)
 {
-	if (pShape->intersect(intersection))
+	if (pShape->intersect(ray, inOutHit))
 	{
-		intersection.pMaterial = &material;
-		intersection.pShape = this;
+		inOutHit.pOwner = this;
 		return true;
 	}
 
 	return false;
 }
 
+void ShapeLight::completeIntersection(const Hit& hit, Intersection& intersection)
+{
+	hit.pShape->completeIntersection(hit, intersection);
+	intersection.pMaterial = &material;
+	intersection.pShape = this;
+}
+
 bool ShapeLight::doesIntersect(const Ray& ray)
 {
 	return pShape->doesIntersect(ray);
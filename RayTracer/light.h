@@ -15,6 +15,9 @@ public:
 
 	virtual Color emitted() const;
 
+	// Radiance arriving along toLight from a point sampled on this light
+	virtual Color radiance(const Vector& toLight) const { return emitted(); }
+
 	virtual float intersectPdf(const Intersection& isect) = 0;
 
 protected:
@@ -31,12 +34,23 @@ public:
 		const Vector& side2,
 		const Color& color,
 		float power)
-		: Light(color, power), origin(pos), side1(side1), side2(side2) { }
+		: Light(color, power), origin(pos), side1(side1), side2(side2)
+	{
+		prepare();
+	}
 
 	virtual ~RectangleLight() { }
 
-	virtual bool intersect(Intersection& intersection);
+	virtual bool intersect(const Ray& ray, Hit& inOutHit);
 	virtual bool doesIntersect(const Ray& ray);
+	virtual void completeIntersection(const Hit& hit, Intersection& intersection);
+
+	// Derives everything the hot paths need from the corner and sides
+	virtual void prepare(unsigned threadCount = 1);
+
+	virtual bool getBounds(BoundingBox& outBounds) const;
+
+	virtual bool translate(const Vector& offset) { origin += offset; return true; }
 
 	virtual bool sampleSurface(const Point& surfPosition,
 		const Vector& surfNormal,
@@ -48,8 +62,17 @@ public:
 	virtual float intersectPdf(const Intersection& isect);
 
 protected:
+	// Distance along the ray and whether it hits inside the rectangle
+	inline float hitDistance(const Ray& ray, float maxDist, bool& outHit) const;
+
 	Point origin;
 	Vector side1, side2;
+
+	// Set by prepare()
+	Vector normal;
+	Vector side1Dir, side2Dir;
+	float side1Length, side2Length;
+	float invArea;
 };
 
 class ShapeLight : public Light
@@ -65,9 +88,17 @@ public:
 		delete pShape;
 	}
 
-	virtual bool intersect(Intersection& intersection);
+	virtual bool intersect(const Ray& ray, Hit& inOutHit);
 	virtual bool doesIntersect(const Ray& ray);
 
+	// Completes the wrapped shape's hit as a hit on the light
+	virtual void completeIntersection(const Hit& hit, Intersection& intersection);
+
+	virtual void prepare(unsigned threadCount = 1) { pShape->prepare(threadCount); }
+	virtual bool getBounds(BoundingBox& outBounds) const { return pShape->getBounds(outBounds); }
+	virtual bool translate(const Vector& offset) { return pShape->translate(offset); }
+	virtual bool setsHitOwner() const { return true; }
+
 	virtual bool sampleSurface(const Point& surfPosition,
 		const Point& surfNormal,
 		float u1, float u2, float u3,
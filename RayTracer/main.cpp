@@ -1,6 +1,309 @@
 #include "maths.h"
+#include "benchmark.h"
+#include "denoiser.h"
+#include "distributed.h"
+#include "numa.h"
+#include "pagedmesh.h"
+#include "renderer.h"
+#include "sceneloader.h"
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+static void printUsage()
+{
+	printf("usage: RayTracer render <scene file> <output .bmp/.pfm/.exr> [options]\n"
+		"  --width W --height H\n"
+		"  --spp N             samples per pixel\n"
+		"  --depth N           maximum path depth\n"
+		"  --min-depth N       depth where Russian roulette starts\n"
+		"  --split F           splitting factor, 1 = roulette only\n"
+		"  --threads N         0 = all hardware threads\n"
+		"  --aovs LIST         albedo,normal,depth,id,variance or all, saved as layers of an .exr output\n"
+		"  --denoise           filter the image guided by the albedo, normal, depth and variance AOVs\n"
+		"  --spectral          trace four wavelengths per path instead of RGB\n"
+		"  --tile-size N       tile edge in pixels\n"
+		"  --ray-order ORDER   path (default), wavefront (a tile's paths a bounce at a time) or\n"
+		"                      sorted (also sort every bounce's rays by direction and origin)\n"
+		"  --numa MODE         off, pin (threads and image tiles per NUMA node) or replicate (also\n"
+		"                      a copy of the scene per node)\n"
+		"  --numa-nodes N      split every node in N, to try --numa on a single node machine\n"
+		"  --page-geometry FILE  keep mesh triangles in clusters in FILE, read back on demand\n"
+		"  --geometry-memory M   MiB of clusters kept in memory with --page-geometry (default 64)\n"
+		"       RayTracer coordinator <scene file> <output .bmp/.pfm/.exr> --listen ADDRESS [options]\n"
+		"  render options except --aovs, --denoise, --spectral, --ray-order, --numa and\n"
+		"  --page-geometry, and\n"
+		"  --workers N         start N local worker processes\n"
+		"  --lease-passes N    passes per tile lease, 0 = all of them\n"
+		"  --lease-timeout S   seconds before a silent worker's tiles are leased again\n"
+		"       RayTracer worker ADDRESS [--threads N]\n"
+		"  ADDRESS is unix:<path> or <host>:<port>\n"
+		"       RayTracer bench [options]\n");
+}
+
+// Parses the options shared by render and coordinator, pDistributed = NULL
+// rejects the coordinator ones and otherwise --aovs, --denoise and
+// --spectral are rejected, as workers only send back RGB beauty tiles, and
+// the ray order, NUMA and paging options, which workers don't take
+static bool parseRenderOptions(int argc, char* argv[], int first,
+	RenderSettings& outSettings, unsigned& outSamplesPerPixel, bool& outDenoise, NumaMode& outNumaMode,
+	unsigned& outNumaNodes, const char*& outGeometryFile, size_t& outGeometryMegabytes,
+	DistributedSettings* pDistributed)
+{
+	outDenoise = false;
+	outNumaMode = NUMA_OFF;
+	outNumaNodes = 1;
+	outGeometryFile = NULL;
+	outGeometryMegabytes = 64;
+	for (int i = first; i < argc; i++)
+	{
+		const char* arg = argv[i];
+		if (pDistributed == NULL && !strcmp(arg, "--denoise"))
+		{
+			outDenoise = true;
+			continue;
+		}
+		if (pDistributed == NULL && !strcmp(arg, "--spectral"))
+		{
+			outSettings.spectral = true;
+			continue;
+		}
+
+		if (i + 1 >= argc)
+			return false;
+		const char* value = argv[++i];
+		if (!strcmp(arg, "--width"))
+			outSettings.width = strtoul(value, NULL, 10);
+		else if (!strcmp(arg, "--height"))
+			outSettings.height = strtoul(value, NULL, 10);
+		else if (!strcmp(arg, "--spp"))
+			outSamplesPerPixel = (unsigned)strtoul(value, NULL, 10);
+		else if (!strcmp(arg, "--depth"))
+			outSettings.maxDepth = (unsigned)strtoul(value, NULL, 10);
+		else if (!strcmp(arg, "--min-depth"))
+			outSettings.minDepth = (unsigned)strtoul(value, NULL, 10);
+		else if (!strcmp(arg, "--split"))
+			outSettings.splitFactor = (float)atof(value);
+		else if (!strcmp(arg, "--threads"))
+			outSettings.threadCount = (unsigned)strtoul(value, NULL, 10);
+		else if (!strcmp(arg, "--tile-size"))
+			outSettings.tileSize = strtoul(value, NULL, 10);
+		else if (pDistributed == NULL && !strcmp(arg, "--ray-order"))
+		{
+			if (!parseRayOrder(value, outSettings.rayOrder))
+				return false;
+		}
+		else if (pDistributed == NULL && !strcmp(arg, "--aovs"))
+		{
+			if (!AovBuffers::parseFlags(value, outSettings.aovFlags))
+				return false;
+		}
+		else if (pDistributed == NULL && !strcmp(arg, "--numa"))
+		{
+			if (!parseNumaMode(value, outNumaMode))
+				return false;
+		}
+		else if (pDistributed == NULL && !strcmp(arg, "--numa-nodes"))
+			outNumaNodes = (unsigned)strtoul(value, NULL, 10);
+		else if (pDistributed == NULL && !strcmp(arg, "--page-geometry"))
+			outGeometryFile = value;
+		else if (pDistributed == NULL && !strcmp(arg, "--geometry-memory"))
+			outGeometryMegabytes = strtoul(value, NULL, 10);
+		else if (pDistributed != NULL && !strcmp(arg, "--listen"))
+			pDistributed->address = value;
+		else if (pDistributed != NULL && !strcmp(arg, "--workers"))
+			pDistributed->spawnCount = (unsigned)strtoul(value, NULL, 10);
+		else if (pDistributed != NULL && !strcmp(arg, "--lease-passes"))
+			pDistributed->passesPerLease = (unsigned)strtoul(value, NULL, 10);
+		else if (pDistributed != NULL && !strcmp(arg, "--lease-timeout"))
+			pDistributed->leaseTimeout = strtod(value, NULL);
+		else
+			return false;
+	}
+	return outSettings.tileSize > 0;
+}
+
+static int runRender(int argc, char* argv[])
+{
+	if (argc < 3)
+	{
+		printUsage();
+		return 1;
+	}
+
+	const char* sceneFile = argv[1];
+	const char* outputFile = argv[2];
+	RenderSettings settings;
+	unsigned samplesPerPixel = 64;
+	bool denoise = false;
+	NumaMode numaMode;
+	unsigned numaNodes;
+	const char* geometryFile;
+	size_t geometryMegabytes;
+
+	if (!parseRenderOptions(argc, argv, 3, settings, samplesPerPixel, denoise, numaMode, numaNodes, geometryFile,
+		geometryMegabytes, NULL))
+	{
+		printUsage();
+		return 1;
+	}
+
+	const char* extension = strrchr(outputFile, '.');
+	if (settings.aovFlags != 0 && (extension == NULL || strcmp(extension, ".exr")))
+	{
+		fprintf(stderr, "%s: AOVs need an .exr output\n", outputFile);
+		return 1;
+	}
+
+	NumaTopology numaTopology = detectNumaTopology().split(numaNodes);
+	if (numaMode != NUMA_OFF)
+	{
+		setNumaPlacement(&numaTopology);
+		printf("numa: %s over %u nodes\n", numaModeName(numaMode), numaTopology.getNodeCount());
+	}
+
+	GeometryCache geometryCache;
+	if (geometryFile != NULL && !geometryCache.open(geometryFile, geometryMegabytes * 1024 * 1024))
+		return 1;
+	GeometryCache* pGeometryCache = geometryCache.isOpen() ? &geometryCache : NULL;
+
+	std::chrono::steady_clock::time_point loadStart = std::chrono::steady_clock::now();
+	Scene scene;
+	SceneReplicas replicas;
+	if (numaMode == NUMA_REPLICATE)
+	{
+		if (!replicas.build(scene, settings.threadCount, [&](Scene& nodeScene, unsigned threadCount)
+			{
+				if (!loadScene(sceneFile, nodeScene, threadCount, pGeometryCache) || nodeScene.getCamera() == NULL)
+					return false;
+				nodeScene.prepare(threadCount);
+				return true;
+			}))
+		{
+			fprintf(stderr, "%s: could not load, or no camera\n", sceneFile);
+			return 1;
+		}
+		std::chrono::duration<double> loadTime = std::chrono::steady_clock::now() - loadStart;
+		printf("loaded and prepared %s %u times in %.3f s\n", sceneFile, (unsigned)replicas.getScenes().size(), loadTime.count());
+	}
+	else
+	{
+		if (!loadScene(sceneFile, scene, settings.threadCount, pGeometryCache))
+			return 1;
+		if (scene.getCamera() == NULL)
+		{
+			fprintf(stderr, "%s: no camera\n", sceneFile);
+			return 1;
+		}
+		std::chrono::duration<double> loadTime = std::chrono::steady_clock::now() - loadStart;
+		printf("loaded %s in %.3f s\n", sceneFile, loadTime.count());
+
+		std::chrono::steady_clock::time_point prepareStart = std::chrono::steady_clock::now();
+		scene.prepare(settings.threadCount);
+		std::chrono::duration<double> prepareTime = std::chrono::steady_clock::now() - prepareStart;
+		printf("prepared in %.3f s\n", prepareTime.count());
+	}
+
+	// The denoiser's features are recorded on top of any requested AOVs and
+	// saved with them
+	bool saveAovs = settings.aovFlags != 0;
+	if (denoise)
+		settings.aovFlags |= kAovAlbedo | kAovNormal | kAovDepth | kAovVariance;
+
+	Renderer renderer(scene, settings);
+	renderer.setReplicas(replicas.getScenes());
+	renderer.render(samplesPerPixel);
+	printf("rendered %u spp in %.3f s\n", renderer.getPassCount(), renderer.getStats().renderSeconds);
+	if (pGeometryCache != NULL)
+	{
+		GeometryCacheStats geometryStats = geometryCache.getStats();
+		printf("geometry cache: %llu clusters, %llu loads, %llu evictions\n",
+			(unsigned long long)geometryCache.getClusterCount(), geometryStats.loads, geometryStats.evictions);
+	}
+
+	Image image(settings.width, settings.height);
+	renderer.resolve(image);
+	AovBuffers aovs(settings.width, settings.height, settings.aovFlags);
+	renderer.resolveAovs(aovs);
+
+	if (denoise)
+	{
+		std::chrono::steady_clock::time_point denoiseStart = std::chrono::steady_clock::now();
+		DenoiseSettings denoiseSettings;
+		denoiseSettings.threadCount = settings.threadCount;
+		Denoiser denoiser(settings.width, settings.height);
+		denoiser.denoise(image, aovs, denoiseSettings, image);
+		std::chrono::duration<double> denoiseTime = std::chrono::steady_clock::now() - denoiseStart;
+		printf("denoised in %.3f s\n", denoiseTime.count());
+	}
+
+	if (!saveAovs)
+	{
+		image.saveToFile(outputFile);
+		return 0;
+	}
+
+	if (!aovs.saveToFile(outputFile, image))
+	{
+		fprintf(stderr, "%s: could not write\n", outputFile);
+		return 1;
+	}
+	return 0;
+}
+
+static int runCoordinatorCommand(const char* programPath, int argc, char* argv[])
+{
+	RenderSettings settings;
+	unsigned samplesPerPixel = 64;
+	DistributedSettings distributed;
+	bool denoise = false;
+	NumaMode numaMode;
+	unsigned numaNodes;
+	const char* geometryFile;
+	size_t geometryMegabytes;
+	if (argc < 3 ||
+		!parseRenderOptions(argc, argv, 3, settings, samplesPerPixel, denoise, numaMode, numaNodes, geometryFile,
+			geometryMegabytes, &distributed) ||
+		distributed.address == NULL)
+	{
+		printUsage();
+		return 1;
+	}
+
+	Image image(settings.width, settings.height);
+	if (!runCoordinator(programPath, argv[1], settings, samplesPerPixel, distributed, image))
+		return 1;
+	image.saveToFile(argv[2]);
+	return 0;
+}
+
+static int runWorkerCommand(int argc, char* argv[])
+{
+	unsigned threadCount = 0;
+	if (argc == 4 && !strcmp(argv[2], "--threads"))
+		threadCount = (unsigned)strtoul(argv[3], NULL, 10);
+	else if (argc != 2)
+	{
+		printUsage();
+		return 1;
+	}
+
+	return runWorker(argv[1], threadCount) ? 0 : 1;
+}
 
 int main(int argc, char* argv[])
 {
+	if (argc > 1 && !strcmp(argv[1], "render"))
+		return runRender(argc - 1, argv + 1);
+	if (argc > 1 && !strcmp(argv[1], "coordinator"))
+		return runCoordinatorCommand(argv[0], argc - 1, argv + 1);
+	if (argc > 1 && !strcmp(argv[1], "worker"))
+		return runWorkerCommand(argc - 1, argv + 1);
+	if (argc > 1 && !strcmp(argv[1], "bench"))
+		return runBenchmark(argc - 1, argv + 1);
+
+	printUsage();
 	return 0;
-}
\ No newline at end of file
+}
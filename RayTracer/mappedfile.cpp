@@ -0,0 +1,101 @@
+#include "mappedfile.h"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+bool MappedFile::open(const char* filename)
+{
+	close();
+
+#ifdef _WIN32
+	HANDLE file = CreateFileA(filename, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE)
+		return false;
+
+	LARGE_INTEGER fileSize;
+	if (!GetFileSizeEx(file, &fileSize))
+	{
+		CloseHandle(file);
+		return false;
+	}
+
+	handle = file;
+	size = (size_t)fileSize.QuadPart;
+	if (size == 0)
+		return true;
+
+	HANDLE fileMapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if (fileMapping == NULL)
+	{
+		close();
+		return false;
+	}
+	mapping = fileMapping;
+
+	pData = (const char*)MapViewOfFile(fileMapping, FILE_MAP_READ, 0, 0, 0);
+	if (pData == NULL)
+	{
+		close();
+		return false;
+	}
+#else
+	int fd = ::open(filename, O_RDONLY);
+	if (fd < 0)
+		return false;
+
+	struct stat info;
+	if (fstat(fd, &info) != 0)
+	{
+		::close(fd);
+		return false;
+	}
+
+	size = (size_t)info.st_size;
+	if (size > 0)
+	{
+		void* pMapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (pMapped == MAP_FAILED)
+		{
+			::close(fd);
+			size = 0;
+			return false;
+		}
+
+		// Parsing threads touch the whole file front to back
+		madvise(pMapped, size, MADV_WILLNEED);
+		pData = (const char*)pMapped;
+	}
+
+	// The mapping stays valid after the descriptor is closed
+	::close(fd);
+#endif
+
+	return true;
+}
+
+void MappedFile::close()
+{
+#ifdef _WIN32
+	if (pData != NULL)
+		UnmapViewOfFile(pData);
+	if (mapping != NULL)
+		CloseHandle((HANDLE)mapping);
+	if (handle != NULL)
+		CloseHandle((HANDLE)handle);
+#else
+	if (pData != NULL)
+		munmap((void*)pData, size);
+#endif
+
+	pData = NULL;
+	size = 0;
+	handle = NULL;
+	mapping = NULL;
+}
@@ -0,0 +1,32 @@
+#ifndef __MAPPEDFILE_H__
+#define __MAPPEDFILE_H__
+
+#include <cstddef>
+
+// Read-only memory mapping of a whole file
+class MappedFile
+{
+public:
+	MappedFile() : pData(NULL), size(0), handle(NULL), mapping(NULL) { }
+
+	virtual ~MappedFile() { close(); }
+
+	bool open(const char* filename);
+	void close();
+
+	const char* getData() const { return pData; }
+	size_t getSize() const { return size; }
+
+protected:
+	MappedFile(const MappedFile&);
+	MappedFile& operator =(const MappedFile&);
+
+	const char* pData;
+	size_t size;
+
+	// Platform handles, unused on POSIX
+	void* handle;
+	void* mapping;
+};
+
+#endif
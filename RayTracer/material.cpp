@@ -1,7 +1,44 @@
 #include "material.h"
 
+#include "fastmath.h"
+#include "kernels.h"
 #include "sampling.h"
 
+void Brdf::evaluateSABatch(const float* const incoming[3],
+	const float* const outgoing[3],
+	const float* const normal[3],
+	size_t count,
+	float* outReflectance,
+	float* outPdf) const
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		outReflectance[i] = evaluateSA(Vector(incoming[0][i], incoming[1][i], incoming[2][i]),
+			Vector(outgoing[0][i], outgoing[1][i], outgoing[2][i]), Vector(normal[0][i], normal[1][i], normal[2][i]),
+			outPdf[i]);
+	}
+}
+
+void Brdf::samplePSABatch(const float* const outgoing[3],
+	const float* const normal[3],
+	const float* u1,
+	const float* u2,
+	size_t count,
+	float* const outIncoming[3],
+	float* outReflectance,
+	float* outPdf) const
+{
+	for (size_t i = 0; i < count; i++)
+	{
+		Vector incoming;
+		outReflectance[i] = samplePSA(incoming, Vector(outgoing[0][i], outgoing[1][i], outgoing[2][i]),
+			Vector(normal[0][i], normal[1][i], normal[2][i]), u1[i], u2[i], outPdf[i]);
+		outIncoming[0][i] = incoming.x;
+		outIncoming[1][i] = incoming.y;
+		outIncoming[2][i] = incoming.z;
+	}
+}
+
 float Lambert::evaluateSA(const Vector& incoming, const Vector& outgoing, const Vector& normal, float& outPdf) const
 {
 	float nDotI = dot(incoming, normal);
@@ -88,149 +125,195 @@ float Lambert::pdfPSA(const Vector& incoming, const Vector& outgoing, const Vect
 	return 1.0f / M_PI;
 }
 
-float Glossy::schlickFresnel(float reflectionIncidentToNormal, float cosTheta) const
+void Lambert::evaluateSABatch(const float* const incoming[3],
+	const float* const outgoing[3],
+	const float* const normal[3],
+	size_t count,
+	float* outReflectance,
+	float* outPdf) const
 {
-	return reflectionIncidentToNormal +
-		(1.0f - reflectionIncidentToNormal) *
-		std::pow(std::max(1.0f - cosTheta, 0.0f), 5);
+	kernels().evaluateLambert(incoming, outgoing, normal, count, outReflectance, outPdf);
 }
 
-float Glossy::evaluateSA(const Vector& incoming, const Vector& outgoing, const Vector& normal, float& outPdf) const
+void Lambert::samplePSABatch(const float* const outgoing[3],
+	const float* const normal[3],
+	const float* u1,
+	const float* u2,
+	size_t count,
+	float* const outIncoming[3],
+	float* outReflectance,
+	float* outPdf) const
 {
-	float nDotI = dot(incoming, normal);
-	float nDotO = dot(incoming, normal);
-	if ((nDotI > 0.0f && nDotO > 0.0f) ||
-		(nDotI < 0.0f && nDotO < 0.0f))
+	// Warped around +z in place, then turned to each normal as samplePSA()
+	// does
+	kernels().cosineHemisphereFloats(u1, u2, count, outIncoming);
+	for (size_t i = 0; i < count; i++)
 	{
-		outPdf = 0.0f;
-		return 0.0f;
+		Vector localIncoming(-outIncoming[0][i], -outIncoming[1][i], -outIncoming[2][i]);
+		Vector surfaceNormal(normal[0][i], normal[1][i], normal[2][i]);
+		Vector x, y, z;
+		makeCoordinateSpace(surfaceNormal, x, y, z);
+		Vector incoming = transformFromLocalSpace(localIncoming, x, y, z);
+
+		if (dot(Vector(outgoing[0][i], outgoing[1][i], outgoing[2][i]), surfaceNormal) < 0.0f)
+			incoming *= -1.0f;
+
+		outIncoming[0][i] = incoming.x;
+		outIncoming[1][i] = incoming.y;
+		outIncoming[2][i] = incoming.z;
+		outReflectance[i] = 1.0f / M_PI;
+		outPdf[i] = 1.0f / M_PI;
 	}
-
-	Vector half;
-	if (dot(outgoing, incoming) > 0.999f)
-		half = normal;
-	else
-		half = (outgoing - incoming).normalized();
-
-	float fresnel = 1.0f;
-
-	float d = (exponent + 1.0f) * std::pow(std::fabs(dot(normal, half)), exponent) / (2.0f * M_PI);
-	float result = fresnel * d / (4.0f * std::fabs(nDotO - nDotI - nDotO * -nDotI));
-	outPdf = d / (4.0f * std::fabs(dot(outgoing, half)));
-	return result;
 }
 
-float Glossy::evaluatePSA(const Vector& incoming, const Vector& outgoing, const Vector& normal, float& outPdf) const
+Glossy::Glossy(float roughness, float normalReflectance)
+	: Brdf(),
+	alpha(std::max(roughness, 1.0e-3f)),
+	alpha2(squared(alpha)),
+	distributionScale(alpha2 / (float)M_PI),
+	alpha2Minus1(alpha2 - 1.0f),
+	normalReflectance(normalReflectance)
 {
-	float nDotI = dot(incoming, normal);
-	float nDotO = dot(incoming, normal);
-	if ((nDotI > 0.0f && nDotO > 0.0f) ||
-		(nDotI < 0.0f && nDotO < 0.0f))
+	// Mean of the sample weights over a stratified grid of visible normals,
+	// finer in the disc radius to resolve the long tail of GGX that ends
+	// below the horizon
+	const unsigned radiusStrata = 64, angleStrata = 8;
+	Vector normal(0.0f, 0.0f, 1.0f);
+	for (unsigned i = 0; i < kGlossyAlbedoTableSize; i++)
 	{
-		outPdf = 0.0f;
-		return 0.0f;
+		float cosOutgoing = (i + 0.5f) / kGlossyAlbedoTableSize;
+		Vector outgoing(std::sqrt(1.0f - squared(cosOutgoing)), 0.0f, cosOutgoing);
+		float sum = 0.0f;
+		for (unsigned j = 0; j < radiusStrata * angleStrata; j++)
+		{
+			Vector incoming;
+			float pdf = 0.0f;
+			float reflectance = sampleSA(incoming, outgoing, normal,
+				(j % radiusStrata + 0.5f) / radiusStrata, (j / radiusStrata + 0.5f) / angleStrata, pdf);
+			if (pdf > 0.0f)
+				sum += reflectance * std::fabs(dot(incoming, normal)) / pdf;
+		}
+		albedoTable[i] = sum / (radiusStrata * angleStrata);
 	}
+}
 
-	Vector half;
-	if (dot(outgoing, incoming) > 0.999f)
-		half = normal;
-	else
-		half = (outgoing - incoming).normalized();
-
-	float fresnel = 1.0f;
+float Glossy::schlickFresnel(float cosTheta) const
+{
+	float x = std::max(1.0f - cosTheta, 0.0f);
+	float x2 = x * x;
+	return normalReflectance +
+		(1.0f - normalReflectance) * x2 * x2 * x;
+}
 
-	float d = (exponent + 1.0f) * std::pow(std::fabs(dot(normal, half)), exponent) / (2.0f * M_PI);
-	float result = fresnel * d / (4.0f * std::fabs(nDotO - nDotI - nDotO * -nDotI));
-	outPdf = d / (4.0f * std::fabs(dot(outgoing, half))) * std::fabs(nDotI);
-	return result;
+float Glossy::directionalAlbedo(float cosOutgoing) const
+{
+	float position = std::fabs(cosOutgoing) * kGlossyAlbedoTableSize - 0.5f;
+	position = std::min(std::max(position, 0.0f), (float)(kGlossyAlbedoTableSize - 1));
+	unsigned i = std::min((unsigned)position, kGlossyAlbedoTableSize - 2);
+	float t = position - i;
+	return albedoTable[i] * (1.0f - t) + albedoTable[i + 1] * t;
 }
 
-float Glossy::sampleSA(Vector& outIncoming, const Vector& outgoing, const Vector& normal, float u1, float u2, float& outPdf) const
+float Glossy::distribution(float cosHalf) const
 {
-	float phi = 2.0f * M_PI * u1;
-	float cosTheta = std::pow(1.0f - u2, 1.0f / (exponent + 1.0f));
-	float sin2Theta = std::max(0.0f, 1.0f - squared(cosTheta));
-	float sinTheta = std::sqrt(sin2Theta);
-	Vector localHalf(sinTheta * std::cos(phi),
-		sinTheta * std::sin(phi),
-		cosTheta);
+	return distributionScale / squared(squared(cosHalf) * alpha2Minus1 + 1.0f);
+}
 
-	Vector x, y, z;
-	makeCoordinateSpace(normal, x, y, z);
-	Vector half = transformFromLocalSpace(localHalf, x, y, z);
+float Glossy::lambda(float cosTheta) const
+{
+	float cos2 = squared(cosTheta);
+	return 0.5f * (std::sqrt(1.0f + alpha2 * std::max(1.0f - cos2, 0.0f) / cos2) - 1.0f);
+}
 
-	if (dot(outgoing, normal) < 0.0f)
-		half *= -1.0f;
+// reflected is the direction light leaves towards, the opposite of incoming,
+// and normal faces outgoing
+float Glossy::evaluateLocal(const Vector& outgoing, const Vector& reflected, const Vector& normal, float& outPdf) const
+{
+	float cosOutgoing = dot(outgoing, normal);
+	float cosReflected = dot(reflected, normal);
+	if (cosOutgoing <= 0.0f || cosReflected <= 0.0f)
+	{
+		outPdf = 0.0f;
+		return 0.0f;
+	}
 
-	outIncoming = outgoing - half * (2.0f * dot(outgoing, half));
+	Vector half = (outgoing + reflected).normalized();
+	float d = distribution(dot(half, normal));
+	float lambdaOutgoing = lambda(cosOutgoing);
+	float shadowing = 1.0f / (1.0f + lambdaOutgoing + lambda(cosReflected));
+	float fresnel = schlickFresnel(dot(outgoing, half));
 
-	return evaluateSA(outIncoming, outgoing, normal, outPdf);
+	// Visible normal density, G1 * D * (o.h) / cos(o), over the Jacobian of
+	// the reflection 4 (o.h)
+	outPdf = d / ((1.0f + lambdaOutgoing) * 4.0f * cosOutgoing);
+	return fresnel * d * shadowing / (4.0f * cosOutgoing * cosReflected);
 }
 
-float Glossy::samplePSA(Vector& outIncoming, const Vector& outgoing, const Vector& normal, float u1, float u2, float& outPdf) const
+float Glossy::evaluateSA(const Vector& incoming, const Vector& outgoing, const Vector& normal, float& outPdf) const
 {
-	float phi = 2.0f * M_PI * u1;
-	float cosTheta = std::pow(1.0f - u2, 1.0f / (exponent + 1.0f));
-	float sin2Theta = std::max(0.0f, 1.0f - squared(cosTheta));
-	float sinTheta = std::sqrt(sin2Theta);
-	Vector localHalf(sinTheta * std::cos(phi),
-		sinTheta * std::sin(phi),
-		cosTheta);
+	Vector facing = dot(outgoing, normal) < 0.0f ? -normal : normal;
+	return evaluateLocal(outgoing, -incoming, facing, outPdf);
+}
 
+float Glossy::sampleSA(Vector& outIncoming, const Vector& outgoing, const Vector& normal, float u1, float u2, float& outPdf) const
+{
+	Vector facing = dot(outgoing, normal) < 0.0f ? -normal : normal;
 	Vector x, y, z;
-	makeCoordinateSpace(normal, x, y, z);
-	Vector half = transformFromLocalSpace(localHalf, x, y, z);
+	makeCoordinateSpace(facing, x, y, z);
+	Vector localOutgoing = transformToLocalSpace(outgoing, x, y, z);
+
+	// Stretch to the hemisphere configuration, sample the projected area of
+	// its visible half and unstretch the normal
+	Vector stretched = Vector(alpha * localOutgoing.x, alpha * localOutgoing.y, localOutgoing.z).normalized();
+	float lengthSquared = squared(stretched.x) + squared(stretched.y);
+	Vector t1 = lengthSquared > 0.0f ?
+		Vector(-stretched.y, stretched.x, 0.0f) / std::sqrt(lengthSquared) :
+		Vector(1.0f, 0.0f, 0.0f);
+	Vector t2 = cross(stretched, t1);
+
+	float discX, discY;
+	uniformToUniformDisc(u1, u2, discX, discY);
+	float blend = 0.5f * (1.0f + stretched.z);
+	discY = (1.0f - blend) * std::sqrt(std::max(1.0f - squared(discX), 0.0f)) + blend * discY;
+	Vector hemisphereNormal = t1 * discX + t2 * discY +
+		stretched * std::sqrt(std::max(1.0f - squared(discX) - squared(discY), 0.0f));
+	Vector localHalf = Vector(alpha * hemisphereNormal.x, alpha * hemisphereNormal.y,
+		std::max(hemisphereNormal.z, 0.0f)).normalized();
 
-	if (dot(outgoing, normal) < 0.0f)
-		half *= -1.0f;
-
-	outIncoming = outgoing - half * (2.0f * dot(outgoing, half));
+	Vector half = transformFromLocalSpace(localHalf, x, y, z);
+	Vector reflected = half * (2.0f * dot(outgoing, half)) - outgoing;
+	outIncoming = -reflected;
 
-	return evaluatePSA(outIncoming, outgoing, normal, outPdf);
+	return evaluateLocal(outgoing, reflected, facing, outPdf);
 }
 
 float Glossy::pdfSA(const Vector& incoming, const Vector& outgoing, const Vector& normal) const
 {
-	float nDotI = dot(incoming, normal);
-	float nDotO = dot(outgoing, normal);
-	if ((nDotI > 0.0f && nDotO > 0.0f) ||
-		(nDotI < 0.0f && nDotO < 0.0f))
-	{
-		return 0.0f;
-	}
-
-	Vector half;
-	if (dot(outgoing, incoming) > 0.999f)
-		half = normal;
-	else
-		half = (outgoing - incoming).normalized();
-
-	return (exponent + 1.0f) * std::pow(std::fabs(dot(normal, half)), exponent) / (8.0f * M_PI * std::fabs(dot(outgoing, half)));
+	float pdf = 0.0f;
+	evaluateSA(incoming, outgoing, normal, pdf);
+	return pdf;
 }
 
-float Glossy::pdfPSA(const Vector& incoming, const Vector& outgoing, const Vector& normal) const
+void Glossy::evaluateSABatch(const float* const incoming[3],
+	const float* const outgoing[3],
+	const float* const normal[3],
+	size_t count,
+	float* outReflectance,
+	float* outPdf) const
 {
-	float nDotI = dot(incoming, normal);
-	float nDotO = dot(outgoing, normal);
-	if ((nDotI > 0.0f && nDotO > 0.0f) ||
-		(nDotI < 0.0f && nDotO < 0.0f))
-	{
-		return 0.0f;
-	}
-
-	Vector half;
-	if (dot(outgoing, incoming) > 0.999f)
-		half = normal;
-	else
-		half = (outgoing - incoming).normalized();
-
-	return (exponent + 1.0f) * std::pow(std::fabs(dot(normal, half)), exponent) / (8.0f * M_PI * std::fabs(dot(outgoing, half))) * std::fabs(nDotI);
+	GgxParams params;
+	params.alpha2 = alpha2;
+	params.distributionScale = distributionScale;
+	params.alpha2Minus1 = alpha2Minus1;
+	params.normalReflectance = normalReflectance;
+	kernels().evaluateGgx(params, incoming, outgoing, normal, count, outReflectance, outPdf);
 }
 
 Color DiffuseMaterial::evaluate(
 	const Point& position,
 	const Vector& normal,
 	const Vector& outgoingRayDirection,
+	float lobeU,
 	Brdf*& pBrdfChosen,
 	float& brdfWeight)
 {
@@ -243,6 +326,7 @@ Color GlossyMaterial::evaluate(
 	const Point& position,
 	const Vector& normal,
 	const Vector& outgoingRayDirection,
+	float lobeU,
 	Brdf*& pBrdfChosen,
 	float& brdfWeight)
 {
@@ -251,10 +335,42 @@ Color GlossyMaterial::evaluate(
 	return color;
 }
 
+Color LayeredMaterial::evaluate(
+	const Point& position,
+	const Vector& normal,
+	const Vector& outgoingRayDirection,
+	float lobeU,
+	Brdf*& pBrdfChosen,
+	float& brdfWeight)
+{
+	float coatAlbedo = glossy.directionalAlbedo(dot(outgoingRayDirection, normal));
+	Color baseColor = diffuseColor * (1.0f - coatAlbedo);
+	float coatWeight = specularColor.luminance() * coatAlbedo;
+	float baseWeight = baseColor.luminance();
+	if (!(coatWeight + baseWeight > 0.0f))
+	{
+		brdfWeight = 1.0f;
+		pBrdfChosen = NULL;
+		return Color();
+	}
+
+	float coatProbability = coatWeight / (coatWeight + baseWeight);
+	if (lobeU < coatProbability)
+	{
+		brdfWeight = 1.0f / coatProbability;
+		pBrdfChosen = &glossy;
+		return specularColor;
+	}
+	brdfWeight = 1.0f / (1.0f - coatProbability);
+	pBrdfChosen = &lambert;
+	return baseColor;
+}
+
 Color Emitter::evaluate(
 	const Point& position,
 	const Vector& normal,
 	const Vector& outgoingRayDirection,
+	float lobeU,
 	Brdf*& pBrdfChosen,
 	float& brdfWeight)
 {
@@ -37,6 +37,26 @@ public:
 	}
 
 	virtual bool isDiracDistribution() const { return false; }
+
+	// evaluateSA() over count sets of directions in structure of arrays
+	// form. Lambert and Glossy run the selected kernels, others loop.
+	virtual void evaluateSABatch(const float* const incoming[3],
+		const float* const outgoing[3],
+		const float* const normal[3],
+		size_t count,
+		float* outReflectance,
+		float* outPdf) const;
+
+	// samplePSA() the same way, with a pair of uniforms per sample. Lambert
+	// warps them with the selected kernel, others loop.
+	virtual void samplePSABatch(const float* const outgoing[3],
+		const float* const normal[3],
+		const float* u1,
+		const float* u2,
+		size_t count,
+		float* const outIncoming[3],
+		float* outReflectance,
+		float* outPdf) const;
 };
 
 class Lambert : public Brdf
@@ -54,41 +74,87 @@ public:
 
 	virtual float pdfSA(const Vector& incoming, const Vector& outgoing, const Vector& normal) const;
 	virtual float pdfPSA(const Vector& incoming, const Vector& outgoing, const Vector& normal) const;
+
+	virtual void evaluateSABatch(const float* const incoming[3],
+		const float* const outgoing[3],
+		const float* const normal[3],
+		size_t count,
+		float* outReflectance,
+		float* outPdf) const;
+	virtual void samplePSABatch(const float* const outgoing[3],
+		const float* const normal[3],
+		const float* u1,
+		const float* u2,
+		size_t count,
+		float* const outIncoming[3],
+		float* outReflectance,
+		float* outPdf) const;
 };
 
+// Directional albedo table entries, evenly spaced in the cosine of the
+// outgoing angle
+static const unsigned kGlossyAlbedoTableSize = 32;
+
+// GGX microfacet reflection with height-correlated Smith shadowing and
+// Schlick's Fresnel. Directions are sampled from the normals visible from
+// outgoing (Heitz 2018), leaving a weight of F * G2 / G1 per sample.
 class Glossy : public Brdf
 {
 public:
-	Glossy(float roughness) : Brdf(), exponent(1.0f / squared(roughness)) { }
+	// roughness is the GGX alpha, normalReflectance Schlick's F0 where 1
+	// reflects everything at every angle
+	Glossy(float roughness, float normalReflectance = 1.0f);
 
 	virtual ~Glossy() { }
 
-	float schlickFresnel(float reflectionIncidentToNormal, float cosTheta) const;
+	float schlickFresnel(float cosTheta) const;
 
-	virtual float evaluateSA(const Vector& incoming, const Vector& outgoing, const Vector& normal, float& outPdf) const;
-	virtual float evaluatePSA(const Vector& incoming, const Vector& outgoing, const Vector& normal, float& outPdf) const;
+	// Fraction of the light from every direction the lobe reflects towards
+	// outgoing, interpolated from a table built at construction
+	float directionalAlbedo(float cosOutgoing) const;
 
+	virtual float evaluateSA(const Vector& incoming, const Vector& outgoing, const Vector& normal, float& outPdf) const;
 	virtual float sampleSA(Vector& outIncoming, const Vector& outgoing, const Vector& normal, float u1, float u2, float& outPdf) const;
-	virtual float samplePSA(Vector& outIncoming, const Vector& outgoing, const Vector& normal, float u1, float u2, float& outPdf) const;
-
 	virtual float pdfSA(const Vector& incoming, const Vector& outgoing, const Vector& normal) const;
-	virtual float pdfPSA(const Vector& incoming, const Vector& outgoing, const Vector& normal) const;
+
+	virtual void evaluateSABatch(const float* const incoming[3],
+		const float* const outgoing[3],
+		const float* const normal[3],
+		size_t count,
+		float* outReflectance,
+		float* outPdf) const;
+
+	float getRoughness() const { return alpha; }
 
 protected:
-	float exponent;
+	// GGX distribution and Smith Lambda, cosines relative to the normal
+	float distribution(float cosHalf) const;
+	float lambda(float cosTheta) const;
+	float evaluateLocal(const Vector& outgoing, const Vector& reflected, const Vector& normal, float& outPdf) const;
+
+	float alpha;
+	float alpha2;
+	// alpha^2 / pi and alpha^2 - 1, the constant parts of D
+	float distributionScale;
+	float alpha2Minus1;
+	float normalReflectance;
+	float albedoTable[kGlossyAlbedoTableSize];
 };
 
-
 class Material
 {
 public:
 	virtual ~Material() { }
 
 	virtual Color emittance() { return Color(); }
+	// Picks the BRDF to use at this point, lobeU in [0, 1) chooses between
+	// them for layered materials. The returned albedo and BRDF, scaled by
+	// brdfWeight, estimate the whole material.
 	virtual Color evaluate(
 		const Point& position,
 		const Vector& normal,
 		const Vector& outgoingRayDirection,
+		float lobeU,
 		Brdf*& pBrdfChosen,
 		float& brdfWeight) = 0;
 };
@@ -104,6 +170,7 @@ public:
 		const Point& position,
 		const Vector& normal,
 		const Vector& outgoingRayDirection,
+		float lobeU,
 		Brdf*& pBrdfChosen,
 		float& brdfWeight);
 
@@ -123,6 +190,7 @@ public:
 		const Point& position,
 		const Vector& normal,
 		const Vector& outgoingRayDirection,
+		float lobeU,
 		Brdf*& pBrdfChosen,
 		float& brdfWeight);
 
@@ -131,6 +199,34 @@ protected:
 	Glossy glossy;
 };
 
+// Glossy coat over a diffuse base. The coat reflects its directional albedo
+// and the base gets what is left, each point picks one of them in
+// proportion to the light it would reflect.
+class LayeredMaterial : public Material
+{
+public:
+	// normalReflectance is the coat's F0, 0.04 for most dielectrics
+	LayeredMaterial(const Color& diffuseColor, const Color& specularColor, float roughness,
+		float normalReflectance = 0.04f)
+		: diffuseColor(diffuseColor), specularColor(specularColor), lambert(), glossy(roughness, normalReflectance) { }
+
+	virtual ~LayeredMaterial() { }
+
+	virtual Color evaluate(
+		const Point& position,
+		const Vector& normal,
+		const Vector& outgoingRayDirection,
+		float lobeU,
+		Brdf*& pBrdfChosen,
+		float& brdfWeight);
+
+protected:
+	Color diffuseColor;
+	Color specularColor;
+	Lambert lambert;
+	Glossy glossy;
+};
+
 class Emitter : public Material
 {
 public:
@@ -144,6 +240,7 @@ public:
 		const Point& position,
 		const Vector& normal,
 		const Vector& outgoingRayDirection,
+		float lobeU,
 		Brdf*& pBrdfChosen,
 		float& brdfWeight);
 
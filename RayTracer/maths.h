@@ -2,6 +2,7 @@
 #define __MATHS_H__
 
 #include <algorithm>
+#include <cmath>
 
 #ifndef M_PI
 #define M_PI 3.14159265358979
@@ -10,133 +11,182 @@
 inline float squared(float n) { return n * n; }
 
 
-struct Color
-{
-	float r, g, b;
+// Colors are one SSE register wherever the target has SSE2, which every
+// x86-64 target does. FMA is only used when the whole build targets it.
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define RAYTRACER_SSE_COLOR
+#include <emmintrin.h>
+#if defined(__FMA__)
+#include <immintrin.h>
+#endif
+#endif
 
-	Color() : r(0.0f), g(0.0f), b(0.0f) {}
-	Color(const Color& c) : r(c.r), g(c.g), b(c.b) {}
-	Color(float r, float g, float b) : r(r), g(g), b(b) {}
-	explicit Color(float intensity) : r(intensity), g(intensity), b(intensity) {}
+// Red, green and blue, plus a fourth lane that pads a color to 16 bytes.
+// RGB rendering ignores whatever the fourth lane holds. Spectral rendering
+// puts the radiance at four wavelengths in the lanes instead, see
+// spectrum.h, and converts scene colors as it picks them up.
+struct alignas(16) Color
+{
+	float r, g, b, a;
+
+	Color() : r(0.0f), g(0.0f), b(0.0f), a(0.0f) {}
+	Color(float r, float g, float b) : r(r), g(g), b(b), a(0.0f) {}
+	Color(float r, float g, float b, float a) : r(r), g(g), b(b), a(a) {}
+	explicit Color(float intensity) : r(intensity), g(intensity), b(intensity), a(intensity) {}
+
+#ifdef RAYTRACER_SSE_COLOR
+	// Unaligned access, as heap arrays are only 8 byte aligned on some
+	// 32-bit targets. It costs the same when the data is aligned.
+	explicit Color(__m128 lanes) { _mm_storeu_ps(&r, lanes); }
+	inline __m128 lanes() const { return _mm_loadu_ps(&r); }
+#endif
 
 	inline void clamp(float min = 0.0f, float max = 1.0f)
 	{
 		r = std::max(std::min(r, max), min);
 		g = std::max(std::min(g, max), min);
 		b = std::max(std::min(b, max), min);
+		a = std::max(std::min(a, max), min);
 	}
 
-	inline float brightness()
+	// RGB channels only
+	inline float brightness() const
 	{
 		return r + g + b;
 	}
 
-	inline Color& operator =(const Color& c)
+	// Rec. 709 weights
+	inline float luminance() const
 	{
-		r = c.r;
-		g = c.g;
-		b = c.b;
-		return *this;
+		return 0.2126f * r + 0.7152f * g + 0.0722f * b;
 	}
 
-	inline Color& operator +=(const Color& c)
-	{
-		r += c.r;
-		g += c.g;
-		b += c.b;
-		return *this;
-	}
+	inline Color& operator +=(const Color& c);
+	inline Color& operator -=(const Color& c);
+	inline Color& operator *=(const Color& c);
+	inline Color& operator /=(const Color& c);
+	inline Color& operator *=(float f);
+	inline Color& operator /=(float f);
 
-	inline Color& operator -=(const Color& c)
-	{
-		r -= c.r;
-		g -= c.g;
-		b -= c.b;
-		return *this;
-	}
+	// this += c * f, fused where the target has FMA
+	inline Color& addProduct(const Color& c, float f);
+};
 
-	inline Color& operator *=(const Color& c)
-	{
-		r *= c.r;
-		g *= c.g;
-		b *= c.b;
-		return *this;
-	}
+#ifdef RAYTRACER_SSE_COLOR
 
-	inline Color& operator /=(const Color& c)
-	{
-		r /= c.r;
-		g /= c.g;
-		b /= c.b;
-		return *this;
-	}
+inline Color operator +(const Color& c1, const Color& c2)
+{
+	return Color(_mm_add_ps(c1.lanes(), c2.lanes()));
+}
 
-	inline Color& operator *=(float f)
-	{
-		r *= f;
-		g *= f;
-		b *= f;
-		return *this;
-	}
+inline Color operator -(const Color& c1, const Color& c2)
+{
+	return Color(_mm_sub_ps(c1.lanes(), c2.lanes()));
+}
 
-	inline Color& operator /=(float f)
-	{
-		r /= f;
-		g /= f;
-		b /= f;
-		return *this;
-	}
-};
+inline Color operator *(const Color& c1, const Color& c2)
+{
+	return Color(_mm_mul_ps(c1.lanes(), c2.lanes()));
+}
+
+inline Color operator /(const Color& c1, const Color& c2)
+{
+	return Color(_mm_div_ps(c1.lanes(), c2.lanes()));
+}
+
+inline Color operator *(const Color& c, float f)
+{
+	return Color(_mm_mul_ps(c.lanes(), _mm_set1_ps(f)));
+}
+
+inline Color operator /(const Color& c, float f)
+{
+	return Color(_mm_div_ps(c.lanes(), _mm_set1_ps(f)));
+}
+
+inline Color& Color::addProduct(const Color& c, float f)
+{
+#if defined(__FMA__)
+	*this = Color(_mm_fmadd_ps(c.lanes(), _mm_set1_ps(f), lanes()));
+#else
+	*this = Color(_mm_add_ps(_mm_mul_ps(c.lanes(), _mm_set1_ps(f)), lanes()));
+#endif
+	return *this;
+}
+
+#else
 
 inline Color operator +(const Color& c1, const Color& c2)
 {
 	return Color(c1.r + c2.r,
 		c1.g + c2.g,
-		c1.b + c2.b);
+		c1.b + c2.b,
+		c1.a + c2.a);
 }
 
 inline Color operator -(const Color& c1, const Color& c2)
 {
 	return Color(c1.r - c2.r,
 		c1.g - c2.g,
-		c1.b - c2.b);
+		c1.b - c2.b,
+		c1.a - c2.a);
 }
 
 inline Color operator *(const Color& c1, const Color& c2)
 {
 	return Color(c1.r * c2.r,
 		c1.g * c2.g,
-		c1.b * c2.b);
+		c1.b * c2.b,
+		c1.a * c2.a);
 }
 
 inline Color operator /(const Color& c1, const Color& c2)
 {
 	return Color(c1.r / c2.r,
 		c1.g / c2.g,
-		c1.b / c2.b);
+		c1.b / c2.b,
+		c1.a / c2.a);
 }
 
 inline Color operator *(const Color& c, float f)
 {
 	return Color(c.r * f,
 		c.g * f,
-		c.b * f);
-}
-
-inline Color operator *(float f, const Color& c)
-{
-	return Color(c.r * f,
-		c.g * f,
-		c.b * f);
+		c.b * f,
+		c.a * f);
 }
 
 inline Color operator /(const Color& c, float f)
 {
 	return Color(c.r / f,
 		c.g / f,
-		c.b / f);
+		c.b / f,
+		c.a / f);
+}
+
+inline Color& Color::addProduct(const Color& c, float f)
+{
+	r += c.r * f;
+	g += c.g * f;
+	b += c.b * f;
+	a += c.a * f;
+	return *this;
+}
+
+#endif
+
+inline Color operator *(float f, const Color& c)
+{
+	return c * f;
 }
 
+inline Color& Color::operator +=(const Color& c) { return *this = *this + c; }
+inline Color& Color::operator -=(const Color& c) { return *this = *this - c; }
+inline Color& Color::operator *=(const Color& c) { return *this = *this * c; }
+inline Color& Color::operator /=(const Color& c) { return *this = *this / c; }
+inline Color& Color::operator *=(float f) { return *this = *this * f; }
+inline Color& Color::operator /=(float f) { return *this = *this / f; }
+
 
 struct Vector
 {
@@ -266,6 +316,64 @@ inline Vector cross(const Vector& v1, const Vector& v2)
 
 typedef Vector Point;
 
+struct BoundingBox
+{
+	Point min, max;
+
+	// Starts empty so that the first grow() sets it
+	BoundingBox() : min(1.0e30f), max(-1.0e30f) {}
+	BoundingBox(const Point& min, const Point& max) : min(min), max(max) {}
+
+	inline bool isEmpty() const
+	{
+		return min.x > max.x || min.y > max.y || min.z > max.z;
+	}
+
+	inline void grow(const Point& p)
+	{
+		min = Point(std::min(min.x, p.x), std::min(min.y, p.y), std::min(min.z, p.z));
+		max = Point(std::max(max.x, p.x), std::max(max.y, p.y), std::max(max.z, p.z));
+	}
+
+	inline void grow(const BoundingBox& b)
+	{
+		min = Point(std::min(min.x, b.min.x), std::min(min.y, b.min.y), std::min(min.z, b.min.z));
+		max = Point(std::max(max.x, b.max.x), std::max(max.y, b.max.y), std::max(max.z, b.max.z));
+	}
+
+	inline Point center() const
+	{
+		return (min + max) * 0.5f;
+	}
+
+	inline Vector extent() const
+	{
+		return max - min;
+	}
+
+	inline float surfaceArea() const
+	{
+		if (isEmpty())
+			return 0.0f;
+		Vector e = extent();
+		return 2.0f * (e.x * e.y + e.y * e.z + e.z * e.x);
+	}
+
+	// 0, 1 or 2 for the longest axis
+	inline int longestAxis() const
+	{
+		Vector e = extent();
+		if (e.x >= e.y && e.x >= e.z)
+			return 0;
+		return e.y >= e.z ? 1 : 2;
+	}
+};
+
+inline float axisValue(const Vector& v, int axis)
+{
+	return axis == 0 ? v.x : (axis == 1 ? v.y : v.z);
+}
+
 inline void makeCoordinateSpace(const Vector& normalRef,
 	Vector& outXAxis, Vector& outYAxis, Vector& outZAxis)
 {
@@ -273,7 +381,7 @@ inline void makeCoordinateSpace(const Vector& normalRef,
 	Vector v2 = (outZAxis.x != 0.0f || outZAxis.z != 0.0f) ?
 		Vector(0.0f, 1.0f, 0.0f) :
 		Vector(1.0f, 0.0f, 0.0f);
-	outXAxis = cross(v2, outZAxis);
+	outXAxis = cross(v2, outZAxis).normalized();
 	outYAxis = cross(outZAxis, outXAxis);
 }
 
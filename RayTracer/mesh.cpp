@@ -0,0 +1,161 @@
+#include "mesh.h"
+#include "parallel.h"
+
+#include <algorithm>
+
+// Triangles per parallel task when preparing
+static const size_t kPrepareChunkSize = 65536;
+
+void TriangleMesh::addTriangle(unsigned a, unsigned b, unsigned c)
+{
+	indices.push_back(a);
+	indices.push_back(b);
+	indices.push_back(c);
+	bvh.clear();
+}
+
+bool TriangleMesh::validate() const
+{
+	for (size_t i = 0; i < indices.size(); i++)
+	{
+		if (indices[i] >= vertices.size())
+			return false;
+	}
+
+	return true;
+}
+
+void TriangleMesh::prepare(unsigned threadCount)
+{
+	size_t triangleCount = getTriangleCount();
+	size_t chunkCount = (triangleCount + kPrepareChunkSize - 1) / kPrepareChunkSize;
+	std::vector<BoundingBox> triangleBounds(triangleCount);
+	parallelFor(chunkCount, threadCount, [&](size_t chunk, unsigned)
+	{
+		size_t end = std::min((chunk + 1) * kPrepareChunkSize, triangleCount);
+		for (size_t i = chunk * kPrepareChunkSize; i < end; i++)
+		{
+			triangleBounds[i].grow(vertices[indices[3 * i + 0]]);
+			triangleBounds[i].grow(vertices[indices[3 * i + 1]]);
+			triangleBounds[i].grow(vertices[indices[3 * i + 2]]);
+		}
+	});
+
+	bvh.build(triangleBounds, 4, threadCount);
+
+	// Reorder so every leaf is a contiguous run of triangles
+	const std::vector<unsigned>& order = bvh.getPrimitiveOrder();
+	LargeVector<unsigned> sortedIndices(indices.size());
+	parallelFor(chunkCount, threadCount, [&](size_t chunk, unsigned)
+	{
+		size_t end = std::min((chunk + 1) * kPrepareChunkSize, triangleCount);
+		for (size_t i = chunk * kPrepareChunkSize; i < end; i++)
+		{
+			sortedIndices[3 * i + 0] = indices[3 * order[i] + 0];
+			sortedIndices[3 * i + 1] = indices[3 * order[i] + 1];
+			sortedIndices[3 * i + 2] = indices[3 * order[i] + 2];
+		}
+	});
+	indices.swap(sortedIndices);
+}
+
+bool TriangleMesh::getBounds(BoundingBox& outBounds) const
+{
+	if (!bvh.isEmpty())
+	{
+		outBounds = bvh.getBounds();
+		return true;
+	}
+
+	outBounds = BoundingBox();
+	for (size_t i = 0; i < indices.size(); i++)
+		outBounds.grow(vertices[indices[i]]);
+	return true;
+}
+
+bool TriangleMesh::intersect(const Ray& ray, Hit& inOutHit)
+{
+	float u, v;
+	if (bvh.isEmpty())
+	{
+		bool hit = false;
+		for (size_t i = 0; i < getTriangleCount(); i++)
+		{
+			float t = intersectTriangle(i, ray, inOutHit.dist, u, v);
+			if (t > 0.0f)
+			{
+				inOutHit.dist = t;
+				inOutHit.pShape = this;
+				inOutHit.pOwner = NULL;
+				inOutHit.primitive = (unsigned)i;
+				inOutHit.u = u;
+				inOutHit.v = v;
+				hit = true;
+			}
+		}
+		return hit;
+	}
+
+	return bvh.intersect(ray, inOutHit.dist, [&](unsigned first, unsigned count)
+	{
+		bool leafHit = false;
+		for (unsigned i = first; i < first + count; i++)
+		{
+			float t = intersectTriangle(i, ray, inOutHit.dist, u, v);
+			if (t > 0.0f)
+			{
+				inOutHit.dist = t;
+				inOutHit.pShape = this;
+				inOutHit.pOwner = NULL;
+				inOutHit.primitive = i;
+				inOutHit.u = u;
+				inOutHit.v = v;
+				leafHit = true;
+			}
+		}
+		return leafHit;
+	});
+}
+
+void TriangleMesh::completeIntersection(const Hit& hit, Intersection& intersection)
+{
+	const Point& p0 = vertices[indices[3 * hit.primitive + 0]];
+	const Point& p1 = vertices[indices[3 * hit.primitive + 1]];
+	const Point& p2 = vertices[indices[3 * hit.primitive + 2]];
+	intersection.normal = cross(p1 - p0, p2 - p0).normalized();
+	intersection.pShape = this;
+	intersection.pMaterial = pMaterial;
+}
+
+bool TriangleMesh::translate(const Vector& offset)
+{
+	for (size_t i = 0; i < vertices.size(); i++)
+		vertices[i] += offset;
+	bvh.translate(offset);
+	return true;
+}
+
+bool TriangleMesh::doesIntersect(const Ray& ray)
+{
+	float u, v;
+	if (!bvh.isEmpty())
+	{
+		return bvh.occluded(ray, [&](unsigned first, unsigned count)
+		{
+			for (unsigned i = first; i < first + count; i++)
+			{
+				if (intersectTriangle(i, ray, ray.maxDist, u, v) > 0.0f)
+					return true;
+			}
+			return false;
+		});
+	}
+
+	for (size_t i = 0; i < getTriangleCount(); i++)
+	{
+		if (intersectTriangle(i, ray, ray.maxDist, u, v) > 0.0f)
+			return true;
+	}
+
+	return false;
+}
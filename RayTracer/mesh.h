@@ -0,0 +1,90 @@
+#ifndef __MESH_H__
+#define __MESH_H__
+
+#include <vector>
+
+#include "bvh.h"
+#include "hugepages.h"
+#include "shape.h"
+
+// Moller-Trumbore, returns the distance to the triangle or 0 for a miss,
+// with the barycentric coordinates of the hit
+inline float intersectTriangleVertices(const Point& p0, const Point& p1, const Point& p2, const Ray& ray,
+	float maxDist, float& outU, float& outV)
+{
+	Vector edge1 = p1 - p0;
+	Vector edge2 = p2 - p0;
+	Vector p = cross(ray.direction, edge2);
+	float det = dot(edge1, p);
+	if (det == 0.0f)
+		return 0.0f;
+
+	float invDet = 1.0f / det;
+	Vector toOrigin = ray.origin - p0;
+	float u = dot(toOrigin, p) * invDet;
+	if (u < 0.0f || u > 1.0f)
+		return 0.0f;
+
+	Vector q = cross(toOrigin, edge1);
+	float v = dot(ray.direction, q) * invDet;
+	if (v < 0.0f || u + v > 1.0f)
+		return 0.0f;
+
+	float t = dot(edge2, q) * invDet;
+	if (t >= maxDist || t < kRayMinDist)
+		return 0.0f;
+
+	outU = u;
+	outV = v;
+	return t;
+}
+
+class TriangleMesh : public Shape
+{
+public:
+	TriangleMesh(Material* pMaterial) : vertices(), indices(), pMaterial(pMaterial), bvh() { }
+	TriangleMesh(size_t vertexCount, size_t triangleCount, Material* pMaterial)
+		: vertices(vertexCount), indices(3 * triangleCount), pMaterial(pMaterial), bvh() { }
+
+	virtual ~TriangleMesh() { }
+
+	virtual bool intersect(const Ray& ray, Hit& inOutHit);
+	virtual bool doesIntersect(const Ray& ray);
+	virtual void completeIntersection(const Hit& hit, Intersection& intersection);
+
+	// Builds the triangle BVH, this reorders the triangles
+	virtual void prepare(unsigned threadCount = 1);
+	virtual bool getBounds(BoundingBox& outBounds) const;
+	virtual void addBvhStats(BvhStats& inOutStats) const { inOutStats.add(bvh); }
+
+	// Moves the triangle BVH along, no rebuild needed
+	virtual bool translate(const Vector& offset);
+	virtual bool setMaterial(Material* pNewMaterial) { pMaterial = pNewMaterial; return true; }
+
+	size_t getVertexCount() const { return vertices.size(); }
+	size_t getTriangleCount() const { return indices.size() / 3; }
+
+	// Direct access so loaders can fill the arrays in place
+	Point* getVertices() { return vertices.empty() ? NULL : &vertices[0]; }
+	unsigned* getIndices() { return indices.empty() ? NULL : &indices[0]; }
+
+	void addVertex(const Point& p) { vertices.push_back(p); bvh.clear(); }
+	void addTriangle(unsigned a, unsigned b, unsigned c);
+
+	// True if every index refers to an existing vertex
+	bool validate() const;
+
+protected:
+	float intersectTriangle(size_t triangle, const Ray& ray, float maxDist, float& outU, float& outV) const
+	{
+		return intersectTriangleVertices(vertices[indices[3 * triangle + 0]], vertices[indices[3 * triangle + 1]],
+			vertices[indices[3 * triangle + 2]], ray, maxDist, outU, outV);
+	}
+
+	LargeVector<Point> vertices;
+	LargeVector<unsigned> indices;
+	Material* pMaterial;
+	Bvh bvh;
+};
+
+#endif
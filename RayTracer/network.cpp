@@ -0,0 +1,316 @@
+#include "network.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#ifdef _MSC_VER
+#pragma comment(lib, "ws2_32.lib")
+#endif
+typedef int socklen_t;
+#define closesocket_ closesocket
+#else
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#define closesocket_ ::close
+#endif
+
+// Stops a dead peer from killing the process with SIGPIPE
+#ifdef MSG_NOSIGNAL
+static const int kSendFlags = MSG_NOSIGNAL;
+#else
+static const int kSendFlags = 0;
+#endif
+
+#ifdef _WIN32
+static bool initSockets()
+{
+	static bool initialized = false;
+	static bool success = false;
+	if (!initialized)
+	{
+		WSADATA data;
+		success = WSAStartup(MAKEWORD(2, 2), &data) == 0;
+		initialized = true;
+	}
+	return success;
+}
+#else
+static bool initSockets()
+{
+	return true;
+}
+#endif
+
+// Splits "host:port" at the last colon
+static bool splitHostPort(const char* address, std::string& outHost, std::string& outPort)
+{
+	const char* colon = strrchr(address, ':');
+	if (colon == NULL || colon[1] == '\0')
+		return false;
+
+	outHost.assign(address, colon - address);
+	outPort.assign(colon + 1);
+	return true;
+}
+
+#ifndef _WIN32
+static bool makeUnixAddress(const char* path, sockaddr_un& outAddress)
+{
+	memset(&outAddress, 0, sizeof(outAddress));
+	outAddress.sun_family = AF_UNIX;
+	if (strlen(path) >= sizeof(outAddress.sun_path))
+		return false;
+	strcpy(outAddress.sun_path, path);
+	return true;
+}
+#endif
+
+bool Socket::listen(const char* address)
+{
+	close();
+	if (!initSockets())
+		return false;
+
+	if (!strncmp(address, "unix:", 5))
+	{
+#ifdef _WIN32
+		fprintf(stderr, "%s: unix sockets are not supported on this platform\n", address);
+		return false;
+#else
+		sockaddr_un unixAddress;
+		if (!makeUnixAddress(address + 5, unixAddress))
+		{
+			fprintf(stderr, "%s: path too long\n", address);
+			return false;
+		}
+
+		handle = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (handle == kInvalidHandle)
+			return false;
+
+		// A stale socket file from an earlier run would make bind() fail
+		unlink(unixAddress.sun_path);
+		if (bind((int)handle, (const sockaddr*)&unixAddress, sizeof(unixAddress)) != 0 ||
+			::listen((int)handle, SOMAXCONN) != 0)
+		{
+			perror(address);
+			close();
+			return false;
+		}
+
+		unixPath = unixAddress.sun_path;
+		return true;
+#endif
+	}
+
+	std::string host, port;
+	if (!splitHostPort(address, host, port))
+	{
+		fprintf(stderr, "%s: expected unix:<path> or <host>:<port>\n", address);
+		return false;
+	}
+
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = AI_PASSIVE;
+	addrinfo* pResults = NULL;
+	if (getaddrinfo(host.empty() ? NULL : host.c_str(), port.c_str(), &hints, &pResults) != 0)
+	{
+		fprintf(stderr, "%s: could not resolve address\n", address);
+		return false;
+	}
+
+	for (addrinfo* pInfo = pResults; pInfo != NULL; pInfo = pInfo->ai_next)
+	{
+		handle = (intptr_t)socket(pInfo->ai_family, pInfo->ai_socktype, pInfo->ai_protocol);
+		if (handle == kInvalidHandle)
+			continue;
+
+		int reuse = 1;
+		setsockopt(handle, SOL_SOCKET, SO_REUSEADDR, (const char*)&reuse, sizeof(reuse));
+		if (bind(handle, pInfo->ai_addr, (socklen_t)pInfo->ai_addrlen) == 0 &&
+			::listen(handle, SOMAXCONN) == 0)
+		{
+			break;
+		}
+		close();
+	}
+	freeaddrinfo(pResults);
+
+	if (!isOpen())
+	{
+		fprintf(stderr, "%s: could not listen\n", address);
+		return false;
+	}
+	return true;
+}
+
+bool Socket::accept(Socket& outClient)
+{
+	outClient.close();
+	intptr_t client = (intptr_t)::accept(handle, NULL, NULL);
+	if (client == kInvalidHandle)
+		return false;
+
+	// Leases and results are small messages that shouldn't wait for more
+	int noDelay = 1;
+	setsockopt(client, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+	outClient.handle = client;
+	return true;
+}
+
+bool Socket::connect(const char* address)
+{
+	close();
+	if (!initSockets())
+		return false;
+
+	if (!strncmp(address, "unix:", 5))
+	{
+#ifdef _WIN32
+		fprintf(stderr, "%s: unix sockets are not supported on this platform\n", address);
+		return false;
+#else
+		sockaddr_un unixAddress;
+		if (!makeUnixAddress(address + 5, unixAddress))
+			return false;
+
+		handle = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (handle == kInvalidHandle)
+			return false;
+		if (::connect((int)handle, (const sockaddr*)&unixAddress, sizeof(unixAddress)) != 0)
+		{
+			close();
+			return false;
+		}
+		return true;
+#endif
+	}
+
+	std::string host, port;
+	if (!splitHostPort(address, host, port))
+		return false;
+
+	addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	addrinfo* pResults = NULL;
+	if (getaddrinfo(host.c_str(), port.c_str(), &hints, &pResults) != 0)
+		return false;
+
+	for (addrinfo* pInfo = pResults; pInfo != NULL; pInfo = pInfo->ai_next)
+	{
+		handle = (intptr_t)socket(pInfo->ai_family, pInfo->ai_socktype, pInfo->ai_protocol);
+		if (handle == kInvalidHandle)
+			continue;
+		if (::connect(handle, pInfo->ai_addr, (socklen_t)pInfo->ai_addrlen) == 0)
+			break;
+		close();
+	}
+	freeaddrinfo(pResults);
+
+	if (!isOpen())
+		return false;
+
+	int noDelay = 1;
+	setsockopt(handle, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+	return true;
+}
+
+void Socket::close()
+{
+	if (handle != kInvalidHandle)
+	{
+		closesocket_(handle);
+		handle = kInvalidHandle;
+	}
+
+#ifndef _WIN32
+	if (!unixPath.empty())
+	{
+		unlink(unixPath.c_str());
+		unixPath.clear();
+	}
+#endif
+}
+
+bool Socket::sendAll(const void* pData, size_t size)
+{
+	const char* p = (const char*)pData;
+	while (size > 0)
+	{
+		int chunk = size > 0x40000000 ? 0x40000000 : (int)size;
+		int sent = (int)send(handle, p, chunk, kSendFlags);
+		if (sent <= 0)
+			return false;
+		p += sent;
+		size -= sent;
+	}
+	return true;
+}
+
+bool Socket::receiveAll(void* pData, size_t size)
+{
+	char* p = (char*)pData;
+	while (size > 0)
+	{
+		long long received = receiveSome(p, size);
+		if (received <= 0)
+			return false;
+		p += received;
+		size -= (size_t)received;
+	}
+	return true;
+}
+
+long long Socket::receiveSome(void* pData, size_t size)
+{
+	int chunk = size > 0x40000000 ? 0x40000000 : (int)size;
+	int received = (int)recv(handle, (char*)pData, chunk, 0);
+	return received < 0 ? -1 : received;
+}
+
+bool Socket::waitReadable(const std::vector<Socket*>& sockets, int timeoutMs, std::vector<bool>& outReadable)
+{
+	size_t count = sockets.size();
+#ifdef _WIN32
+	std::vector<WSAPOLLFD> fds(count);
+#else
+	std::vector<pollfd> fds(count);
+#endif
+	for (size_t i = 0; i < count; i++)
+	{
+		fds[i].fd = sockets[i]->handle;
+		fds[i].events = POLLIN;
+		fds[i].revents = 0;
+	}
+
+#ifdef _WIN32
+	int result = WSAPoll(count > 0 ? &fds[0] : NULL, (ULONG)count, timeoutMs);
+#else
+	int result = poll(count > 0 ? &fds[0] : NULL, (nfds_t)count, timeoutMs);
+	// A signal just ends the wait early with nothing readable
+	if (result < 0 && errno == EINTR)
+		result = 0;
+#endif
+	if (result < 0)
+		return false;
+
+	// Errors and hangups count as readable, the next read reports them
+	outReadable.resize(count);
+	for (size_t i = 0; i < count; i++)
+		outReadable[i] = (fds[i].revents & (POLLIN | POLLERR | POLLHUP)) != 0;
+	return true;
+}
@@ -0,0 +1,48 @@
+#ifndef __NETWORK_H__
+#define __NETWORK_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Blocking stream socket. Addresses are "unix:<path>" for a Unix domain
+// socket (POSIX only) or "<host>:<port>" for TCP.
+class Socket
+{
+public:
+	Socket() : handle(kInvalidHandle), unixPath() { }
+
+	virtual ~Socket() { close(); }
+
+	bool listen(const char* address);
+	bool accept(Socket& outClient);
+	bool connect(const char* address);
+	void close();
+
+	bool isOpen() const { return handle != kInvalidHandle; }
+
+	bool sendAll(const void* pData, size_t size);
+	bool receiveAll(void* pData, size_t size);
+
+	// Returns the number of bytes read, 0 once the peer has closed the
+	// connection and -1 on error. Only blocks when nothing is buffered.
+	long long receiveSome(void* pData, size_t size);
+
+	// Waits up to timeoutMs for data or a closed connection on any of the
+	// sockets, outReadable gets one flag per socket. -1 waits forever.
+	static bool waitReadable(const std::vector<Socket*>& sockets, int timeoutMs, std::vector<bool>& outReadable);
+
+protected:
+	Socket(const Socket&);
+	Socket& operator =(const Socket&);
+
+	static const intptr_t kInvalidHandle = -1;
+
+	// SOCKET on Windows, a file descriptor elsewhere
+	intptr_t handle;
+	// Unix socket to remove again when a listening socket closes
+	std::string unixPath;
+};
+
+#endif
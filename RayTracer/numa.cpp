@@ -0,0 +1,290 @@
+#include "numa.h"
+#include "parallel.h"
+#include "scene.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+// Set before rendering starts, read by every parallelFor()
+static const NumaTopology* pPlacement = NULL;
+static thread_local int pinnedNode = -1;
+
+size_t NumaTopology::getCpuCount() const
+{
+	size_t count = 0;
+	for (size_t node = 0; node < nodeCpus.size(); node++)
+		count += nodeCpus[node].size();
+	return count;
+}
+
+unsigned NumaTopology::getThreadNode(unsigned threadIndex, unsigned threadCount) const
+{
+	// The CPU the thread would get if the threads were spread evenly over
+	// all of them, in node order
+	size_t cpu = (size_t)threadIndex * getCpuCount() / std::max(threadCount, 1u);
+	for (unsigned node = 0; node < nodeCpus.size(); node++)
+	{
+		if (cpu < nodeCpus[node].size())
+			return node;
+		cpu -= nodeCpus[node].size();
+	}
+	return 0;
+}
+
+void NumaTopology::getShare(unsigned node, size_t count, size_t& outBegin, size_t& outEnd) const
+{
+	size_t cpuCount = std::max(getCpuCount(), (size_t)1);
+	size_t cpusBefore = 0;
+	for (unsigned i = 0; i < node; i++)
+		cpusBefore += nodeCpus[i].size();
+	outBegin = count * cpusBefore / cpuCount;
+	outEnd = count * (cpusBefore + nodeCpus[node].size()) / cpuCount;
+}
+
+unsigned NumaTopology::getShareNode(size_t index, size_t count) const
+{
+	for (unsigned node = 0; node + 1 < nodeCpus.size(); node++)
+	{
+		size_t begin, end;
+		getShare(node, count, begin, end);
+		if (index < end)
+			return node;
+	}
+	return nodeCpus.empty() ? 0 : getNodeCount() - 1;
+}
+
+NumaTopology NumaTopology::split(unsigned parts) const
+{
+	NumaTopology result;
+	for (size_t node = 0; node < nodeCpus.size(); node++)
+	{
+		const std::vector<unsigned>& cpus = nodeCpus[node];
+		if (parts <= 1 || cpus.empty())
+		{
+			result.nodeCpus.push_back(cpus);
+			continue;
+		}
+		// Parts of a node with fewer CPUs than parts share them
+		for (unsigned part = 0; part < parts; part++)
+		{
+			std::vector<unsigned> partCpus(cpus.begin() + part * cpus.size() / parts,
+				cpus.begin() + (part + 1) * cpus.size() / parts);
+			if (partCpus.empty())
+				partCpus.push_back(cpus[part % cpus.size()]);
+			result.nodeCpus.push_back(partCpus);
+		}
+	}
+	return result;
+}
+
+bool parseCpuList(const char* text, std::vector<unsigned>& outCpus)
+{
+	outCpus.clear();
+	const char* p = text;
+	while (*p != '\0' && *p != '\n')
+	{
+		char* pEnd;
+		unsigned long first = strtoul(p, &pEnd, 10);
+		if (pEnd == p)
+			return false;
+		unsigned long last = first;
+		p = pEnd;
+		if (*p == '-')
+		{
+			last = strtoul(p + 1, &pEnd, 10);
+			if (pEnd == p + 1 || last < first)
+				return false;
+			p = pEnd;
+		}
+		for (unsigned long cpu = first; cpu <= last; cpu++)
+			outCpus.push_back((unsigned)cpu);
+		if (*p == ',')
+			p++;
+		else if (*p != '\0' && *p != '\n')
+			return false;
+	}
+	return true;
+}
+
+static NumaTopology readTopology()
+{
+	NumaTopology topology;
+
+#ifdef __linux__
+	cpu_set_t allowed;
+	CPU_ZERO(&allowed);
+	bool haveMask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+	std::vector<unsigned> nodes;
+	char text[4096];
+	FILE* pFile = fopen("/sys/devices/system/node/online", "r");
+	if (pFile != NULL)
+	{
+		if (fgets(text, sizeof(text), pFile) == NULL || !parseCpuList(text, nodes))
+			nodes.clear();
+		fclose(pFile);
+	}
+
+	for (size_t i = 0; i < nodes.size(); i++)
+	{
+		char path[64];
+		snprintf(path, sizeof(path), "/sys/devices/system/node/node%u/cpulist", nodes[i]);
+		pFile = fopen(path, "r");
+		if (pFile == NULL)
+			continue;
+		std::vector<unsigned> cpus, usable;
+		if (fgets(text, sizeof(text), pFile) != NULL && parseCpuList(text, cpus))
+		{
+			for (size_t c = 0; c < cpus.size(); c++)
+			{
+				if (!haveMask || (cpus[c] < CPU_SETSIZE && CPU_ISSET(cpus[c], &allowed)))
+					usable.push_back(cpus[c]);
+			}
+		}
+		fclose(pFile);
+		if (!usable.empty())
+			topology.nodeCpus.push_back(usable);
+	}
+#endif
+
+	if (topology.nodeCpus.empty())
+	{
+		std::vector<unsigned> cpus;
+		for (unsigned cpu = 0; cpu < defaultThreadCount(); cpu++)
+			cpus.push_back(cpu);
+		topology.nodeCpus.push_back(cpus);
+	}
+	return topology;
+}
+
+const NumaTopology& detectNumaTopology()
+{
+	static const NumaTopology topology = readTopology();
+	return topology;
+}
+
+void setNumaPlacement(const NumaTopology* pTopology)
+{
+	pPlacement = pTopology;
+}
+
+const NumaTopology* getNumaPlacement()
+{
+	return pPlacement;
+}
+
+bool pinThreadToNode(const NumaTopology& topology, unsigned node)
+{
+	pinnedNode = (int)node;
+#ifdef __linux__
+	cpu_set_t cpus;
+	CPU_ZERO(&cpus);
+	const std::vector<unsigned>& nodeCpus = topology.nodeCpus[node];
+	for (size_t c = 0; c < nodeCpus.size(); c++)
+	{
+		if (nodeCpus[c] < CPU_SETSIZE)
+			CPU_SET(nodeCpus[c], &cpus);
+	}
+	return pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) == 0;
+#else
+	(void)topology;
+	return false;
+#endif
+}
+
+int getPinnedNode()
+{
+	return pinnedNode;
+}
+
+void runOnEveryNode(const std::function<void(unsigned node)>& fn)
+{
+	const NumaTopology* pTopology = pPlacement;
+	if (pTopology == NULL)
+	{
+		fn(0);
+		return;
+	}
+
+	std::vector<std::thread> threads;
+	for (unsigned node = 0; node < pTopology->getNodeCount(); node++)
+	{
+		threads.push_back(std::thread([pTopology, node, &fn]()
+		{
+			pinThreadToNode(*pTopology, node);
+			fn(node);
+		}));
+	}
+	for (size_t t = 0; t < threads.size(); t++)
+		threads[t].join();
+}
+
+bool SceneReplicas::build(Scene& scene, unsigned threadCount,
+	const std::function<bool(Scene&, unsigned)>& buildScene)
+{
+	clear();
+	unsigned nodeCount = pPlacement != NULL ? pPlacement->getNodeCount() : 1;
+	if (threadCount == 0)
+		threadCount = defaultThreadCount();
+	std::vector<unsigned> nodeThreads(nodeCount, 0);
+	for (unsigned t = 0; t < threadCount; t++)
+		nodeThreads[pPlacement != NULL ? pPlacement->getThreadNode(t, threadCount) : 0]++;
+
+	scenes.push_back(&scene);
+	for (unsigned node = 1; node < nodeCount; node++)
+		scenes.push_back(new Scene());
+
+	std::vector<char> built(nodeCount, 0);
+	runOnEveryNode([&](unsigned node)
+	{
+		built[node] = buildScene(*scenes[node], std::max(nodeThreads[node], 1u)) ? 1 : 0;
+	});
+
+	if (std::find(built.begin(), built.end(), 0) == built.end())
+		return true;
+	clear();
+	return false;
+}
+
+void SceneReplicas::clear()
+{
+	for (size_t node = 1; node < scenes.size(); node++)
+		delete scenes[node];
+	scenes.clear();
+}
+
+bool parseNumaMode(const char* name, NumaMode& outMode)
+{
+	if (!strcmp(name, "off"))
+		outMode = NUMA_OFF;
+	else if (!strcmp(name, "pin"))
+		outMode = NUMA_PIN;
+	else if (!strcmp(name, "replicate"))
+		outMode = NUMA_REPLICATE;
+	else
+		return false;
+
+	return true;
+}
+
+const char* numaModeName(NumaMode mode)
+{
+	switch (mode)
+	{
+	case NUMA_PIN:
+		return "pin";
+	case NUMA_REPLICATE:
+		return "replicate";
+	default:
+	case NUMA_OFF:
+		return "off";
+	}
+}
@@ -0,0 +1,102 @@
+#ifndef __NUMA_H__
+#define __NUMA_H__
+
+#include <cstddef>
+#include <functional>
+#include <vector>
+
+class Scene;
+
+// Memory nodes of the machine and the CPUs of each that this process may
+// run on, nodes without any are left out
+struct NumaTopology
+{
+	std::vector<std::vector<unsigned> > nodeCpus;
+
+	NumaTopology() : nodeCpus() { }
+
+	unsigned getNodeCount() const { return (unsigned)nodeCpus.size(); }
+	size_t getCpuCount() const;
+
+	// Node of thread threadIndex out of threadCount, threads are spread over
+	// the nodes in proportion to their CPUs and numbered node by node
+	unsigned getThreadNode(unsigned threadIndex, unsigned threadCount) const;
+
+	// The contiguous part of [0, count) a node's threads work on first, in
+	// proportion to its CPUs
+	void getShare(unsigned node, size_t count, size_t& outBegin, size_t& outEnd) const;
+	unsigned getShareNode(size_t index, size_t count) const;
+
+	// Every node cut into parts nodes of consecutive CPUs, to try the NUMA
+	// paths on a machine with a single node. Nodes too small to cut stay whole.
+	NumaTopology split(unsigned parts) const;
+};
+
+// Read once from /sys/devices/system/node on Linux and limited to the
+// process' affinity mask. Elsewhere, or without that directory, a single
+// node holds every CPU.
+const NumaTopology& detectNumaTopology();
+
+// "0-3,8,10-11" as in sysfs cpulist files
+bool parseCpuList(const char* text, std::vector<unsigned>& outCpus);
+
+// Process wide like the kernel selection. Once set, parallelFor() spreads its
+// threads over the nodes, pins them to their node's CPUs and has them take
+// indices from their node's share before helping the others, and renderers
+// keep their accumulation in tiles allocated on the node that owns them.
+// NULL, the default, turns all of that off. The topology must outlive its use.
+void setNumaPlacement(const NumaTopology* pTopology);
+const NumaTopology* getNumaPlacement();
+
+// Restricts the calling thread to the node's CPUs, parallelFor() called from
+// it afterwards keeps all its threads there. False where threads can't be
+// pinned, which only affects performance.
+bool pinThreadToNode(const NumaTopology& topology, unsigned node);
+
+// Node the calling thread was pinned to, or -1
+int getPinnedNode();
+
+// Calls fn(node) for every node of the placement at once, each on a new
+// thread pinned to it, and waits for them. Memory fn touches first is
+// allocated on its node by the OS.
+void runOnEveryNode(const std::function<void(unsigned node)>& fn);
+
+// One copy of a scene per node of the placement, see Renderer::setReplicas()
+class SceneReplicas
+{
+public:
+	SceneReplicas() : scenes() { }
+
+	virtual ~SceneReplicas() { clear(); }
+
+	// Makes every copy with build(scene, threadCount) on its node at once,
+	// which must build and prepare the same scene every time with the threads
+	// given. Node 0 builds into scene, which stays the caller's. threadCount
+	// = 0 spreads all hardware threads over the nodes.
+	bool build(Scene& scene, unsigned threadCount, const std::function<bool(Scene&, unsigned)>& buildScene);
+	void clear();
+
+	// Indexed by node, empty until build()
+	const std::vector<Scene*>& getScenes() const { return scenes; }
+
+protected:
+	SceneReplicas(const SceneReplicas&);
+	SceneReplicas& operator =(const SceneReplicas&);
+
+	std::vector<Scene*> scenes;
+};
+
+enum NumaMode
+{
+	NUMA_OFF = 0,
+	// Place threads and the accumulation, one shared scene
+	NUMA_PIN = 1,
+	// And a copy of the scene per node
+	NUMA_REPLICATE = 2
+};
+
+// Parses "off", "pin" or "replicate"
+bool parseNumaMode(const char* name, NumaMode& outMode);
+const char* numaModeName(NumaMode mode);
+
+#endif
@@ -0,0 +1,892 @@
+#include "pagedmesh.h"
+#include "parallel.h"
+
+#include <algorithm>
+#include <cstring>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Stored in front of every cluster, followed by its BVH nodes and triangles
+struct ClusterHeader
+{
+	uint32_t triangleCount;
+	uint32_t nodeCount;
+};
+
+// Buckets of a grid at most, which keeps their buffers under 50 MiB, and
+// times an oversized bucket is split again
+static const size_t kMaxBuckets = 4096;
+static const unsigned kMaxBucketDepth = 4;
+
+static inline Point triangleCentroid(const ClusterTriangle& triangle)
+{
+	return (triangle.p0 + triangle.p1 + triangle.p2) * (1.0f / 3.0f);
+}
+
+GeometryCache::GeometryCache()
+	: path(),
+#ifdef _WIN32
+	pFile(NULL),
+	fileMutex(),
+#else
+	fd(-1),
+#endif
+	memoryCap(0),
+	fileBytes(0),
+	records(),
+	slotBytes(0),
+	slotCost(0),
+	slots(),
+	pSlotMemory(NULL),
+	clockHand(0),
+	stats(),
+	mutex(),
+	slotChanged()
+{
+}
+
+bool GeometryCache::open(const char* newPath, size_t newMemoryCap)
+{
+	close();
+#ifdef _WIN32
+	pFile = fopen(newPath, "w+b");
+	if (pFile == NULL)
+#else
+	fd = ::open(newPath, O_RDWR | O_CREAT | O_TRUNC, 0600);
+	if (fd < 0)
+#endif
+	{
+		fprintf(stderr, "%s: could not create the geometry cache\n", newPath);
+		return false;
+	}
+
+	path = newPath;
+	memoryCap = newMemoryCap;
+	return true;
+}
+
+void GeometryCache::close()
+{
+	if (!isOpen())
+		return;
+
+#ifdef _WIN32
+	fclose(pFile);
+	pFile = NULL;
+#else
+	::close(fd);
+	fd = -1;
+#endif
+	remove(path.c_str());
+
+	freeLarge(pSlotMemory, slots.size() * slotBytes);
+	pSlotMemory = NULL;
+	slots.clear();
+	records.clear();
+	fileBytes = 0;
+	slotBytes = 0;
+	slotCost = 0;
+	clockHand = 0;
+	stats = GeometryCacheStats();
+}
+
+bool GeometryCache::isOpen() const
+{
+#ifdef _WIN32
+	return pFile != NULL;
+#else
+	return fd >= 0;
+#endif
+}
+
+bool GeometryCache::writeAt(unsigned long long offset, const void* pData, size_t bytes)
+{
+#ifdef _WIN32
+	std::lock_guard<std::mutex> lock(fileMutex);
+	return _fseeki64(pFile, (long long)offset, SEEK_SET) == 0 && fwrite(pData, 1, bytes, pFile) == bytes;
+#else
+	const char* p = static_cast<const char*>(pData);
+	while (bytes > 0)
+	{
+		ssize_t written = pwrite(fd, p, bytes, (off_t)offset);
+		if (written <= 0)
+			return false;
+		p += written;
+		offset += written;
+		bytes -= written;
+	}
+	return true;
+#endif
+}
+
+bool GeometryCache::readAt(unsigned long long offset, void* pData, size_t bytes)
+{
+#ifdef _WIN32
+	std::lock_guard<std::mutex> lock(fileMutex);
+	return _fseeki64(pFile, (long long)offset, SEEK_SET) == 0 && fread(pData, 1, bytes, pFile) == bytes;
+#else
+	char* p = static_cast<char*>(pData);
+	while (bytes > 0)
+	{
+		ssize_t read = pread(fd, p, bytes, (off_t)offset);
+		if (read <= 0)
+			return false;
+		p += read;
+		offset += read;
+		bytes -= read;
+	}
+	return true;
+#endif
+}
+
+int GeometryCache::addCluster(const Bvh& bvh, const ClusterTriangle* pTriangles, unsigned triangleCount)
+{
+	ClusterHeader header = { triangleCount, (uint32_t)bvh.getNodeCount() };
+	size_t nodeBytes = header.nodeCount * sizeof(BvhNode);
+	size_t triangleBytes = triangleCount * sizeof(ClusterTriangle);
+	std::vector<char> data(sizeof(header) + nodeBytes + triangleBytes);
+	memcpy(&data[0], &header, sizeof(header));
+	memcpy(&data[sizeof(header)], bvh.getNodes(), nodeBytes);
+	memcpy(&data[sizeof(header) + nodeBytes], pTriangles, triangleBytes);
+
+	// Each cluster gets its own range of the file, written outside the lock
+	unsigned long long offset;
+	int id;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		offset = fileBytes;
+		fileBytes += data.size();
+		id = (int)records.size();
+		ClusterRecord record = { offset, (unsigned)data.size(), -1 };
+		records.push_back(record);
+		slotBytes = std::max(slotBytes, data.size());
+		slotCost = std::max(slotCost, data.size() + nodeBytes);
+	}
+
+	if (!writeAt(offset, &data[0], data.size()))
+	{
+		fprintf(stderr, "%s: could not write to the geometry cache\n", path.c_str());
+		return -1;
+	}
+	return id;
+}
+
+bool GeometryCache::appendStaging(const void* pData, size_t bytes, unsigned long long& outOffset)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		outOffset = fileBytes;
+		fileBytes += bytes;
+	}
+
+	if (!writeAt(outOffset, pData, bytes))
+	{
+		fprintf(stderr, "%s: could not write to the geometry cache\n", path.c_str());
+		return false;
+	}
+	return true;
+}
+
+void GeometryCache::allocateSlots()
+{
+	size_t slotCount = std::max(memoryCap / std::max(slotCost, (size_t)1), (size_t)1);
+	slotCount = std::min(slotCount, std::max(records.size(), (size_t)1));
+	pSlotMemory = static_cast<char*>(allocateLarge(slotCount * slotBytes));
+	slots.resize(slotCount);
+	for (size_t s = 0; s < slotCount; s++)
+	{
+		slots[s].id = -1;
+		slots[s].pins = 0;
+		slots[s].referenced = false;
+		slots[s].loading = false;
+	}
+}
+
+int GeometryCache::findVictim()
+{
+	// Two sweeps clear every reference bit on the way, so an unheld slot is
+	// always found in them
+	size_t slotCount = slots.size();
+	for (size_t step = 0; step < 2 * slotCount; step++)
+	{
+		size_t s = clockHand;
+		clockHand = (clockHand + 1) % slotCount;
+		Slot& slot = slots[s];
+		if (slot.pins > 0)
+			continue;
+		if (slot.referenced)
+		{
+			slot.referenced = false;
+			continue;
+		}
+		return (int)s;
+	}
+	return -1;
+}
+
+const GeometryCluster* GeometryCache::acquire(unsigned id)
+{
+	std::unique_lock<std::mutex> lock(mutex);
+	if (slots.empty())
+		allocateSlots();
+	stats.acquires++;
+
+	ClusterRecord& record = records[id];
+	for (;;)
+	{
+		if (record.slot >= 0)
+		{
+			Slot& slot = slots[record.slot];
+			stats.hits++;
+			slot.pins++;
+			slot.referenced = true;
+			if (slot.loading)
+				stats.waits++;
+			while (slot.loading)
+				slotChanged.wait(lock);
+			if (slot.id == (int)id)
+				return &slot.cluster;
+
+			// The read failed
+			slot.pins--;
+			slotChanged.notify_all();
+			return NULL;
+		}
+
+		int victim = findVictim();
+		if (victim < 0)
+		{
+			stats.waits++;
+			slotChanged.wait(lock);
+			continue;
+		}
+
+		Slot& slot = slots[victim];
+		if (slot.id >= 0)
+		{
+			records[slot.id].slot = -1;
+			stats.evictions++;
+		}
+		slot.id = (int)id;
+		slot.pins = 1;
+		slot.referenced = true;
+		slot.loading = true;
+		record.slot = victim;
+		stats.loads++;
+		stats.bytesRead += record.bytes;
+		lock.unlock();
+
+		// Others wanting the cluster wait on loading, nobody else touches
+		// the slot until then
+		char* pData = pSlotMemory + (size_t)victim * slotBytes;
+		bool read = readAt(record.offset, pData, record.bytes);
+		if (read)
+		{
+			ClusterHeader header;
+			memcpy(&header, pData, sizeof(header));
+			const BvhNode* pNodes = reinterpret_cast<const BvhNode*>(pData + sizeof(header));
+			slot.cluster.bvh.setNodes(pNodes, header.nodeCount);
+			slot.cluster.pTriangles = reinterpret_cast<const ClusterTriangle*>(pNodes + header.nodeCount);
+			slot.cluster.triangleCount = header.triangleCount;
+		}
+		else
+			fprintf(stderr, "%s: could not read cluster %u from the geometry cache\n", path.c_str(), id);
+
+		lock.lock();
+		slot.loading = false;
+		if (!read)
+		{
+			slot.id = -1;
+			slot.pins--;
+			record.slot = -1;
+		}
+		slotChanged.notify_all();
+		return read ? &slot.cluster : NULL;
+	}
+}
+
+void GeometryCache::release(unsigned id)
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	Slot& slot = slots[records[id].slot];
+	if (--slot.pins == 0)
+		slotChanged.notify_all();
+}
+
+size_t GeometryCache::getClusterCount() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return records.size();
+}
+
+unsigned long long GeometryCache::getFileBytes() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return fileBytes;
+}
+
+size_t GeometryCache::getSlotCount() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return slots.size();
+}
+
+size_t GeometryCache::getResidentBytes() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	size_t bytes = 0;
+	for (size_t s = 0; s < slots.size(); s++)
+	{
+		if (slots[s].id >= 0)
+			bytes += records[slots[s].id].bytes + slots[s].cluster.bvh.getNodeCount() * sizeof(BvhNode);
+	}
+	return bytes;
+}
+
+GeometryCacheStats GeometryCache::getStats() const
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return stats;
+}
+
+void GeometryCache::resetStats()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	stats = GeometryCacheStats();
+}
+
+void TriangleBuckets::reset(const BoundingBox& centroidBounds, size_t bucketCount)
+{
+	bounds = centroidBounds;
+	cells[0] = cells[1] = cells[2] = 1;
+
+	// Splits the cells in two along the axis where they are longest
+	Vector extent = bounds.isEmpty() ? Vector(0.0f) : bounds.extent();
+	size_t count = 1;
+	while (count < bucketCount)
+	{
+		int axis = 0;
+		for (int a = 1; a < 3; a++)
+		{
+			if (axisValue(extent, a) / cells[a] > axisValue(extent, axis) / cells[axis])
+				axis = a;
+		}
+		if (axisValue(extent, axis) <= 0.0f)
+			break;
+		cells[axis] *= 2;
+		count *= 2;
+	}
+
+	buckets.assign(count, Bucket());
+}
+
+bool TriangleBuckets::add(const StagedTriangle& staged, GeometryCache& cache)
+{
+	Point centroid = triangleCentroid(staged.triangle);
+	size_t index = 0;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float low = axisValue(bounds.min, axis);
+		float size = axisValue(bounds.max, axis) - low;
+		float cell = size > 0.0f ? (axisValue(centroid, axis) - low) / size * cells[axis] : 0.0f;
+		index = index * cells[axis] + (cell > 0.0f ? (unsigned)std::min(cell, (float)(cells[axis] - 1)) : 0);
+	}
+
+	Bucket& bucket = buckets[index];
+	if (bucket.buffer.empty())
+		bucket.buffer.reserve(kBufferTriangles);
+	bucket.buffer.push_back(staged);
+	bucket.triangleCount++;
+	return bucket.buffer.size() < kBufferTriangles || flushBucket(bucket, cache);
+}
+
+bool TriangleBuckets::flushBucket(Bucket& bucket, GeometryCache& cache)
+{
+	if (bucket.buffer.empty())
+		return true;
+
+	Run run = { 0, (unsigned)bucket.buffer.size() };
+	if (!cache.appendStaging(&bucket.buffer[0], bucket.buffer.size() * sizeof(StagedTriangle), run.offset))
+		return false;
+	bucket.runs.push_back(run);
+	bucket.buffer.clear();
+	return true;
+}
+
+bool TriangleBuckets::flush(GeometryCache& cache)
+{
+	for (size_t b = 0; b < buckets.size(); b++)
+	{
+		if (!flushBucket(buckets[b], cache))
+			return false;
+		std::vector<StagedTriangle>().swap(buckets[b].buffer);
+	}
+	return true;
+}
+
+bool TriangleBuckets::readRun(size_t bucket, size_t run, GeometryCache& cache,
+	std::vector<StagedTriangle>& inOutTriangles) const
+{
+	const Run& source = buckets[bucket].runs[run];
+	size_t first = inOutTriangles.size();
+	inOutTriangles.resize(first + source.count);
+	return cache.readStaging(source.offset, &inOutTriangles[first], source.count * sizeof(StagedTriangle));
+}
+
+bool TriangleBuckets::readBucket(size_t bucket, GeometryCache& cache, std::vector<StagedTriangle>& inOutTriangles) const
+{
+	inOutTriangles.reserve(inOutTriangles.size() + buckets[bucket].triangleCount);
+	for (size_t r = 0; r < buckets[bucket].runs.size(); r++)
+	{
+		if (!readRun(bucket, r, cache, inOutTriangles))
+			return false;
+	}
+	return true;
+}
+
+bool PagedMesh::addTriangles(const unsigned* pIndices, size_t firstTriangle, size_t count)
+{
+	if (!streaming)
+	{
+		std::copy(pIndices, pIndices + 3 * count, &indices[3 * firstTriangle]);
+		return true;
+	}
+
+	std::vector<StagedTriangle> staged(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		staged[i].triangle.p0 = vertices[pIndices[3 * i + 0]];
+		staged[i].triangle.p1 = vertices[pIndices[3 * i + 1]];
+		staged[i].triangle.p2 = vertices[pIndices[3 * i + 2]];
+		staged[i].face = firstTriangle + i;
+	}
+
+	std::lock_guard<std::mutex> lock(stagingMutex);
+	if (!bucketsReady)
+	{
+		BoundingBox bounds;
+		for (size_t v = 0; v < vertices.size(); v++)
+			bounds.grow(vertices[v]);
+		buckets.reset(bounds, std::min((streamedTriangleCount + kBucketTriangles - 1) / kBucketTriangles, kMaxBuckets));
+		bucketsReady = true;
+	}
+
+	for (size_t i = 0; i < count; i++)
+	{
+		if (!buckets.add(staged[i], *pCache))
+		{
+			stagingFailed = true;
+			return false;
+		}
+	}
+	stagedTriangleCount += count;
+	return true;
+}
+
+int PagedMesh::writeCluster(const ClusterTriangle* pTriangles, unsigned count, BoundingBox& outBounds)
+{
+	std::vector<BoundingBox> triangleBounds(count);
+	for (unsigned i = 0; i < count; i++)
+	{
+		triangleBounds[i].grow(pTriangles[i].p0);
+		triangleBounds[i].grow(pTriangles[i].p1);
+		triangleBounds[i].grow(pTriangles[i].p2);
+	}
+
+	Bvh clusterTree;
+	clusterTree.build(triangleBounds, 4, 1);
+	const std::vector<unsigned>& order = clusterTree.getPrimitiveOrder();
+	std::vector<ClusterTriangle> sorted(count);
+	for (unsigned i = 0; i < count; i++)
+		sorted[i] = pTriangles[order[i]];
+
+	outBounds = clusterTree.getBounds();
+	return pCache->addCluster(clusterTree, &sorted[0], count);
+}
+
+bool PagedMesh::writeBucket(const TriangleBuckets& from, size_t bucket, unsigned depth,
+	std::vector<BoundingBox>& inOutBounds, std::vector<int>& inOutIds)
+{
+	size_t count = from.getTriangleCount(bucket);
+	if (count == 0)
+		return true;
+
+	std::vector<StagedTriangle> triangles;
+	if (count > kMaxBucketTriangles && depth < kMaxBucketDepth)
+	{
+		// Bins the bucket again over its own centroids, a run at a time.
+		// Triangles that all share a centroid can't be split.
+		BoundingBox centroidBounds;
+		for (size_t r = 0; r < from.getRunCount(bucket); r++)
+		{
+			triangles.clear();
+			if (!from.readRun(bucket, r, *pCache, triangles))
+				return false;
+			for (size_t i = 0; i < triangles.size(); i++)
+				centroidBounds.grow(triangleCentroid(triangles[i].triangle));
+		}
+
+		Vector extent = centroidBounds.extent();
+		if (extent.x > 0.0f || extent.y > 0.0f || extent.z > 0.0f)
+		{
+			TriangleBuckets split;
+			split.reset(centroidBounds, std::min((count + kBucketTriangles - 1) / kBucketTriangles, kMaxBuckets));
+			for (size_t r = 0; r < from.getRunCount(bucket); r++)
+			{
+				triangles.clear();
+				if (!from.readRun(bucket, r, *pCache, triangles))
+					return false;
+				for (size_t i = 0; i < triangles.size(); i++)
+				{
+					if (!split.add(triangles[i], *pCache))
+						return false;
+				}
+			}
+			if (!split.flush(*pCache))
+				return false;
+
+			for (size_t b = 0; b < split.getBucketCount(); b++)
+			{
+				if (!writeBucket(split, b, depth + 1, inOutBounds, inOutIds))
+					return false;
+			}
+			return true;
+		}
+		triangles.clear();
+	}
+
+	// In mesh order, then cut into clusters along a BVH over the bucket
+	if (!from.readBucket(bucket, *pCache, triangles))
+		return false;
+	std::sort(triangles.begin(), triangles.end(), [](const StagedTriangle& a, const StagedTriangle& b)
+	{
+		return a.face < b.face;
+	});
+
+	std::vector<BoundingBox> triangleBounds(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		triangleBounds[i].grow(triangles[i].triangle.p0);
+		triangleBounds[i].grow(triangles[i].triangle.p1);
+		triangleBounds[i].grow(triangles[i].triangle.p2);
+	}
+	Bvh bucketTree;
+	bucketTree.build(triangleBounds, 4, 1);
+	const std::vector<unsigned>& order = bucketTree.getPrimitiveOrder();
+
+	std::vector<ClusterTriangle> clusterTriangles(kClusterTriangles);
+	for (size_t first = 0; first < count; first += kClusterTriangles)
+	{
+		unsigned clusterCount = (unsigned)std::min((size_t)kClusterTriangles, count - first);
+		for (unsigned i = 0; i < clusterCount; i++)
+			clusterTriangles[i] = triangles[order[first + i]].triangle;
+
+		BoundingBox bounds;
+		int id = writeCluster(&clusterTriangles[0], clusterCount, bounds);
+		if (id < 0)
+			return false;
+		inOutBounds.push_back(bounds);
+		inOutIds.push_back(id);
+	}
+	return true;
+}
+
+void PagedMesh::prepareStaged(unsigned threadCount)
+{
+	bool written = !stagingFailed && buckets.flush(*pCache);
+	size_t bucketCount = buckets.getBucketCount();
+	std::vector<std::vector<BoundingBox> > bucketBounds(bucketCount);
+	std::vector<std::vector<int> > bucketIds(bucketCount);
+	std::vector<char> bucketWritten(bucketCount, 0);
+	if (written)
+	{
+		parallelFor(bucketCount, threadCount, [&](size_t b, unsigned)
+		{
+			bucketWritten[b] = writeBucket(buckets, b, 0, bucketBounds[b], bucketIds[b]) ? 1 : 0;
+		});
+	}
+
+	// Every staged triangle is in a cluster or lost now
+	size_t triangleCount = stagedTriangleCount;
+	buckets = TriangleBuckets();
+	bucketsReady = false;
+	stagedTriangleCount = 0;
+	stagingFailed = false;
+	LargeVector<Point>().swap(vertices);
+	if (triangleCount == 0 && written)
+		return;
+
+	if (!written || std::find(bucketWritten.begin(), bucketWritten.end(), 0) != bucketWritten.end())
+	{
+		fprintf(stderr, "could not page a mesh of %llu triangles, leaving it out\n", (unsigned long long)triangleCount);
+		return;
+	}
+
+	// Buckets in grid order, so the clusters don't depend on the threads
+	std::vector<BoundingBox> clusterBounds;
+	std::vector<int> ids;
+	for (size_t b = 0; b < bucketCount; b++)
+	{
+		clusterBounds.insert(clusterBounds.end(), bucketBounds[b].begin(), bucketBounds[b].end());
+		ids.insert(ids.end(), bucketIds[b].begin(), bucketIds[b].end());
+	}
+	finishClusters(clusterBounds, ids, triangleCount, threadCount);
+}
+
+void PagedMesh::finishClusters(const std::vector<BoundingBox>& bounds, const std::vector<int>& ids,
+	size_t triangleCount, unsigned threadCount)
+{
+	clusterBvh.build(bounds, 1, threadCount);
+	const std::vector<unsigned>& order = clusterBvh.getPrimitiveOrder();
+	clusterIds.resize(ids.size());
+	clusterBounds.resize(ids.size());
+	for (size_t c = 0; c < ids.size(); c++)
+	{
+		clusterIds[c] = (unsigned)ids[order[c]];
+		clusterBounds[c] = bounds[order[c]];
+	}
+	pagedTriangleCount = triangleCount;
+}
+
+void PagedMesh::prepare(unsigned threadCount)
+{
+	if (isPaged())
+		return;
+
+	if (streaming && indices.empty())
+	{
+		prepareStaged(threadCount);
+		return;
+	}
+
+	TriangleMesh::prepare(threadCount);
+	if (pCache == NULL || !pCache->isOpen() || indices.empty())
+		return;
+
+	// The triangles are in BVH order now, so runs of them are compact
+	size_t triangleCount = getTriangleCount();
+	size_t clusterCount = (triangleCount + kClusterTriangles - 1) / kClusterTriangles;
+	std::vector<BoundingBox> clusterBounds(clusterCount);
+	std::vector<int> ids(clusterCount, -1);
+	parallelFor(clusterCount, threadCount, [&](size_t c, unsigned)
+	{
+		size_t first = c * kClusterTriangles;
+		unsigned count = (unsigned)std::min((size_t)kClusterTriangles, triangleCount - first);
+		std::vector<ClusterTriangle> triangles(count);
+		for (unsigned i = 0; i < count; i++)
+		{
+			triangles[i].p0 = vertices[indices[3 * (first + i) + 0]];
+			triangles[i].p1 = vertices[indices[3 * (first + i) + 1]];
+			triangles[i].p2 = vertices[indices[3 * (first + i) + 2]];
+		}
+		ids[c] = writeCluster(&triangles[0], count, clusterBounds[c]);
+	});
+
+	if (std::find(ids.begin(), ids.end(), -1) != ids.end())
+	{
+		fprintf(stderr, "keeping a mesh of %llu triangles in memory\n", (unsigned long long)triangleCount);
+		return;
+	}
+
+	finishClusters(clusterBounds, ids, triangleCount, threadCount);
+	LargeVector<Point>().swap(vertices);
+	LargeVector<unsigned>().swap(indices);
+	bvh.clear();
+}
+
+bool PagedMesh::getBounds(BoundingBox& outBounds) const
+{
+	if (!isPaged())
+		return TriangleMesh::getBounds(outBounds);
+
+	outBounds = clusterBvh.getBounds();
+	return true;
+}
+
+void PagedMesh::addBvhStats(BvhStats& inOutStats) const
+{
+	// Only the resident tree over the clusters
+	if (isPaged())
+		inOutStats.add(clusterBvh);
+	else
+		TriangleMesh::addBvhStats(inOutStats);
+}
+
+bool PagedMesh::translate(const Vector& offset)
+{
+	return !isPaged() && TriangleMesh::translate(offset);
+}
+
+bool PagedMesh::intersectCluster(const GeometryCluster& cluster, unsigned clusterIndex, const Ray& ray, Hit& inOutHit)
+{
+	float u, v;
+	return cluster.bvh.intersect(ray, inOutHit.dist, [&](unsigned first, unsigned count)
+	{
+		bool leafHit = false;
+		for (unsigned i = first; i < first + count; i++)
+		{
+			const ClusterTriangle& triangle = cluster.pTriangles[i];
+			float t = intersectTriangleVertices(triangle.p0, triangle.p1, triangle.p2, ray, inOutHit.dist, u, v);
+			if (t > 0.0f)
+			{
+				inOutHit.dist = t;
+				inOutHit.pShape = this;
+				inOutHit.pOwner = NULL;
+				inOutHit.primitive = clusterIndex * kClusterTriangles + i;
+				inOutHit.u = u;
+				inOutHit.v = v;
+				leafHit = true;
+			}
+		}
+		return leafHit;
+	});
+}
+
+bool PagedMesh::intersect(const Ray& ray, Hit& inOutHit)
+{
+	if (!isPaged())
+		return TriangleMesh::intersect(ray, inOutHit);
+
+	// Clusters front to back, so ones behind the closest hit aren't read
+	return clusterBvh.intersect(ray, inOutHit.dist, [&](unsigned first, unsigned count)
+	{
+		bool leafHit = false;
+		for (unsigned i = first; i < first + count; i++)
+		{
+			const GeometryCluster* pCluster = pCache->acquire(clusterIds[i]);
+			if (pCluster == NULL)
+				continue;
+			if (intersectCluster(*pCluster, i, ray, inOutHit))
+				leafHit = true;
+			pCache->release(clusterIds[i]);
+		}
+		return leafHit;
+	});
+}
+
+bool PagedMesh::doesIntersect(const Ray& ray)
+{
+	if (!isPaged())
+		return TriangleMesh::doesIntersect(ray);
+
+	return clusterBvh.occluded(ray, [&](unsigned first, unsigned count)
+	{
+		for (unsigned i = first; i < first + count; i++)
+		{
+			const GeometryCluster* pCluster = pCache->acquire(clusterIds[i]);
+			if (pCluster == NULL)
+				continue;
+
+			float u, v;
+			bool occluded = pCluster->bvh.occluded(ray, [&](unsigned firstTriangle, unsigned triangleCount)
+			{
+				for (unsigned t = firstTriangle; t < firstTriangle + triangleCount; t++)
+				{
+					const ClusterTriangle& triangle = pCluster->pTriangles[t];
+					if (intersectTriangleVertices(triangle.p0, triangle.p1, triangle.p2, ray, ray.maxDist, u, v) > 0.0f)
+						return true;
+				}
+				return false;
+			});
+			pCache->release(clusterIds[i]);
+			if (occluded)
+				return true;
+		}
+		return false;
+	});
+}
+
+void PagedMesh::completeIntersection(const Hit& hit, Intersection& intersection)
+{
+	if (!isPaged())
+	{
+		TriangleMesh::completeIntersection(hit, intersection);
+		return;
+	}
+
+	// Usually still resident from the traversal that found the hit
+	unsigned clusterIndex = hit.primitive / kClusterTriangles;
+	const GeometryCluster* pCluster = pCache->acquire(clusterIds[clusterIndex]);
+	if (pCluster != NULL)
+	{
+		const ClusterTriangle& triangle = pCluster->pTriangles[hit.primitive % kClusterTriangles];
+		intersection.normal = cross(triangle.p1 - triangle.p0, triangle.p2 - triangle.p0).normalized();
+		pCache->release(clusterIds[clusterIndex]);
+	}
+	else
+		intersection.normal = -intersection.ray.direction;
+	intersection.pShape = this;
+	intersection.pMaterial = pMaterial;
+}
+
+size_t PagedMesh::intersectBatch(const Ray* pRays, size_t count, Hit* inOutHits)
+{
+	if (!isPaged())
+		return TriangleMesh::intersectBatch(pRays, count, inOutHits);
+
+	// Every cluster each ray reaches within its limit, with the distance it
+	// enters the cluster at
+	std::vector<char> rayHit(count, 0);
+	std::vector<QueuedRay> queue;
+	for (size_t r = 0; r < count; r++)
+	{
+		Bvh::RayBoxTest test(pRays[r]);
+		clusterBvh.intersect(pRays[r], inOutHits[r].dist, [&](unsigned first, unsigned clusterCount)
+		{
+			for (unsigned i = first; i < first + clusterCount; i++)
+			{
+				QueuedRay queued = { i, (unsigned)r, 0.0f };
+				if (test.intersect(clusterBounds[i], inOutHits[r].dist, queued.entry))
+					queue.push_back(queued);
+			}
+			return false;
+		});
+	}
+
+	// Grouped per cluster with the rays in order, and the clusters nearest
+	// to their rays first so that the hits found in them rule out clusters
+	// further away before those are read
+	std::sort(queue.begin(), queue.end(), [](const QueuedRay& a, const QueuedRay& b)
+	{
+		return a.cluster != b.cluster ? a.cluster < b.cluster : a.ray < b.ray;
+	});
+	std::vector<std::pair<float, size_t> > groups;
+	for (size_t begin = 0; begin < queue.size();)
+	{
+		float nearest = queue[begin].entry;
+		size_t end = begin + 1;
+		for (; end < queue.size() && queue[end].cluster == queue[begin].cluster; end++)
+			nearest = std::min(nearest, queue[end].entry);
+		groups.push_back(std::make_pair(nearest, begin));
+		begin = end;
+	}
+	std::sort(groups.begin(), groups.end());
+
+	for (size_t g = 0; g < groups.size(); g++)
+	{
+		size_t begin = groups[g].second;
+		unsigned clusterIndex = queue[begin].cluster;
+		size_t end = begin;
+		bool reached = false;
+		for (; end < queue.size() && queue[end].cluster == clusterIndex; end++)
+			reached = reached || queue[end].entry <= inOutHits[queue[end].ray].dist;
+		if (!reached)
+			continue;
+
+		const GeometryCluster* pCluster = pCache->acquire(clusterIds[clusterIndex]);
+		if (pCluster == NULL)
+			continue;
+		for (size_t q = begin; q < end; q++)
+		{
+			unsigned r = queue[q].ray;
+			if (queue[q].entry <= inOutHits[r].dist && intersectCluster(*pCluster, clusterIndex, pRays[r], inOutHits[r]))
+				rayHit[r] = 1;
+		}
+		pCache->release(clusterIds[clusterIndex]);
+	}
+
+	return std::count(rayHit.begin(), rayHit.end(), 1);
+}
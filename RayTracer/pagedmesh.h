@@ -0,0 +1,304 @@
+#ifndef __PAGEDMESH_H__
+#define __PAGEDMESH_H__
+
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "mesh.h"
+
+// Triangle positions as clusters store them, without shared vertices
+struct ClusterTriangle
+{
+	Point p0, p1, p2;
+};
+
+// A cluster while it is resident: its own BVH and the triangles in that
+// BVH's order
+struct GeometryCluster
+{
+	Bvh bvh;
+	const ClusterTriangle* pTriangles;
+	unsigned triangleCount;
+
+	GeometryCluster() : bvh(), pTriangles(NULL), triangleCount(0) { }
+};
+
+// A triangle of a mesh still being loaded, with its position in the mesh so
+// that the clusters don't depend on the order triangles arrive in
+struct StagedTriangle
+{
+	ClusterTriangle triangle;
+	unsigned long long face;
+};
+
+struct GeometryCacheStats
+{
+	// acquire() calls, and those that found the cluster resident or being
+	// read for another thread
+	unsigned long long acquires;
+	unsigned long long hits;
+	// Clusters read from the file and the clusters evicted for them
+	unsigned long long loads;
+	unsigned long long bytesRead;
+	unsigned long long evictions;
+	// Times a thread waited for another's read or for a slot to be released
+	unsigned long long waits;
+
+	GeometryCacheStats() : acquires(0), hits(0), loads(0), bytesRead(0), evictions(0), waits(0) { }
+};
+
+// Clusters of triangles kept in a scratch file, with only as many in memory
+// as fit under a byte cap. Meshes stage triangles in the file while they
+// load, add their clusters while they are prepared and every cluster is
+// read back on demand. When all slots are taken, a clock hand sweeps them
+// and evicts the first cluster nobody holds that hasn't been used since the
+// hand last passed it. Thread safe, reads of different clusters run in
+// parallel.
+class GeometryCache
+{
+public:
+	GeometryCache();
+
+	virtual ~GeometryCache() { close(); }
+
+	// Creates or truncates the file, close() deletes it. memoryCap is split
+	// into slots for the largest cluster, there is always at least one.
+	bool open(const char* path, size_t memoryCap);
+	void close();
+	bool isOpen() const;
+
+	// Appends a cluster of a BVH and triangles already in its order and
+	// returns its id, or -1 if the file can't be written. Every cluster must
+	// be added before the first acquire().
+	int addCluster(const Bvh& bvh, const ClusterTriangle* pTriangles, unsigned triangleCount);
+
+	// Scratch data of meshes still being loaded, appended to the same file.
+	// The bytes are only reclaimed when the file is closed.
+	bool appendStaging(const void* pData, size_t bytes, unsigned long long& outOffset);
+	bool readStaging(unsigned long long offset, void* pData, size_t bytes) { return readAt(offset, pData, bytes); }
+
+	// The cluster, read from the file first if it isn't resident, or NULL
+	// on a read error. It stays resident until the matching release(). A
+	// thread must not hold more clusters than there are slots.
+	const GeometryCluster* acquire(unsigned id);
+	void release(unsigned id);
+
+	size_t getClusterCount() const;
+	unsigned long long getFileBytes() const;
+	// 0 until the first acquire()
+	size_t getSlotCount() const;
+	size_t getResidentBytes() const;
+
+	GeometryCacheStats getStats() const;
+	void resetStats();
+
+protected:
+	GeometryCache(const GeometryCache&);
+	GeometryCache& operator =(const GeometryCache&);
+
+	struct ClusterRecord
+	{
+		unsigned long long offset;
+		unsigned bytes;
+		// Slot holding the cluster or -1
+		int slot;
+	};
+
+	struct Slot
+	{
+		GeometryCluster cluster;
+		// Cluster held, or -1 for a free slot
+		int id;
+		unsigned pins;
+		bool referenced;
+		bool loading;
+	};
+
+	bool writeAt(unsigned long long offset, const void* pData, size_t bytes);
+	bool readAt(unsigned long long offset, void* pData, size_t bytes);
+	void allocateSlots();
+	// Next slot the clock evicts, -1 if every one is held. Needs the lock.
+	int findVictim();
+
+	std::string path;
+#ifdef _WIN32
+	// Seeks and reads are one step under fileMutex
+	FILE* pFile;
+	std::mutex fileMutex;
+#else
+	int fd;
+#endif
+	size_t memoryCap;
+	unsigned long long fileBytes;
+	std::vector<ClusterRecord> records;
+	// Largest cluster, and its share of the cap with the nodes copied out
+	size_t slotBytes;
+	size_t slotCost;
+
+	std::vector<Slot> slots;
+	char* pSlotMemory;
+	size_t clockHand;
+	GeometryCacheStats stats;
+
+	mutable std::mutex mutex;
+	std::condition_variable slotChanged;
+};
+
+// Triangles binned by their centroids into a grid of buckets. Each bucket
+// buffers a few triangles and appends them to a cache's file as a run when
+// the buffer fills, so only the buffers are in memory. Not thread safe.
+class TriangleBuckets
+{
+public:
+	static const unsigned kBufferTriangles = 256;
+
+	TriangleBuckets() : bounds(), buckets() { cells[0] = cells[1] = cells[2] = 1; }
+
+	// Empties the grid and splits centroidBounds into at least bucketCount
+	// buckets, more of them along its longer axes
+	void reset(const BoundingBox& centroidBounds, size_t bucketCount);
+
+	bool add(const StagedTriangle& triangle, GeometryCache& cache);
+	// Appends every buffer still holding triangles and frees the buffers
+	bool flush(GeometryCache& cache);
+
+	size_t getBucketCount() const { return buckets.size(); }
+	size_t getTriangleCount(size_t bucket) const { return buckets[bucket].triangleCount; }
+	size_t getRunCount(size_t bucket) const { return buckets[bucket].runs.size(); }
+
+	// Appends the triangles of one run, or of the whole bucket once it is
+	// flushed
+	bool readRun(size_t bucket, size_t run, GeometryCache& cache, std::vector<StagedTriangle>& inOutTriangles) const;
+	bool readBucket(size_t bucket, GeometryCache& cache, std::vector<StagedTriangle>& inOutTriangles) const;
+
+protected:
+	struct Run
+	{
+		unsigned long long offset;
+		unsigned count;
+	};
+
+	struct Bucket
+	{
+		std::vector<StagedTriangle> buffer;
+		std::vector<Run> runs;
+		size_t triangleCount;
+
+		Bucket() : buffer(), runs(), triangleCount(0) { }
+	};
+
+	bool flushBucket(Bucket& bucket, GeometryCache& cache);
+
+	BoundingBox bounds;
+	unsigned cells[3];
+	std::vector<Bucket> buckets;
+};
+
+// A triangle mesh whose triangles live in a GeometryCache, in clusters of
+// kClusterTriangles with a BVH each. Only a BVH over the cluster bounds
+// stays in memory, and rays fault clusters in synchronously as they reach
+// them. The mesh can't be moved or edited once it is paged, and
+// getVertexCount() and getTriangleCount() are then 0.
+//
+// Made with an open cache, the mesh streams: only its vertices are
+// allocated, and addTriangles() bins the triangles spatially into runs in
+// the cache file as they arrive. prepare() then reads back a bucket at a
+// time, builds its BVH, cuts the sorted triangles into clusters and frees
+// the vertices, so memory peaks at the vertices plus a bucket per thread
+// rather than at the whole mesh and its BVH. A mesh filled through
+// getIndices() or addTriangle() instead gets its triangle BVH built in
+// memory first and is cut from that.
+//
+// Without an open cache the mesh stays an ordinary TriangleMesh.
+class PagedMesh : public TriangleMesh
+{
+public:
+	static const unsigned kClusterTriangles = 1024;
+	// Triangles a bucket aims for, and the most built at once before a
+	// bucket is split again
+	static const unsigned kBucketTriangles = 32 * kClusterTriangles;
+	static const unsigned kMaxBucketTriangles = 4 * kBucketTriangles;
+
+	PagedMesh(size_t vertexCount, size_t triangleCount, Material* pMaterial, GeometryCache* pCache)
+		: TriangleMesh(vertexCount, pCache != NULL && pCache->isOpen() ? 0 : triangleCount, pMaterial),
+		pCache(pCache), clusterBvh(), clusterIds(), clusterBounds(), pagedTriangleCount(0),
+		streaming(pCache != NULL && pCache->isOpen()), streamedTriangleCount(streaming ? triangleCount : 0),
+		bucketsReady(false), buckets(), stagedTriangleCount(0), stagingFailed(false), stagingMutex() { }
+
+	virtual ~PagedMesh() { }
+
+	virtual bool intersect(const Ray& ray, Hit& inOutHit);
+	virtual bool doesIntersect(const Ray& ray);
+	virtual void completeIntersection(const Hit& hit, Intersection& intersection);
+
+	virtual void prepare(unsigned threadCount = 1);
+	virtual bool getBounds(BoundingBox& outBounds) const;
+	virtual void addBvhStats(BvhStats& inOutStats) const;
+	virtual bool translate(const Vector& offset);
+
+	// Stages count triangles, the first being triangle firstTriangle of the
+	// mesh, once every vertex is in place; a mesh that doesn't stream copies
+	// them into its indices. The indices must be valid. Thread safe, returns
+	// false if the file can't be written.
+	bool addTriangles(const unsigned* pIndices, size_t firstTriangle, size_t count);
+
+	// Every ray's candidate clusters are queued first, then each queued
+	// cluster is acquired once for all of its rays, so a batch reads a
+	// cluster at most once whatever the cap. Clusters go nearest first and
+	// are skipped once every ray queued for them hit something closer.
+	virtual size_t intersectBatch(const Ray* pRays, size_t count, Hit* inOutHits);
+	virtual bool prefersBatches() const { return isPaged(); }
+
+	bool isStreaming() const { return streaming; }
+	bool isPaged() const { return !clusterIds.empty(); }
+	size_t getClusterCount() const { return clusterIds.size(); }
+	size_t getPagedTriangleCount() const { return pagedTriangleCount; }
+
+protected:
+	// A ray waiting for a cluster in intersectBatch()
+	struct QueuedRay
+	{
+		unsigned cluster;
+		unsigned ray;
+		float entry;
+	};
+
+	// Tests the ray against a resident cluster, clusterIndex is its position
+	// in clusterBvh
+	bool intersectCluster(const GeometryCluster& cluster, unsigned clusterIndex, const Ray& ray, Hit& inOutHit);
+
+	// Builds the BVH of one cluster, writes it with the triangles in its
+	// order and returns its id, or -1
+	int writeCluster(const ClusterTriangle* pTriangles, unsigned count, BoundingBox& outBounds);
+	// Writes the clusters of a bucket, splitting it first if it is too big
+	// to build at once
+	bool writeBucket(const TriangleBuckets& from, size_t bucket, unsigned depth,
+		std::vector<BoundingBox>& inOutBounds, std::vector<int>& inOutIds);
+	void prepareStaged(unsigned threadCount);
+	// Builds clusterBvh over the written clusters
+	void finishClusters(const std::vector<BoundingBox>& bounds, const std::vector<int>& ids, size_t triangleCount,
+		unsigned threadCount);
+
+	GeometryCache* pCache;
+	Bvh clusterBvh;
+	// Cache ids and bounds in clusterBvh's primitive order
+	std::vector<unsigned> clusterIds;
+	std::vector<BoundingBox> clusterBounds;
+	size_t pagedTriangleCount;
+
+	bool streaming;
+	size_t streamedTriangleCount;
+	// Set up by the first addTriangles(), over the bounds of the vertices
+	bool bucketsReady;
+	TriangleBuckets buckets;
+	size_t stagedTriangleCount;
+	// An addTriangles() failed, prepare() then leaves the mesh out
+	bool stagingFailed;
+	std::mutex stagingMutex;
+};
+
+#endif
@@ -0,0 +1,93 @@
+#include "parallel.h"
+#include "numa.h"
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+unsigned defaultThreadCount()
+{
+	unsigned count = std::thread::hardware_concurrency();
+	return count > 0 ? count : 1;
+}
+
+// Every thread is pinned to its node and takes indices from the node's share
+// until it runs out, then helps the other nodes with theirs. The caller only
+// waits, as it may run anywhere.
+static void spreadOverNodes(const NumaTopology& topology, size_t count, unsigned threadCount,
+	const std::function<void(size_t index, unsigned threadIndex)>& fn)
+{
+	unsigned nodeCount = topology.getNodeCount();
+	std::vector<std::atomic<size_t> > nextIndex(nodeCount);
+	std::vector<size_t> shareEnd(nodeCount);
+	for (unsigned node = 0; node < nodeCount; node++)
+	{
+		size_t begin;
+		topology.getShare(node, count, begin, shareEnd[node]);
+		nextIndex[node] = begin;
+	}
+
+	auto worker = [&](unsigned threadIndex)
+	{
+		unsigned node = topology.getThreadNode(threadIndex, threadCount);
+		pinThreadToNode(topology, node);
+		for (unsigned n = 0; n < nodeCount; n++)
+		{
+			unsigned share = (node + n) % nodeCount;
+			for (size_t i = nextIndex[share]++; i < shareEnd[share]; i = nextIndex[share]++)
+				fn(i, threadIndex);
+		}
+	};
+
+	std::vector<std::thread> threads;
+	threads.reserve(threadCount);
+	for (unsigned t = 0; t < threadCount; t++)
+		threads.push_back(std::thread(worker, t));
+	for (size_t t = 0; t < threads.size(); t++)
+		threads[t].join();
+}
+
+void parallelFor(size_t count,
+	unsigned threadCount,
+	const std::function<void(size_t index, unsigned threadIndex)>& fn)
+{
+	if (threadCount == 0)
+		threadCount = defaultThreadCount();
+	if (threadCount > count)
+		threadCount = (unsigned)count;
+
+	if (threadCount <= 1)
+	{
+		for (size_t i = 0; i < count; i++)
+			fn(i, 0);
+		return;
+	}
+
+	const NumaTopology* pPlacement = getNumaPlacement();
+	if (pPlacement != NULL && getPinnedNode() < 0)
+	{
+		spreadOverNodes(*pPlacement, count, threadCount, fn);
+		return;
+	}
+
+	// A pinned caller keeps its threads on its own node
+	int node = getPinnedNode();
+	std::atomic<size_t> nextIndex(0);
+	std::vector<std::thread> threads;
+	threads.reserve(threadCount - 1);
+
+	auto worker = [&](unsigned threadIndex)
+	{
+		if (threadIndex > 0 && node >= 0 && pPlacement != NULL)
+			pinThreadToNode(*pPlacement, (unsigned)node);
+		for (size_t i = nextIndex++; i < count; i = nextIndex++)
+			fn(i, threadIndex);
+	};
+
+	for (unsigned t = 1; t < threadCount; t++)
+		threads.push_back(std::thread(worker, t));
+	worker(0);
+
+	for (size_t t = 0; t < threads.size(); t++)
+		threads[t].join();
+}
@@ -0,0 +1,17 @@
+#ifndef __PARALLEL_H__
+#define __PARALLEL_H__
+
+#include <cstddef>
+#include <functional>
+
+// Number of worker threads to use when none is requested
+unsigned defaultThreadCount();
+
+// Calls fn(index, threadIndex) for every index in [0, count), handing indices
+// out dynamically to threadCount threads. threadCount = 0 uses the default.
+// See setNumaPlacement() for how threads are placed on NUMA machines.
+void parallelFor(size_t count,
+	unsigned threadCount,
+	const std::function<void(size_t index, unsigned threadIndex)>& fn);
+
+#endif
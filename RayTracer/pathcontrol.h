@@ -0,0 +1,58 @@
+#ifndef __PATHCONTROL_H__
+#define __PATHCONTROL_H__
+
+#include "maths.h"
+
+// Russian roulette and splitting for the path tracer. At every surface the
+// path's throughput, albedo included, is compared with a target of
+// 1 / splitFactor: paths well above it split into several continuations and
+// paths below it survive with a probability in proportion. Each continuation
+// is divided by the expected continuation count, which keeps the estimate
+// unbiased and gives every continuation roughly the target throughput.
+class PathControl
+{
+public:
+	// Paths never end by roulette before minDepth and never go past maxDepth
+	// surfaces. A splitFactor of 1 only plays roulette, paths whose
+	// throughput is above the target continue once at their full weight.
+	PathControl(unsigned minDepth, unsigned maxDepth, float splitFactor)
+		: minDepth(minDepth), maxDepth(maxDepth), splitFactor(std::max(splitFactor, 1.0f)) { }
+
+	// Number of continuations of a path leaving a surface at depth, at most
+	// maxCount (> 0), each with its throughput multiplied by outWeight. u is
+	// uniform in [0, 1).
+	unsigned continuations(const Color& throughput, unsigned depth, unsigned maxCount, float u,
+		float& outWeight) const
+	{
+		outWeight = 0.0f;
+		if (depth + 1 >= maxDepth)
+			return 0;
+
+		// brightness() sums the channels, the target is for their mean
+		float expected = throughput.brightness() * (splitFactor / 3.0f);
+		if (depth < minDepth)
+			expected = std::max(expected, 1.0f);
+		// Without splitting, bright paths continue once
+		unsigned limit = splitFactor > 1.0f ? maxCount : 1;
+		expected = std::min(expected, (float)limit);
+		if (!(expected > 0.0f))
+			return 0;
+
+		unsigned count = (unsigned)expected;
+		if (u < expected - count)
+			count++;
+		outWeight = 1.0f / expected;
+		return count;
+	}
+
+	unsigned getMinDepth() const { return minDepth; }
+	unsigned getMaxDepth() const { return maxDepth; }
+	float getSplitFactor() const { return splitFactor; }
+
+protected:
+	unsigned minDepth;
+	unsigned maxDepth;
+	float splitFactor;
+};
+
+#endif
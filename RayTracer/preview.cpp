@@ -0,0 +1,185 @@
+#include "preview.h"
+
+// Pixels per block side at each level
+static const size_t kBlockSizes[kPreviewLevels] = { 16, 4, 1 };
+
+PreviewRenderer::PreviewRenderer(Scene& scene, const RenderSettings& settings, unsigned maxPasses,
+	const PreviewCallback& callback)
+	: scene(scene),
+	maxPasses(std::max(maxPasses, 1u)),
+	callback(callback),
+	levels(),
+	levelImages(),
+	frame(settings.width, settings.height),
+	thread(),
+	mutex(),
+	wake(),
+	cancel(false),
+	stopping(false),
+	idle(false),
+	pPendingCamera(NULL),
+	pendingTime(),
+	changeTime(),
+	awaitingFrame(false),
+	stats()
+{
+	for (unsigned level = 0; level < kPreviewLevels; level++)
+	{
+		RenderSettings levelSettings = settings;
+		levelSettings.width = (settings.width + kBlockSizes[level] - 1) / kBlockSizes[level];
+		levelSettings.height = (settings.height + kBlockSizes[level] - 1) / kBlockSizes[level];
+		levelSettings.aovFlags = 0;
+		levels.push_back(new Renderer(scene, levelSettings));
+		levelImages.push_back(new Image(levelSettings.width, levelSettings.height));
+	}
+}
+
+PreviewRenderer::~PreviewRenderer()
+{
+	stop();
+	delete pPendingCamera;
+	for (unsigned level = 0; level < kPreviewLevels; level++)
+	{
+		delete levels[level];
+		delete levelImages[level];
+	}
+}
+
+void PreviewRenderer::start()
+{
+	if (thread.joinable())
+		return;
+	stopping = false;
+	idle = false;
+	cancel = false;
+	thread = std::thread(&PreviewRenderer::run, this);
+}
+
+void PreviewRenderer::stop()
+{
+	if (!thread.joinable())
+		return;
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stopping = true;
+		cancel = true;
+	}
+	wake.notify_one();
+	thread.join();
+}
+
+void PreviewRenderer::setCamera(Camera* pNewCamera)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (pPendingCamera == NULL)
+			pendingTime = std::chrono::steady_clock::now();
+		delete pPendingCamera;
+		pPendingCamera = pNewCamera;
+		stats.cameraChanges++;
+		cancel = true;
+	}
+	wake.notify_one();
+}
+
+bool PreviewRenderer::isIdle()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return idle && pPendingCamera == NULL;
+}
+
+PreviewStats PreviewRenderer::getStats()
+{
+	std::lock_guard<std::mutex> lock(mutex);
+	return stats;
+}
+
+void PreviewRenderer::run()
+{
+	unsigned level = 0;
+	for (;;)
+	{
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			while (!stopping && idle && pPendingCamera == NULL)
+				wake.wait(lock);
+			if (stopping)
+				return;
+
+			// Only this thread touches the scene, so the camera is swapped
+			// between passes. The renderers see the new revision and restart.
+			if (pPendingCamera != NULL)
+			{
+				std::chrono::duration<double> waited = std::chrono::steady_clock::now() - pendingTime;
+				stats.appliedChanges++;
+				stats.cancelSeconds += waited.count();
+				stats.maxCancelSeconds = std::max(stats.maxCancelSeconds, waited.count());
+				if (!awaitingFrame)
+					changeTime = pendingTime;
+				awaitingFrame = true;
+
+				scene.setCamera(pPendingCamera);
+				pPendingCamera = NULL;
+				cancel = false;
+				idle = false;
+				level = 0;
+			}
+		}
+
+		if (!levels[level]->renderPass(&cancel))
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stats.cancelledPasses++;
+			continue;
+		}
+
+		present(level);
+		if (level + 1 < kPreviewLevels)
+			level++;
+		else if (levels[level]->getPassCount() >= maxPasses)
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			idle = true;
+		}
+	}
+}
+
+void PreviewRenderer::present(unsigned level)
+{
+	const Renderer& renderer = *levels[level];
+	if (kBlockSizes[level] == 1)
+		renderer.resolve(frame);
+	else
+	{
+		// Nearest neighbour, the level's pixels cover whole blocks give or
+		// take the rounding of its size
+		Image& image = *levelImages[level];
+		renderer.resolve(image);
+		size_t width = frame.getWidth(), height = frame.getHeight();
+		size_t levelWidth = image.getWidth(), levelHeight = image.getHeight();
+		const Color* pSource = image.getPixels();
+		Color* pTarget = frame.getPixels();
+		for (size_t y = 0; y < height; y++)
+		{
+			const Color* pRow = pSource + (y * levelHeight / height) * levelWidth;
+			for (size_t x = 0; x < width; x++)
+				pTarget[y * width + x] = pRow[x * levelWidth / width];
+		}
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		stats.frames++;
+		if (awaitingFrame)
+		{
+			std::chrono::duration<double> latency = std::chrono::steady_clock::now() - changeTime;
+			stats.shownChanges++;
+			stats.latencySeconds += latency.count();
+			stats.maxLatencySeconds = std::max(stats.maxLatencySeconds, latency.count());
+			awaitingFrame = false;
+		}
+	}
+
+	if (callback)
+		callback(frame, level, renderer.getPassCount());
+}
@@ -0,0 +1,100 @@
+#ifndef __PREVIEW_H__
+#define __PREVIEW_H__
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "image.h"
+#include "renderer.h"
+
+// Called on the preview thread with the full size frame, which is only
+// valid during the call. level counts up to kPreviewLevels - 1, the full
+// resolution, and passes is the samples per pixel behind it.
+typedef std::function<void(const Image& frame, unsigned level, unsigned passes)> PreviewCallback;
+
+// 1/16, 1/4 and full resolution
+static const unsigned kPreviewLevels = 3;
+
+struct PreviewStats
+{
+	unsigned long long frames;
+	unsigned long long cameraChanges;
+	unsigned long long cancelledPasses;
+	// From setCamera() until the preview thread let go of the old view,
+	// summed over appliedChanges and the largest one. Changes made while
+	// another waited are applied together.
+	unsigned long long appliedChanges;
+	double cancelSeconds, maxCancelSeconds;
+	// From setCamera() until the first frame after it was written, summed
+	// over shownChanges. Changes that never got a frame of their own are
+	// timed from the oldest one.
+	unsigned long long shownChanges;
+	double latencySeconds, maxLatencySeconds;
+
+	PreviewStats()
+		: frames(0), cameraChanges(0), cancelledPasses(0), appliedChanges(0), cancelSeconds(0.0),
+		maxCancelSeconds(0.0), shownChanges(0), latencySeconds(0.0), maxLatencySeconds(0.0) { }
+};
+
+// Interactive renderer for a prepared scene. A background thread renders
+// one sample per 16x16 block first, then per 4x4 block, then refines the
+// full resolution image up to maxPasses, handing each step to the callback
+// upscaled to full size. setCamera() interrupts that within one tile and
+// starts over from the coarsest level with the new view, the scene itself
+// is never prepared again.
+class PreviewRenderer
+{
+public:
+	// settings give the full resolution, AOVs are not recorded
+	PreviewRenderer(Scene& scene, const RenderSettings& settings, unsigned maxPasses,
+		const PreviewCallback& callback);
+
+	virtual ~PreviewRenderer();
+
+	void start();
+	// Waits for the pass in flight to give up
+	void stop();
+
+	// Takes ownership and replaces the scene's camera at the next tile
+	// boundary, from any thread
+	void setCamera(Camera* pNewCamera);
+
+	// True once the current view reached maxPasses
+	bool isIdle();
+
+	PreviewStats getStats();
+
+protected:
+	PreviewRenderer(const PreviewRenderer&);
+	PreviewRenderer& operator =(const PreviewRenderer&);
+
+	void run();
+	void present(unsigned level);
+
+	Scene& scene;
+	unsigned maxPasses;
+	PreviewCallback callback;
+	// One renderer per level, each restarts by itself on the new revision
+	std::vector<Renderer*> levels;
+	std::vector<Image*> levelImages;
+	Image frame;
+
+	std::thread thread;
+	std::mutex mutex;
+	std::condition_variable wake;
+	std::atomic<bool> cancel;
+	bool stopping;
+	bool idle;
+	Camera* pPendingCamera;
+	// When the oldest change not yet applied, and not yet shown, was made
+	std::chrono::steady_clock::time_point pendingTime, changeTime;
+	bool awaitingFrame;
+	PreviewStats stats;
+};
+
+#endif
@@ -0,0 +1,95 @@
+#ifndef __RANDOM_H__
+#define __RANDOM_H__
+
+#include <cstdint>
+
+// Deterministic random numbers for rendering. Every (pixel, sample index)
+// pair starts its own PCG32 stream at a key hashed from the pair, and the
+// d-th number drawn from it is dimension d of that sample. Any dimension can
+// also be reached directly with a RandomJump, so results never depend on
+// how pixels are split into tiles or spread over threads.
+//
+// The free functions are static inline like fastmath.h so the batched
+// kernels get their own copy, kernels must not use the classes.
+
+static const uint64_t kPcgMultiplier = 6364136223846793005ull;
+static const uint64_t kPcgIncrement = 1442695040888963407ull;
+
+// Bijective finalizer (splitmix64), distinct pairs never share a key
+static inline uint64_t randomStreamKey(uint32_t pixelIndex, uint32_t sampleIndex, uint32_t seed = 0)
+{
+	uint64_t z = (((uint64_t)sampleIndex << 32) | pixelIndex) + (uint64_t)seed * 0x9E3779B97F4A7C15ull;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+// PCG XSH-RR output permutation of one state
+static inline uint32_t randomOutput(uint64_t state)
+{
+	uint32_t xorShifted = (uint32_t)(((state >> 18) ^ state) >> 27);
+	uint32_t rotation = (uint32_t)(state >> 59);
+	return (xorShifted >> rotation) | (xorShifted << ((32 - rotation) & 31));
+}
+
+// Top 24 bits, uniform in [0, 1)
+static inline float randomToFloat(uint32_t bits)
+{
+	return (bits >> 8) * (1.0f / 16777216.0f);
+}
+
+// Moves a stream state forward by a fixed number of draws:
+// state * multiplier + increment. Built in O(log steps).
+struct RandomJump
+{
+	uint64_t multiplier;
+	uint64_t increment;
+
+	RandomJump() : multiplier(1), increment(0) { }
+
+	explicit RandomJump(uint64_t steps) : multiplier(1), increment(0)
+	{
+		uint64_t stepMultiplier = kPcgMultiplier;
+		uint64_t stepIncrement = kPcgIncrement;
+		while (steps > 0)
+		{
+			if (steps & 1)
+			{
+				multiplier *= stepMultiplier;
+				increment = increment * stepMultiplier + stepIncrement;
+			}
+			stepIncrement = (stepMultiplier + 1) * stepIncrement;
+			stepMultiplier *= stepMultiplier;
+			steps >>= 1;
+		}
+	}
+
+	uint64_t apply(uint64_t state) const { return state * multiplier + increment; }
+};
+
+class RandomStream
+{
+public:
+	explicit RandomStream(uint64_t key) : state(key) { }
+	RandomStream(uint32_t pixelIndex, uint32_t sampleIndex, uint32_t seed = 0)
+		: state(randomStreamKey(pixelIndex, sampleIndex, seed)) { }
+
+	uint32_t nextBits()
+	{
+		uint64_t old = state;
+		state = old * kPcgMultiplier + kPcgIncrement;
+		return randomOutput(old);
+	}
+
+	// Uniform in [0, 1)
+	float next() { return randomToFloat(nextBits()); }
+
+	void skip(const RandomJump& jump) { state = jump.apply(state); }
+
+	uint64_t getState() const { return state; }
+
+protected:
+	uint64_t state;
+};
+
+#endif
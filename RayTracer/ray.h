@@ -1,6 +1,8 @@
 #ifndef __RAY_H__
 #define __RAY_H__
 
+#include <vector>
+
 #include "maths.h"
 
 // Prevents self intersection
@@ -14,25 +16,90 @@ struct Ray
 	Vector direction;
 	float maxDist;
 
-	Ray() : origin(), direction(0.0f, 0.0f, 1.0f), maxDist(kRayMaxDist) {}
-	Ray(const Ray& r) : origin(r.origin), direction(r.direction), maxDist(r.maxDist) {}
-	Ray(const Point& origin, const Vector& direction, float maxDist = kRayMaxDist)
-		: origin(origin), direction(direction.normalized()), maxDist(maxDist) {}
+	// Within the shutter interval, [0, 1] covers all motion keyframes
+	float time;
+
+	Ray() : origin(), direction(0.0f, 0.0f, 1.0f), maxDist(kRayMaxDist), time(0.0f) {}
+	Ray(const Ray& r) : origin(r.origin), direction(r.direction), maxDist(r.maxDist), time(r.time) {}
+	Ray(const Point& origin, const Vector& direction, float maxDist = kRayMaxDist, float time = 0.0f)
+		: origin(origin), direction(direction.normalized()), maxDist(maxDist), time(time) {}
 
 	inline Ray& operator =(const Ray& r)
 	{
 		origin = r.origin;
 		direction = r.direction;
 		maxDist = r.maxDist;
+		time = r.time;
 		return *this;
 	}
 
 	Point calc(float dist) const;
 };
 
+// Structure of arrays batch of rays, as made by Camera::generateRays()
+struct RaySoA
+{
+	std::vector<float> originX, originY, originZ;
+	std::vector<float> directionX, directionY, directionZ;
+	std::vector<float> time;
+
+	size_t size() const { return time.size(); }
+
+	void resize(size_t count)
+	{
+		originX.resize(count);
+		originY.resize(count);
+		originZ.resize(count);
+		directionX.resize(count);
+		directionY.resize(count);
+		directionZ.resize(count);
+		time.resize(count);
+	}
+
+	Ray getRay(size_t i) const
+	{
+		Ray ray;
+		ray.origin = Point(originX[i], originY[i], originZ[i]);
+		ray.direction = Vector(directionX[i], directionY[i], directionZ[i]);
+		ray.time = time[i];
+		return ray;
+	}
+
+	void setRay(size_t i, const Ray& ray)
+	{
+		originX[i] = ray.origin.x;
+		originY[i] = ray.origin.y;
+		originZ[i] = ray.origin.z;
+		directionX[i] = ray.direction.x;
+		directionY[i] = ray.direction.y;
+		directionZ[i] = ray.direction.z;
+		time[i] = ray.time;
+	}
+};
+
 class Shape;
 class Material;
 
+// Closest hit found so far while tracing a ray, kept small since shapes
+// update it for every closer candidate. Normal, position and material are
+// only worked out for the final hit, see Shape::intersectSurface().
+struct Hit
+{
+	float dist;
+	// Shape that was hit and completes the intersection
+	Shape* pShape;
+	// Shape wrapping pShape, such as an instance or a light, that completes
+	// it instead when set
+	Shape* pOwner;
+	// Triangle index for meshes
+	unsigned primitive;
+	// Barycentric coordinates of the second and third triangle vertices
+	float u, v;
+
+	Hit() : dist(kRayMaxDist), pShape(NULL), pOwner(NULL), primitive(0), u(0.0f), v(0.0f) {}
+	Hit(float dist) : dist(dist), pShape(NULL), pOwner(NULL), primitive(0), u(0.0f), v(0.0f) {}
+};
+
 struct Intersection
 {
 	Ray ray;
@@ -62,6 +129,7 @@ struct Intersection
 		pShape = i.pShape;
 		pMaterial = i.pMaterial;
 		normal = i.normal;
+		return *this;
 	}
 
 	bool intersected() const;
@@ -0,0 +1,104 @@
+#include "raysort.h"
+
+#include <algorithm>
+#include <cstring>
+
+// Origins are quantized to this many bits per axis
+static const unsigned kMortonBits = 9;
+static const unsigned kOctantShift = 3 * kMortonBits;
+
+// The low 10 bits of x moved to every third bit
+static uint32_t spreadBits(uint32_t x)
+{
+	x &= 0x3ff;
+	x = (x | (x << 16)) & 0x030000ff;
+	x = (x | (x << 8)) & 0x0300f00f;
+	x = (x | (x << 4)) & 0x030c30c3;
+	x = (x | (x << 2)) & 0x09249249;
+	return x;
+}
+
+bool parseRayOrder(const char* name, RayOrder& outOrder)
+{
+	if (!strcmp(name, "path"))
+		outOrder = RAY_ORDER_PATH;
+	else if (!strcmp(name, "wavefront"))
+		outOrder = RAY_ORDER_WAVEFRONT;
+	else if (!strcmp(name, "sorted"))
+		outOrder = RAY_ORDER_SORTED;
+	else
+		return false;
+
+	return true;
+}
+
+const char* rayOrderName(RayOrder order)
+{
+	switch (order)
+	{
+	case RAY_ORDER_WAVEFRONT:
+		return "wavefront";
+	case RAY_ORDER_SORTED:
+		return "sorted";
+	default:
+	case RAY_ORDER_PATH:
+		return "path";
+	}
+}
+
+void RaySorter::sort(const Ray* pRays, size_t count, std::vector<unsigned>& outOrder)
+{
+	outOrder.resize(count);
+	if (count == 0)
+		return;
+
+	BoundingBox bounds;
+	for (size_t i = 0; i < count; i++)
+		bounds.grow(pRays[i].origin);
+	const float cells = (float)((1 << kMortonBits) - 1);
+	Vector extent = bounds.max - bounds.min;
+	Vector scale(extent.x > 0.0f ? cells / extent.x : 0.0f, extent.y > 0.0f ? cells / extent.y : 0.0f,
+		extent.z > 0.0f ? cells / extent.z : 0.0f);
+
+	keys.resize(count);
+	for (size_t i = 0; i < count; i++)
+	{
+		const Ray& ray = pRays[i];
+		uint32_t octant = (ray.direction.x < 0.0f ? 1 : 0) | (ray.direction.y < 0.0f ? 2 : 0) |
+			(ray.direction.z < 0.0f ? 4 : 0);
+		uint32_t x = std::min((uint32_t)((ray.origin.x - bounds.min.x) * scale.x), (uint32_t)cells);
+		uint32_t y = std::min((uint32_t)((ray.origin.y - bounds.min.y) * scale.y), (uint32_t)cells);
+		uint32_t z = std::min((uint32_t)((ray.origin.z - bounds.min.z) * scale.z), (uint32_t)cells);
+		keys[i] = (octant << kOctantShift) | (spreadBits(x) << 2) | (spreadBits(y) << 1) | spreadBits(z);
+		outOrder[i] = (unsigned)i;
+	}
+
+	// Least significant digit first, each pass stable
+	scratchKeys.resize(count);
+	scratchOrder.resize(count);
+	for (unsigned shift = 0; shift < kOctantShift + 3; shift += 8)
+	{
+		size_t offsets[256] = { 0 };
+		for (size_t i = 0; i < count; i++)
+			offsets[(keys[i] >> shift) & 0xff]++;
+		if (offsets[(keys[0] >> shift) & 0xff] == count)
+			continue;
+
+		size_t sum = 0;
+		for (unsigned digit = 0; digit < 256; digit++)
+		{
+			size_t digitCount = offsets[digit];
+			offsets[digit] = sum;
+			sum += digitCount;
+		}
+		for (size_t i = 0; i < count; i++)
+		{
+			size_t& offset = offsets[(keys[i] >> shift) & 0xff];
+			scratchKeys[offset] = keys[i];
+			scratchOrder[offset] = outOrder[i];
+			offset++;
+		}
+		keys.swap(scratchKeys);
+		outOrder.swap(scratchOrder);
+	}
+}
@@ -0,0 +1,50 @@
+#ifndef __RAYSORT_H__
+#define __RAYSORT_H__
+
+#include <cstdint>
+#include <vector>
+
+#include "ray.h"
+
+enum RayOrder
+{
+	// Each path is traced to its end before the next one starts
+	RAY_ORDER_PATH = 0,
+	// The paths of a tile advance together one vertex at a time, so every
+	// bounce and its shadow rays are traced as a batch. Bounces go through
+	// Shape::intersectBatch(), which paged meshes use to read each cluster
+	// once per batch.
+	RAY_ORDER_WAVEFRONT = 1,
+	// As wavefront, with every batch sorted by RaySorter first
+	RAY_ORDER_SORTED = 2
+};
+
+// Parses "path", "wavefront" or "sorted"
+bool parseRayOrder(const char* name, RayOrder& outOrder);
+const char* rayOrderName(RayOrder order);
+
+// Puts a batch of rays in an order where neighbours tend to visit the same
+// BVH nodes: by direction octant, then by the Morton code of the origin
+// within the bounds of the batch's origins at 9 bits per axis. The 30 bit
+// keys are radix sorted 8 bits at a time, skipping digits all keys share.
+// The buffers are kept between batches.
+class RaySorter
+{
+public:
+	RaySorter() : keys(), scratchKeys(), scratchOrder() { }
+
+	virtual ~RaySorter() { }
+
+	// outOrder receives the indices of the count rays in traversal order
+	void sort(const Ray* pRays, size_t count, std::vector<unsigned>& outOrder);
+
+protected:
+	RaySorter(const RaySorter&);
+	RaySorter& operator =(const RaySorter&);
+
+	std::vector<uint32_t> keys;
+	std::vector<uint32_t> scratchKeys;
+	std::vector<unsigned> scratchOrder;
+};
+
+#endif
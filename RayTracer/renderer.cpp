@@ -0,0 +1,962 @@
+#include "renderer.h"
+#include "kernels.h"
+#include "numa.h"
+#include "parallel.h"
+#include "random.h"
+#include "raysort.h"
+#include "spectrum.h"
+
+#include <chrono>
+#include <unordered_map>
+#include <vector>
+
+// Camera sample dimensions drawn in a batch before each path starts
+static const unsigned kCameraDimensions = 5;
+
+// Bounds how far splitting can fan out below one camera ray
+static const unsigned kMaxPendingVertices = 32;
+
+// A path vertex still to be traced
+struct PathVertex
+{
+	Ray ray;
+	Color throughput;
+	unsigned depth;
+	bool lastBounceDirac;
+	// Solid angle density of the BRDF sample that led here
+	float lastBrdfPdf;
+
+	PathVertex() : ray(), throughput(1.0f), depth(0), lastBounceDirac(true), lastBrdfPdf(0.0f) { }
+};
+
+// A path between the vertices it traces
+struct PathState
+{
+	RandomStream sampler;
+	Wavelengths wavelengths;
+	// NULL for RGB paths
+	const Wavelengths* pWavelengths;
+	Color result;
+	// Splitting leaves several vertices to trace, depth first
+	PathVertex pending[kMaxPendingVertices];
+	unsigned pendingCount;
+	// Receives the first hit for the AOVs, or NULL
+	PrimaryHit* pHit;
+
+	PathState() : sampler(0), wavelengths(), pWavelengths(NULL), result(), pendingCount(0), pHit(NULL) { }
+};
+
+// Direct light a vertex receives unless its shadow ray is blocked
+struct ShadowSample
+{
+	Ray ray;
+	Color radiance;
+	float scale;
+};
+
+// Queries of one kind for one BRDF queued by Renderer::shadeVertex(), in
+// structure of arrays form. Samples fill in incoming.
+struct BrdfQueryGroup
+{
+	const Brdf* pBrdf;
+	size_t count;
+	// Kept at least count long, so a vertex at a time costs no allocations
+	std::vector<float> incoming[3];
+	std::vector<float> outgoing[3];
+	std::vector<float> normal[3];
+	std::vector<float> u1, u2;
+	std::vector<float> reflectance;
+	std::vector<float> pdf;
+
+	BrdfQueryGroup() : pBrdf(NULL), count(0) { }
+
+	// Return the query's index in the group
+	unsigned addEvaluation(const Vector& inIncoming, const Vector& inOutgoing, const Vector& inNormal);
+	unsigned addSample(const Vector& inOutgoing, const Vector& inNormal, float inU1, float inU2);
+	void clear() { count = 0; }
+	// Each BRDF gets all of its queries in one call
+	void run(bool sample);
+	// Room for one more query
+	void makeRoom();
+};
+
+// The groups of one kind, one per BRDF. Groups stay allocated for the BRDFs
+// seen before and only those used since clear() are run.
+struct BrdfQueryGroups
+{
+	std::vector<BrdfQueryGroup> groups;
+	std::unordered_map<const Brdf*, unsigned> groupIds;
+	std::vector<unsigned> used;
+	const Brdf* pLastBrdf;
+	unsigned lastGroup;
+
+	BrdfQueryGroups() : groups(), groupIds(), used(), pLastBrdf(NULL), lastGroup(0) { }
+
+	BrdfQueryGroup& find(const Brdf* pBrdf, unsigned& outGroup);
+	void clear();
+	void run(bool sample);
+};
+
+// The BRDF work of a wave, Brdf::evaluateSABatch() towards the sampled
+// lights and Brdf::samplePSABatch() for the continuations
+struct BrdfQueries
+{
+	BrdfQueryGroups evaluations;
+	BrdfQueryGroups samples;
+
+	void clear()
+	{
+		evaluations.clear();
+		samples.clear();
+	}
+
+	void run()
+	{
+		evaluations.run(false);
+		samples.run(true);
+	}
+};
+
+// A vertex whose BRDF Renderer::shadeVertex() chose, waiting for its queries
+struct ShadedVertex
+{
+	Point position;
+	Vector normal;
+	float time;
+	unsigned depth;
+	bool dirac;
+	Color surfaceThroughput;
+	// Direct light, lightGroup is -1 without it
+	int lightGroup;
+	unsigned lightQuery;
+	Ray shadowRay;
+	float lightPdf;
+	float cosTheta;
+	Color lightRadiance;
+	// Continuations, consecutive in their group
+	unsigned sampleGroup;
+	unsigned firstSample;
+	unsigned sampleCount;
+	float splitWeight;
+};
+
+// Kept by each thread between its wavefront tiles
+struct WavefrontScratch
+{
+	std::vector<PathState> paths;
+	// Paths with vertices left, in path order
+	std::vector<unsigned> active;
+	std::vector<PathVertex> waveVertices;
+	std::vector<Ray> waveRays;
+	// The wave in tracing order for ShapeSet::intersectBatch()
+	std::vector<Ray> batchRays;
+	std::vector<Hit> batchHits;
+	std::vector<Intersection> intersections;
+	std::vector<char> hits;
+	std::vector<ShadedVertex> shaded;
+	std::vector<char> queued;
+	BrdfQueries queries;
+	std::vector<ShadowSample> shadows;
+	std::vector<unsigned> shadowPaths;
+	std::vector<Ray> shadowRays;
+	std::vector<char> occluded;
+	std::vector<unsigned> order;
+	RaySorter sorter;
+};
+
+static thread_local WavefrontScratch wavefrontScratch;
+static thread_local BrdfQueries pathQueries;
+
+inline float powerHeuristic(float pdf1, float pdf2)
+{
+	float p1 = squared(pdf1);
+	float p2 = squared(pdf2);
+	return (p1 + p2) > 0.0f ? p1 / (p1 + p2) : 0.0f;
+}
+
+unsigned BrdfQueryGroup::addEvaluation(const Vector& inIncoming, const Vector& inOutgoing, const Vector& inNormal)
+{
+	makeRoom();
+	incoming[0][count] = inIncoming.x;
+	incoming[1][count] = inIncoming.y;
+	incoming[2][count] = inIncoming.z;
+	outgoing[0][count] = inOutgoing.x;
+	outgoing[1][count] = inOutgoing.y;
+	outgoing[2][count] = inOutgoing.z;
+	normal[0][count] = inNormal.x;
+	normal[1][count] = inNormal.y;
+	normal[2][count] = inNormal.z;
+	return (unsigned)count++;
+}
+
+unsigned BrdfQueryGroup::addSample(const Vector& inOutgoing, const Vector& inNormal, float inU1, float inU2)
+{
+	makeRoom();
+	outgoing[0][count] = inOutgoing.x;
+	outgoing[1][count] = inOutgoing.y;
+	outgoing[2][count] = inOutgoing.z;
+	normal[0][count] = inNormal.x;
+	normal[1][count] = inNormal.y;
+	normal[2][count] = inNormal.z;
+	u1[count] = inU1;
+	u2[count] = inU2;
+	return (unsigned)count++;
+}
+
+void BrdfQueryGroup::run(bool sample)
+{
+	float* const outIncoming[3] = { &incoming[0][0], &incoming[1][0], &incoming[2][0] };
+	const float* const inOutgoing[3] = { &outgoing[0][0], &outgoing[1][0], &outgoing[2][0] };
+	const float* const inNormal[3] = { &normal[0][0], &normal[1][0], &normal[2][0] };
+	if (sample)
+		pBrdf->samplePSABatch(inOutgoing, inNormal, &u1[0], &u2[0], count, outIncoming, &reflectance[0], &pdf[0]);
+	else
+		pBrdf->evaluateSABatch(outIncoming, inOutgoing, inNormal, count, &reflectance[0], &pdf[0]);
+}
+
+void BrdfQueryGroup::makeRoom()
+{
+	if (count < pdf.size())
+		return;
+
+	size_t size = std::max(2 * count, (size_t)16);
+	for (int c = 0; c < 3; c++)
+	{
+		incoming[c].resize(size);
+		outgoing[c].resize(size);
+		normal[c].resize(size);
+	}
+	u1.resize(size);
+	u2.resize(size);
+	reflectance.resize(size);
+	pdf.resize(size);
+}
+
+BrdfQueryGroup& BrdfQueryGroups::find(const Brdf* pBrdf, unsigned& outGroup)
+{
+	// Neighbouring vertices mostly share their BRDF
+	if (pBrdf != pLastBrdf)
+	{
+		std::pair<std::unordered_map<const Brdf*, unsigned>::iterator, bool> inserted =
+			groupIds.insert(std::make_pair(pBrdf, (unsigned)groups.size()));
+		if (inserted.second)
+		{
+			groups.push_back(BrdfQueryGroup());
+			groups.back().pBrdf = pBrdf;
+		}
+		pLastBrdf = pBrdf;
+		lastGroup = inserted.first->second;
+	}
+
+	outGroup = lastGroup;
+	BrdfQueryGroup& group = groups[lastGroup];
+	if (group.count == 0)
+		used.push_back(lastGroup);
+	return group;
+}
+
+void BrdfQueryGroups::clear()
+{
+	for (size_t i = 0; i < used.size(); i++)
+		groups[used[i]].clear();
+	used.clear();
+}
+
+void BrdfQueryGroups::run(bool sample)
+{
+	for (size_t i = 0; i < used.size(); i++)
+		groups[used[i]].run(sample);
+}
+
+inline bool isFinite(const Color& c)
+{
+	return std::isfinite(c.r) && std::isfinite(c.g) && std::isfinite(c.b);
+}
+
+// Scene colors as the path carries them, pWavelengths is NULL for RGB
+inline Color pathColor(const Color& rgb, const Wavelengths* pWavelengths)
+{
+	return pWavelengths != NULL ? pWavelengths->fromRgb(rgb) : rgb;
+}
+
+// Renderers keep their accumulation in per node tile pools instead of an
+// image under a placement of more than one node
+static bool usesTilePools(const NumaTopology* pPlacement)
+{
+	return pPlacement != NULL && pPlacement->getNodeCount() > 1;
+}
+
+Renderer::Renderer(Scene& scene, const RenderSettings& settings)
+	: scene(scene),
+	settings(settings),
+	accumulation(usesTilePools(getNumaPlacement()) ? 0 : settings.width,
+		usesTilePools(getNumaPlacement()) ? 0 : settings.height),
+	pPlacement(getNumaPlacement()),
+	tilePools(),
+	replicas(),
+	replicaRevision(0),
+	aovAccumulation(settings.width, settings.height, settings.aovFlags),
+	shapeIds(),
+	pathControl(settings.minDepth, settings.maxDepth, settings.splitFactor),
+	passCount(0),
+	stats(),
+	sceneRevision(scene.getRevision())
+{
+	assignShapeIds();
+
+	if (usesTilePools(pPlacement))
+	{
+		// Allocated and cleared by a thread on the node, so the pages are there
+		tilePools.assign(pPlacement->getNodeCount(), NULL);
+		runOnEveryNode([&](unsigned node)
+		{
+			tilePools[node] = newLargeArray<Color>(getTilePoolSize(node));
+		});
+	}
+}
+
+Renderer::~Renderer()
+{
+	for (unsigned node = 0; node < tilePools.size(); node++)
+		deleteLargeArray(tilePools[node], getTilePoolSize(node));
+}
+
+size_t Renderer::getTilePoolSize(unsigned node) const
+{
+	size_t begin, end;
+	pPlacement->getShare(node, settings.getTileCount(), begin, end);
+	return (end - begin) * settings.tileSize * settings.tileSize + 1;
+}
+
+void Renderer::setReplicas(const std::vector<Scene*>& nodeScenes)
+{
+	replicas = nodeScenes;
+	replicaRevision = scene.getRevision();
+	assignShapeIds();
+}
+
+Scene& Renderer::getThreadScene()
+{
+	int node = getPinnedNode();
+	if (node < 0 || (size_t)node >= replicas.size() || replicas[node] == NULL || scene.getRevision() != replicaRevision)
+		return scene;
+	return *replicas[node];
+}
+
+Color* Renderer::getTileAccumulation(size_t tileIndex, size_t& outRowStride)
+{
+	size_t x0, y0, x1, y1;
+	settings.getTileBounds(tileIndex, x0, y0, x1, y1);
+	if (tilePools.empty())
+	{
+		outRowStride = settings.width;
+		return accumulation.getPixels() + y0 * settings.width + x0;
+	}
+
+	size_t tileCount = settings.getTileCount();
+	unsigned node = pPlacement->getShareNode(tileIndex, tileCount);
+	size_t begin, end;
+	pPlacement->getShare(node, tileCount, begin, end);
+	outRowStride = settings.tileSize;
+	return tilePools[node] + (tileIndex - begin) * settings.tileSize * settings.tileSize;
+}
+
+void Renderer::gatherTiles(Image& outImage) const
+{
+	if (tilePools.empty())
+	{
+		std::copy(accumulation.getPixels(), accumulation.getPixels() + settings.width * settings.height,
+			outImage.getPixels());
+		return;
+	}
+	size_t tileCount = settings.getTileCount();
+	for (unsigned node = 0; node < tilePools.size(); node++)
+	{
+		size_t begin, end;
+		pPlacement->getShare(node, tileCount, begin, end);
+		for (size_t tileIndex = begin; tileIndex < end; tileIndex++)
+		{
+			size_t x0, y0, x1, y1;
+			settings.getTileBounds(tileIndex, x0, y0, x1, y1);
+			const Color* pTile = tilePools[node] + (tileIndex - begin) * settings.tileSize * settings.tileSize;
+			for (size_t y = y0; y < y1; y++)
+			{
+				std::copy(pTile + (y - y0) * settings.tileSize, pTile + (y - y0) * settings.tileSize + (x1 - x0),
+					outImage.getPixels() + y * settings.width + x0);
+			}
+		}
+	}
+}
+
+void Renderer::assignShapeIds()
+{
+	shapeIds.clear();
+	if (settings.aovFlags & kAovShapeId)
+	{
+		std::vector<Shape*> shapes;
+		scene.findShapes(shapes);
+		for (size_t i = 0; i < shapes.size(); i++)
+			shapeIds.insert(std::make_pair(shapes[i], (uint32_t)i + 1));
+
+		// Replicas list the same shapes in the same order
+		for (size_t node = 0; node < replicas.size(); node++)
+		{
+			if (replicas[node] == NULL || replicas[node] == &scene)
+				continue;
+			shapes.clear();
+			replicas[node]->findShapes(shapes);
+			for (size_t i = 0; i < shapes.size(); i++)
+				shapeIds.insert(std::make_pair(shapes[i], (uint32_t)i + 1));
+		}
+	}
+}
+
+void Renderer::reset()
+{
+	accumulation.clear();
+	for (unsigned node = 0; node < tilePools.size(); node++)
+		std::fill(tilePools[node], tilePools[node] + getTilePoolSize(node), Color());
+	aovAccumulation.clear();
+	passCount = 0;
+	stats = RenderStats();
+}
+
+bool Renderer::renderPass(const std::atomic<bool>* pCancel)
+{
+	if (scene.getRevision() != sceneRevision)
+	{
+		reset();
+		assignShapeIds();
+		sceneRevision = scene.getRevision();
+	}
+
+	unsigned threadCount = settings.threadCount > 0 ? settings.threadCount : defaultThreadCount();
+	std::vector<RenderStats> threadStats(threadCount);
+	std::atomic<bool> cancelled(false);
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	parallelFor(settings.getTileCount(), threadCount,
+		[&](size_t tileIndex, unsigned threadIndex)
+	{
+		if (pCancel != NULL && pCancel->load(std::memory_order_relaxed))
+		{
+			cancelled = true;
+			return;
+		}
+		size_t rowStride;
+		Color* pTileOrigin = getTileAccumulation(tileIndex, rowStride);
+		renderTile(tileIndex, passCount, pTileOrigin, rowStride, settings.aovFlags != 0 ? &aovAccumulation : NULL,
+			threadStats[threadIndex]);
+	});
+
+	std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+	for (unsigned t = 0; t < threadCount; t++)
+		stats += threadStats[t];
+	stats.renderSeconds += elapsed.count();
+	if (cancelled)
+		return false;
+	passCount++;
+	return true;
+}
+
+void Renderer::render(unsigned passes)
+{
+	for (unsigned i = 0; i < passes; i++)
+		renderPass();
+}
+
+void Renderer::resolve(Image& outImage) const
+{
+	float scale = passCount > 0 ? 1.0f / passCount : 0.0f;
+	if (!tilePools.empty())
+	{
+		gatherTiles(outImage);
+		kernels().scaleFloats(&outImage.getPixels()->r, scale, 4 * settings.width * settings.height,
+			&outImage.getPixels()->r);
+		return;
+	}
+	kernels().scaleFloats(&accumulation.getPixels()->r, scale,
+		4 * settings.width * settings.height, &outImage.getPixels()->r);
+}
+
+void Renderer::resolveAovs(AovBuffers& outBuffers) const
+{
+	aovAccumulation.scale(passCount > 0 ? 1.0f / passCount : 0.0f, outBuffers);
+
+	// Mean squared luminance to the variance of the pixel mean, which is
+	// unknown after a single pass
+	float* pVariance = outBuffers.getPlane(kAovVariancePlane);
+	if (pVariance == NULL)
+		return;
+	const Color* pSums = accumulation.getPixels();
+	Image gathered(tilePools.empty() ? 0 : settings.width, tilePools.empty() ? 0 : settings.height);
+	if (!tilePools.empty())
+	{
+		gatherTiles(gathered);
+		pSums = gathered.getPixels();
+	}
+	const float* pEmission[3] = { outBuffers.getPlane(kAovEmissionR), outBuffers.getPlane(kAovEmissionG),
+		outBuffers.getPlane(kAovEmissionB) };
+	float invPasses = passCount > 0 ? 1.0f / passCount : 0.0f;
+	float invDegrees = passCount > 1 ? 1.0f / (passCount - 1) : 0.0f;
+	for (size_t i = 0; i < settings.width * settings.height; i++)
+	{
+		Color emission(pEmission[0][i], pEmission[1][i], pEmission[2][i]);
+		float mean = (pSums[i] * invPasses - emission).luminance();
+		pVariance[i] = std::max(pVariance[i] - mean * mean, 0.0f) * invDegrees;
+	}
+}
+
+void Renderer::renderTileSamples(size_t tileIndex, unsigned firstPass, unsigned passes,
+	Color* outPixels, RenderStats& tileStats)
+{
+	size_t x0, y0, x1, y1;
+	settings.getTileBounds(tileIndex, x0, y0, x1, y1);
+	for (unsigned pass = firstPass; pass < firstPass + passes; pass++)
+		renderTile(tileIndex, pass, outPixels, x1 - x0, NULL, tileStats);
+}
+
+void Renderer::renderTile(size_t tileIndex, unsigned pass, Color* pTileOrigin, size_t rowStride,
+	AovBuffers* pAovs, RenderStats& tileStats)
+{
+	Scene& tileScene = getThreadScene();
+	Camera* pCamera = tileScene.getCamera();
+	if (pCamera == NULL)
+		return;
+
+	size_t x0, y0, x1, y1;
+	settings.getTileBounds(tileIndex, x0, y0, x1, y1);
+
+	// One random stream per pixel and pass, independent of the tiling
+	size_t sampleCount = (x1 - x0) * (y1 - y0);
+	std::vector<uint64_t> streams(sampleCount);
+	size_t sampleIndex = 0;
+	for (size_t y = y0; y < y1; y++)
+	{
+		for (size_t x = x0; x < x1; x++, sampleIndex++)
+			streams[sampleIndex] = randomStreamKey((uint32_t)(y * settings.width + x), pass);
+	}
+
+	// Camera samples for the whole tile first so its primary rays come from
+	// one batched call
+	SampleBlock samples;
+	samples.resize(sampleCount);
+	float* dimensions[kCameraDimensions] = { &samples.xScreen[0], &samples.yScreen[0],
+		&samples.lensU[0], &samples.lensV[0], &samples.timeU[0] };
+	for (unsigned d = 0; d < kCameraDimensions; d++)
+	{
+		RandomJump jump(d);
+		kernels().randomFloats(&streams[0], sampleCount, jump.multiplier, jump.increment, dimensions[d]);
+	}
+
+	// Square pixels, x spans [0, 1] and y is centred on 0.5
+	float invWidth = 1.0f / settings.width;
+	float halfHeight = 0.5f * settings.height;
+	sampleIndex = 0;
+	for (size_t y = y0; y < y1; y++)
+	{
+		for (size_t x = x0; x < x1; x++, sampleIndex++)
+		{
+			samples.xScreen[sampleIndex] = (x + samples.xScreen[sampleIndex]) * invWidth;
+			samples.yScreen[sampleIndex] = 0.5f + (halfHeight - (y + samples.yScreen[sampleIndex])) * invWidth;
+		}
+	}
+
+	RaySoA rays;
+	pCamera->generateRays(samples, rays);
+	tileStats.cameraRays += rays.size();
+
+	// Paths carry on from the first dimension after the camera's
+	RandomJump pathStart(kCameraDimensions);
+	for (size_t i = 0; i < sampleCount; i++)
+		streams[i] = pathStart.apply(streams[i]);
+
+	std::vector<Color> tileSamples(sampleCount);
+	std::vector<PrimaryHit> hits(pAovs != NULL ? sampleCount : 0);
+	if (settings.rayOrder == RAY_ORDER_PATH)
+	{
+		for (size_t i = 0; i < sampleCount; i++)
+			tileSamples[i] = tracePath(tileScene, rays.getRay(i), streams[i], tileStats, pAovs != NULL ? &hits[i] : NULL);
+	}
+	else
+		traceWavefront(tileScene, rays, &streams[0], pAovs != NULL ? &hits[0] : NULL, &tileSamples[0], tileStats);
+
+	sampleIndex = 0;
+	for (size_t y = y0; y < y1; y++)
+	{
+		for (size_t x = x0; x < x1; x++, sampleIndex++)
+		{
+			const Color& sample = tileSamples[sampleIndex];
+			bool finite = isFinite(sample);
+			if (finite)
+				pTileOrigin[(y - y0) * rowStride + (x - x0)] += sample;
+			if (pAovs != NULL)
+			{
+				pAovs->add(y * settings.width + x, hits[sampleIndex], pass == 0);
+				if (finite)
+					pAovs->addSample(y * settings.width + x, sample, hits[sampleIndex]);
+			}
+		}
+	}
+}
+
+void Renderer::startPath(PathState& path, const Ray& cameraRay, uint64_t streamKey, PrimaryHit* pHit) const
+{
+	path.sampler = RandomStream(streamKey);
+
+	// Spectral paths draw their wavelengths first, RGB ones draw nothing
+	path.pWavelengths = NULL;
+	if (settings.spectral)
+	{
+		path.wavelengths.sample(path.sampler.next());
+		path.pWavelengths = &path.wavelengths;
+	}
+
+	path.result = Color();
+	path.pending[0] = PathVertex();
+	path.pending[0].ray = cameraRay;
+	path.pendingCount = 1;
+	path.pHit = pHit;
+}
+
+bool Renderer::shadeVertex(Scene& pathScene, PathState& path, const PathVertex& vertex, const Intersection& isect,
+	bool hit, ShadedVertex& outShaded, BrdfQueries& inOutQueries)
+{
+	const std::vector<Light*>& lights = pathScene.getLights();
+	EnvironmentLight* pEnvironment = pathScene.getEnvironment();
+	float lightPickPdf = lights.empty() ? 0.0f : 1.0f / lights.size();
+	RandomStream& sampler = path.sampler;
+	const Wavelengths* pWavelengths = path.pWavelengths;
+
+	// Emitters seen directly or through a dirac bounce get full weight
+	const Ray& ray = vertex.ray;
+	const Color& throughput = vertex.throughput;
+	unsigned depth = vertex.depth;
+
+	// AOVs come from the first hit only, which costs nothing when disabled
+	PrimaryHit* pHit = depth == 0 ? path.pHit : NULL;
+
+	if (!hit)
+	{
+		if (pEnvironment != NULL)
+		{
+			float weight = 1.0f;
+			if (!vertex.lastBounceDirac)
+				weight = powerHeuristic(vertex.lastBrdfPdf, pEnvironment->directionPdf(ray.direction) * lightPickPdf);
+			Color radiance = pEnvironment->radiance(ray.direction);
+			path.result.addProduct(throughput * pathColor(radiance, pWavelengths), weight);
+			// Throughput is still one
+			if (pHit != NULL)
+				pHit->emission = radiance * weight;
+		}
+		return false;
+	}
+
+	Point position = isect.position();
+	Vector outgoing = -ray.direction;
+
+	if (pHit != NULL)
+	{
+		pHit->normal = isect.normal;
+		pHit->depth = isect.dist;
+		std::unordered_map<const Shape*, uint32_t>::const_iterator id = shapeIds.find(isect.pShape);
+		pHit->shapeId = id != shapeIds.end() ? id->second : 0;
+	}
+
+	Color emitted = isect.pMaterial->emittance();
+	if (emitted.brightness() > 0.0f)
+	{
+		if (pHit != NULL)
+		{
+			pHit->albedo = emitted;
+			pHit->albedo.clamp();
+			pHit->emission = emitted;
+		}
+
+		float weight = 1.0f;
+		if (!vertex.lastBounceDirac && isect.pShape->isLight())
+		{
+			float lightPdf = static_cast<Light*>(isect.pShape)->intersectPdf(isect) * lightPickPdf;
+			weight = powerHeuristic(vertex.lastBrdfPdf, lightPdf);
+		}
+		path.result.addProduct(throughput * pathColor(emitted, pWavelengths), weight);
+		return false;
+	}
+
+	Brdf* pBrdf = NULL;
+	float brdfWeight = 1.0f;
+	Color albedo = isect.pMaterial->evaluate(position, isect.normal, outgoing, sampler.next(), pBrdf, brdfWeight);
+	if (pHit != NULL)
+		pHit->albedo = albedo;
+	if (pBrdf == NULL)
+		return false;
+
+	Color surfaceThroughput = throughput * pathColor(albedo, pWavelengths) * brdfWeight;
+	outShaded.position = position;
+	outShaded.normal = isect.normal;
+	outShaded.time = ray.time;
+	outShaded.depth = depth;
+	outShaded.dirac = pBrdf->isDiracDistribution();
+	outShaded.surfaceThroughput = surfaceThroughput;
+	outShaded.lightGroup = -1;
+
+	// Direct lighting from one randomly chosen light, the caller traces its
+	// shadow ray
+	float lightChoice = sampler.next();
+	float lightU1 = sampler.next();
+	float lightU2 = sampler.next();
+	float lightU3 = sampler.next();
+	if (!lights.empty() && !pBrdf->isDiracDistribution())
+	{
+		size_t lightIndex = std::min((size_t)(lightChoice * lights.size()), lights.size() - 1);
+		Light* pLight = lights[lightIndex];
+
+		Point lightPosition;
+		Vector lightNormal;
+		float lightPdf = 0.0f;
+		if (pLight->sampleSurface(position, isect.normal, lightU1, lightU2, lightU3,
+			lightPosition, lightNormal, lightPdf) && lightPdf > 0.0f)
+		{
+			Vector toLight = lightPosition - position;
+			float lightDist = toLight.normalize();
+
+			unsigned group = 0;
+			outShaded.lightQuery = inOutQueries.evaluations.find(pBrdf, group).addEvaluation(-toLight, outgoing,
+				isect.normal);
+			outShaded.lightGroup = (int)group;
+			// Stop just short of the light so it doesn't occlude itself
+			outShaded.shadowRay = Ray(position, toLight, lightDist * (1.0f - 1.0e-3f), ray.time);
+			outShaded.lightPdf = lightPdf * lightPickPdf;
+			outShaded.cosTheta = std::fabs(dot(toLight, isect.normal));
+			outShaded.lightRadiance = surfaceThroughput * pathColor(pLight->radiance(toLight), pWavelengths);
+		}
+	}
+
+	// Roulette or split, then continue each path by sampling the BRDF in
+	// projected solid angle, where the cosine cancels out of the weight
+	outShaded.splitWeight = 0.0f;
+	outShaded.sampleCount = pathControl.continuations(surfaceThroughput, depth,
+		kMaxPendingVertices - path.pendingCount, sampler.next(), outShaded.splitWeight);
+	outShaded.sampleGroup = 0;
+	outShaded.firstSample = 0;
+	for (unsigned i = 0; i < outShaded.sampleCount; i++)
+	{
+		BrdfQueryGroup& group = inOutQueries.samples.find(pBrdf, outShaded.sampleGroup);
+		float u1 = sampler.next();
+		float u2 = sampler.next();
+		unsigned index = group.addSample(outgoing, isect.normal, u1, u2);
+		if (i == 0)
+			outShaded.firstSample = index;
+	}
+
+	return true;
+}
+
+bool Renderer::finishVertex(PathState& path, const ShadedVertex& shaded, const BrdfQueries& queries,
+	ShadowSample& outShadow, RenderStats& pathStats)
+{
+	bool shadowed = false;
+	if (shaded.lightGroup >= 0)
+	{
+		const BrdfQueryGroup& group = queries.evaluations.groups[shaded.lightGroup];
+		float reflectance = group.reflectance[shaded.lightQuery];
+		if (reflectance > 0.0f)
+		{
+			outShadow.ray = shaded.shadowRay;
+			pathStats.shadowRays++;
+			float weight = powerHeuristic(shaded.lightPdf, group.pdf[shaded.lightQuery]);
+			outShadow.radiance = shaded.lightRadiance;
+			outShadow.scale = reflectance * shaded.cosTheta * weight / shaded.lightPdf;
+			shadowed = true;
+		}
+	}
+
+	for (unsigned i = 0; i < shaded.sampleCount; i++)
+	{
+		const BrdfQueryGroup& group = queries.samples.groups[shaded.sampleGroup];
+		unsigned q = shaded.firstSample + i;
+		float reflectance = group.reflectance[q];
+		float brdfPdf = group.pdf[q];
+		if (reflectance <= 0.0f || brdfPdf <= 0.0f)
+			continue;
+
+		Vector nextDirection(-group.incoming[0][q], -group.incoming[1][q], -group.incoming[2][q]);
+		PathVertex& next = path.pending[path.pendingCount++];
+		next.ray = Ray(shaded.position, nextDirection, kRayMaxDist, shaded.time);
+		next.throughput = shaded.surfaceThroughput * (reflectance * shaded.splitWeight / brdfPdf);
+		next.depth = shaded.depth + 1;
+		next.lastBounceDirac = shaded.dirac;
+		// MIS compares solid angle densities
+		next.lastBrdfPdf = brdfPdf * std::fabs(dot(nextDirection, shaded.normal));
+	}
+
+	return shadowed;
+}
+
+Color Renderer::tracePath(Scene& pathScene, const Ray& cameraRay, uint64_t streamKey, RenderStats& pathStats,
+	PrimaryHit* pOutHit)
+{
+	ShapeSet& shapes = pathScene.getShapes();
+	PathState path;
+	startPath(path, cameraRay, streamKey, pOutHit);
+
+	while (path.pendingCount > 0)
+	{
+		// Copied out, continuations reuse its slot
+		const PathVertex vertex = path.pending[--path.pendingCount];
+		if (vertex.depth > 0)
+			pathStats.bounceRays++;
+
+		Intersection isect(vertex.ray);
+		bool hit = shapes.intersectSurface(isect);
+		ShadedVertex shaded;
+		pathQueries.clear();
+		if (!shadeVertex(pathScene, path, vertex, isect, hit, shaded, pathQueries))
+			continue;
+
+		// A batch of one, so paths shade exactly as the wavefront does
+		pathQueries.run();
+		ShadowSample shadow;
+		if (finishVertex(path, shaded, pathQueries, shadow, pathStats) && !shapes.doesIntersect(shadow.ray))
+			path.result.addProduct(shadow.radiance, shadow.scale);
+	}
+
+	return path.pWavelengths != NULL ? path.pWavelengths->toRgb(path.result) : path.result;
+}
+
+void Renderer::traceWavefront(Scene& pathScene, const RaySoA& cameraRays, const uint64_t* pStreamKeys,
+	PrimaryHit* pHits, Color* outSamples, RenderStats& tileStats)
+{
+	WavefrontScratch& scratch = wavefrontScratch;
+	ShapeSet& shapes = pathScene.getShapes();
+	bool sorted = settings.rayOrder == RAY_ORDER_SORTED;
+
+	size_t pathCount = cameraRays.size();
+	if (scratch.paths.size() < pathCount)
+		scratch.paths.resize(pathCount);
+	scratch.active.clear();
+	for (size_t p = 0; p < pathCount; p++)
+	{
+		startPath(scratch.paths[p], cameraRays.getRay(p), pStreamKeys[p], pHits != NULL ? &pHits[p] : NULL);
+		scratch.active.push_back((unsigned)p);
+	}
+
+	// Every wave takes the next vertex of each path, so each path still
+	// traces its vertices and draws its random numbers in the same order
+	for (unsigned wave = 0; !scratch.active.empty(); wave++)
+	{
+		size_t waveSize = scratch.active.size();
+		scratch.waveVertices.resize(waveSize);
+		scratch.waveRays.resize(waveSize);
+		for (size_t k = 0; k < waveSize; k++)
+		{
+			PathState& path = scratch.paths[scratch.active[k]];
+			scratch.waveVertices[k] = path.pending[--path.pendingCount];
+			scratch.waveRays[k] = scratch.waveVertices[k].ray;
+			if (scratch.waveVertices[k].depth > 0)
+				tileStats.bounceRays++;
+		}
+
+		// The first wave is camera rays, the ones after it are timed as
+		// secondary with their sorting
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		if (sorted)
+			scratch.sorter.sort(&scratch.waveRays[0], waveSize, scratch.order);
+		scratch.batchRays.resize(waveSize);
+		scratch.batchHits.resize(waveSize);
+		for (size_t i = 0; i < waveSize; i++)
+		{
+			size_t k = sorted ? scratch.order[i] : i;
+			scratch.batchRays[i] = scratch.waveRays[k];
+			scratch.batchHits[i] = Hit(scratch.waveRays[k].maxDist);
+		}
+
+		// The whole wave at once, so a paged mesh reads each cluster once
+		// per wave instead of once per ray that reaches it
+		shapes.intersectBatch(&scratch.batchRays[0], waveSize, &scratch.batchHits[0]);
+		scratch.intersections.resize(waveSize);
+		scratch.hits.resize(waveSize);
+		for (size_t i = 0; i < waveSize; i++)
+		{
+			size_t k = sorted ? scratch.order[i] : i;
+			const Hit& hit = scratch.batchHits[i];
+			scratch.intersections[k] = Intersection(scratch.waveRays[k]);
+			scratch.hits[k] = hit.pShape != NULL ? 1 : 0;
+			if (hit.pShape != NULL)
+				Shape::completeHit(hit, scratch.intersections[k]);
+		}
+		std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
+		if (wave > 0)
+		{
+			tileStats.secondaryRays += waveSize;
+			tileStats.secondarySeconds += std::chrono::duration<double>(end - start).count();
+		}
+
+		// Each vertex queues its BRDF work, which then runs a BRDF at a time
+		// through the batched kernels
+		scratch.shaded.resize(waveSize);
+		scratch.queued.resize(waveSize);
+		scratch.queries.clear();
+		for (size_t k = 0; k < waveSize; k++)
+		{
+			scratch.queued[k] = shadeVertex(pathScene, scratch.paths[scratch.active[k]], scratch.waveVertices[k],
+				scratch.intersections[k], scratch.hits[k] != 0, scratch.shaded[k], scratch.queries) ? 1 : 0;
+		}
+		scratch.queries.run();
+
+		scratch.shadows.clear();
+		scratch.shadowPaths.clear();
+		for (size_t k = 0; k < waveSize; k++)
+		{
+			ShadowSample shadow;
+			if (scratch.queued[k] && finishVertex(scratch.paths[scratch.active[k]], scratch.shaded[k], scratch.queries,
+				shadow, tileStats))
+			{
+				scratch.shadows.push_back(shadow);
+				scratch.shadowPaths.push_back(scratch.active[k]);
+			}
+		}
+
+		size_t shadowCount = scratch.shadows.size();
+		start = std::chrono::steady_clock::now();
+		scratch.shadowRays.resize(shadowCount);
+		for (size_t s = 0; s < shadowCount; s++)
+			scratch.shadowRays[s] = scratch.shadows[s].ray;
+		if (sorted && shadowCount > 0)
+			scratch.sorter.sort(&scratch.shadowRays[0], shadowCount, scratch.order);
+		scratch.occluded.resize(shadowCount);
+		for (size_t i = 0; i < shadowCount; i++)
+		{
+			size_t s = sorted ? scratch.order[i] : i;
+			scratch.occluded[s] = shapes.doesIntersect(scratch.shadowRays[s]) ? 1 : 0;
+		}
+		end = std::chrono::steady_clock::now();
+		if (wave > 0)
+		{
+			tileStats.secondaryRays += shadowCount;
+			tileStats.secondarySeconds += std::chrono::duration<double>(end - start).count();
+		}
+
+		for (size_t s = 0; s < shadowCount; s++)
+		{
+			if (!scratch.occluded[s])
+				scratch.paths[scratch.shadowPaths[s]].result.addProduct(scratch.shadows[s].radiance, scratch.shadows[s].scale);
+		}
+
+		size_t remaining = 0;
+		for (size_t k = 0; k < waveSize; k++)
+		{
+			if (scratch.paths[scratch.active[k]].pendingCount > 0)
+				scratch.active[remaining++] = scratch.active[k];
+		}
+		scratch.active.resize(remaining);
+	}
+
+	for (size_t p = 0; p < pathCount; p++)
+	{
+		const PathState& path = scratch.paths[p];
+		outSamples[p] = path.pWavelengths != NULL ? path.pWavelengths->toRgb(path.result) : path.result;
+	}
+}
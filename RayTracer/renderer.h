@@ -0,0 +1,182 @@
+#ifndef __RENDERER_H__
+#define __RENDERER_H__
+
+#include <atomic>
+#include <unordered_map>
+
+#include "aov.h"
+#include "image.h"
+#include "pathcontrol.h"
+#include "raysort.h"
+#include "scene.h"
+
+struct RenderSettings
+{
+	size_t width, height;
+	unsigned maxDepth;
+	// Russian roulette starts at minDepth, see PathControl
+	unsigned minDepth;
+	float splitFactor;
+	// 0 = use every hardware thread
+	unsigned threadCount;
+	size_t tileSize;
+	// AovFlags recorded during renderPass()
+	unsigned aovFlags;
+	// Trace four wavelengths per path instead of RGB, see spectrum.h
+	bool spectral;
+	// How the paths of a tile are traced, the image is the same in every order
+	RayOrder rayOrder;
+
+	RenderSettings()
+		: width(512), height(512), maxDepth(8), minDepth(3), splitFactor(1.0f), threadCount(0), tileSize(16),
+		aovFlags(0), spectral(false), rayOrder(RAY_ORDER_PATH) { }
+
+	size_t getTilesX() const { return (width + tileSize - 1) / tileSize; }
+	size_t getTilesY() const { return (height + tileSize - 1) / tileSize; }
+	size_t getTileCount() const { return getTilesX() * getTilesY(); }
+
+	// Pixel rectangle [x0, x1) x [y0, y1) of a tile, row major from the top left
+	void getTileBounds(size_t tileIndex, size_t& outX0, size_t& outY0, size_t& outX1, size_t& outY1) const
+	{
+		outX0 = (tileIndex % getTilesX()) * tileSize;
+		outY0 = (tileIndex / getTilesX()) * tileSize;
+		outX1 = std::min(outX0 + tileSize, width);
+		outY1 = std::min(outY0 + tileSize, height);
+	}
+};
+
+struct RenderStats
+{
+	unsigned long long cameraRays;
+	unsigned long long bounceRays;
+	unsigned long long shadowRays;
+	double renderSeconds;
+	// Bounce rays and the shadow rays of their hits traced in batches by the
+	// wavefront orders, and the thread time spent sorting and tracing them
+	unsigned long long secondaryRays;
+	double secondarySeconds;
+
+	RenderStats() : cameraRays(0), bounceRays(0), shadowRays(0), renderSeconds(0.0), secondaryRays(0),
+		secondarySeconds(0.0) { }
+
+	unsigned long long totalRays() const { return cameraRays + bounceRays + shadowRays; }
+
+	RenderStats& operator +=(const RenderStats& s)
+	{
+		cameraRays += s.cameraRays;
+		bounceRays += s.bounceRays;
+		shadowRays += s.shadowRays;
+		renderSeconds += s.renderSeconds;
+		secondaryRays += s.secondaryRays;
+		secondarySeconds += s.secondarySeconds;
+		return *this;
+	}
+};
+
+struct NumaTopology;
+struct PathState;
+struct PathVertex;
+struct ShadowSample;
+struct ShadedVertex;
+struct BrdfQueries;
+
+// Progressive path tracer, each pass adds one sample to every pixel. Pass p
+// of pixel i draws from random stream (i, p), so images are bit identical
+// whatever the thread count or tile size.
+//
+// Under a NUMA placement the accumulation lives in tiles allocated on the
+// node whose threads render them first, see setNumaPlacement(), and threads
+// can read a copy of the scene on their own node.
+class Renderer
+{
+public:
+	Renderer(Scene& scene, const RenderSettings& settings);
+
+	virtual ~Renderer();
+
+	void reset();
+
+	// Copies of the scene made by SceneReplicas, threads pinned to node n
+	// read nodeScenes[n]. They are only used until the scene is edited, as
+	// edits don't reach them.
+	void setReplicas(const std::vector<Scene*>& nodeScenes);
+
+	// Restarts first if the scene was edited since the last pass. Tiles not
+	// yet started are skipped once *pCancel is set, the pass then returns
+	// false and isn't counted, leaving the accumulation partly updated until
+	// the next reset().
+	bool renderPass(const std::atomic<bool>* pCancel = NULL);
+	void render(unsigned passes);
+
+	// Writes the average of all passes so far, outImage must match the render size
+	void resolve(Image& outImage) const;
+
+	// The same for the AOVs, outBuffers must match the render size and flags.
+	// The variance plane becomes the variance of each pixel's mean.
+	void resolveAovs(AovBuffers& outBuffers) const;
+
+	// Adds passes [firstPass, firstPass + passes) of one tile to outPixels,
+	// a row major tile sized buffer, without touching the accumulation. Gives
+	// exactly the samples renderPass() would for those passes.
+	void renderTileSamples(size_t tileIndex, unsigned firstPass, unsigned passes,
+		Color* outPixels, RenderStats& tileStats);
+
+	unsigned getPassCount() const { return passCount; }
+	const RenderStats& getStats() const { return stats; }
+	const RenderSettings& getSettings() const { return settings; }
+
+protected:
+	Renderer(const Renderer&);
+	Renderer& operator =(const Renderer&);
+
+	void assignShapeIds();
+	// The calling thread's copy of the scene
+	Scene& getThreadScene();
+	// Where a tile's pixels accumulate, row by row
+	Color* getTileAccumulation(size_t tileIndex, size_t& outRowStride);
+	size_t getTilePoolSize(unsigned node) const;
+	// Adds one sample per pixel, pixel (x0, y0) of the tile goes to pTileOrigin.
+	// pAovs is NULL or receives the primary hits.
+	void renderTile(size_t tileIndex, unsigned pass, Color* pTileOrigin, size_t rowStride,
+		AovBuffers* pAovs, RenderStats& tileStats);
+	// Sets up a path drawing from random stream streamKey
+	void startPath(PathState& path, const Ray& cameraRay, uint64_t streamKey, PrimaryHit* pHit) const;
+	// Adds what the vertex sees at isect, or of the environment without a
+	// hit. If the path goes on, chooses its BRDF, draws the light and
+	// continuation samples, queues their BRDF work in inOutQueries and
+	// returns true. Once the queries have run, finishVertex() pushes the
+	// vertices continuing the path and returns true if direct light was
+	// sampled, the caller then adds outShadow unless its ray is blocked.
+	bool shadeVertex(Scene& pathScene, PathState& path, const PathVertex& vertex, const Intersection& isect, bool hit,
+		ShadedVertex& outShaded, BrdfQueries& inOutQueries);
+	bool finishVertex(PathState& path, const ShadedVertex& shaded, const BrdfQueries& queries, ShadowSample& outShadow,
+		RenderStats& pathStats);
+	// The path's radiance in RGB, also when it is traced spectrally
+	Color tracePath(Scene& pathScene, const Ray& cameraRay, uint64_t streamKey, RenderStats& pathStats,
+		PrimaryHit* pOutHit);
+	// The same for all paths of a tile a vertex at a time, see RayOrder.
+	// pHits is NULL or gets one primary hit per path.
+	void traceWavefront(Scene& pathScene, const RaySoA& cameraRays, const uint64_t* pStreamKeys, PrimaryHit* pHits,
+		Color* outSamples, RenderStats& tileStats);
+	// The accumulation in image layout
+	void gatherTiles(Image& outImage) const;
+
+	Scene& scene;
+	RenderSettings settings;
+	Image accumulation;
+	// With more than one node, one pool per node holds the tiles of its share
+	// at tileSize pixels per row, and accumulation is left empty
+	const NumaTopology* pPlacement;
+	std::vector<Color*> tilePools;
+	std::vector<Scene*> replicas;
+	unsigned long long replicaRevision;
+	AovBuffers aovAccumulation;
+	std::unordered_map<const Shape*, uint32_t> shapeIds;
+	PathControl pathControl;
+	unsigned passCount;
+	RenderStats stats;
+	// Scene::getRevision() the accumulation belongs to
+	unsigned long long sceneRevision;
+};
+
+#endif
@@ -1,6 +1,7 @@
 #ifndef __SAMPLING_H__
 #define __SAMPLING_H__
 
+#include "fastmath.h"
 #include "maths.h"
 
 inline void concentricSampleDisc(float u1, float u2, float& outDx, float& outDy)
@@ -46,9 +47,10 @@ inline void concentricSampleDisc(float u1, float u2, float& outDx, float& outDy)
 		}
 	}
 
-	theta *= M_PI / 4.0f;
-	outDx = r * std::cos(theta);
-	outDy = r * std::sin(theta);
+	float sinTheta, cosTheta;
+	fastSinCos(theta * (float)(M_PI / 4.0), sinTheta, cosTheta);
+	outDx = r * cosTheta;
+	outDy = r * sinTheta;
 }
 
 inline Vector uniformToSphere(float u1, float u2)
@@ -57,26 +59,29 @@ inline Vector uniformToSphere(float u1, float u2)
 
 	float radius = std::sqrt(std::max(0.0f, 1.0f - squared(z)));
 
-	float phi = M_PI * 2.0f * u2;
+	float sinPhi, cosPhi;
+	fastSinCos((float)(M_PI * 2.0) * u2, sinPhi, cosPhi);
 
-	return Vector(radius * std::cos(phi), radius * std::sin(phi), z);
+	return Vector(radius * cosPhi, radius * sinPhi, z);
 }
 
-inline void uniformToUniformDisc(float u1, float u2, float& uDx, float uDy)
+inline void uniformToUniformDisc(float u1, float u2, float& uDx, float& uDy)
 {
 	float radius = std::sqrt(u1);
-	float theta = M_PI * 2.0f * u2;
+	float sinTheta, cosTheta;
+	fastSinCos((float)(M_PI * 2.0) * u2, sinTheta, cosTheta);
 
-	uDx = radius * std::cos(theta);
-	uDy = radius * std::sin(theta);
+	uDx = radius * cosTheta;
+	uDy = radius * sinTheta;
 }
 
 inline Vector uniformToHemisphere(float u1, float u2)
 {
 	float radius = std::sqrt(std::max(0.0f, 1.0f - squared(u1)));
-	float phi = M_PI * 2.0f * u2;
-	return Vector(radius * std::cos(phi),
-		radius * std::sin(phi),
+	float sinPhi, cosPhi;
+	fastSinCos((float)(M_PI * 2.0) * u2, sinPhi, cosPhi);
+	return Vector(radius * cosPhi,
+		radius * sinPhi,
 		u1);
 }
 
@@ -93,8 +98,9 @@ inline Vector uniformToCone(float u1, float u2, float cosThetaMax)
 {
 	float cosTheta = u1 * (cosThetaMax - 1.0f) + 1.0f;
 	float sinTheta = std::sqrt(std::max(0.0f, 1.0f - squared(cosTheta)));
-	float phi = u2 * M_PI * 2.0f;
-	return Vector(std::cos(phi) * sinTheta, std::sin(phi) * sinTheta, cosTheta);
+	float sinPhi, cosPhi;
+	fastSinCos(u2 * (float)(M_PI * 2.0), sinPhi, cosPhi);
+	return Vector(cosPhi * sinTheta, sinPhi * sinTheta, cosTheta);
 }
 
 inline float uniformConePdf(float cosThetaMax)
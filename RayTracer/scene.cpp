@@ -0,0 +1,189 @@
+#include "scene.h"
+
+#include <algorithm>
+
+void Scene::clear()
+{
+	delete pCamera;
+	pCamera = NULL;
+	delete pEnvironment;
+	pEnvironment = NULL;
+
+	shapes.clearShapes();
+	lights.clear();
+
+	for (std::vector<Shape*>::iterator iter = prototypes.begin();
+		iter != prototypes.end();
+		iter++)
+	{
+		delete *iter;
+	}
+	prototypes.clear();
+
+	for (std::vector<ShapeBlock*>::iterator iter = shapeBlocks.begin();
+		iter != shapeBlocks.end();
+		iter++)
+	{
+		delete *iter;
+	}
+	shapeBlocks.clear();
+
+	for (std::vector<Material*>::iterator iter = materials.begin();
+		iter != materials.end();
+		iter++)
+	{
+		delete *iter;
+	}
+	materials.clear();
+
+	prepared = false;
+	revision++;
+}
+
+void Scene::setCamera(Camera* pNewCamera)
+{
+	delete pCamera;
+	pCamera = pNewCamera;
+	revision++;
+}
+
+void Scene::setEnvironment(EnvironmentLight* pNewEnvironment)
+{
+	delete pEnvironment;
+	pEnvironment = pNewEnvironment;
+	if (prepared)
+	{
+		if (pEnvironment != NULL)
+			pEnvironment->prepare();
+		updateLights();
+	}
+	revision++;
+}
+
+Material* Scene::addMaterial(Material* pMaterial)
+{
+	if (pMaterial != NULL)
+		materials.push_back(pMaterial);
+	return pMaterial;
+}
+
+void Scene::addShape(Shape* pShape)
+{
+	if (pShape == NULL)
+		return;
+
+	shapes.addShape(pShape);
+	if (prepared && pShape->isLight())
+		updateLights();
+	revision++;
+}
+
+bool Scene::moveShape(Shape* pShape, const Vector& offset)
+{
+	if (!shapes.hasShape(pShape))
+		return false;
+	if (offset.x == 0.0f && offset.y == 0.0f && offset.z == 0.0f)
+		return true;
+
+	if (!pShape->translate(offset))
+		return false;
+	shapes.shapeChanged(pShape);
+	revision++;
+	return true;
+}
+
+bool Scene::removeShape(Shape* pShape)
+{
+	bool light = pShape != NULL && pShape->isLight();
+	if (!shapes.removeShape(pShape))
+		return false;
+
+	if (prepared && light)
+		updateLights();
+	revision++;
+	return true;
+}
+
+bool Scene::setShapeMaterial(Shape* pShape, Material* pMaterial)
+{
+	if (!shapes.hasShape(pShape))
+		return false;
+
+	if (!pShape->setMaterial(pMaterial))
+		return false;
+	revision++;
+	return true;
+}
+
+void Scene::materialChanged(const Material* pMaterial)
+{
+	if (std::find(materials.begin(), materials.end(), pMaterial) != materials.end())
+		revision++;
+}
+
+Shape* Scene::addPrototype(Shape* pPrototype)
+{
+	if (pPrototype != NULL)
+		prototypes.push_back(pPrototype);
+	return pPrototype;
+}
+
+void Scene::findShapes(std::vector<Shape*>& outShapes)
+{
+	shapes.findShapes(outShapes);
+	for (std::vector<Shape*>::iterator iter = prototypes.begin();
+		iter != prototypes.end();
+		iter++)
+	{
+		(*iter)->findShapes(outShapes);
+	}
+}
+
+BvhStats Scene::getBvhStats() const
+{
+	BvhStats stats;
+	shapes.addBvhStats(stats);
+	for (std::vector<Shape*>::const_iterator iter = prototypes.begin();
+		iter != prototypes.end();
+		iter++)
+	{
+		(*iter)->addBvhStats(stats);
+	}
+	return stats;
+}
+
+void Scene::prepare(unsigned threadCount)
+{
+	// Instances take their bounds from already prepared prototypes
+	for (std::vector<Shape*>::iterator iter = prototypes.begin();
+		iter != prototypes.end();
+		iter++)
+	{
+		(*iter)->prepare(threadCount);
+	}
+
+	shapes.prepare(threadCount);
+
+	if (pEnvironment != NULL)
+		pEnvironment->prepare();
+	updateLights();
+
+	prepared = true;
+	revision++;
+}
+
+void Scene::updateLights()
+{
+	std::list<Shape*> lightList;
+	shapes.findLights(lightList);
+	lights.clear();
+	for (std::list<Shape*>::iterator iter = lightList.begin();
+		iter != lightList.end();
+		iter++)
+	{
+		lights.push_back(static_cast<Light*>(*iter));
+	}
+
+	if (pEnvironment != NULL)
+		lights.push_back(pEnvironment);
+}
@@ -0,0 +1,121 @@
+#ifndef __SCENE_H__
+#define __SCENE_H__
+
+#include <list>
+#include <vector>
+
+#include "camera.h"
+#include "environmentlight.h"
+#include "light.h"
+#include "material.h"
+#include "shape.h"
+
+// Owns everything needed to render: camera, materials, shapes and lights,
+// including an optional environment around everything else
+class Scene
+{
+public:
+	Scene()
+		: pCamera(NULL), pEnvironment(NULL), shapes(), prototypes(), shapeBlocks(), materials(), lights(),
+		prepared(false), revision(0) { }
+
+	virtual ~Scene() { clear(); }
+
+	void clear();
+
+	void setCamera(Camera* pNewCamera);
+	void setEnvironment(EnvironmentLight* pNewEnvironment);
+	Material* addMaterial(Material* pMaterial);
+
+	// Also an edit once the scene is prepared, see moveShape()
+	void addShape(Shape* pShape);
+
+	// Allocates count default constructed shapes in one contiguous block owned
+	// by the scene, callers add them to a shape set themselves
+	template <class T>
+	T* allocateShapes(size_t count)
+	{
+		T* pBlock = new T[count];
+		shapeBlocks.push_back(new TypedShapeBlock<T>(pBlock));
+		return pBlock;
+	}
+
+	// As allocateShapes() but also adds them to the scene, callers assign
+	// each one in place before prepare()
+	template <class T>
+	T* createShapes(size_t count)
+	{
+		T* pBlock = allocateShapes<T>(count);
+		for (size_t i = 0; i < count; i++)
+			shapes.addShape(&pBlock[i], false);
+		return pBlock;
+	}
+
+	// Shared geometry for instances, owned by the scene and prepared before
+	// the top level shapes. Not rendered unless an Instance refers to it.
+	Shape* addPrototype(Shape* pPrototype);
+
+	// Must be called after the scene is built and before rendering,
+	// threadCount = 0 uses the default
+	void prepare(unsigned threadCount);
+
+	// Every shape an intersection can report, in the order they were added
+	// with prototype shapes last
+	void findShapes(std::vector<Shape*>& outShapes);
+
+	// Size and SAH cost of the BVHs, prototypes counted once
+	BvhStats getBvhStats() const;
+
+	// Edits for interactive changes, cheap after prepare(): the BVHs are
+	// refitted bottom up, or rebuilt once refits have degraded them too far,
+	// and nothing else is prepared again. Only shapes added with addShape()
+	// can be edited, moving an instance moves all of it. False if the shape
+	// is not one of those or doesn't support the edit.
+	bool moveShape(Shape* pShape, const Vector& offset);
+	// Deletes the shape unless it came from createShapes()
+	bool removeShape(Shape* pShape);
+	bool setShapeMaterial(Shape* pShape, Material* pMaterial);
+	// Call after changing the parameters of one of the scene's materials
+	void materialChanged(const Material* pMaterial);
+
+	// Changes whenever anything a render depends on is edited, renderers
+	// restart their accumulation when it does
+	unsigned long long getRevision() const { return revision; }
+
+	Camera* getCamera() const { return pCamera; }
+	EnvironmentLight* getEnvironment() const { return pEnvironment; }
+	ShapeSet& getShapes() { return shapes; }
+	// Includes the environment, which isn't one of the shapes
+	const std::vector<Light*>& getLights() const { return lights; }
+
+protected:
+	Scene(const Scene&);
+	Scene& operator =(const Scene&);
+
+	struct ShapeBlock
+	{
+		virtual ~ShapeBlock() { }
+	};
+
+	template <class T>
+	struct TypedShapeBlock : public ShapeBlock
+	{
+		TypedShapeBlock(T* pShapes) : pShapes(pShapes) { }
+		virtual ~TypedShapeBlock() { delete[] pShapes; }
+		T* pShapes;
+	};
+
+	Camera* pCamera;
+	EnvironmentLight* pEnvironment;
+	ShapeSet shapes;
+	std::vector<Shape*> prototypes;
+	std::vector<ShapeBlock*> shapeBlocks;
+	std::vector<Material*> materials;
+	std::vector<Light*> lights;
+	bool prepared;
+	unsigned long long revision;
+
+	void updateLights();
+};
+
+#endif
@@ -0,0 +1,1108 @@
+#include "sceneloader.h"
+#include "environmentlight.h"
+#include "instance.h"
+#include "light.h"
+#include "mappedfile.h"
+#include "mesh.h"
+#include "pagedmesh.h"
+#include "parallel.h"
+
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+// A view into the mapped file, nothing is copied while parsing
+struct Token
+{
+	const char* begin;
+	const char* end;
+
+	Token() : begin(NULL), end(NULL) { }
+	Token(const char* begin, const char* end) : begin(begin), end(end) { }
+
+	size_t length() const { return end - begin; }
+
+	bool equals(const char* text) const
+	{
+		size_t textLength = strlen(text);
+		return length() == textLength && !memcmp(begin, text, textLength);
+	}
+};
+
+static inline bool isSpace(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline bool isDigit(char c)
+{
+	return c >= '0' && c <= '9';
+}
+
+static double powerOfTen(int exponent)
+{
+	static const double exact[] =
+	{
+		1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+		1e11, 1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+	};
+
+	if (exponent >= 0 && exponent <= 22)
+		return exact[exponent];
+	if (exponent < 0 && exponent >= -22)
+		return 1.0 / exact[-exponent];
+	return std::pow(10.0, exponent);
+}
+
+static bool parseFloat(const Token& token, float& outValue)
+{
+	const char* p = token.begin;
+	const char* end = token.end;
+
+	bool negative = false;
+	if (p < end && (*p == '-' || *p == '+'))
+	{
+		negative = *p == '-';
+		p++;
+	}
+
+	// Up to 19 significant digits fit in the mantissa, the rest only scale
+	unsigned long long mantissa = 0;
+	int significantDigits = 0;
+	int exponent = 0;
+	bool anyDigits = false;
+
+	for (; p < end && isDigit(*p); p++)
+	{
+		anyDigits = true;
+		if (significantDigits < 19)
+		{
+			mantissa = mantissa * 10 + (*p - '0');
+			if (mantissa > 0)
+				significantDigits++;
+		}
+		else
+		{
+			exponent++;
+		}
+	}
+
+	if (p < end && *p == '.')
+	{
+		for (p++; p < end && isDigit(*p); p++)
+		{
+			anyDigits = true;
+			if (significantDigits < 19)
+			{
+				mantissa = mantissa * 10 + (*p - '0');
+				if (mantissa > 0)
+					significantDigits++;
+				exponent--;
+			}
+		}
+	}
+
+	if (!anyDigits)
+		return false;
+
+	if (p < end && (*p == 'e' || *p == 'E'))
+	{
+		p++;
+		bool negativeExponent = false;
+		if (p < end && (*p == '-' || *p == '+'))
+		{
+			negativeExponent = *p == '-';
+			p++;
+		}
+
+		if (p == end || !isDigit(*p))
+			return false;
+
+		int exponentValue = 0;
+		for (; p < end && isDigit(*p); p++)
+		{
+			if (exponentValue < 10000)
+				exponentValue = exponentValue * 10 + (*p - '0');
+		}
+		exponent += negativeExponent ? -exponentValue : exponentValue;
+	}
+
+	if (p != end)
+		return false;
+
+	double value = (double)mantissa * powerOfTen(exponent);
+	outValue = (float)(negative ? -value : value);
+	return true;
+}
+
+static bool parseUnsigned(const Token& token, unsigned long long& outValue)
+{
+	if (token.length() == 0 || token.length() > 19)
+		return false;
+
+	unsigned long long value = 0;
+	for (const char* p = token.begin; p < token.end; p++)
+	{
+		if (!isDigit(*p))
+			return false;
+		value = value * 10 + (*p - '0');
+	}
+
+	outValue = value;
+	return true;
+}
+
+// Splits one line into whitespace separated tokens
+class LineParser
+{
+public:
+	LineParser(const char* begin, const char* end) : p(begin), end(end) { }
+
+	bool next(Token& outToken)
+	{
+		while (p < end && isSpace(*p))
+			p++;
+		if (p == end || *p == '#')
+			return false;
+
+		const char* tokenBegin = p;
+		while (p < end && !isSpace(*p) && *p != '#')
+			p++;
+
+		outToken = Token(tokenBegin, p);
+		return true;
+	}
+
+	bool atEnd()
+	{
+		Token token;
+		return !next(token);
+	}
+
+	bool readFloat(float& outValue)
+	{
+		Token token;
+		return next(token) && parseFloat(token, outValue);
+	}
+
+	bool readUnsigned(unsigned long long& outValue)
+	{
+		Token token;
+		return next(token) && parseUnsigned(token, outValue);
+	}
+
+	bool readIndex(unsigned& outValue)
+	{
+		unsigned long long value;
+		if (!readUnsigned(value) || value > 0xFFFFFFFFull)
+			return false;
+		outValue = (unsigned)value;
+		return true;
+	}
+
+	bool readVector(Vector& outVector)
+	{
+		return readFloat(outVector.x) && readFloat(outVector.y) && readFloat(outVector.z);
+	}
+
+	bool readColor(Color& outColor)
+	{
+		return readFloat(outColor.r) && readFloat(outColor.g) && readFloat(outColor.b);
+	}
+
+protected:
+	const char* p;
+	const char* end;
+};
+
+enum LineKind
+{
+	LINE_EMPTY,
+	LINE_VERTEX,
+	LINE_FACE,
+	LINE_SPHERE,
+	LINE_SECTION,
+	LINE_STATEMENT
+};
+
+static LineKind classifyLine(const char* begin, const char* end)
+{
+	LineParser parser(begin, end);
+	Token keyword;
+	if (!parser.next(keyword))
+		return LINE_EMPTY;
+
+	if (keyword.equals("v"))
+		return LINE_VERTEX;
+	if (keyword.equals("f"))
+		return LINE_FACE;
+	if (keyword.equals("sphere"))
+		return LINE_SPHERE;
+	if (keyword.equals("mesh") || keyword.equals("object") || keyword.equals("endobject"))
+		return LINE_SECTION;
+	return LINE_STATEMENT;
+}
+
+struct Statement
+{
+	const char* begin;
+	const char* end;
+	size_t line;
+};
+
+// Bulk lines between two section statements (mesh, object, endobject)
+// within one chunk, they all go to the same mesh and the same shape set
+struct Segment
+{
+	size_t vertexCount;
+	size_t triangleCount;
+	size_t sphereCount;
+
+	// Filled in once the owning mesh is known, pStreamedMesh is set when
+	// that mesh takes its faces through PagedMesh::addTriangles()
+	TriangleMesh* pMesh;
+	PagedMesh* pStreamedMesh;
+	size_t firstVertex;
+	size_t firstTriangle;
+	size_t firstSphere;
+
+	Segment()
+		: vertexCount(0), triangleCount(0), sphereCount(0),
+		pMesh(NULL), pStreamedMesh(NULL), firstVertex(0), firstTriangle(0), firstSphere(0) { }
+};
+
+struct Chunk
+{
+	const char* begin;
+	const char* end;
+	size_t firstLine;
+	size_t lineCount;
+
+	// Scene level statements in order, including section statements
+	std::vector<Statement> statements;
+
+	// Segment 0 continues the previous chunk, every section statement in
+	// this chunk starts another
+	std::vector<Segment> segments;
+
+	// First error in the bulk parse
+	const char* error;
+	size_t errorLine;
+
+	Chunk()
+		: begin(NULL), end(NULL), firstLine(0), lineCount(0),
+		statements(), segments(1), error(NULL), errorLine(0) { }
+};
+
+class SceneLoader
+{
+public:
+	SceneLoader(const char* filename, Scene& scene, GeometryCache* pGeometryCache)
+		: filename(filename), scene(scene), pGeometryCache(pGeometryCache), pSpheres(NULL), nextSphere(0), pCurrentMesh(NULL), pCurrentObject(NULL), currentObjectLine(0),
+		hasShutter(false), shutterOpen(0.0f), shutterClose(0.0f),
+		materialNames(), materialList(), objectNames(), objectList(), meshDeclarations() { }
+
+	bool load(unsigned threadCount);
+
+protected:
+	void reportError(size_t line, const char* message) const
+	{
+		fprintf(stderr, "%s:%u: %s\n", filename, (unsigned)(line + 1), message);
+	}
+
+	Material* findMaterial(const Token& name) const;
+	ShapeSet* findObject(const Token& name) const;
+
+	// To the object being defined, or the scene outside of one
+	ShapeSet& currentShapes() { return pCurrentObject != NULL ? *pCurrentObject : scene.getShapes(); }
+
+	void scanChunk(Chunk& chunk);
+	bool defineMaterial(const Statement& statement);
+	bool applySection(const Statement& statement);
+	bool applyStatement(const Statement& statement);
+	bool assignSegment(Chunk& chunk, size_t segmentIndex);
+	void parseBulk(Chunk& chunk, bool streamedFaces);
+
+	const char* filename;
+	Scene& scene;
+	GeometryCache* pGeometryCache;
+
+	// All spheres in one block, handed out in file order
+	Sphere* pSpheres;
+	size_t nextSphere;
+
+	// State while applying statements in order
+	TriangleMesh* pCurrentMesh;
+	ShapeSet* pCurrentObject;
+	size_t currentObjectLine;
+
+	// Applied to the camera at the end, wherever either was declared
+	bool hasShutter;
+	float shutterOpen, shutterClose;
+
+	std::vector<std::string> materialNames;
+	std::vector<Material*> materialList;
+	std::vector<std::string> objectNames;
+	std::vector<ShapeSet*> objectList;
+
+	// Declared sizes, checked against the number of lines actually found
+	struct MeshDeclaration
+	{
+		TriangleMesh* pMesh;
+		PagedMesh* pStreamedMesh;
+		size_t line;
+		size_t vertexCount;
+		size_t triangleCount;
+		size_t verticesFound;
+		size_t trianglesFound;
+	};
+	std::vector<MeshDeclaration> meshDeclarations;
+};
+
+Material* SceneLoader::findMaterial(const Token& name) const
+{
+	for (size_t i = 0; i < materialNames.size(); i++)
+	{
+		if (materialNames[i].size() == name.length() &&
+			!memcmp(materialNames[i].data(), name.begin, name.length()))
+		{
+			return materialList[i];
+		}
+	}
+
+	return NULL;
+}
+
+ShapeSet* SceneLoader::findObject(const Token& name) const
+{
+	for (size_t i = 0; i < objectNames.size(); i++)
+	{
+		if (objectNames[i].size() == name.length() &&
+			!memcmp(objectNames[i].data(), name.begin, name.length()))
+		{
+			return objectList[i];
+		}
+	}
+
+	return NULL;
+}
+
+void SceneLoader::scanChunk(Chunk& chunk)
+{
+	size_t line = 0;
+	for (const char* lineBegin = chunk.begin; lineBegin < chunk.end; line++)
+	{
+		const char* lineEnd = (const char*)memchr(lineBegin, '\n', chunk.end - lineBegin);
+		if (lineEnd == NULL)
+			lineEnd = chunk.end;
+
+		switch (classifyLine(lineBegin, lineEnd))
+		{
+		case LINE_VERTEX:
+			chunk.segments.back().vertexCount++;
+			break;
+
+		case LINE_FACE:
+			chunk.segments.back().triangleCount++;
+			break;
+
+		case LINE_SPHERE:
+			chunk.segments.back().sphereCount++;
+			break;
+
+		case LINE_SECTION:
+			chunk.segments.push_back(Segment());
+			// Fall through, sections are applied with the other statements
+
+		case LINE_STATEMENT:
+		{
+			Statement statement = { lineBegin, lineEnd, chunk.firstLine + line };
+			chunk.statements.push_back(statement);
+			break;
+		}
+
+		default:
+		case LINE_EMPTY:
+			break;
+		}
+
+		lineBegin = lineEnd + 1;
+	}
+
+	chunk.lineCount = line;
+}
+
+bool SceneLoader::defineMaterial(const Statement& statement)
+{
+	LineParser parser(statement.begin, statement.end);
+	Token keyword, name, type;
+	parser.next(keyword);
+
+	if (!parser.next(name) || !parser.next(type))
+	{
+		reportError(statement.line, "expected: material <name> <type> ...");
+		return false;
+	}
+
+	if (findMaterial(name) != NULL)
+	{
+		reportError(statement.line, "material defined twice");
+		return false;
+	}
+
+	Color color;
+	Material* pMaterial = NULL;
+	if (type.equals("diffuse"))
+	{
+		if (!parser.readColor(color) || !parser.atEnd())
+		{
+			reportError(statement.line, "expected: material <name> diffuse <r g b>");
+			return false;
+		}
+		pMaterial = new DiffuseMaterial(color);
+	}
+	else if (type.equals("glossy"))
+	{
+		float roughness;
+		if (!parser.readColor(color) || !parser.readFloat(roughness) || !parser.atEnd() || roughness <= 0.0f)
+		{
+			reportError(statement.line, "expected: material <name> glossy <r g b> <roughness>");
+			return false;
+		}
+		pMaterial = new GlossyMaterial(color, roughness);
+	}
+	else if (type.equals("layered"))
+	{
+		Color specular;
+		float roughness;
+		if (!parser.readColor(color) || !parser.readColor(specular) || !parser.readFloat(roughness) ||
+			!parser.atEnd() || roughness <= 0.0f)
+		{
+			reportError(statement.line, "expected: material <name> layered <diffuse r g b> <specular r g b> <roughness>");
+			return false;
+		}
+		pMaterial = new LayeredMaterial(color, specular, roughness);
+	}
+	else
+	{
+		reportError(statement.line, "unknown material type");
+		return false;
+	}
+
+	materialNames.push_back(std::string(name.begin, name.end));
+	materialList.push_back(scene.addMaterial(pMaterial));
+	return true;
+}
+
+bool SceneLoader::applySection(const Statement& statement)
+{
+	LineParser parser(statement.begin, statement.end);
+	Token keyword;
+	parser.next(keyword);
+
+	if (keyword.equals("object"))
+	{
+		Token name;
+		if (!parser.next(name) || !parser.atEnd())
+		{
+			reportError(statement.line, "expected: object <name>");
+			return false;
+		}
+		if (pCurrentObject != NULL)
+		{
+			reportError(statement.line, "objects cannot be nested");
+			return false;
+		}
+		if (findObject(name) != NULL)
+		{
+			reportError(statement.line, "object defined twice");
+			return false;
+		}
+
+		pCurrentObject = new ShapeSet();
+		scene.addPrototype(pCurrentObject);
+		objectNames.push_back(std::string(name.begin, name.end));
+		objectList.push_back(pCurrentObject);
+		currentObjectLine = statement.line;
+		pCurrentMesh = NULL;
+		return true;
+	}
+
+	if (keyword.equals("endobject"))
+	{
+		if (!parser.atEnd() || pCurrentObject == NULL)
+		{
+			reportError(statement.line, "endobject without object");
+			return false;
+		}
+
+		pCurrentObject = NULL;
+		pCurrentMesh = NULL;
+		return true;
+	}
+
+	Token materialName;
+	unsigned long long vertexCount, triangleCount;
+	Material* pMaterial = NULL;
+	if (!parser.next(materialName) || !parser.readUnsigned(vertexCount) || !parser.readUnsigned(triangleCount) ||
+		!parser.atEnd() || (pMaterial = findMaterial(materialName)) == NULL)
+	{
+		reportError(statement.line, "expected: mesh <material> <vertexCount> <triangleCount>");
+		return false;
+	}
+
+	PagedMesh* pStreamedMesh = NULL;
+	if (pGeometryCache != NULL)
+	{
+		PagedMesh* pPaged = new PagedMesh((size_t)vertexCount, (size_t)triangleCount, pMaterial, pGeometryCache);
+		pStreamedMesh = pPaged->isStreaming() ? pPaged : NULL;
+		pCurrentMesh = pPaged;
+	}
+	else
+		pCurrentMesh = new TriangleMesh((size_t)vertexCount, (size_t)triangleCount, pMaterial);
+	currentShapes().addShape(pCurrentMesh);
+
+	MeshDeclaration declaration = { pCurrentMesh, pStreamedMesh, statement.line, (size_t)vertexCount,
+		(size_t)triangleCount, 0, 0 };
+	meshDeclarations.push_back(declaration);
+	return true;
+}
+
+bool SceneLoader::applyStatement(const Statement& statement)
+{
+	LineParser parser(statement.begin, statement.end);
+	Token keyword;
+	parser.next(keyword);
+
+	if (keyword.equals("material"))
+		return true;
+
+	if (keyword.equals("camera"))
+	{
+		Token type;
+		float fov, focalDistance, lensRadius, viewWidth;
+		Point origin, target;
+		Vector up;
+		if (!parser.next(type))
+			type = Token();
+
+		if (type.equals("perspective"))
+		{
+			if (!parser.readFloat(fov) || !parser.readVector(origin) || !parser.readVector(target) ||
+				!parser.readVector(up) || !parser.readFloat(focalDistance) || !parser.readFloat(lensRadius) ||
+				!parser.atEnd())
+			{
+				reportError(statement.line, "expected: camera perspective <fov> <origin> <target> <up> <focalDistance> <lensRadius>");
+				return false;
+			}
+
+			scene.setCamera(new PerspectiveCamera(fov, origin, target, up, focalDistance, lensRadius));
+			return true;
+		}
+
+		if (type.equals("orthographic"))
+		{
+			if (!parser.readVector(origin) || !parser.readVector(target) || !parser.readVector(up) ||
+				!parser.readFloat(viewWidth) || !parser.atEnd())
+			{
+				reportError(statement.line, "expected: camera orthographic <origin> <target> <up> <viewWidth>");
+				return false;
+			}
+
+			scene.setCamera(new OrthographicCamera(origin, target, up, viewWidth));
+			return true;
+		}
+
+		if (type.equals("environment"))
+		{
+			if (!parser.readVector(origin) || !parser.readVector(target) || !parser.readVector(up) || !parser.atEnd())
+			{
+				reportError(statement.line, "expected: camera environment <origin> <target> <up>");
+				return false;
+			}
+
+			scene.setCamera(new EnvironmentCamera(origin, target, up));
+			return true;
+		}
+
+		reportError(statement.line, "expected: camera perspective|orthographic|environment ...");
+		return false;
+	}
+
+	if (keyword.equals("plane"))
+	{
+		Point point;
+		Vector normal;
+		Token materialName;
+		Material* pMaterial = NULL;
+		if (!parser.readVector(point) || !parser.readVector(normal) || !parser.next(materialName) ||
+			!parser.atEnd() || (pMaterial = findMaterial(materialName)) == NULL)
+		{
+			reportError(statement.line, "expected: plane <point> <normal> <material>");
+			return false;
+		}
+
+		currentShapes().addShape(new Plane(point, normal, pMaterial));
+		return true;
+	}
+
+	if ((keyword.equals("rectlight") || keyword.equals("spherelight") || keyword.equals("environment")) &&
+		pCurrentObject != NULL)
+	{
+		reportError(statement.line, "lights cannot be part of an object");
+		return false;
+	}
+
+	if (keyword.equals("rectlight"))
+	{
+		Point corner;
+		Vector side1, side2;
+		Color color;
+		float power;
+		if (!parser.readVector(corner) || !parser.readVector(side1) || !parser.readVector(side2) ||
+			!parser.readColor(color) || !parser.readFloat(power) || !parser.atEnd())
+		{
+			reportError(statement.line, "expected: rectlight <corner> <side1> <side2> <r g b> <power>");
+			return false;
+		}
+
+		scene.addShape(new RectangleLight(corner, side1, side2, color, power));
+		return true;
+	}
+
+	if (keyword.equals("spherelight"))
+	{
+		Point center;
+		float radius, power;
+		Color color;
+		if (!parser.readVector(center) || !parser.readFloat(radius) || !parser.readColor(color) ||
+			!parser.readFloat(power) || !parser.atEnd())
+		{
+			reportError(statement.line, "expected: spherelight <center> <radius> <r g b> <power>");
+			return false;
+		}
+
+		scene.addShape(new ShapeLight(new Sphere(center, radius, NULL), color, power));
+		return true;
+	}
+
+	if (keyword.equals("environment"))
+	{
+		Token path, rotationToken;
+		float power, rotation = 0.0f;
+		if (!parser.next(path) || !parser.readFloat(power) ||
+			(parser.next(rotationToken) && (!parseFloat(rotationToken, rotation) || !parser.atEnd())))
+		{
+			reportError(statement.line, "expected: environment <file.pfm> <power> [rotation]");
+			return false;
+		}
+
+		// Relative paths start from the scene file's directory
+		std::string imagePath(path.begin, path.end);
+		const char* lastSlash = strrchr(filename, '/');
+		const char* lastBackslash = strrchr(filename, '\\');
+		if (lastBackslash > lastSlash)
+			lastSlash = lastBackslash;
+		if (lastSlash != NULL && imagePath[0] != '/' && imagePath[0] != '\\' && imagePath.find(':') == std::string::npos)
+			imagePath.insert(0, filename, lastSlash - filename + 1);
+
+		EnvironmentLight* pEnvironment = new EnvironmentLight(power, rotation);
+		if (!pEnvironment->loadFromFile(imagePath.c_str()))
+		{
+			delete pEnvironment;
+			fprintf(stderr, "%s:%u: could not load environment '%s'\n", filename, (unsigned)(statement.line + 1), imagePath.c_str());
+			return false;
+		}
+
+		scene.setEnvironment(pEnvironment);
+		return true;
+	}
+
+	if (keyword.equals("shutter"))
+	{
+		if (!parser.readFloat(shutterOpen) || !parser.readFloat(shutterClose) || !parser.atEnd())
+		{
+			reportError(statement.line, "expected: shutter <open> <close>");
+			return false;
+		}
+
+		hasShutter = true;
+		return true;
+	}
+
+	if (keyword.equals("movingsphere"))
+	{
+		float radius;
+		Token materialName;
+		Material* pMaterial = NULL;
+		std::vector<Point> centers;
+		bool valid = parser.readFloat(radius) && parser.next(materialName) &&
+			(pMaterial = findMaterial(materialName)) != NULL;
+
+		Token token;
+		while (valid && parser.next(token))
+		{
+			Point center;
+			valid = parseFloat(token, center.x) && parser.readFloat(center.y) && parser.readFloat(center.z);
+			centers.push_back(center);
+		}
+
+		if (!valid || centers.empty())
+		{
+			reportError(statement.line, "expected: movingsphere <radius> <material> <center xyz> ...");
+			return false;
+		}
+
+		currentShapes().addShape(new MovingSphere(centers, radius, pMaterial));
+		return true;
+	}
+
+	if (keyword.equals("instance"))
+	{
+		Token objectName;
+		ShapeSet* pObject = NULL;
+		std::vector<Transform> keyframes;
+		bool valid = parser.next(objectName) && (pObject = findObject(objectName)) != NULL;
+		if (valid && pObject == pCurrentObject)
+		{
+			reportError(statement.line, "an object cannot instance itself");
+			return false;
+		}
+
+		Token token;
+		while (valid && parser.next(token))
+		{
+			float values[12];
+			valid = parseFloat(token, values[0]);
+			for (int i = 1; i < 12 && valid; i++)
+				valid = parser.readFloat(values[i]);
+			keyframes.push_back(Transform(values));
+		}
+
+		if (!valid || keyframes.empty())
+		{
+			reportError(statement.line, "expected: instance <object> <3x4 transform, row major> ...");
+			return false;
+		}
+
+		currentShapes().addShape(new Instance(pObject, keyframes));
+		return true;
+	}
+
+	reportError(statement.line, "unknown statement");
+	return false;
+}
+
+// The first pass over the bulk data parses everything but the faces of
+// streamed meshes, which need all of their vertices in place. The second
+// parses just those and hands them to their mesh a block at a time.
+void SceneLoader::parseBulk(Chunk& chunk, bool streamedFaces)
+{
+	const size_t kStreamBlock = 4096;
+	std::vector<unsigned> streamed;
+
+	size_t segmentIndex = 0;
+	Segment* pSegment = &chunk.segments[0];
+	size_t nextVertex = pSegment->firstVertex;
+	size_t nextTriangle = pSegment->firstTriangle;
+	size_t nextSphere = pSegment->firstSphere;
+
+	// Faces buffered in streamed end at nextTriangle
+	auto flushStreamed = [&]()
+	{
+		size_t count = streamed.size() / 3;
+		if (count > 0 && !pSegment->pStreamedMesh->addTriangles(&streamed[0], nextTriangle - count, count))
+			chunk.error = "could not stage faces in the geometry cache";
+		streamed.clear();
+		return chunk.error == NULL;
+	};
+
+	size_t line = 0;
+	for (const char* lineBegin = chunk.begin; lineBegin < chunk.end; line++)
+	{
+		const char* lineEnd = (const char*)memchr(lineBegin, '\n', chunk.end - lineBegin);
+		if (lineEnd == NULL)
+			lineEnd = chunk.end;
+
+		LineParser parser(lineBegin, lineEnd);
+		Token keyword;
+		if (parser.next(keyword))
+		{
+			if (keyword.equals("v"))
+			{
+				if (!streamedFaces &&
+					(!parser.readVector(pSegment->pMesh->getVertices()[nextVertex++]) || !parser.atEnd()))
+				{
+					chunk.error = "expected: v <x y z>";
+					break;
+				}
+			}
+			else if (keyword.equals("f"))
+			{
+				if ((pSegment->pStreamedMesh != NULL) != streamedFaces)
+				{
+					nextTriangle++;
+				}
+				else if (streamedFaces)
+				{
+					unsigned triangle[3];
+					if (!parser.readIndex(triangle[0]) || !parser.readIndex(triangle[1]) ||
+						!parser.readIndex(triangle[2]) || !parser.atEnd())
+					{
+						chunk.error = "expected: f <a b c>";
+						break;
+					}
+
+					size_t vertexCount = pSegment->pMesh->getVertexCount();
+					if (triangle[0] >= vertexCount || triangle[1] >= vertexCount || triangle[2] >= vertexCount)
+					{
+						chunk.error = "face index past the mesh's last vertex";
+						break;
+					}
+
+					streamed.insert(streamed.end(), triangle, triangle + 3);
+					nextTriangle++;
+					if (streamed.size() == 3 * kStreamBlock && !flushStreamed())
+						break;
+				}
+				else
+				{
+					unsigned* pTriangle = pSegment->pMesh->getIndices() + 3 * nextTriangle++;
+					if (!parser.readIndex(pTriangle[0]) || !parser.readIndex(pTriangle[1]) ||
+						!parser.readIndex(pTriangle[2]) || !parser.atEnd())
+					{
+						chunk.error = "expected: f <a b c>";
+						break;
+					}
+				}
+			}
+			else if (keyword.equals("sphere") && !streamedFaces)
+			{
+				Point center;
+				float radius;
+				Token materialName;
+				Material* pMaterial = NULL;
+				if (!parser.readVector(center) || !parser.readFloat(radius) || !parser.next(materialName) ||
+					!parser.atEnd() || (pMaterial = findMaterial(materialName)) == NULL)
+				{
+					chunk.error = "expected: sphere <center> <radius> <material>";
+					break;
+				}
+				pSpheres[nextSphere++] = Sphere(center, radius, pMaterial);
+			}
+			else if (keyword.equals("mesh") || keyword.equals("object") || keyword.equals("endobject"))
+			{
+				if (streamedFaces && !flushStreamed())
+					break;
+				pSegment = &chunk.segments[++segmentIndex];
+				nextVertex = pSegment->firstVertex;
+				nextTriangle = pSegment->firstTriangle;
+				nextSphere = pSegment->firstSphere;
+			}
+		}
+
+		lineBegin = lineEnd + 1;
+	}
+
+	if (chunk.error == NULL && streamedFaces)
+		flushStreamed();
+	if (chunk.error != NULL)
+		chunk.errorLine = chunk.firstLine + line;
+}
+
+bool SceneLoader::load(unsigned threadCount)
+{
+	MappedFile file;
+	if (!file.open(filename))
+	{
+		fprintf(stderr, "%s: could not open file\n", filename);
+		return false;
+	}
+
+	const char* pData = file.getData();
+	size_t size = file.getSize();
+
+	if (threadCount == 0)
+		threadCount = defaultThreadCount();
+
+	// Chunks start on line boundaries, small files get a single chunk
+	const size_t kMinChunkSize = 1 << 20;
+	size_t chunkCount = std::max((size_t)1, std::min((size_t)threadCount * 4, size / kMinChunkSize));
+	std::vector<Chunk> chunks(chunkCount);
+	const char* pChunkBegin = pData;
+	for (size_t i = 0; i < chunkCount; i++)
+	{
+		const char* pChunkEnd = pData + size;
+		if (i + 1 < chunkCount)
+		{
+			pChunkEnd = std::max(pChunkBegin, pData + size * (i + 1) / chunkCount);
+			const char* pNewline = (const char*)memchr(pChunkEnd, '\n', pData + size - pChunkEnd);
+			pChunkEnd = pNewline != NULL ? pNewline + 1 : pData + size;
+		}
+
+		chunks[i].begin = pChunkBegin;
+		chunks[i].end = pChunkEnd;
+		pChunkBegin = pChunkEnd;
+	}
+
+	// Pass 1: classify lines and count bulk data per chunk
+	parallelFor(chunkCount, threadCount, [&](size_t index, unsigned)
+	{
+		scanChunk(chunks[index]);
+	});
+
+	// Line numbers and the sphere total
+	size_t lineCount = 0;
+	size_t sphereCount = 0;
+	for (size_t i = 0; i < chunkCount; i++)
+	{
+		chunks[i].firstLine = lineCount;
+		lineCount += chunks[i].lineCount;
+		for (size_t s = 0; s < chunks[i].segments.size(); s++)
+			sphereCount += chunks[i].segments[s].sphereCount;
+
+		for (size_t s = 0; s < chunks[i].statements.size(); s++)
+			chunks[i].statements[s].line += chunks[i].firstLine;
+	}
+
+	// Pass 2: scene level statements in file order, materials first so they
+	// can be referenced from anywhere
+	for (size_t i = 0; i < chunkCount; i++)
+	{
+		for (size_t s = 0; s < chunks[i].statements.size(); s++)
+		{
+			const Statement& statement = chunks[i].statements[s];
+			Token keyword;
+			LineParser(statement.begin, statement.end).next(keyword);
+			if (keyword.equals("material") && !defineMaterial(statement))
+				return false;
+		}
+	}
+
+	// Spheres are placed now and parsed in pass 3
+	pSpheres = sphereCount > 0 ? scene.allocateShapes<Sphere>(sphereCount) : NULL;
+
+	for (size_t i = 0; i < chunkCount; i++)
+	{
+		Chunk& chunk = chunks[i];
+		size_t segmentIndex = 0;
+		if (!assignSegment(chunk, segmentIndex))
+			return false;
+
+		for (size_t s = 0; s < chunk.statements.size(); s++)
+		{
+			const Statement& statement = chunk.statements[s];
+			if (classifyLine(statement.begin, statement.end) == LINE_SECTION)
+			{
+				if (!applySection(statement) || !assignSegment(chunk, ++segmentIndex))
+					return false;
+			}
+			else if (!applyStatement(statement))
+			{
+				return false;
+			}
+		}
+	}
+
+	if (pCurrentObject != NULL)
+	{
+		reportError(currentObjectLine, "object without endobject");
+		return false;
+	}
+
+	if (hasShutter && scene.getCamera() != NULL)
+		scene.getCamera()->setShutter(shutterOpen, shutterClose);
+
+	for (size_t m = 0; m < meshDeclarations.size(); m++)
+	{
+		const MeshDeclaration& declaration = meshDeclarations[m];
+		if (declaration.verticesFound != declaration.vertexCount ||
+			declaration.trianglesFound != declaration.triangleCount)
+		{
+			reportError(declaration.line, "mesh has fewer vertices or faces than declared");
+			return false;
+		}
+	}
+
+	// Pass 3: bulk data straight into place, then the faces of streamed
+	// meshes once their vertices are
+	bool streams = false;
+	for (size_t m = 0; m < meshDeclarations.size(); m++)
+		streams = streams || meshDeclarations[m].pStreamedMesh != NULL;
+	for (int streamedFaces = 0; streamedFaces < (streams ? 2 : 1); streamedFaces++)
+	{
+		parallelFor(chunkCount, threadCount, [&](size_t index, unsigned)
+		{
+			parseBulk(chunks[index], streamedFaces != 0);
+		});
+
+		for (size_t i = 0; i < chunkCount; i++)
+		{
+			if (chunks[i].error != NULL)
+			{
+				reportError(chunks[i].errorLine, chunks[i].error);
+				return false;
+			}
+		}
+	}
+
+	std::vector<char> meshValid(meshDeclarations.size());
+	parallelFor(meshDeclarations.size(), threadCount, [&](size_t index, unsigned)
+	{
+		meshValid[index] = meshDeclarations[index].pMesh->validate();
+	});
+
+	for (size_t m = 0; m < meshDeclarations.size(); m++)
+	{
+		if (!meshValid[m])
+		{
+			reportError(meshDeclarations[m].line, "mesh has a face index past its last vertex");
+			return false;
+		}
+	}
+
+	return true;
+}
+
+bool SceneLoader::assignSegment(Chunk& chunk, size_t segmentIndex)
+{
+	Segment& segment = chunk.segments[segmentIndex];
+
+	ShapeSet& shapes = currentShapes();
+	segment.firstSphere = nextSphere;
+	for (size_t i = 0; i < segment.sphereCount; i++)
+		shapes.addShape(&pSpheres[nextSphere++], false);
+
+	if (segment.vertexCount == 0 && segment.triangleCount == 0)
+		return true;
+
+	if (pCurrentMesh == NULL)
+	{
+		reportError(chunk.firstLine, "vertex or face data outside a mesh");
+		return false;
+	}
+
+	MeshDeclaration& declaration = meshDeclarations.back();
+	segment.pMesh = pCurrentMesh;
+	segment.pStreamedMesh = declaration.pStreamedMesh;
+	segment.firstVertex = declaration.verticesFound;
+	segment.firstTriangle = declaration.trianglesFound;
+	declaration.verticesFound += segment.vertexCount;
+	declaration.trianglesFound += segment.triangleCount;
+
+	if (declaration.verticesFound > declaration.vertexCount ||
+		declaration.trianglesFound > declaration.triangleCount)
+	{
+		reportError(declaration.line, "mesh has more vertices or faces than declared");
+		return false;
+	}
+
+	return true;
+}
+
+bool loadScene(const char* filename, Scene& outScene, unsigned threadCount, GeometryCache* pGeometryCache)
+{
+	SceneLoader loader(filename, outScene, pGeometryCache);
+	return loader.load(threadCount);
+}
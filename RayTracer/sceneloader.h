@@ -0,0 +1,59 @@
+#ifndef __SCENELOADER_H__
+#define __SCENELOADER_H__
+
+#include "scene.h"
+
+class GeometryCache;
+
+// Text scene format, one statement per line, '#' starts a comment:
+//
+//   camera perspective <fov> <origin xyz> <target xyz> <up xyz> <focalDistance> <lensRadius>
+//   camera orthographic <origin xyz> <target xyz> <up xyz> <viewWidth>
+//   camera environment <origin xyz> <target xyz> <up xyz>
+//   material <name> diffuse <r g b>
+//   material <name> glossy <r g b> <roughness>
+//   material <name> layered <diffuse r g b> <specular r g b> <roughness>
+//   sphere <center xyz> <radius> <material>
+//   plane <point xyz> <normal xyz> <material>
+//   rectlight <corner xyz> <side1 xyz> <side2 xyz> <r g b> <power>
+//   spherelight <center xyz> <radius> <r g b> <power>
+//   environment <file.pfm> <power> [rotation]
+//   mesh <material> <vertexCount> <triangleCount>
+//   v <x y z>
+//   f <a b c>
+//   object <name>
+//   endobject
+//   instance <object> <3x4 object to world transform, row major> ...
+//   movingsphere <radius> <material> <center xyz> ...
+//   shutter <open> <close>
+//
+// Several transforms or centers are keyframes evenly spaced over time [0, 1]
+// with linear motion between them. The camera shutter picks the ray times
+// and defaults to 0 0, without motion blur.
+//
+// 'v' and 'f' lines belong to the closest mesh statement above them, face
+// indices start at 0. Materials may be defined anywhere in the file.
+//
+// The environment is a latitude-longitude image around the whole scene, see
+// EnvironmentLight. Its path is relative to the scene file and rotation turns
+// it about +y in degrees.
+//
+// Shapes between 'object' and 'endobject' are not rendered directly, they
+// form a prototype shared by every 'instance' of it further down. Objects
+// cannot be nested or contain lights, but may instance objects defined
+// before them.
+//
+// The file is memory mapped and split into one chunk per thread. Every
+// chunk is scanned in parallel, the few scene level statements are then
+// applied in order, and finally spheres, vertices and faces are parsed in
+// parallel straight into their preallocated arrays.
+//
+// With pGeometryCache, meshes are PagedMeshes. Their faces are parsed in a
+// pass of their own after the vertices and streamed into the cache, so no
+// mesh is ever held in memory whole, and prepare() cuts them into clusters.
+//
+// Errors are printed to stderr with the file and line, outScene is left
+// partially built on failure.
+bool loadScene(const char* filename, Scene& outScene, unsigned threadCount = 0, GeometryCache* pGeometryCache = NULL);
+
+#endif
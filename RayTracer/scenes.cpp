@@ -0,0 +1,279 @@
+#include "scenes.h"
+#include "mesh.h"
+#include "pagedmesh.h"
+#include "random.h"
+
+#include <algorithm>
+#include <cstring>
+#include <vector>
+
+class SceneRandom
+{
+public:
+	SceneRandom(unsigned seed) : stream(0, 0, seed) { }
+
+	float next(float min = 0.0f, float max = 1.0f)
+	{
+		return min + (max - min) * stream.next();
+	}
+
+protected:
+	RandomStream stream;
+};
+
+void buildCornellBox(Scene& outScene)
+{
+	outScene.clear();
+	outScene.setCamera(new PerspectiveCamera(40.0f,
+		Point(0.0f, 1.0f, 3.4f),
+		Point(0.0f, 1.0f, 0.0f),
+		Vector(0.0f, 1.0f, 0.0f),
+		3.4f,
+		0.0f));
+
+	Material* pWhite = outScene.addMaterial(new DiffuseMaterial(Color(0.73f, 0.73f, 0.73f)));
+	Material* pRed = outScene.addMaterial(new DiffuseMaterial(Color(0.65f, 0.05f, 0.05f)));
+	Material* pGreen = outScene.addMaterial(new DiffuseMaterial(Color(0.12f, 0.45f, 0.15f)));
+	Material* pGlossy = outScene.addMaterial(new GlossyMaterial(Color(0.9f, 0.9f, 0.9f), 0.2f));
+
+	outScene.addShape(new Plane(Point(0.0f, 0.0f, 0.0f), Vector(0.0f, 1.0f, 0.0f), pWhite));
+	outScene.addShape(new Plane(Point(0.0f, 2.0f, 0.0f), Vector(0.0f, -1.0f, 0.0f), pWhite));
+	outScene.addShape(new Plane(Point(0.0f, 0.0f, -1.0f), Vector(0.0f, 0.0f, 1.0f), pWhite));
+	outScene.addShape(new Plane(Point(-1.0f, 0.0f, 0.0f), Vector(1.0f, 0.0f, 0.0f), pRed));
+	outScene.addShape(new Plane(Point(1.0f, 0.0f, 0.0f), Vector(-1.0f, 0.0f, 0.0f), pGreen));
+
+	outScene.addShape(new Sphere(Point(-0.4f, 0.35f, -0.3f), 0.35f, pWhite));
+	outScene.addShape(new Sphere(Point(0.45f, 0.35f, 0.2f), 0.35f, pGlossy));
+
+	outScene.addShape(new RectangleLight(Point(-0.3f, 1.99f, -0.3f),
+		Vector(0.6f, 0.0f, 0.0f),
+		Vector(0.0f, 0.0f, 0.6f),
+		Color(1.0f, 0.85f, 0.6f),
+		12.0f));
+}
+
+void buildSphereField(Scene& outScene, size_t sphereCount)
+{
+	outScene.clear();
+	SceneRandom random(1234);
+
+	size_t gridSize = (size_t)std::ceil(std::sqrt((float)sphereCount));
+	const float spacing = 1.0f;
+	float fieldSize = gridSize * spacing;
+
+	outScene.setCamera(new PerspectiveCamera(40.0f,
+		Point(0.0f, 0.12f * fieldSize, -0.55f * fieldSize),
+		Point(0.0f, 0.0f, 0.0f),
+		Vector(0.0f, 1.0f, 0.0f),
+		0.55f * fieldSize,
+		0.0f));
+
+	const size_t paletteSize = 16;
+	Material* palette[paletteSize];
+	for (size_t i = 0; i < paletteSize; i++)
+	{
+		Color color(random.next(0.1f, 0.9f), random.next(0.1f, 0.9f), random.next(0.1f, 0.9f));
+		if (i % 2 == 0)
+			palette[i] = outScene.addMaterial(new DiffuseMaterial(color));
+		else
+			palette[i] = outScene.addMaterial(new GlossyMaterial(color, random.next(0.05f, 0.5f)));
+	}
+
+	Material* pGround = outScene.addMaterial(new DiffuseMaterial(Color(0.5f)));
+	outScene.addShape(new Plane(Point(0.0f), Vector(0.0f, 1.0f, 0.0f), pGround));
+
+	for (size_t i = 0; i < sphereCount; i++)
+	{
+		float radius = spacing * random.next(0.15f, 0.45f);
+		float jitter = spacing * 0.5f - radius;
+		Point center(((i % gridSize) + 0.5f) * spacing - 0.5f * fieldSize + random.next(-jitter, jitter),
+			radius,
+			((i / gridSize) + 0.5f) * spacing - 0.5f * fieldSize + random.next(-jitter, jitter));
+		outScene.addShape(new Sphere(center, radius, palette[i % paletteSize]));
+	}
+
+	// Sun
+	outScene.addShape(new ShapeLight(new Sphere(Point(0.5f * fieldSize, fieldSize, 0.25f * fieldSize), 0.1f * fieldSize, NULL),
+		Color(1.0f, 0.95f, 0.85f),
+		400.0f));
+}
+
+void buildMotionField(Scene& outScene, size_t sphereCount)
+{
+	outScene.clear();
+	SceneRandom random(4321);
+
+	size_t gridSize = (size_t)std::ceil(std::sqrt((float)sphereCount));
+	const float spacing = 1.0f;
+	float fieldSize = gridSize * spacing;
+
+	Camera* pCamera = new PerspectiveCamera(40.0f,
+		Point(0.0f, 0.12f * fieldSize, -0.55f * fieldSize),
+		Point(0.0f, 0.0f, 0.0f),
+		Vector(0.0f, 1.0f, 0.0f),
+		0.55f * fieldSize,
+		0.0f);
+	pCamera->setShutter(0.0f, 1.0f);
+	outScene.setCamera(pCamera);
+
+	const size_t paletteSize = 16;
+	Material* palette[paletteSize];
+	for (size_t i = 0; i < paletteSize; i++)
+	{
+		Color color(random.next(0.1f, 0.9f), random.next(0.1f, 0.9f), random.next(0.1f, 0.9f));
+		palette[i] = outScene.addMaterial(new DiffuseMaterial(color));
+	}
+
+	Material* pGround = outScene.addMaterial(new DiffuseMaterial(Color(0.5f)));
+	outScene.addShape(new Plane(Point(0.0f), Vector(0.0f, 1.0f, 0.0f), pGround));
+
+	// Each sphere hops up and sideways during the shutter
+	std::vector<Point> centers(3);
+	for (size_t i = 0; i < sphereCount; i++)
+	{
+		float radius = spacing * random.next(0.15f, 0.35f);
+		float jitter = spacing * 0.5f - radius;
+		centers[0] = Point(((i % gridSize) + 0.5f) * spacing - 0.5f * fieldSize + random.next(-jitter, jitter),
+			radius,
+			((i / gridSize) + 0.5f) * spacing - 0.5f * fieldSize + random.next(-jitter, jitter));
+		Vector hop(random.next(-0.5f, 0.5f) * spacing, random.next(0.2f, 1.0f) * spacing, 0.0f);
+		centers[1] = centers[0] + hop;
+		centers[2] = centers[0] + Vector(2.0f * hop.x, 0.0f, 0.0f);
+		outScene.addShape(new MovingSphere(centers, radius, palette[i % paletteSize]));
+	}
+
+	// Sun
+	outScene.addShape(new ShapeLight(new Sphere(Point(0.5f * fieldSize, fieldSize, 0.25f * fieldSize), 0.1f * fieldSize, NULL),
+		Color(1.0f, 0.95f, 0.85f),
+		400.0f));
+}
+
+void buildManyLights(Scene& outScene, size_t lightCount)
+{
+	outScene.clear();
+	SceneRandom random(5678);
+
+	outScene.setCamera(new PerspectiveCamera(35.0f,
+		Point(0.0f, 2.0f, 7.0f),
+		Point(0.0f, 1.0f, 0.0f),
+		Vector(0.0f, 1.0f, 0.0f),
+		7.0f,
+		0.0f));
+
+	Material* pFloor = outScene.addMaterial(new DiffuseMaterial(Color(0.6f)));
+	Material* pWall = outScene.addMaterial(new DiffuseMaterial(Color(0.7f, 0.7f, 0.65f)));
+	Material* pDiffuse = outScene.addMaterial(new DiffuseMaterial(Color(0.8f, 0.3f, 0.2f)));
+	Material* pGlossy = outScene.addMaterial(new GlossyMaterial(Color(0.3f, 0.5f, 0.9f), 0.15f));
+
+	outScene.addShape(new Plane(Point(0.0f), Vector(0.0f, 1.0f, 0.0f), pFloor));
+	outScene.addShape(new Plane(Point(0.0f, 0.0f, -3.0f), Vector(0.0f, 0.0f, 1.0f), pWall));
+
+	for (int i = 0; i < 5; i++)
+	{
+		float x = -2.4f + 1.2f * i;
+		outScene.addShape(new Sphere(Point(x, 0.5f, 0.0f), 0.5f, (i % 2) ? pGlossy : pDiffuse));
+	}
+
+	// Three quarters rectangles hanging from the ceiling, the rest small spheres
+	size_t rectCount = (lightCount * 3) / 4;
+	size_t rectGrid = (size_t)std::ceil(std::sqrt((float)std::max(rectCount, (size_t)1)));
+	for (size_t i = 0; i < rectCount; i++)
+	{
+		float x = -3.0f + 6.0f * ((i % rectGrid) + 0.5f) / rectGrid;
+		float z = -2.5f + 4.0f * ((i / rectGrid) + 0.5f) / rectGrid;
+		Color color(random.next(0.2f, 1.0f), random.next(0.2f, 1.0f), random.next(0.2f, 1.0f));
+		outScene.addShape(new RectangleLight(Point(x - 0.1f, 3.5f, z - 0.1f),
+			Vector(0.2f, 0.0f, 0.0f),
+			Vector(0.0f, 0.0f, 0.2f),
+			color,
+			3000.0f / lightCount));
+	}
+
+	for (size_t i = rectCount; i < lightCount; i++)
+	{
+		Point center(random.next(-3.0f, 3.0f), random.next(1.5f, 3.0f), random.next(-2.5f, 1.0f));
+		Color color(random.next(0.2f, 1.0f), random.next(0.2f, 1.0f), random.next(0.2f, 1.0f));
+		outScene.addShape(new ShapeLight(new Sphere(center, 0.05f, NULL), color, 3000.0f / lightCount));
+	}
+}
+
+void buildTerrain(Scene& outScene, size_t triangleCount, GeometryCache* pGeometryCache)
+{
+	outScene.clear();
+	SceneRandom random(8765);
+
+	size_t gridSize = std::max((size_t)std::ceil(std::sqrt(triangleCount / 2.0)), (size_t)1);
+	const float size = 100.0f;
+	outScene.setCamera(new PerspectiveCamera(50.0f,
+		Point(0.0f, 25.0f, -0.6f * size),
+		Point(0.0f, 0.0f, 0.0f),
+		Vector(0.0f, 1.0f, 0.0f),
+		0.6f * size,
+		0.0f));
+
+	Material* pGround = outScene.addMaterial(new DiffuseMaterial(Color(0.45f, 0.4f, 0.3f)));
+	size_t vertexCount = (gridSize + 1) * (gridSize + 1);
+	PagedMesh* pPaged = pGeometryCache != NULL ?
+		new PagedMesh(vertexCount, 2 * gridSize * gridSize, pGround, pGeometryCache) : NULL;
+	TriangleMesh* pMesh = pPaged != NULL ? pPaged : new TriangleMesh(vertexCount, 2 * gridSize * gridSize, pGround);
+
+	// Rolling hills with a little per-vertex roughness
+	Point* pVertices = pMesh->getVertices();
+	for (size_t z = 0; z <= gridSize; z++)
+	{
+		for (size_t x = 0; x <= gridSize; x++)
+		{
+			float px = size * ((float)x / gridSize - 0.5f);
+			float pz = size * ((float)z / gridSize - 0.5f);
+			float height = 4.0f * std::sin(px * 0.11f) * std::cos(pz * 0.07f) +
+				1.5f * std::sin(px * 0.37f + pz * 0.23f) + random.next(-0.05f, 0.05f);
+			pVertices[z * (gridSize + 1) + x] = Point(px, height, pz);
+		}
+	}
+
+	// A row of quads at a time, a paged mesh streams them into its cache
+	std::vector<unsigned> row(6 * gridSize);
+	for (size_t z = 0; z < gridSize; z++)
+	{
+		for (size_t x = 0; x < gridSize; x++)
+		{
+			unsigned corner = (unsigned)(z * (gridSize + 1) + x);
+			unsigned* pQuad = &row[6 * x];
+			pQuad[0] = corner;
+			pQuad[1] = corner + (unsigned)gridSize + 1;
+			pQuad[2] = corner + 1;
+			pQuad[3] = corner + 1;
+			pQuad[4] = corner + (unsigned)gridSize + 1;
+			pQuad[5] = corner + (unsigned)gridSize + 2;
+		}
+
+		if (pPaged != NULL)
+			pPaged->addTriangles(&row[0], 2 * gridSize * z, 2 * gridSize);
+		else
+			std::copy(row.begin(), row.end(), pMesh->getIndices() + 6 * gridSize * z);
+	}
+	outScene.addShape(pMesh);
+
+	// Sun
+	outScene.addShape(new ShapeLight(new Sphere(Point(0.4f * size, size, 0.3f * size), 0.08f * size, NULL),
+		Color(1.0f, 0.95f, 0.85f),
+		400.0f));
+}
+
+bool buildBenchmarkScene(const char* name, Scene& outScene, size_t count, GeometryCache* pGeometryCache)
+{
+	if (!strcmp(name, "cornell"))
+		buildCornellBox(outScene);
+	else if (!strcmp(name, "spheres"))
+		buildSphereField(outScene, count > 0 ? count : 100000);
+	else if (!strcmp(name, "motion"))
+		buildMotionField(outScene, count > 0 ? count : 10000);
+	else if (!strcmp(name, "manylights"))
+		buildManyLights(outScene, count > 0 ? count : 64);
+	else if (!strcmp(name, "terrain"))
+		buildTerrain(outScene, count > 0 ? count : 2000000, pGeometryCache);
+	else
+		return false;
+
+	return true;
+}
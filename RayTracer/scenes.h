@@ -0,0 +1,30 @@
+#ifndef __SCENES_H__
+#define __SCENES_H__
+
+#include "scene.h"
+
+class GeometryCache;
+
+// Procedurally generated reference scenes used for benchmarking
+
+// Five planes with a rectangle light in the ceiling, one diffuse and one glossy sphere
+void buildCornellBox(Scene& outScene);
+
+// Ground plane covered in a jittered grid of mixed diffuse and glossy spheres
+void buildSphereField(Scene& outScene, size_t sphereCount = 100000);
+
+// Like the sphere field but every sphere moves during a [0, 1] shutter
+void buildMotionField(Scene& outScene, size_t sphereCount = 10000);
+
+// A small room lit by a grid of coloured rectangle and sphere lights
+void buildManyLights(Scene& outScene, size_t lightCount = 64);
+
+// Heightfield mesh of about triangleCount triangles lit by a sun, mostly to
+// time BVH builds. With pGeometryCache the mesh is paged into it.
+void buildTerrain(Scene& outScene, size_t triangleCount = 2000000, GeometryCache* pGeometryCache = NULL);
+
+// Builds one of "cornell", "spheres", "motion", "manylights" or "terrain",
+// count = 0 uses the default. Meshes are paged into pGeometryCache if set.
+bool buildBenchmarkScene(const char* name, Scene& outScene, size_t count = 0, GeometryCache* pGeometryCache = NULL);
+
+#endif
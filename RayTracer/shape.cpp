@@ -1,6 +1,14 @@
 #include "shape.h"
+#include "kernels.h"
 #include "sampling.h"
 
+#include <algorithm>
+#include <typeinfo>
+
+// Rebuilding pays off once a ray through the refitted trees, plus a test of
+// every pending shape, costs this much more than through fresh trees
+static const float kRebuildCostRatio = 1.3f;
+
 bool Shape::sampleSurface(
 	const Point& refPosition,
 	const Vector& refNormal,
@@ -9,7 +17,7 @@ bool Shape::sampleSurface(
 	float u3,
 	Point& outPosition,
 	Vector& outNormal,
-	float& outPDF) const
+	float& outPDF)
 {
 	outPDF = 0.0f;
 	return false;
@@ -26,26 +34,213 @@ float Shape::pdfSA(
 	return squared(dist) * surfaceAreaPDF() / std::fabs(dot(surfNormal, incoming));
 }
 
-bool ShapeSet::intersect(Intersection& intersection)
+// Bounds of a shape at each of keyframeCount evenly spaced times. A shape
+// whose own keyframes are not among those times gets its bounds over the
+// whole interval at every keyframe, which is loose but conservative.
+static void gatherKeyframeBounds(const Shape* pShape, unsigned keyframeCount, BoundingBox* pOutBounds)
 {
-	bool intersect = false;
+	unsigned shapeKeyframes = pShape->getKeyframeCount();
+	if (shapeKeyframes <= 1 || (keyframeCount - 1) % (shapeKeyframes - 1) != 0)
+	{
+		BoundingBox bounds;
+		pShape->getBounds(bounds);
+		for (unsigned k = 0; k < keyframeCount; k++)
+			pOutBounds[k] = bounds;
+		return;
+	}
 
-	for (std::vector<Shape*>::iterator iter = shapes.begin();
-		iter != shapes.end();
+	// Linear between the shape's keyframes, so interpolate exactly
+	unsigned step = (keyframeCount - 1) / (shapeKeyframes - 1);
+	for (unsigned k = 0; k < keyframeCount; k++)
+	{
+		BoundingBox b0, b1;
+		unsigned keyframe = std::min(k / step, shapeKeyframes - 2);
+		float t = (float)(k - keyframe * step) / step;
+		pShape->getKeyframeBounds(keyframe, b0);
+		pShape->getKeyframeBounds(keyframe + 1, b1);
+		pOutBounds[k] = BoundingBox(b0.min + (b1.min - b0.min) * t, b0.max + (b1.max - b0.max) * t);
+	}
+}
+
+bool Shape::intersectSurface(Intersection& intersection)
+{
+	Hit hit(intersection.dist);
+	if (!intersect(intersection.ray, hit))
+		return false;
+
+	completeHit(hit, intersection);
+	return true;
+}
+
+size_t Shape::intersectBatch(const Ray* pRays, size_t count, Hit* inOutHits)
+{
+	size_t hitCount = 0;
+	for (size_t r = 0; r < count; r++)
+	{
+		if (intersect(pRays[r], inOutHits[r]))
+			hitCount++;
+	}
+	return hitCount;
+}
+
+void Shape::completeHit(const Hit& hit, Intersection& intersection)
+{
+	intersection.dist = hit.dist;
+	Shape* pCompleting = hit.pOwner != NULL ? hit.pOwner : hit.pShape;
+	pCompleting->completeIntersection(hit, intersection);
+}
+
+bool ShapeSet::intersect(const Ray& ray, Hit& inOutHit)
+{
+	return intersectMembers(ray, inOutHit, NULL, 0);
+}
+
+size_t ShapeSet::intersectBatch(const Ray* pRays, size_t count, Hit* inOutHits)
+{
+	if (!prepared || !batchedShapes)
+		return Shape::intersectBatch(pRays, count, inOutHits);
+
+	std::vector<char> rayHit(count, 0);
+	std::vector<std::pair<Shape*, unsigned> > deferredRays;
+	for (size_t r = 0; r < count; r++)
+		rayHit[r] = intersectMembers(pRays[r], inOutHits[r], &deferredRays, (unsigned)r) ? 1 : 0;
+
+	// Members are numbered in the order rays first reached them, so the
+	// calls don't depend on where the shapes are in memory
+	std::unordered_map<const Shape*, unsigned> memberNumbers;
+	std::vector<Shape*> members;
+	std::vector<std::pair<unsigned, unsigned> > deferred(deferredRays.size());
+	for (size_t q = 0; q < deferredRays.size(); q++)
+	{
+		std::pair<std::unordered_map<const Shape*, unsigned>::iterator, bool> inserted =
+			memberNumbers.insert(std::make_pair(deferredRays[q].first, (unsigned)members.size()));
+		if (inserted.second)
+			members.push_back(deferredRays[q].first);
+		deferred[q] = std::make_pair(inserted.first->second, deferredRays[q].second);
+	}
+
+	// One call per deferred member with its rays in order, each limited by
+	// what the ray hit elsewhere
+	std::stable_sort(deferred.begin(), deferred.end(),
+		[](const std::pair<unsigned, unsigned>& a, const std::pair<unsigned, unsigned>& b)
+	{
+		return a.first < b.first;
+	});
+
+	std::vector<Ray> rays;
+	std::vector<Hit> hits;
+	for (size_t begin = 0; begin < deferred.size();)
+	{
+		size_t end = begin + 1;
+		while (end < deferred.size() && deferred[end].first == deferred[begin].first)
+			end++;
+
+		rays.clear();
+		hits.clear();
+		for (size_t q = begin; q < end; q++)
+		{
+			rays.push_back(pRays[deferred[q].second]);
+			hits.push_back(Hit(inOutHits[deferred[q].second].dist));
+		}
+		members[deferred[begin].first]->intersectBatch(&rays[0], rays.size(), &hits[0]);
+
+		for (size_t q = begin; q < end; q++)
+		{
+			if (hits[q - begin].pShape != NULL)
+			{
+				inOutHits[deferred[q].second] = hits[q - begin];
+				rayHit[deferred[q].second] = 1;
+			}
+		}
+		begin = end;
+	}
+
+	return std::count(rayHit.begin(), rayHit.end(), 1);
+}
+
+bool ShapeSet::intersectMembers(const Ray& ray, Hit& inOutHit, std::vector<std::pair<Shape*, unsigned> >* pDeferred,
+	unsigned rayIndex)
+{
+	if (!prepared)
+	{
+		bool intersect = false;
+		for (std::vector<Shape*>::const_iterator iter = shapes.begin();
+			iter != shapes.end();
+			iter++)
+		{
+			Shape *pShape = *iter;
+			if (pShape->intersect(ray, inOutHit))
+				intersect = true;
+		}
+		return intersect;
+	}
+
+	bool intersect = false;
+	for (std::vector<Shape*>::const_iterator iter = unboundedShapes.begin();
+		iter != unboundedShapes.end();
 		iter++)
 	{
 		Shape *pShape = *iter;
-		if (pShape->intersect(intersection))
+		if (pShape->intersect(ray, inOutHit))
 			intersect = true;
 	}
 
+	auto hitLeaf = [&](Shape* const* pLeaf, unsigned count)
+	{
+		bool hit = false;
+		for (unsigned i = 0; i < count; i++)
+		{
+			Shape* pShape = pLeaf[i];
+			if (pShape == NULL)
+				continue;
+			if (pDeferred != NULL && pShape->prefersBatches())
+				pDeferred->push_back(std::make_pair(pShape, rayIndex));
+			else if (pShape->intersect(ray, inOutHit))
+				hit = true;
+		}
+		return hit;
+	};
+
+	if (shapeBvh.intersect(ray, inOutHit.dist, [&](unsigned first, unsigned count)
+	{
+		return hitLeaf(&boundedShapes[first], count);
+	}))
+		intersect = true;
+
+	for (size_t level = 0; level < addedLevels.size(); level++)
+	{
+		const std::vector<Shape*>& levelShapes = addedLevels[level]->shapes;
+		if (addedLevels[level]->bvh.intersect(ray, inOutHit.dist, [&](unsigned first, unsigned count)
+		{
+			return hitLeaf(&levelShapes[first], count);
+		}))
+			intersect = true;
+	}
+
+	float origin[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+	float direction[3] = { ray.direction.x, ray.direction.y, ray.direction.z };
+	if (sphereBvh.intersect(ray, inOutHit.dist, [&](unsigned first, unsigned count)
+	{
+		float dist = inOutHit.dist;
+		int hit = kernels().intersectSpheres(&sphereCenterX[first], &sphereCenterY[first], &sphereCenterZ[first],
+			&sphereRadius2[first], count, origin, direction, kRayMinDist, dist);
+		if (hit < 0)
+			return false;
+		inOutHit.dist = dist;
+		inOutHit.pShape = packedSpheres[first + hit];
+		inOutHit.pOwner = NULL;
+		return true;
+	}))
+		intersect = true;
+
 	return intersect;
 }
 
 bool ShapeSet::doesIntersect(const Ray& ray)
 {
-	for (std::vector<Shape*>::iterator iter = shapes.begin();
-		iter != shapes.end();
+	const std::vector<Shape*>& shapeList = prepared ? unboundedShapes : shapes;
+	for (std::vector<Shape*>::const_iterator iter = shapeList.begin();
+		iter != shapeList.end();
 		iter++)
 	{
 		Shape* pShape = *iter;
@@ -53,18 +248,198 @@ bool ShapeSet::doesIntersect(const Ray& ray)
 			return true;
 	}
 
-	return false;
+	if (!prepared)
+		return false;
+
+	auto occludedByLeaf = [&](Shape* const* pLeaf, unsigned count)
+	{
+		for (unsigned i = 0; i < count; i++)
+		{
+			if (pLeaf[i] != NULL && pLeaf[i]->doesIntersect(ray))
+				return true;
+		}
+		return false;
+	};
+
+	if (shapeBvh.occluded(ray, [&](unsigned first, unsigned count)
+	{
+		return occludedByLeaf(&boundedShapes[first], count);
+	}))
+		return true;
+
+	for (size_t level = 0; level < addedLevels.size(); level++)
+	{
+		const std::vector<Shape*>& levelShapes = addedLevels[level]->shapes;
+		if (addedLevels[level]->bvh.occluded(ray, [&](unsigned first, unsigned count)
+		{
+			return occludedByLeaf(&levelShapes[first], count);
+		}))
+			return true;
+	}
+
+	float origin[3] = { ray.origin.x, ray.origin.y, ray.origin.z };
+	float direction[3] = { ray.direction.x, ray.direction.y, ray.direction.z };
+	return sphereBvh.occluded(ray, [&](unsigned first, unsigned count)
+	{
+		return kernels().occludedBySpheres(&sphereCenterX[first], &sphereCenterY[first], &sphereCenterZ[first],
+			&sphereRadius2[first], count, origin, direction, kRayMinDist, ray.maxDist);
+	});
 }
 
-void ShapeSet::prepare()
+void ShapeSet::prepare(unsigned threadCount)
 {
+	for (std::vector<Shape*>::iterator iter = shapes.begin();
+		iter != shapes.end();
+		iter++)
+	{
+		(*iter)->prepare(threadCount);
+	}
+
+	buildAccelerators(threadCount);
+}
+
+void ShapeSet::buildAccelerators(unsigned threadCount)
+{
+	clearPrepared();
+	prepareThreadCount = threadCount;
+
+	std::vector<Sphere*> spheres;
+	std::vector<Shape*> bounded;
+	std::vector<BoundingBox> sphereBounds, shapeBounds;
 	for (std::vector<Shape*>::iterator iter = shapes.begin();
 		iter != shapes.end();
 		iter++)
 	{
 		Shape* pShape = *iter;
-		pShape->prepare();
+		BoundingBox bounds;
+		if (!pShape->getBounds(bounds))
+		{
+			unboundedShapes.push_back(pShape);
+		}
+		else if (typeid(*pShape) == typeid(Sphere))
+		{
+			// Only exactly Sphere, subclasses may intersect differently
+			spheres.push_back(static_cast<Sphere*>(pShape));
+			sphereBounds.push_back(bounds);
+		}
+		else
+		{
+			bounded.push_back(pShape);
+			shapeBounds.push_back(bounds);
+		}
+	}
+
+	// Moving shapes make this a motion BVH with the most keyframes of any
+	unsigned keyframeCount = 1;
+	for (size_t i = 0; i < bounded.size(); i++)
+		keyframeCount = std::max(keyframeCount, bounded[i]->getKeyframeCount());
+
+	if (keyframeCount > 1)
+	{
+		std::vector<BoundingBox> keyframeBounds(bounded.size() * keyframeCount);
+		for (size_t i = 0; i < bounded.size(); i++)
+			gatherKeyframeBounds(bounded[i], keyframeCount, &keyframeBounds[i * keyframeCount]);
+		shapeBvh.buildMotion(keyframeBounds, keyframeCount, 4, threadCount);
+	}
+	else
+	{
+		shapeBvh.build(shapeBounds, 4, threadCount);
+	}
+
+	const std::vector<unsigned>& shapeOrder = shapeBvh.getPrimitiveOrder();
+	boundedShapes.resize(bounded.size());
+	for (size_t i = 0; i < shapeOrder.size(); i++)
+	{
+		boundedShapes[i] = bounded[shapeOrder[i]];
+		batchedShapes = batchedShapes || boundedShapes[i]->prefersBatches();
+	}
+
+	// Leaves hold a few spheres each, which is few enough that the kernel
+	// call is cheap and many enough to keep its lanes busy
+	sphereBvh.build(sphereBounds, 8, threadCount);
+	const std::vector<unsigned>& sphereOrder = sphereBvh.getPrimitiveOrder();
+	size_t sphereCount = sphereOrder.size();
+	packedSpheres.resize(sphereCount);
+	sphereCenterX.resize(sphereCount);
+	sphereCenterY.resize(sphereCount);
+	sphereCenterZ.resize(sphereCount);
+	sphereRadius2.resize(sphereCount);
+	for (size_t i = 0; i < sphereCount; i++)
+	{
+		Sphere* pSphere = spheres[sphereOrder[i]];
+		packedSpheres[i] = pSphere;
+		sphereCenterX[i] = pSphere->getOrigin().x;
+		sphereCenterY[i] = pSphere->getOrigin().y;
+		sphereCenterZ[i] = pSphere->getOrigin().z;
+		sphereRadius2[i] = pSphere->getRadius2();
+	}
+
+	prepared = true;
+}
+
+void ShapeSet::clearPrepared()
+{
+	prepared = false;
+	unboundedShapes.clear();
+	boundedShapes.clear();
+	batchedShapes = false;
+	shapeBvh.clear();
+	packedSpheres.clear();
+	sphereCenterX.clear();
+	sphereCenterY.clear();
+	sphereCenterZ.clear();
+	sphereRadius2.clear();
+	sphereBvh.clear();
+	slots.clear();
+	for (size_t level = 0; level < addedLevels.size(); level++)
+		delete addedLevels[level];
+	addedLevels.clear();
+}
+
+bool ShapeSet::getBounds(BoundingBox& outBounds) const
+{
+	if (prepared)
+	{
+		if (!unboundedShapes.empty())
+			return false;
+		outBounds = shapeBvh.getBounds();
+		outBounds.grow(sphereBvh.getBounds());
+		for (size_t level = 0; level < addedLevels.size(); level++)
+			outBounds.grow(addedLevels[level]->bvh.getBounds());
+		return true;
 	}
+
+	outBounds = BoundingBox();
+	for (std::vector<Shape*>::const_iterator iter = shapes.begin();
+		iter != shapes.end();
+		iter++)
+	{
+		BoundingBox bounds;
+		if (!(*iter)->getBounds(bounds))
+			return false;
+		outBounds.grow(bounds);
+	}
+
+	return true;
+}
+
+unsigned ShapeSet::getKeyframeCount() const
+{
+	return prepared ? shapeBvh.getKeyframeCount() : 1;
+}
+
+bool ShapeSet::getKeyframeBounds(unsigned keyframe, BoundingBox& outBounds) const
+{
+	if (!prepared || shapeBvh.getKeyframeCount() == 1)
+		return getBounds(outBounds);
+	if (!unboundedShapes.empty())
+		return false;
+
+	outBounds = shapeBvh.getKeyframeBounds(keyframe);
+	outBounds.grow(sphereBvh.getBounds());
+	for (size_t level = 0; level < addedLevels.size(); level++)
+		outBounds.grow(addedLevels[level]->bvh.getBounds());
+	return true;
 }
 
 float ShapeSet::surfaceAreaPDF() const
@@ -94,140 +469,452 @@ void ShapeSet::findLights(std::list<Shape*>& outLights)
 	}
 }
 
-void ShapeSet::addShape(Shape* pShape)
+void ShapeSet::findShapes(std::vector<Shape*>& outShapes)
 {
-	if (pShape == NULL)
-		return;
-
-	shapes.push_back(pShape);
+	for (std::vector<Shape*>::iterator iter = shapes.begin();
+		iter != shapes.end();
+		iter++)
+	{
+		Shape *pShape = *iter;
+		pShape->findShapes(outShapes);
+	}
 }
 
-void ShapeSet::clearShapes()
+void ShapeSet::addBvhStats(BvhStats& inOutStats) const
 {
-	for (std::vector<Shape*>::iterator iter = shapes.begin();
+	inOutStats.add(shapeBvh);
+	inOutStats.add(sphereBvh);
+	for (size_t level = 0; level < addedLevels.size(); level++)
+		inOutStats.add(addedLevels[level]->bvh);
+	for (std::vector<Shape*>::const_iterator iter = shapes.begin();
 		iter != shapes.end();
 		iter++)
 	{
-		Shape *pShape = *iter;
-		delete pShape;
+		(*iter)->addBvhStats(inOutStats);
 	}
+}
 
-	shapes.clear();
+bool ShapeSet::setsHitOwner() const
+{
+	for (size_t i = 0; i < shapes.size(); i++)
+	{
+		if (shapes[i]->setsHitOwner())
+			return true;
+	}
+	return false;
 }
 
-bool Plane::intersect(Intersection& intersection)
+void ShapeSet::addShape(Shape* pShape, bool takeOwnership)
 {
-	float nDotD = dot(normal, intersection.ray.direction);
-	if (nDotD == 0.0f)
-		return false;
+	if (pShape == NULL)
+		return;
 
-	float t = dot(normal, origin - intersection.ray.origin) / nDotD;
+	if (!slots.empty())
+	{
+		Slot slot = { (unsigned)shapes.size(), kMemberSlot, 0, 0 };
+		slots[pShape] = slot;
+	}
+	shapes.push_back(pShape);
+	ownedShapes.push_back(takeOwnership);
+	if (!prepared)
+		return;
 
-	if (t >= intersection.dist || t < kRayMinDist)
+	pShape->prepare(prepareThreadCount);
+	BoundingBox bounds;
+	if (pShape->getBounds(bounds))
+	{
+		addToLevels(pShape);
+	}
+	else
+	{
+		if (!slots.empty())
+		{
+			slots[pShape].kind = kUnboundedSlot;
+			slots[pShape].index = (unsigned)unboundedShapes.size();
+		}
+		unboundedShapes.push_back(pShape);
+	}
+	rebuildIfNeeded();
+}
+
+bool ShapeSet::hasShape(const Shape* pShape) const
+{
+	if (!slots.empty())
+		return slots.find(pShape) != slots.end();
+	return std::find(shapes.begin(), shapes.end(), pShape) != shapes.end();
+}
+
+bool ShapeSet::shapeChanged(Shape* pShape)
+{
+	if (!prepared)
+		return hasShape(pShape);
+
+	buildSlots();
+	std::unordered_map<const Shape*, Slot>::const_iterator found = slots.find(pShape);
+	if (found == slots.end())
 		return false;
 
-	intersection.dist = t;
-	intersection.normal = normal;
-	intersection.pShape = this;
-	intersection.pMaterial = pMaterial;
+	Slot slot = found->second;
+	std::vector<unsigned> positions(1, slot.index);
+	if (slot.kind == kBoundedSlot)
+	{
+		// Motion BVHs keep bounds per keyframe, which refit() doesn't handle
+		if (shapeBvh.getKeyframeCount() > 1)
+		{
+			buildAccelerators(prepareThreadCount);
+			rebuildCount++;
+			return true;
+		}
+		shapeBvh.refit(positions, [&](unsigned i) { return boundedShapeBounds(i); });
+	}
+	else if (slot.kind == kSphereSlot)
+	{
+		unsigned index = slot.index;
+		sphereCenterX[index] = packedSpheres[index]->getOrigin().x;
+		sphereCenterY[index] = packedSpheres[index]->getOrigin().y;
+		sphereCenterZ[index] = packedSpheres[index]->getOrigin().z;
+		sphereRadius2[index] = packedSpheres[index]->getRadius2();
+		sphereBvh.refit(positions, [&](unsigned i) { return packedSphereBounds(i); });
+	}
+	else if (slot.kind == kAddedSlot)
+	{
+		AddedLevel* pLevel = addedLevels[slot.level];
+		if (pLevel->bvh.getKeyframeCount() > 1)
+		{
+			std::vector<Shape*> members;
+			for (size_t i = 0; i < pLevel->shapes.size(); i++)
+			{
+				if (pLevel->shapes[i] != NULL)
+					members.push_back(pLevel->shapes[i]);
+			}
+			buildLevel(slot.level, members);
+		}
+		else
+		{
+			pLevel->bvh.refit(positions, [&](unsigned i) { return addedShapeBounds(slot.level, i); });
+		}
+	}
 
+	rebuildIfNeeded();
 	return true;
 }
 
-bool Plane::doesIntersect(const Ray& ray)
+bool ShapeSet::removeShape(Shape* pShape)
 {
-	float nDotD = dot(normal, ray.direction);
-	if (nDotD == 0.0f)
+	buildSlots();
+	std::unordered_map<const Shape*, Slot>::iterator found = slots.find(pShape);
+	if (found == slots.end())
 		return false;
+	Slot slot = found->second;
+	slots.erase(found);
 
-	float t = dot(normal, origin - ray.origin) / nDotD;
+	// The last member takes the removed one's place
+	bool owned = ownedShapes[slot.member];
+	Shape* pLast = shapes.back();
+	if (pLast != pShape)
+	{
+		shapes[slot.member] = pLast;
+		ownedShapes[slot.member] = ownedShapes.back();
+		slots[pLast].member = slot.member;
+	}
+	shapes.pop_back();
+	ownedShapes.pop_back();
 
-	if (t >= ray.maxDist || t < kRayMinDist)
-		return false;
+	std::vector<unsigned> positions(1, slot.index);
+	if (slot.kind == kUnboundedSlot)
+	{
+		Shape* pLastUnbounded = unboundedShapes.back();
+		if (pLastUnbounded != pShape)
+		{
+			unboundedShapes[slot.index] = pLastUnbounded;
+			slots[pLastUnbounded].index = slot.index;
+		}
+		unboundedShapes.pop_back();
+	}
+	else if (slot.kind == kBoundedSlot)
+	{
+		boundedShapes[slot.index] = NULL;
+		if (shapeBvh.getKeyframeCount() == 1)
+			shapeBvh.refit(positions, [&](unsigned i) { return boundedShapeBounds(i); });
+	}
+	else if (slot.kind == kSphereSlot)
+	{
+		packedSpheres[slot.index] = NULL;
+		sphereRadius2[slot.index] = -1.0f;
+		sphereBvh.refit(positions, [&](unsigned i) { return packedSphereBounds(i); });
+	}
+	else if (slot.kind == kAddedSlot)
+	{
+		AddedLevel* pLevel = addedLevels[slot.level];
+		pLevel->shapes[slot.index] = NULL;
+		if (pLevel->bvh.getKeyframeCount() == 1)
+			pLevel->bvh.refit(positions, [&](unsigned i) { return addedShapeBounds(slot.level, i); });
+	}
 
+	if (owned)
+		delete pShape;
+
+	if (prepared)
+		rebuildIfNeeded();
 	return true;
 }
 
-bool Sphere::intersect(Intersection& intersection)
+void ShapeSet::buildSlots()
 {
-	Ray translatedRay = intersection.ray;
-	translatedRay.origin -= origin;
+	if (!slots.empty())
+		return;
 
-	// Simplifies to the quadratic formula
-	// a = 1
-	float b = 2 * dot(translatedRay.origin, translatedRay.direction);
-	float c = translatedRay.origin.length2() - squared(radius);
+	for (size_t i = 0; i < shapes.size(); i++)
+	{
+		Slot slot = { (unsigned)i, kMemberSlot, 0, 0 };
+		slots[shapes[i]] = slot;
+	}
+	if (!prepared)
+		return;
 
-	float discriminant = squared(b) - 4.0f * c;
-	if (discriminant < 0.0f)
-		return false;
+	auto place = [&](const Shape* pShape, SlotKind kind, size_t level, size_t index)
+	{
+		if (pShape == NULL)
+			return;
+		Slot& slot = slots[pShape];
+		slot.kind = kind;
+		slot.level = (unsigned)level;
+		slot.index = (unsigned)index;
+	};
 
-	discriminant = std::sqrt(discriminant);
+	for (size_t i = 0; i < unboundedShapes.size(); i++)
+		place(unboundedShapes[i], kUnboundedSlot, 0, i);
+	for (size_t i = 0; i < boundedShapes.size(); i++)
+		place(boundedShapes[i], kBoundedSlot, 0, i);
+	for (size_t i = 0; i < packedSpheres.size(); i++)
+		place(packedSpheres[i], kSphereSlot, 0, i);
+	for (size_t level = 0; level < addedLevels.size(); level++)
+	{
+		for (size_t i = 0; i < addedLevels[level]->shapes.size(); i++)
+			place(addedLevels[level]->shapes[i], kAddedSlot, level, i);
+	}
+}
 
-	float t1 = (-b + discriminant) / 2;
-	float t2 = (-b - discriminant) / 2;
+void ShapeSet::addToLevels(Shape* pShape)
+{
+	std::vector<Shape*> members(1, pShape);
+	while (!addedLevels.empty() && addedLevels.back()->shapes.size() <= members.size())
+	{
+		const std::vector<Shape*>& merged = addedLevels.back()->shapes;
+		for (size_t i = 0; i < merged.size(); i++)
+		{
+			if (merged[i] != NULL)
+				members.push_back(merged[i]);
+		}
+		delete addedLevels.back();
+		addedLevels.pop_back();
+	}
+
+	addedLevels.push_back(new AddedLevel());
+	buildLevel((unsigned)addedLevels.size() - 1, members);
+}
 
-	if (t2 < t1)
+void ShapeSet::buildLevel(unsigned level, const std::vector<Shape*>& members)
+{
+	AddedLevel* pLevel = addedLevels[level];
+	unsigned keyframeCount = 1;
+	for (size_t i = 0; i < members.size(); i++)
+		keyframeCount = std::max(keyframeCount, members[i]->getKeyframeCount());
+
+	if (keyframeCount > 1)
 	{
-		float tmp = t2;
-		t2 = t1;
-		t1 = tmp;
+		std::vector<BoundingBox> keyframeBounds(members.size() * keyframeCount);
+		for (size_t i = 0; i < members.size(); i++)
+			gatherKeyframeBounds(members[i], keyframeCount, &keyframeBounds[i * keyframeCount]);
+		pLevel->bvh.buildMotion(keyframeBounds, keyframeCount, 4, prepareThreadCount);
+	}
+	else
+	{
+		std::vector<BoundingBox> bounds(members.size());
+		for (size_t i = 0; i < members.size(); i++)
+			members[i]->getBounds(bounds[i]);
+		pLevel->bvh.build(bounds, 4, prepareThreadCount);
 	}
 
-	if (t1 < intersection.dist && t1 > kRayMinDist)
+	const std::vector<unsigned>& order = pLevel->bvh.getPrimitiveOrder();
+	pLevel->shapes.resize(order.size());
+	for (size_t i = 0; i < order.size(); i++)
 	{
-		intersection.dist = t1;
+		Shape* pShape = members[order[i]];
+		pLevel->shapes[i] = pShape;
+		batchedShapes = batchedShapes || pShape->prefersBatches();
+		if (!slots.empty())
+		{
+			Slot& slot = slots[pShape];
+			slot.kind = kAddedSlot;
+			slot.level = level;
+			slot.index = (unsigned)i;
+		}
 	}
-	else if (t2 < intersection.dist && t2 > kRayMinDist)
+}
+
+BoundingBox ShapeSet::boundedShapeBounds(unsigned index) const
+{
+	BoundingBox bounds;
+	if (boundedShapes[index] != NULL)
+		boundedShapes[index]->getBounds(bounds);
+	return bounds;
+}
+
+BoundingBox ShapeSet::packedSphereBounds(unsigned index) const
+{
+	BoundingBox bounds;
+	if (packedSpheres[index] != NULL)
+		packedSpheres[index]->getBounds(bounds);
+	return bounds;
+}
+
+BoundingBox ShapeSet::addedShapeBounds(unsigned level, unsigned index) const
+{
+	BoundingBox bounds;
+	if (addedLevels[level]->shapes[index] != NULL)
+		addedLevels[level]->shapes[index]->getBounds(bounds);
+	return bounds;
+}
+
+bool ShapeSet::needsRebuild() const
+{
+	float cost = shapeBvh.getSahCost() + sphereBvh.getSahCost();
+	float builtCost = shapeBvh.getBuiltSahCost() + sphereBvh.getBuiltSahCost();
+
+	// Rays reach an added level in proportion to its area within the built
+	// trees, or always when they are empty
+	BoundingBox builtBounds = shapeBvh.getBounds();
+	builtBounds.grow(sphereBvh.getBounds());
+	float builtArea = builtBounds.surfaceArea();
+	for (size_t level = 0; level < addedLevels.size(); level++)
 	{
-		intersection.dist = t2;
+		const Bvh& bvh = addedLevels[level]->bvh;
+		float weight = builtArea > 0.0f ? bvh.getBounds().surfaceArea() / builtArea : 1.0f;
+		cost += bvh.getSahCost() * weight;
 	}
-	else
+
+	return cost > kRebuildCostRatio * std::max(builtCost, 1.0f);
+}
+
+void ShapeSet::rebuildIfNeeded()
+{
+	if (!needsRebuild())
+		return;
+	buildAccelerators(prepareThreadCount);
+	rebuildCount++;
+}
+
+void ShapeSet::clearShapes()
+{
+	for (size_t i = 0; i < shapes.size(); i++)
 	{
-		return false;
+		if (ownedShapes[i])
+			delete shapes[i];
 	}
 
-	intersection.normal = translatedRay.calc(intersection.dist).normalized();
+	shapes.clear();
+	ownedShapes.clear();
+	clearPrepared();
+}
+
+bool Plane::intersect(const Ray& ray, Hit& inOutHit)
+{
+	float nDotD = dot(normal, ray.direction);
+	if (nDotD == 0.0f)
+		return false;
+
+	float t = dot(normal, origin - ray.origin) / nDotD;
+
+	if (t >= inOutHit.dist || t < kRayMinDist)
+		return false;
+
+	inOutHit.dist = t;
+	inOutHit.pShape = this;
+	inOutHit.pOwner = NULL;
+
+	return true;
+}
+
+void Plane::completeIntersection(const Hit& hit, Intersection& intersection)
+{
+	intersection.normal = normal;
 	intersection.pShape = this;
 	intersection.pMaterial = pMaterial;
+}
+
+bool Plane::doesIntersect(const Ray& ray)
+{
+	float nDotD = dot(normal, ray.direction);
+	if (nDotD == 0.0f)
+		return false;
+
+	float t = dot(normal, origin - ray.origin) / nDotD;
+
+	if (t >= ray.maxDist || t < kRayMinDist)
+		return false;
 
 	return true;
 }
 
-bool Sphere::doesIntersect(const Ray& ray)
+void Sphere::prepare(unsigned threadCount)
 {
-	Ray translatedRay = ray;
-	translatedRay.origin -= origin;
+	radius2 = squared(radius);
+	invRadius = 1.0f / radius;
+	invArea = 1.0f / (4.0f * (float)M_PI * radius2);
+}
+
+float Sphere::intersectDistance(const Point& center, float radius2, const Ray& ray, float maxDist)
+{
+	Vector translatedOrigin = ray.origin - center;
 
 	// Simplifies to the quadratic formula
 	// a = 1
-	float b = 2 * dot(translatedRay.origin, translatedRay.direction);
-	float c = translatedRay.origin.length2() - squared(radius);
+	float b = 2 * dot(translatedOrigin, ray.direction);
+	float c = translatedOrigin.length2() - radius2;
 
 	float discriminant = squared(b) - 4.0f * c;
 	if (discriminant < 0.0f)
-		return false;
+		return 0.0f;
 
 	discriminant = std::sqrt(discriminant);
 
-	float t1 = (-b + discriminant) / 2;
-	float t2 = (-b - discriminant) / 2;
-
-	if (t2 < t1)
-	{
-		float tmp = t2;
-		t2 = t1;
-		t1 = tmp;
-	}
+	// Near root unless it is behind the ray start, selects rather than branches
+	float tNear = (-b - discriminant) / 2;
+	float tFar = (-b + discriminant) / 2;
+	float t = (tNear > kRayMinDist) ? tNear : tFar;
+	return (t > kRayMinDist && t < maxDist) ? t : 0.0f;
+}
 
-	if ((t1 < ray.maxDist && t1 > kRayMinDist) || (t2 < ray.maxDist && t2 > kRayMinDist))
-	{
-		return true;
-	}
-	else
-	{
+bool Sphere::intersect(const Ray& ray, Hit& inOutHit)
+{
+	float t = intersectDistance(origin, radius2, ray, inOutHit.dist);
+	if (t == 0.0f)
 		return false;
-	}
+
+	inOutHit.dist = t;
+	inOutHit.pShape = this;
+	inOutHit.pOwner = NULL;
+
+	return true;
+}
+
+bool Sphere::getBounds(BoundingBox& outBounds) const
+{
+	outBounds = BoundingBox(origin - Vector(radius), origin + Vector(radius));
+	return true;
+}
+
+void Sphere::completeIntersection(const Hit& hit, Intersection& intersection)
+{
+	intersection.normal = (intersection.position() - origin) * invRadius;
+	intersection.pShape = this;
+	intersection.pMaterial = pMaterial;
+}
+
+bool Sphere::doesIntersect(const Ray& ray)
+{
+	return intersectDistance(origin, radius2, ray, ray.maxDist) != 0.0f;
 }
 
 bool Sphere::sampleSurface(const Point& refPosition,
@@ -239,7 +926,7 @@ bool Sphere::sampleSurface(const Point& refPosition,
 {
 	Vector toCenter = origin - refPosition;
 	float dist2 = toCenter.length2();
-	if (dist2 < squared(radius) * 1.00001f)
+	if (dist2 < radius2 * 1.00001f)
 	{
 		// Point is on or in the sphere
 		outNormal = uniformToSphere(u1, u2);
@@ -250,7 +937,7 @@ bool Sphere::sampleSurface(const Point& refPosition,
 	}
 
 	// Outside the sphere, fit a cone around to sample more efficiently
-	float sinThetaMax2 = squared(radius) / dist2;
+	float sinThetaMax2 = radius2 / dist2;
 	float cosThetaMax = std::sqrt(std::max(0.0f, 1 - sinThetaMax2));
 	Vector x, y, z;
 	makeCoordinateSpace(toCenter, x, y, z);
@@ -259,11 +946,11 @@ bool Sphere::sampleSurface(const Point& refPosition,
 
 	// Make sure direction hits sphere
 	Ray ray(refPosition, cone);
-	Intersection isect(ray);
-	if (!intersect(isect))
-		isect.dist = dot(toCenter, cone);
+	Hit hit;
+	if (!intersect(ray, hit))
+		hit.dist = dot(toCenter, cone);
 
-	outPosition = ray.calc(isect.dist);
+	outPosition = ray.calc(hit.dist);
 	outNormal = (outPosition - origin).normalized();
 	outPdf = uniformConePdf(cosThetaMax);
 	return true;
@@ -276,19 +963,81 @@ float Sphere::pdfSA(const Point& refPosition,
 {
 	Vector toCenter = origin - refPosition;
 	float dist2 = toCenter.length2();
-	if (dist2 > squared(radius) * 1.00001f)
+	if (dist2 < radius2 * 1.00001f)
 	{
 		// Point is on or in the sphere
 		Vector toSurf = refPosition - surfPosition;
 		return toSurf.length2() * surfaceAreaPDF() / std::fabs(dot(toSurf.normalized(), surfNormal));
 	}
 
-	float sinThetaMax2 = squared(radius) / dist2;
+	float sinThetaMax2 = radius2 / dist2;
 	float cosThetaMax = std::sqrt(std::max(0.0f, 1.0f - sinThetaMax2));
 	return uniformConePdf(cosThetaMax);
 }
 
-float Sphere::surfaceAreaPdf() const
+float Sphere::surfaceAreaPDF() const
+{
+	return invArea;
+}
+
+Point MovingSphere::centerAt(float time) const
+{
+	if (centers.size() < 2)
+		return origin;
+
+	float segment = std::min(std::max(time, 0.0f), 1.0f) * (centers.size() - 1);
+	size_t keyframe = std::min((size_t)segment, centers.size() - 2);
+	float t = segment - keyframe;
+	return centers[keyframe] + (centers[keyframe + 1] - centers[keyframe]) * t;
+}
+
+bool MovingSphere::intersect(const Ray& ray, Hit& inOutHit)
+{
+	float t = intersectDistance(centerAt(ray.time), radius2, ray, inOutHit.dist);
+	if (t == 0.0f)
+		return false;
+
+	inOutHit.dist = t;
+	inOutHit.pShape = this;
+	inOutHit.pOwner = NULL;
+	return true;
+}
+
+void MovingSphere::completeIntersection(const Hit& hit, Intersection& intersection)
+{
+	intersection.normal = (intersection.position() - centerAt(intersection.ray.time)) * invRadius;
+	intersection.pShape = this;
+	intersection.pMaterial = pMaterial;
+}
+
+bool MovingSphere::translate(const Vector& offset)
+{
+	origin += offset;
+	for (size_t i = 0; i < centers.size(); i++)
+		centers[i] += offset;
+	return true;
+}
+
+bool MovingSphere::doesIntersect(const Ray& ray)
 {
-	return 3.0f / (4.0f * M_PI * squared(radius));
+	return intersectDistance(centerAt(ray.time), radius2, ray, ray.maxDist) != 0.0f;
+}
+
+bool MovingSphere::getBounds(BoundingBox& outBounds) const
+{
+	outBounds = BoundingBox();
+	for (unsigned k = 0; k < getKeyframeCount(); k++)
+	{
+		BoundingBox keyframeBounds;
+		getKeyframeBounds(k, keyframeBounds);
+		outBounds.grow(keyframeBounds);
+	}
+	return true;
+}
+
+bool MovingSphere::getKeyframeBounds(unsigned keyframe, BoundingBox& outBounds) const
+{
+	Point center = centers.empty() ? origin : centers[keyframe];
+	outBounds = BoundingBox(center - Vector(radius), center + Vector(radius));
+	return true;
 }
\ No newline at end of file
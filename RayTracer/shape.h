@@ -2,8 +2,12 @@
 #define __SHAPE_H__
 
 #include <list>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "bvh.h"
+#include "hugepages.h"
 #include "maths.h"
 #include "ray.h"
 #include "material.h"
@@ -13,10 +17,40 @@ class Shape
 public:
 	virtual ~Shape() {}
 
-	virtual bool intersect(Intersection& intersection) = 0;
+	// Records a hit closer than inOutHit.dist, leaving the surface for
+	// completeIntersection()
+	virtual bool intersect(const Ray& ray, Hit& inOutHit) = 0;
 	virtual bool doesIntersect(const Ray& ray) = 0;
 
-	virtual void prepare() { }
+	// Fills in the normal, shape and material of a hit recorded by this shape,
+	// intersection already holds the ray and distance
+	virtual void completeIntersection(const Hit& hit, Intersection& intersection) = 0;
+
+	// Finds the closest hit within intersection.dist and completes it
+	bool intersectSurface(Intersection& intersection);
+
+	// Closest hits for count rays at once, each limited by its
+	// inOutHits[i].dist. Returns the number of rays that hit. The default
+	// tests one ray after another; shapes that gain from seeing many rays
+	// together override it and return true from prefersBatches().
+	virtual size_t intersectBatch(const Ray* pRays, size_t count, Hit* inOutHits);
+	virtual bool prefersBatches() const { return false; }
+
+	// Takes the distance of a hit from intersect() or intersectBatch() and
+	// has its shape or owner complete it
+	static void completeHit(const Hit& hit, Intersection& intersection);
+
+	// Builds acceleration structures and derived data before rendering,
+	// threadCount = 0 uses the default
+	virtual void prepare(unsigned threadCount = 1) { }
+
+	// False for unbounded shapes such as planes
+	virtual bool getBounds(BoundingBox& outBounds) const { return false; }
+
+	// Moving shapes also give bounds at evenly spaced keyframes over ray time
+	// [0, 1], getBounds() then covers the whole interval
+	virtual unsigned getKeyframeCount() const { return 1; }
+	virtual bool getKeyframeBounds(unsigned keyframe, BoundingBox& outBounds) const { return getBounds(outBounds); }
 
 	// Usually used for lights when sampling
 	virtual bool sampleSurface(
@@ -27,7 +61,7 @@ public:
 		float u3,
 		Point& outPosition,
 		Vector& outNormal,
-		float& outPDF) const;
+		float& outPDF);
 
 	virtual float pdfSA(
 		const Point& refPosition,
@@ -43,30 +77,155 @@ public:
 	// Finds all lights within the scene
 	virtual void findLights(std::list<Shape*>& outLights) { }
 
+	// Finds every shape an intersection can report, sets add their members
+	virtual void findShapes(std::vector<Shape*>& outShapes) { outShapes.push_back(this); }
+
+	// Adds the BVHs built by prepare()
+	virtual void addBvhStats(BvhStats& inOutStats) const { }
+
+	// Edits, false if the shape doesn't support them. Scene::moveShape() and
+	// Scene::setShapeMaterial() also update the BVHs and renderers.
+	virtual bool translate(const Vector& offset) { return false; }
+	virtual bool setMaterial(Material* pNewMaterial) { return false; }
+
 	virtual bool isLight() const { return false; }
+
+	// True if intersect() can report hits with Hit::pOwner set
+	virtual bool setsHitOwner() const { return false; }
 };
 
+class Sphere;
+
 class ShapeSet : public Shape
 {
 public:
-	ShapeSet() : shapes() {}
+	ShapeSet()
+		: shapes(), ownedShapes(), prepared(false), batchedShapes(false), prepareThreadCount(1), rebuildCount(0),
+		addedLevels(), slots() {}
 
 	virtual ~ShapeSet() { clearShapes(); }
 
-	virtual bool intersect(Intersection& intersection);
+	virtual bool intersect(const Ray& ray, Hit& inOutHit);
 	virtual bool doesIntersect(const Ray& ray);
 
-	virtual void prepare();
+	// Members that prefer batches are skipped while each ray traverses the
+	// set, and then get all the rays that reached them in a single call
+	virtual size_t intersectBatch(const Ray* pRays, size_t count, Hit* inOutHits);
+	virtual bool prefersBatches() const { return batchedShapes; }
+
+	// Hits always name a member
+	virtual void completeIntersection(const Hit& hit, Intersection& intersection) { }
+
+	virtual void prepare(unsigned threadCount = 1);
+
+	virtual bool getBounds(BoundingBox& outBounds) const;
+	virtual unsigned getKeyframeCount() const;
+	virtual bool getKeyframeBounds(unsigned keyframe, BoundingBox& outBounds) const;
 
 	virtual float surfaceAreaPDF() const;
 
 	virtual void findLights(std::list<Shape*>& outLights);
+	virtual void findShapes(std::vector<Shape*>& outShapes);
+	virtual void addBvhStats(BvhStats& inOutStats) const;
+	virtual bool setsHitOwner() const;
 
-	void addShape(Shape* pShape);
+	// Shapes not owned must outlive the set. Once prepared, new bounded
+	// shapes go into small BVHs of their own until the next rebuild, see
+	// addedLevels.
+	void addShape(Shape* pShape, bool takeOwnership = true);
 	void clearShapes();
 
+	// Edits of a prepared set, members only. shapeChanged() refits the BVH
+	// after a member changed its bounds and removeShape() takes a member out,
+	// deleting it if owned, and moves the last member into its place. Edits
+	// rebuild the BVHs instead once refitting and shapes added since have
+	// made them too costly, see needsRebuild().
+	bool hasShape(const Shape* pShape) const;
+	bool shapeChanged(Shape* pShape);
+	bool removeShape(Shape* pShape);
+
+	// Rebuilds caused by edits
+	unsigned getRebuildCount() const { return rebuildCount; }
+
 protected:
 	std::vector<Shape*> shapes;
+	// Parallel to shapes
+	std::vector<bool> ownedShapes;
+
+	void clearPrepared();
+
+	// intersect(), but with pDeferred members that prefer batches are left
+	// out and (member, rayIndex) is added instead
+	bool intersectMembers(const Ray& ray, Hit& inOutHit, std::vector<std::pair<Shape*, unsigned> >* pDeferred,
+		unsigned rayIndex);
+
+	// Sorts the prepared shapes into the structures below and builds the BVHs
+	void buildAccelerators(unsigned threadCount);
+	bool needsRebuild() const;
+	void rebuildIfNeeded();
+
+	// Built by prepare(): plain spheres are packed as structure of arrays for
+	// the batched intersection kernels with a BVH whose leaves are ranges of
+	// those arrays, other bounded shapes get a BVH of their own and unbounded
+	// shapes are tested one by one
+	bool prepared;
+	std::vector<Shape*> unboundedShapes;
+	std::vector<Shape*> boundedShapes;
+	// Some of boundedShapes prefer batches
+	bool batchedShapes;
+	Bvh shapeBvh;
+	std::vector<Sphere*> packedSpheres;
+	LargeVector<float> sphereCenterX, sphereCenterY, sphereCenterZ, sphereRadius2;
+	Bvh sphereBvh;
+	unsigned prepareThreadCount;
+	unsigned rebuildCount;
+
+	// Bounded shapes added since the BVHs were built, in levels like the
+	// digits of a binary counter: each add makes a level of one shape, then
+	// merges it with the last level while that one is no bigger, rebuilding
+	// the merged BVH. A shape is rebuilt into about log2(added) levels and
+	// rays test as many BVHs.
+	struct AddedLevel
+	{
+		Bvh bvh;
+		// In bvh's primitive order, NULL once removed
+		std::vector<Shape*> shapes;
+	};
+
+	std::vector<AddedLevel*> addedLevels;
+
+	// Where each member sits in shapes and in the structures above, made by
+	// the first edit. Removed members leave a NULL in boundedShapes,
+	// packedSpheres and the added levels, and a removed sphere gets a
+	// negative squared radius so the kernels miss it.
+	enum SlotKind
+	{
+		// The set isn't prepared
+		kMemberSlot,
+		kUnboundedSlot,
+		kBoundedSlot,
+		kSphereSlot,
+		kAddedSlot
+	};
+
+	struct Slot
+	{
+		unsigned member;
+		SlotKind kind;
+		// Only for kAddedSlot
+		unsigned level;
+		unsigned index;
+	};
+
+	std::unordered_map<const Shape*, Slot> slots;
+
+	void buildSlots();
+	void addToLevels(Shape* pShape);
+	// Builds the level's BVH over members and puts them in its order
+	void buildLevel(unsigned level, const std::vector<Shape*>& members);
+	BoundingBox boundedShapeBounds(unsigned index) const;
+	BoundingBox addedShapeBounds(unsigned level, unsigned index) const;
+	BoundingBox packedSphereBounds(unsigned index) const;
 };
 
 class Plane : public Shape
@@ -78,8 +237,12 @@ public:
 
 	virtual ~Plane() { }
 
-	virtual bool intersect(Intersection& intersection);
+	virtual bool intersect(const Ray& ray, Hit& inOutHit);
 	virtual bool doesIntersect(const Ray& ray);
+	virtual void completeIntersection(const Hit& hit, Intersection& intersection);
+
+	virtual bool translate(const Vector& offset) { origin += offset; return true; }
+	virtual bool setMaterial(Material* pNewMaterial) { pMaterial = pNewMaterial; return true; }
 
 protected:
 	Point origin;
@@ -90,14 +253,21 @@ protected:
 class Sphere : public Shape
 {
 public:
-	Sphere() : origin(0.0f), radius(1.0f), pMaterial(NULL) {}
+	Sphere() : origin(0.0f), radius(1.0f), pMaterial(NULL) { prepare(); }
 	Sphere(const Point& origin, float radius, Material* pMaterial)
-		: origin(origin), radius(radius), pMaterial(pMaterial) {}
+		: origin(origin), radius(radius), pMaterial(pMaterial)
+	{
+		prepare();
+	}
 
 	virtual ~Sphere() { }
 
-	virtual bool intersect(Intersection& intersection);
+	virtual bool intersect(const Ray& ray, Hit& inOutHit);
 	virtual bool doesIntersect(const Ray& ray);
+	virtual void completeIntersection(const Hit& hit, Intersection& intersection);
+
+	// Derives the squared and inverse radius and the inverse area
+	virtual void prepare(unsigned threadCount = 1);
 
 	virtual bool sampleSurface(const Point& refPosition,
 		const Vector& refNormal,
@@ -111,12 +281,56 @@ public:
 		const Point& surfPosition,
 		const Vector& surfNormal) const;
 
-	virtual float surfaceAreaPdf() const;
+	virtual bool getBounds(BoundingBox& outBounds) const;
+
+	virtual float surfaceAreaPDF() const;
+
+	virtual bool translate(const Vector& offset) { origin += offset; return true; }
+	virtual bool setMaterial(Material* pNewMaterial) { pMaterial = pNewMaterial; return true; }
+
+	const Point& getOrigin() const { return origin; }
+	float getRadius() const { return radius; }
+	float getRadius2() const { return radius2; }
 
 protected:
+	// Returns the nearest distance in (kRayMinDist, maxDist) or 0 for a miss
+	static float intersectDistance(const Point& center, float radius2, const Ray& ray, float maxDist);
+
 	Point origin;
 	float radius;
 	Material* pMaterial;
+
+	// Set by prepare()
+	float radius2;
+	float invRadius;
+	float invArea;
+};
+
+// Sphere whose center moves linearly between evenly spaced keyframes over
+// ray time [0, 1]. Not sampled as a light.
+class MovingSphere : public Sphere
+{
+public:
+	MovingSphere() : Sphere(), centers() {}
+	MovingSphere(const std::vector<Point>& centers, float radius, Material* pMaterial)
+		: Sphere(centers.empty() ? Point(0.0f) : centers[0], radius, pMaterial), centers(centers) {}
+
+	virtual ~MovingSphere() { }
+
+	virtual bool intersect(const Ray& ray, Hit& inOutHit);
+	virtual bool doesIntersect(const Ray& ray);
+	virtual void completeIntersection(const Hit& hit, Intersection& intersection);
+
+	virtual bool getBounds(BoundingBox& outBounds) const;
+	virtual unsigned getKeyframeCount() const { return centers.empty() ? 1 : (unsigned)centers.size(); }
+	virtual bool getKeyframeBounds(unsigned keyframe, BoundingBox& outBounds) const;
+
+	virtual bool translate(const Vector& offset);
+
+	Point centerAt(float time) const;
+
+protected:
+	std::vector<Point> centers;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,122 @@
+#include "spectrum.h"
+
+// One entry per nanometre, linear interpolation between them is far below
+// the noise of a path
+static const unsigned kTableSize = 401;
+
+namespace
+{
+	// Piecewise Gaussian lobe of the CIE 1931 fit by Wyman, Sloan and
+	// Shirley 2013
+	inline float lobe(float wavelength, float mean, float lowerWidth, float upperWidth)
+	{
+		float t = (wavelength - mean) / (wavelength < mean ? lowerWidth : upperWidth);
+		return std::exp(-0.5f * t * t);
+	}
+
+	// Linear sRGB of the CIE matching functions, before calibration
+	Color matchingRgb(float wavelength)
+	{
+		float x = 1.056f * lobe(wavelength, 599.8f, 37.9f, 31.0f) + 0.362f * lobe(wavelength, 442.0f, 16.0f, 26.7f) -
+			0.065f * lobe(wavelength, 501.1f, 20.4f, 26.2f);
+		float y = 0.821f * lobe(wavelength, 568.8f, 46.9f, 40.5f) + 0.286f * lobe(wavelength, 530.9f, 16.3f, 31.1f);
+		float z = 1.217f * lobe(wavelength, 437.0f, 11.8f, 36.0f) + 0.681f * lobe(wavelength, 459.0f, 26.0f, 13.8f);
+		return Color(3.2406f * x - 1.5372f * y - 0.4986f * z,
+			-0.9689f * x + 1.8758f * y + 0.0415f * z,
+			0.0557f * x - 0.2040f * y + 1.0570f * z);
+	}
+
+	inline float smoothStep(float edge0, float edge1, float x)
+	{
+		float t = std::min(std::max((x - edge0) / (edge1 - edge0), 0.0f), 1.0f);
+		return t * t * (3.0f - 2.0f * t);
+	}
+
+	// Red, green and blue basis spectra in the matching lanes
+	Color basis(float wavelength)
+	{
+		float blue = 1.0f - smoothStep(480.0f, 510.0f, wavelength);
+		float red = smoothStep(570.0f, 600.0f, wavelength);
+		return Color(red, 1.0f - red - blue, blue);
+	}
+
+	struct SpectrumTables
+	{
+		Color basis[kTableSize];
+		Color toRgb[kTableSize];
+
+		SpectrumTables()
+		{
+			// Column j of q is the uncalibrated RGB of basis spectrum j,
+			// integrated with the trapezoid rule
+			float q[3][3] = { { 0.0f } };
+			Color rgb[kTableSize];
+			for (unsigned i = 0; i < kTableSize; i++)
+			{
+				float wavelength = kMinWavelength + i;
+				basis[i] = ::basis(wavelength);
+				rgb[i] = matchingRgb(wavelength);
+				float weight = (i == 0 || i == kTableSize - 1) ? 0.5f : 1.0f;
+				const float spectrum[3] = { basis[i].r, basis[i].g, basis[i].b };
+				for (unsigned j = 0; j < 3; j++)
+				{
+					q[0][j] += rgb[i].r * spectrum[j] * weight;
+					q[1][j] += rgb[i].g * spectrum[j] * weight;
+					q[2][j] += rgb[i].b * spectrum[j] * weight;
+				}
+			}
+
+			float inverse[3][3];
+			float determinant = q[0][0] * (q[1][1] * q[2][2] - q[1][2] * q[2][1]) -
+				q[0][1] * (q[1][0] * q[2][2] - q[1][2] * q[2][0]) +
+				q[0][2] * (q[1][0] * q[2][1] - q[1][1] * q[2][0]);
+			for (unsigned row = 0; row < 3; row++)
+			{
+				for (unsigned column = 0; column < 3; column++)
+				{
+					// Cofactor of the transposed element
+					unsigned r0 = (column + 1) % 3, r1 = (column + 2) % 3;
+					unsigned c0 = (row + 1) % 3, c1 = (row + 2) % 3;
+					inverse[row][column] = (q[r0][c0] * q[r1][c1] - q[r0][c1] * q[r1][c0]) / determinant;
+				}
+			}
+
+			// Four samples of pdf 1 / range each
+			float scale = (kMaxWavelength - kMinWavelength) / 4.0f;
+			for (unsigned i = 0; i < kTableSize; i++)
+			{
+				toRgb[i] = Color(inverse[0][0] * rgb[i].r + inverse[0][1] * rgb[i].g + inverse[0][2] * rgb[i].b,
+					inverse[1][0] * rgb[i].r + inverse[1][1] * rgb[i].g + inverse[1][2] * rgb[i].b,
+					inverse[2][0] * rgb[i].r + inverse[2][1] * rgb[i].g + inverse[2][2] * rgb[i].b) * scale;
+			}
+		}
+	};
+
+	const SpectrumTables& spectrumTables()
+	{
+		static const SpectrumTables tables;
+		return tables;
+	}
+}
+
+void Wavelengths::sample(float u)
+{
+	const SpectrumTables& tables = spectrumTables();
+	float range = kMaxWavelength - kMinWavelength;
+	Color lanes[4];
+	for (unsigned lane = 0; lane < 4; lane++)
+	{
+		float offset = u + 0.25f * lane;
+		offset = (offset < 1.0f ? offset : offset - 1.0f) * range;
+		wavelengths[lane] = kMinWavelength + offset;
+
+		unsigned i = std::min((unsigned)offset, kTableSize - 2);
+		float t = offset - i;
+		lanes[lane] = tables.basis[i] * (1.0f - t) + tables.basis[i + 1] * t;
+		toRgbWeights[lane] = tables.toRgb[i] * (1.0f - t) + tables.toRgb[i + 1] * t;
+	}
+
+	basisRed = Color(lanes[0].r, lanes[1].r, lanes[2].r, lanes[3].r);
+	basisGreen = Color(lanes[0].g, lanes[1].g, lanes[2].g, lanes[3].g);
+	basisBlue = Color(lanes[0].b, lanes[1].b, lanes[2].b, lanes[3].b);
+}
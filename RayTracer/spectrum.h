@@ -0,0 +1,54 @@
+#ifndef __SPECTRUM_H__
+#define __SPECTRUM_H__
+
+#include "maths.h"
+
+// Visible range sampled by spectral rendering, in nanometres
+static const float kMinWavelength = 380.0f;
+static const float kMaxWavelength = 780.0f;
+
+// The four wavelengths a spectral path carries in the Color lanes: a hero
+// wavelength drawn uniformly over the visible range and three more spaced
+// evenly after it, wrapping around (Wilkie et al. 2014). Every lane follows
+// the same path, so a spectral path costs about what an RGB one does.
+//
+// RGB colors become smooth spectra from three basis functions that sum to
+// one, so white stays flat and reflectances stay within [0, 1]. The CIE
+// matching functions take a sample back to linear sRGB, calibrated so a
+// color turned into a spectrum and back is unchanged on average.
+class Wavelengths
+{
+public:
+	// Nothing is set up until sample()
+	Wavelengths() { }
+
+	// u in [0, 1) picks the hero wavelength
+	void sample(float u);
+
+	// Reflectance or emission of rgb at the four wavelengths
+	Color fromRgb(const Color& rgb) const
+	{
+		return basisRed * rgb.r + basisGreen * rgb.g + basisBlue * rgb.b;
+	}
+
+	// The linear sRGB this sample estimates for its pixel
+	Color toRgb(const Color& spectral) const
+	{
+		Color rgb = toRgbWeights[0] * spectral.r;
+		rgb.addProduct(toRgbWeights[1], spectral.g);
+		rgb.addProduct(toRgbWeights[2], spectral.b);
+		rgb.addProduct(toRgbWeights[3], spectral.a);
+		return rgb;
+	}
+
+	float getWavelength(unsigned lane) const { return wavelengths[lane]; }
+
+protected:
+	float wavelengths[4];
+	// Each basis function at the four wavelengths
+	Color basisRed, basisGreen, basisBlue;
+	// RGB contribution of unit radiance in each lane, over its pdf
+	Color toRgbWeights[4];
+};
+
+#endif
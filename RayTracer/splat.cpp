@@ -0,0 +1,176 @@
+#include "splat.h"
+#include "parallel.h"
+
+#include <cstring>
+
+bool parseSplatMode(const char* name, SplatMode& outMode)
+{
+	if (!strcmp(name, "per-thread"))
+		outMode = SPLAT_PER_THREAD;
+	else if (!strcmp(name, "atomic"))
+		outMode = SPLAT_ATOMIC;
+	else
+		return false;
+
+	return true;
+}
+
+const char* splatModeName(SplatMode mode)
+{
+	switch (mode)
+	{
+	case SPLAT_ATOMIC:
+		return "atomic";
+	default:
+	case SPLAT_PER_THREAD:
+		return "per-thread";
+	}
+}
+
+// std::atomic<float> has no fetch_add before C++20
+static inline void atomicAdd(std::atomic<float>& target, float value)
+{
+	float current = target.load(std::memory_order_relaxed);
+	while (!target.compare_exchange_weak(current, current + value, std::memory_order_relaxed))
+		;
+}
+
+SplatBuffer::SplatBuffer(size_t width, size_t height, SplatMode mode, unsigned threadCount)
+	: width(width), height(height), mode(mode),
+	blocksX((width + kBlockSize - 1) / kBlockSize), blocksY((height + kBlockSize - 1) / kBlockSize),
+	threads(threadCount > 0 ? threadCount : defaultThreadCount()), pLanes(NULL)
+{
+	if (mode == SPLAT_ATOMIC)
+	{
+		pLanes = newLargeArray<std::atomic<float> >(width * height * 4);
+		clear();
+	}
+	else
+	{
+		for (size_t t = 0; t < threads.size(); t++)
+			threads[t].blocks.assign(blocksX * blocksY, NULL);
+	}
+}
+
+SplatBuffer::~SplatBuffer()
+{
+	for (size_t t = 0; t < threads.size(); t++)
+	{
+		for (size_t b = 0; b < threads[t].blocks.size(); b++)
+			delete[] threads[t].blocks[b];
+	}
+	deleteLargeArray(pLanes, width * height * 4);
+}
+
+void SplatBuffer::splat(ptrdiff_t x, ptrdiff_t y, const Color& value, unsigned threadIndex)
+{
+	ThreadBlocks& thread = threads[threadIndex];
+	if (x < 0 || y < 0 || x >= (ptrdiff_t)width || y >= (ptrdiff_t)height)
+	{
+		thread.droppedCount++;
+		return;
+	}
+
+	if (mode == SPLAT_ATOMIC)
+	{
+		std::atomic<float>* pPixel = &pLanes[((size_t)y * width + x) * 4];
+		const float lanes[4] = { value.r, value.g, value.b, value.a };
+		// RGB leaves the fourth lane at zero, and splats are often black in
+		// some channels
+		for (int i = 0; i < 4; i++)
+		{
+			if (lanes[i] != 0.0f)
+				atomicAdd(pPixel[i], lanes[i]);
+		}
+		return;
+	}
+
+	Color*& pBlock = thread.blocks[getBlockIndex(x, y)];
+	if (pBlock == NULL)
+	{
+		pBlock = new Color[kBlockSize * kBlockSize];
+		thread.allocatedCount++;
+	}
+	pBlock[(y % kBlockSize) * kBlockSize + x % kBlockSize] += value;
+}
+
+void SplatBuffer::resolve(Image& outImage, float scale, unsigned threadCount) const
+{
+	Color* pPixels = outImage.getPixels();
+	if (mode == SPLAT_ATOMIC)
+	{
+		parallelFor(height, threadCount, [&](size_t y, unsigned)
+		{
+			for (size_t x = 0; x < width; x++)
+			{
+				const std::atomic<float>* pPixel = &pLanes[(y * width + x) * 4];
+				pPixels[y * width + x] = Color(pPixel[0].load(std::memory_order_relaxed),
+					pPixel[1].load(std::memory_order_relaxed), pPixel[2].load(std::memory_order_relaxed),
+					pPixel[3].load(std::memory_order_relaxed)) * scale;
+			}
+		});
+		return;
+	}
+
+	// Block by block, adding the threads' copies in thread order
+	parallelFor(blocksX * blocksY, threadCount, [&](size_t blockIndex, unsigned)
+	{
+		size_t x0 = (blockIndex % blocksX) * kBlockSize;
+		size_t y0 = (blockIndex / blocksX) * kBlockSize;
+		size_t x1 = std::min(x0 + kBlockSize, width);
+		size_t y1 = std::min(y0 + kBlockSize, height);
+		for (size_t y = y0; y < y1; y++)
+		{
+			for (size_t x = x0; x < x1; x++)
+			{
+				Color sum;
+				for (size_t t = 0; t < threads.size(); t++)
+				{
+					const Color* pBlock = threads[t].blocks[blockIndex];
+					if (pBlock != NULL)
+						sum += pBlock[(y - y0) * kBlockSize + x - x0];
+				}
+				pPixels[y * width + x] = sum * scale;
+			}
+		}
+	});
+}
+
+void SplatBuffer::clear()
+{
+	for (size_t t = 0; t < threads.size(); t++)
+	{
+		ThreadBlocks& thread = threads[t];
+		thread.droppedCount = 0;
+		for (size_t b = 0; b < thread.blocks.size(); b++)
+		{
+			if (thread.blocks[b] != NULL)
+				std::fill(thread.blocks[b], thread.blocks[b] + kBlockSize * kBlockSize, Color());
+		}
+	}
+
+	if (pLanes != NULL)
+	{
+		for (size_t i = 0; i < width * height * 4; i++)
+			pLanes[i].store(0.0f, std::memory_order_relaxed);
+	}
+}
+
+unsigned long long SplatBuffer::getDroppedCount() const
+{
+	unsigned long long count = 0;
+	for (size_t t = 0; t < threads.size(); t++)
+		count += threads[t].droppedCount;
+	return count;
+}
+
+size_t SplatBuffer::getAllocatedBytes() const
+{
+	if (mode == SPLAT_ATOMIC)
+		return width * height * 4 * sizeof(float);
+
+	size_t blocks = 0;
+	for (size_t t = 0; t < threads.size(); t++)
+		blocks += threads[t].allocatedCount;
+	return blocks * kBlockSize * kBlockSize * sizeof(Color);
+}
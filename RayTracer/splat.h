@@ -0,0 +1,90 @@
+#ifndef __SPLAT_H__
+#define __SPLAT_H__
+
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+#include "image.h"
+
+enum SplatMode
+{
+	// Every thread adds into blocks of pixels of its own, allocated the first
+	// time it touches them, and resolve() sums the threads' blocks
+	SPLAT_PER_THREAD = 0,
+	// A single shared buffer of four float lanes per pixel, each lane added
+	// to with a compare-and-swap loop
+	SPLAT_ATOMIC = 1
+};
+
+// Parses "per-thread" or "atomic"
+bool parseSplatMode(const char* name, SplatMode& outMode);
+const char* splatModeName(SplatMode mode);
+
+// Accumulates colors written by many threads at once to any pixel, like
+// filter footprints wider than a pixel or light paths hitting the camera.
+// Neither mode takes a lock. Per thread blocks cost no synchronization at all
+// but memory for every block each thread touches, the atomic buffer costs
+// one image and contention only where threads hit the same cache line.
+// Splats outside the image are dropped and counted.
+class SplatBuffer
+{
+public:
+	// Edge of the per thread blocks in pixels
+	static const size_t kBlockSize = 8;
+
+	// Splats come from threads 0 to threadCount - 1, numbered as parallelFor()
+	// numbers them. threadCount = 0 uses the default thread count.
+	SplatBuffer(size_t width, size_t height, SplatMode mode, unsigned threadCount = 0);
+
+	virtual ~SplatBuffer();
+
+	size_t getWidth() const { return width; }
+	size_t getHeight() const { return height; }
+	SplatMode getMode() const { return mode; }
+	unsigned getThreadCount() const { return (unsigned)threads.size(); }
+
+	// Adds all four lanes of value to pixel (x, y)
+	void splat(ptrdiff_t x, ptrdiff_t y, const Color& value, unsigned threadIndex);
+
+	// Writes the sums times scale to outImage, which must be the buffer's
+	// size. No thread may splat meanwhile.
+	void resolve(Image& outImage, float scale = 1.0f, unsigned threadCount = 0) const;
+
+	// Zeroes the buffer, per thread blocks are kept for the next pass
+	void clear();
+
+	unsigned long long getDroppedCount() const;
+	// Atomic lanes or per thread blocks allocated so far
+	size_t getAllocatedBytes() const;
+
+protected:
+	SplatBuffer(const SplatBuffer&);
+	SplatBuffer& operator =(const SplatBuffer&);
+
+	struct ThreadBlocks
+	{
+		// Per block index, NULL until the thread first splats into it
+		std::vector<Color*> blocks;
+		size_t allocatedCount;
+		unsigned long long droppedCount;
+		// Keeps threads' counters off each other's cache lines
+		char padding[64];
+
+		ThreadBlocks() : blocks(), allocatedCount(0), droppedCount(0) { }
+	};
+
+	size_t getBlockIndex(size_t x, size_t y) const
+	{
+		return (y / kBlockSize) * blocksX + x / kBlockSize;
+	}
+
+	size_t width, height;
+	SplatMode mode;
+	size_t blocksX, blocksY;
+	std::vector<ThreadBlocks> threads;
+	// width * height * 4 lanes with SPLAT_ATOMIC, otherwise NULL
+	std::atomic<float>* pLanes;
+};
+
+#endif
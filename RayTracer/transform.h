@@ -0,0 +1,147 @@
+#ifndef __TRANSFORM_H__
+#define __TRANSFORM_H__
+
+#include "maths.h"
+
+// 3x4 affine transform, the last column is the translation
+struct Transform
+{
+	float m[3][4];
+
+	Transform()
+	{
+		for (int row = 0; row < 3; row++)
+			for (int col = 0; col < 4; col++)
+				m[row][col] = (row == col) ? 1.0f : 0.0f;
+	}
+
+	// Row major, 12 values
+	explicit Transform(const float* values)
+	{
+		for (int row = 0; row < 3; row++)
+			for (int col = 0; col < 4; col++)
+				m[row][col] = values[row * 4 + col];
+	}
+
+	static Transform translation(const Vector& v)
+	{
+		Transform t;
+		t.m[0][3] = v.x;
+		t.m[1][3] = v.y;
+		t.m[2][3] = v.z;
+		return t;
+	}
+
+	static Transform scale(float s)
+	{
+		Transform t;
+		t.m[0][0] = s;
+		t.m[1][1] = s;
+		t.m[2][2] = s;
+		return t;
+	}
+
+	// Rotation about a normalized axis
+	static Transform rotation(const Vector& axis, float angleInDegrees)
+	{
+		float angle = angleInDegrees * (float)M_PI / 180.0f;
+		float c = std::cos(angle);
+		float s = std::sin(angle);
+		float ic = 1.0f - c;
+
+		Transform t;
+		t.m[0][0] = c + axis.x * axis.x * ic;
+		t.m[0][1] = axis.x * axis.y * ic - axis.z * s;
+		t.m[0][2] = axis.x * axis.z * ic + axis.y * s;
+		t.m[1][0] = axis.y * axis.x * ic + axis.z * s;
+		t.m[1][1] = c + axis.y * axis.y * ic;
+		t.m[1][2] = axis.y * axis.z * ic - axis.x * s;
+		t.m[2][0] = axis.z * axis.x * ic - axis.y * s;
+		t.m[2][1] = axis.z * axis.y * ic + axis.x * s;
+		t.m[2][2] = c + axis.z * axis.z * ic;
+		return t;
+	}
+
+	inline Point transformPoint(const Point& p) const
+	{
+		return Point(m[0][0] * p.x + m[0][1] * p.y + m[0][2] * p.z + m[0][3],
+			m[1][0] * p.x + m[1][1] * p.y + m[1][2] * p.z + m[1][3],
+			m[2][0] * p.x + m[2][1] * p.y + m[2][2] * p.z + m[2][3]);
+	}
+
+	inline Vector transformVector(const Vector& v) const
+	{
+		return Vector(m[0][0] * v.x + m[0][1] * v.y + m[0][2] * v.z,
+			m[1][0] * v.x + m[1][1] * v.y + m[1][2] * v.z,
+			m[2][0] * v.x + m[2][1] * v.y + m[2][2] * v.z);
+	}
+
+	// Normals go through the inverse transpose, so call this on the inverse
+	inline Vector transformNormalByInverse(const Vector& n) const
+	{
+		return Vector(m[0][0] * n.x + m[1][0] * n.y + m[2][0] * n.z,
+			m[0][1] * n.x + m[1][1] * n.y + m[2][1] * n.z,
+			m[0][2] * n.x + m[1][2] * n.y + m[2][2] * n.z);
+	}
+
+	BoundingBox transformBox(const BoundingBox& box) const
+	{
+		BoundingBox result;
+		if (box.isEmpty())
+			return result;
+
+		for (int corner = 0; corner < 8; corner++)
+		{
+			Point p((corner & 1) ? box.max.x : box.min.x,
+				(corner & 2) ? box.max.y : box.min.y,
+				(corner & 4) ? box.max.z : box.min.z);
+			result.grow(transformPoint(p));
+		}
+		return result;
+	}
+
+	Transform inverse() const
+	{
+		// Inverse of the 3x3 part by cofactors, then the translation
+		float det = m[0][0] * (m[1][1] * m[2][2] - m[1][2] * m[2][1]) -
+			m[0][1] * (m[1][0] * m[2][2] - m[1][2] * m[2][0]) +
+			m[0][2] * (m[1][0] * m[2][1] - m[1][1] * m[2][0]);
+		float invDet = det != 0.0f ? 1.0f / det : 0.0f;
+
+		Transform inv;
+		inv.m[0][0] = (m[1][1] * m[2][2] - m[1][2] * m[2][1]) * invDet;
+		inv.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * invDet;
+		inv.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * invDet;
+		inv.m[1][0] = (m[1][2] * m[2][0] - m[1][0] * m[2][2]) * invDet;
+		inv.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * invDet;
+		inv.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * invDet;
+		inv.m[2][0] = (m[1][0] * m[2][1] - m[1][1] * m[2][0]) * invDet;
+		inv.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * invDet;
+		inv.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * invDet;
+
+		Vector translation = inv.transformVector(Vector(m[0][3], m[1][3], m[2][3]));
+		inv.m[0][3] = -translation.x;
+		inv.m[1][3] = -translation.y;
+		inv.m[2][3] = -translation.z;
+		return inv;
+	}
+};
+
+// Applies t2 first, then t1
+inline Transform operator *(const Transform& t1, const Transform& t2)
+{
+	Transform result;
+	for (int row = 0; row < 3; row++)
+	{
+		for (int col = 0; col < 4; col++)
+		{
+			result.m[row][col] = t1.m[row][0] * t2.m[0][col] +
+				t1.m[row][1] * t2.m[1][col] +
+				t1.m[row][2] * t2.m[2][col] +
+				(col == 3 ? t1.m[row][3] : 0.0f);
+		}
+	}
+	return result;
+}
+
+#endif